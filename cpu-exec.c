@@ -192,13 +192,16 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
 
     cpu->can_do_io = !use_icount;
 
-    panda_callbacks_before_block_exec(cpu, itb);
+    if (itb->panda_instrument) {
+        panda_callbacks_before_block_exec(cpu, itb);
+    }
 
     // NB: This is where we did this in panda1
     panda_bb_invalidate_done = false;
 
 #if defined(CONFIG_LLVM)
-    if (execute_llvm){
+    // TBs outside the instrumentation gates have no LLVM code
+    if (execute_llvm && itb->panda_instrument){
         assert(itb->llvm_tc_ptr);
         //next_tb = tcg_llvm_qemu_tb_exec(env, tb);
         ret = tcg_llvm_qemu_tb_exec(env, itb);
@@ -213,7 +216,9 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     cpu->can_do_io = 1;
     last_tb = (TranslationBlock *)(ret & ~TB_EXIT_MASK);
 
-    panda_callbacks_after_block_exec(cpu, itb);
+    if (itb->panda_instrument) {
+        panda_callbacks_after_block_exec(cpu, itb);
+    }
 
     tb_exit = ret & TB_EXIT_MASK;
     trace_exec_tb_exit(last_tb, tb_exit);
@@ -323,6 +328,7 @@ static bool tb_cmp(const void *p, const void *d)
         tb->page_addr[0] == desc->phys_page1 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags &&
+        tb->panda_asid_mask == panda_gate_asid_mask &&
         !atomic_read(&tb->invalid)) {
         /* check next page if needed */
         if (tb->page_addr[1] == -1) {
@@ -376,7 +382,8 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
     tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
+                 tb->flags != flags ||
+                 tb->panda_asid_mask != panda_gate_asid_mask)) {
         tb = tb_htable_lookup(cpu, pc, cs_base, flags);
         if (!tb) {
 
@@ -393,12 +400,16 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
              */
             tb = tb_htable_lookup(cpu, pc, cs_base, flags);
             if (!tb) {
-                panda_callbacks_before_block_translate(cpu, pc);
+                if (panda_gate_block(cpu, pc)) {
+                    panda_callbacks_before_block_translate(cpu, pc);
+                }
 
                 /* if no translated code available, then translate it now */
                 tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
 
-                panda_callbacks_after_block_translate(cpu, tb);
+                if (tb->panda_instrument) {
+                    panda_callbacks_after_block_translate(cpu, tb);
+                }
             }
 
             mmap_unlock();
@@ -418,7 +429,8 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 #endif
     /* See if we can patch the calling TB. */
 #ifdef CONFIG_SOFTMMU
-    if (rr_mode != RR_REPLAY && panda_tb_chaining) {
+    if (rr_mode != RR_REPLAY && panda_tb_chaining
+            && panda_next_deadline == UINT64_MAX) {
 #endif
     if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
         if (!have_tb_lock) {
@@ -427,6 +439,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         }
         if (!tb->invalid) {
             tb_add_jump(last_tb, tb_exit, tb);
+            panda_deadline_chained = true;
         }
     }
 #ifdef CONFIG_SOFTMMU
@@ -734,6 +747,12 @@ int cpu_exec(CPUState *cpu)
 
     cc->cpu_exec_enter(cpu);
 
+    /* The ASID may have changed without asid_changed, e.g. on loading a
+       snapshot or on targets that don't report it */
+    if (panda_gate_on) {
+        panda_gate_set_asid(panda_current_asid(cpu));
+    }
+
     /* Calculate difference between guest clock and host clock.
      * This delay includes the delay of the last cycle, so
      * what we have to do is sleep until it is 0. As for the
@@ -762,20 +781,28 @@ int cpu_exec(CPUState *cpu)
                     rr_skipped_callsite_location = RR_CALLSITE_MAIN_LOOP_WAIT;
                     rr_replay_skipped_calls();
                 }
+                rr_maybe_digest();
                 cpu_handle_interrupt(cpu, &last_tb);
+                if (unlikely(cpu->rr_guest_instr_count >= panda_next_deadline)) {
+                    panda_deadline_run(cpu);
+                }
                 panda_before_find_fast();
                 tb = tb_find(cpu, last_tb, tb_exit);
-                panda_bb_invalidate_done = panda_callbacks_after_find_fast(
-                        cpu, tb, panda_bb_invalidate_done, &panda_invalidate_tb);
+                if (tb->panda_instrument) {
+                    panda_bb_invalidate_done = panda_callbacks_after_find_fast(
+                            cpu, tb, panda_bb_invalidate_done, &panda_invalidate_tb);
+                }
                 qemu_log_rr(tb->pc);
 
 #ifdef CONFIG_SOFTMMU
                 uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
                 if (panda_invalidate_tb
                         || (rr_mode == RR_REPLAY && until_interrupt > 0
-                            && tb->icount > until_interrupt)) {
+                            && tb->icount > until_interrupt)
+                        || tb->icount > panda_num_instr_before_next_deadline()) {
                     // retranslate so that basic block boundary matches
-                    // record & replay for interrupt delivery
+                    // record & replay for interrupt delivery, or the next
+                    // deadline
                     tb_lock();
                     tb_phys_invalidate(tb, -1);
                     tb_unlock();
@@ -13,6 +13,7 @@
 #include "trace-root.h"
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
+#include "panda/rr/rr_log_all.h"
 
 /* #define DEBUG_IOMMU */
 
@@ -82,6 +83,9 @@ typedef struct {
     QEMUBH *bh;
     DMAIOFunc *io_func;
     void *io_func_opaque;
+    /* where in sg the request in flight (iov) starts */
+    int rr_sg_index;
+    dma_addr_t rr_sg_byte;
 } DMAAIOCB;
 
 static void dma_blk_cb(void *opaque, int ret);
@@ -123,6 +127,50 @@ static void dma_complete(DMAAIOCB *dbs, int ret)
     qemu_aio_unref(dbs);
 }
 
+static BlockAIOCB *dma_blk_read_io_func(int64_t offset, QEMUIOVector *iov,
+                                        BlockCompletionFunc *cb,
+                                        void *cb_opaque, void *opaque);
+static BlockAIOCB *dma_blk_write_io_func(int64_t offset, QEMUIOVector *iov,
+                                         BlockCompletionFunc *cb,
+                                         void *cb_opaque, void *opaque);
+
+/* Note the request that just completed as hd transfers, one per mapped
+ * piece of guest memory, for PANDA's replay.  Only plain disk reads and
+ * writes are noted: dbs->offset means something else to other io_funcs
+ * (e.g. TRIM). */
+static void dma_blk_rr_record(DMAAIOCB *dbs)
+{
+    uint64_t offset = dbs->offset;
+    int sg_index = dbs->rr_sg_index;
+    dma_addr_t sg_byte = dbs->rr_sg_byte;
+    int i;
+
+    if (!rr_record_device_call() ||
+        (dbs->io_func != dma_blk_read_io_func &&
+         dbs->io_func != dma_blk_write_io_func)) {
+        return;
+    }
+
+    for (i = 0; i < dbs->iov.niov; ++i) {
+        dma_addr_t addr = dbs->sg->sg[sg_index].base + sg_byte;
+        size_t len = dbs->iov.iov[i].iov_len;
+
+        if (dbs->dir == DMA_DIRECTION_FROM_DEVICE) {
+            rr_record_hd_transfer(rr_skipped_callsite_location,
+                                  HD_TRANSFER_HD_TO_RAM, offset, addr, len);
+        } else {
+            rr_record_hd_transfer(rr_skipped_callsite_location,
+                                  HD_TRANSFER_RAM_TO_HD, addr, offset, len);
+        }
+        offset += len;
+        sg_byte += len;
+        if (sg_byte == dbs->sg->sg[sg_index].len) {
+            sg_byte = 0;
+            ++sg_index;
+        }
+    }
+}
+
 static void dma_blk_cb(void *opaque, int ret)
 {
     DMAAIOCB *dbs = (DMAAIOCB *)opaque;
@@ -131,6 +179,10 @@ static void dma_blk_cb(void *opaque, int ret)
 
     trace_dma_blk_cb(dbs, ret);
 
+    if (ret >= 0) {
+        dma_blk_rr_record(dbs);
+    }
+
     dbs->acb = NULL;
     dbs->offset += dbs->iov.size;
 
@@ -140,6 +192,8 @@ static void dma_blk_cb(void *opaque, int ret)
     }
     dma_blk_unmap(dbs);
 
+    dbs->rr_sg_index = dbs->sg_cur_index;
+    dbs->rr_sg_byte = dbs->sg_cur_byte;
     while (dbs->sg_cur_index < dbs->sg->nsg) {
         cur_addr = dbs->sg->sg[dbs->sg_cur_index].base + dbs->sg_cur_byte;
         cur_len = dbs->sg->sg[dbs->sg_cur_index].len - dbs->sg_cur_byte;
@@ -217,6 +271,8 @@ BlockAIOCB *dma_blk_io(AioContext *ctx,
     dbs->align = align;
     dbs->sg_cur_index = 0;
     dbs->sg_cur_byte = 0;
+    dbs->rr_sg_index = 0;
+    dbs->rr_sg_byte = 0;
     dbs->dir = dir;
     dbs->io_func = io_func;
     dbs->io_func_opaque = io_func_opaque;
@@ -64,7 +64,6 @@
 #include "qemu/mmap-alloc.h"
 #endif
 
-#include <zlib.h>
 #include "panda/callback_support.h"
 
 //#define DEBUG_SUBPAGE
@@ -2720,6 +2719,7 @@ static MemTxResult address_space_write_continue(AddressSpace *as, hwaddr addr,
             memcpy(ptr, buf, l);
             panda_callbacks_after_dma(first_cpu, addr1, buf, l, /*is_write=1*/ 1);
             invalidate_and_set_dirty(mr, addr1, l);
+            panda_guest_obj_invalidate();
         }
 
         if (release_lock) {
@@ -2772,7 +2772,7 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
     uint64_t val;
     MemTxResult result = MEMTX_OK;
     bool release_lock = false;
-    _Static_assert(sizeof(MemTxResult) == 4, "Unexpected size of MemTxResult (does not match rr_input_4)");
+    _Static_assert(sizeof(MemTxResult) == 4, "Unexpected size of MemTxResult (does not match rr_input_mmio)");
     for (;;) {
         if (!memory_access_is_direct(mr, false)) {
             /* I/O case */
@@ -2784,8 +2784,8 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
                 RR_DO_RECORD_OR_REPLAY(
                 /*action=*/result |= memory_region_dispatch_read(mr, addr1, &val, 8,
                                                       attrs),
-                /*record=*/rr_input_4(&result); rr_input_8(&val),
-                /*replay=*/rr_input_4(&result); rr_input_8(&val),
+                /*record=*/rr_input_mmio((uint32_t *)&result, &val),
+                /*replay=*/rr_input_mmio((uint32_t *)&result, &val),
                 /*location=*/RR_CALLSITE_READ_8);
                 stq_p(buf, val);
                 break;
@@ -2794,8 +2794,8 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
                 RR_DO_RECORD_OR_REPLAY(
                 /*action=*/result |= memory_region_dispatch_read(mr, addr1, &val, 4,
                                                       attrs),
-                /*record=*/rr_input_4(&result); rr_input_8(&val),
-                /*replay=*/rr_input_4(&result); rr_input_8(&val),
+                /*record=*/rr_input_mmio((uint32_t *)&result, &val),
+                /*replay=*/rr_input_mmio((uint32_t *)&result, &val),
                 /*location=*/RR_CALLSITE_READ_4);
                 stl_p(buf, val);
                 break;
@@ -2804,8 +2804,8 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
                 RR_DO_RECORD_OR_REPLAY(
                 /*action=*/result |= memory_region_dispatch_read(mr, addr1, &val, 2,
                                                       attrs),
-                /*record=*/rr_input_4(&result); rr_input_8(&val),
-                /*replay=*/rr_input_4(&result); rr_input_8(&val),
+                /*record=*/rr_input_mmio((uint32_t *)&result, &val),
+                /*replay=*/rr_input_mmio((uint32_t *)&result, &val),
                 /*location=*/RR_CALLSITE_READ_2);
                 stw_p(buf, val);
                 break;
@@ -2814,8 +2814,8 @@ MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
                 RR_DO_RECORD_OR_REPLAY(
                 /*action=*/result |= memory_region_dispatch_read(mr, addr1, &val, 1,
                                                       attrs),
-                /*record=*/rr_input_4(&result); rr_input_8(&val),
-                /*replay=*/rr_input_4(&result); rr_input_8(&val),
+                /*record=*/rr_input_mmio((uint32_t *)&result, &val),
+                /*replay=*/rr_input_mmio((uint32_t *)&result, &val),
                 /*location=*/RR_CALLSITE_READ_1);
                 stb_p(buf, val);
                 break;
@@ -3165,7 +3165,7 @@ void *address_space_map(AddressSpace *as,
         region->addr = addr;
         region->len = *plen; // can't use len because it was modified
         region->ptr = ptr;
-        region->crc = crc32(crc32(0, Z_NULL, 0), region->ptr, region->len);
+        region->shadow = g_memdup(region->ptr, region->len);
         QLIST_INSERT_HEAD(&rr_map_list, region, link);
     }
 
@@ -3191,6 +3191,7 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                 rr_device_mem_rw_call_record(addr1, buffer, access_len, is_write);
             }
             invalidate_and_set_dirty(mr, addr1, access_len);
+            panda_guest_obj_invalidate();
         }
         if (xen_enabled()) {
             xen_invalidate_map_cache_entry(buffer);
@@ -3209,6 +3210,7 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
             }
             if (found) {
                 QLIST_REMOVE(region, link);
+                g_free(region->shadow);
                 g_free(region);
             }
         }
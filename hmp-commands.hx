@@ -1830,6 +1830,14 @@ ETEXI
         .cmd = hmp_panda_list_plugins,
     },
 
+    {
+        .name       = "profile_plugins",
+        .args_type  = "cmd:s?",
+        .params     = "[on|off|reset]",
+        .help       = "show, start, stop or reset plugin callback profiling",
+        .cmd = hmp_panda_profile_plugins,
+    },
+
     {
         .name       = "end_replay",
         .args_type  = "",
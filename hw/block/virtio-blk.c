@@ -28,6 +28,7 @@
 #endif
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
+#include "panda/rr/rr_log_all.h"
 
 static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
                                     VirtIOBlockReq *req)
@@ -86,6 +87,51 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     return action != BLOCK_ERROR_ACTION_IGNORE;
 }
 
+/* Note the guest memory a request reads into or writes from as hd
+ * transfers, for PANDA's replay.  Writes are noted as they are submitted
+ * and reads as they complete, i.e. when the data is where the transfer
+ * says it is. */
+static void virtio_blk_rr_record_read(VirtIOBlockReq *req)
+{
+    uint64_t offset = req->sector_num << BDRV_SECTOR_BITS;
+    size_t left = req->in_len - sizeof(struct virtio_blk_inhdr);
+    unsigned i;
+
+    if (!rr_record_device_call()) {
+        return;
+    }
+    for (i = 0; i < req->elem.in_num && left; i++) {
+        size_t len = MIN(req->elem.in_sg[i].iov_len, left);
+        rr_record_hd_transfer(rr_skipped_callsite_location,
+                              HD_TRANSFER_HD_TO_RAM, offset,
+                              req->elem.in_addr[i], len);
+        offset += len;
+        left -= len;
+    }
+}
+
+/* iov is what is left of req->elem.out_sg once the header is discarded;
+ * its first entry may have been trimmed in place. */
+static void virtio_blk_rr_record_write(VirtIOBlockReq *req,
+                                       struct iovec *iov, unsigned out_num)
+{
+    unsigned first = iov - req->elem.out_sg;
+    size_t trimmed = sizeof(req->out) - iov_size(req->elem.out_sg, first);
+    uint64_t offset = req->sector_num << BDRV_SECTOR_BITS;
+    unsigned i;
+
+    if (!rr_record_device_call()) {
+        return;
+    }
+    for (i = 0; i < out_num; i++) {
+        hwaddr addr = req->elem.out_addr[first + i] + (i ? 0 : trimmed);
+        rr_record_hd_transfer(rr_skipped_callsite_location,
+                              HD_TRANSFER_RAM_TO_HD, addr, offset,
+                              iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+}
+
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
@@ -102,6 +148,11 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             qemu_iovec_destroy(&req->qiov);
         }
 
+        if (!ret && !(virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type)
+                      & VIRTIO_BLK_T_OUT)) {
+            virtio_blk_rr_record_read(req);
+        }
+
         if (ret) {
             int p = virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type);
             bool is_read = !(p & VIRTIO_BLK_T_OUT);
@@ -534,6 +585,10 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
             return 0;
         }
 
+        if (is_write) {
+            virtio_blk_rr_record_write(req, iov, out_num);
+        }
+
         block_acct_start(blk_get_stats(req->dev->blk),
                          &req->acct, req->qiov.size,
                          is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
@@ -37,6 +37,7 @@
 #include "qemu/range.h"
 
 #include "e1000x_common.h"
+#include "panda/rr/rr_log_all.h"
 
 static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
@@ -517,6 +518,28 @@ inc_tx_bcast_or_mcast_count(E1000State *s, const unsigned char *arr)
     }
 }
 
+/* PANDA: note packets, and moves of their bytes between guest memory and
+ * the card's buffers, for replay.  The card's buffers are named by their
+ * host addresses at record time, the same as a packet's old_buf_addr. */
+static inline void
+e1000_rr_net_transfer(Net_transfer_type type, uint64_t src_addr,
+                      uint64_t dest_addr, uint32_t num_bytes)
+{
+    if (rr_record_device_call()) {
+        rr_record_net_transfer(rr_skipped_callsite_location, type,
+                               src_addr, dest_addr, num_bytes);
+    }
+}
+
+static inline void
+e1000_rr_packet(const void *buf, int size, Net_packet_direction direction)
+{
+    if (rr_record_device_call()) {
+        rr_record_handle_packet_call(rr_skipped_callsite_location,
+                                     (uint8_t *)buf, size, direction);
+    }
+}
+
 static void
 e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
 {
@@ -524,6 +547,7 @@ e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
                                     PTC1023, PTC1522 };
 
     NetClientState *nc = qemu_get_queue(s->nic);
+    e1000_rr_packet(buf, size, PANDA_NET_TX);
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
         nc->info->receive(nc, buf, size);
     } else {
@@ -587,6 +611,10 @@ xmit_seg(E1000State *s)
     if (tp->vlan_needed) {
         memmove(tp->vlan, tp->data, 4);
         memmove(tp->data, tp->data + 4, 8);
+        e1000_rr_net_transfer(NET_TRANSFER_IOB_TO_IOB, (uintptr_t)tp->data,
+                              (uintptr_t)tp->vlan, 4);
+        e1000_rr_net_transfer(NET_TRANSFER_IOB_TO_IOB,
+                              (uintptr_t)(tp->data + 4), (uintptr_t)tp->data, 8);
         memcpy(tp->data + 8, tp->vlan_header, 4);
         e1000_send_packet(s, tp->vlan, tp->size + 4);
     } else {
@@ -652,15 +680,24 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 
             bytes = MIN(sizeof(tp->data) - tp->size, bytes);
             pci_dma_read(d, addr, tp->data + tp->size, bytes);
+            e1000_rr_net_transfer(NET_TRANSFER_RAM_TO_IOB, addr,
+                                  (uintptr_t)(tp->data + tp->size), bytes);
             sz = tp->size + bytes;
             if (sz >= tp->props.hdr_len && tp->size < tp->props.hdr_len) {
                 memmove(tp->header, tp->data, tp->props.hdr_len);
+                e1000_rr_net_transfer(NET_TRANSFER_IOB_TO_IOB,
+                                      (uintptr_t)tp->data,
+                                      (uintptr_t)tp->header,
+                                      tp->props.hdr_len);
             }
             tp->size = sz;
             addr += bytes;
             if (sz == msh) {
                 xmit_seg(s);
                 memmove(tp->data, tp->header, tp->props.hdr_len);
+                e1000_rr_net_transfer(NET_TRANSFER_IOB_TO_IOB,
+                                      (uintptr_t)tp->header,
+                                      (uintptr_t)tp->data, tp->props.hdr_len);
                 tp->size = tp->props.hdr_len;
             }
             split_size -= bytes;
@@ -671,6 +708,8 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     } else {
         split_size = MIN(sizeof(tp->data) - tp->size, split_size);
         pci_dma_read(d, addr, tp->data + tp->size, split_size);
+        e1000_rr_net_transfer(NET_TRANSFER_RAM_TO_IOB, addr,
+                              (uintptr_t)(tp->data + tp->size), split_size);
         tp->size += split_size;
     }
 
@@ -859,6 +898,9 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     size_t desc_offset;
     size_t desc_size;
     size_t total_size;
+    const struct iovec *iov_end;
+    struct iovec rr_iov;
+    uint8_t *rr_buf = NULL;
 
     if (!e1000x_hw_rx_enabled(s->mac_reg)) {
         return -1;
@@ -887,6 +929,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     if (!receive_filter(s, filter_buf, size)) {
         return size;
     }
+    iov_end = iov + iovcnt;
 
     if (e1000x_vlan_enabled(s->mac_reg) &&
         e1000x_is_vlan_packet(filter_buf, le16_to_cpu(s->mac_reg[VET]))) {
@@ -912,6 +955,20 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
             set_ics(s, 0, E1000_ICS_RXO);
             return -1;
     }
+    if (rr_record_device_call()) {
+        /* One packet per frame.  A frame in fragments is gathered into one
+         * buffer, which the DMA below then copies from, so that the packet
+         * and its transfers to RAM name the same card buffer. */
+        if (iov->iov_len - iov_ofs < size) {
+            rr_buf = g_malloc(size);
+            iov_to_buf(iov, iov_end - iov, iov_ofs, rr_buf, size);
+            rr_iov.iov_base = rr_buf;
+            rr_iov.iov_len = size;
+            iov = &rr_iov;
+            iov_ofs = 0;
+        }
+        e1000_rr_packet(iov->iov_base + iov_ofs, size, PANDA_NET_RX);
+    }
     do {
         desc_size = total_size - desc_offset;
         if (desc_size > s->rxbuf_size) {
@@ -932,6 +989,9 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
                 do {
                     iov_copy = MIN(copy_size, iov->iov_len - iov_ofs);
                     pci_dma_write(d, ba, iov->iov_base + iov_ofs, iov_copy);
+                    e1000_rr_net_transfer(NET_TRANSFER_IOB_TO_RAM,
+                                          (uintptr_t)(iov->iov_base + iov_ofs),
+                                          ba, iov_copy);
                     copy_size -= iov_copy;
                     ba += iov_copy;
                     iov_ofs += iov_copy;
@@ -963,6 +1023,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
             set_ics(s, 0, E1000_ICS_RXO);
+            g_free(rr_buf);
             return -1;
         }
     } while (desc_offset < total_size);
@@ -978,6 +1039,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
 
     set_ics(s, 0, n);
 
+    g_free(rr_buf);
     return size;
 }
 
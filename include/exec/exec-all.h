@@ -241,6 +241,14 @@ struct TranslationBlock {
 
     uint16_t invalid;
 
+    /* PANDA instrumentation gates (panda/src/gate.c): which gates the
+       ASID passed when this TB was translated, and whether the TB is
+       instrumented at all */
+    uint32_t panda_asid_mask;
+    bool panda_instrument;
+    /* PANDA insn cache (panda/src/insn_cache.c), or NULL */
+    struct panda_tb_insns *panda_insns;
+
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
     /* original tb when cflags has CF_NOCACHE */
@@ -13,6 +13,9 @@ static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count, flag, imm;
 
+    tcg_ctx.panda_sync_pending = false;
+    tcg_ctx.panda_sync_insns = 0;
+
     exitreq_label = gen_new_label();
     flag = tcg_temp_new_i32();
     tcg_gen_ld_i32(flag, cpu_env,
@@ -47,6 +50,13 @@ static inline void gen_tb_start(TranslationBlock *tb)
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
+    /* The exits below are only reached from gen_tb_start, before any insn
+       has run, so they must not store the last insn's pc and count.  */
+    tcg_ctx.panda_sync_pending = false;
+    if (tcg_ctx.panda_sync_insns) {
+        tcg_temp_free_i64(tcg_ctx.panda_icount_base);
+    }
+
     gen_set_label(exitreq_label);
     tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
 
@@ -76,25 +86,25 @@ static inline void gen_io_end(void)
     tcg_temp_free_i32(tmp);
 }
 
-// Record and replay
-static inline void gen_op_update_rr_icount(void)
-{
-    TCGv_i64 count;
-
-    count = tcg_temp_new_i64();
-
-    tcg_gen_ld_i64(count, cpu_env, -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
-    tcg_gen_addi_i64(count, count, 1);
-    tcg_gen_st_i64(count, cpu_env, -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
-
-    tcg_temp_free_i64(count);
-}
-
-static inline void gen_op_update_panda_pc(uint64_t new_pc)
+// Record and replay, precise pc
+//
+// Call at the start of each guest insn to count it in
+// CPUState::rr_guest_instr_count and make new_pc CPUState::panda_guest_pc.
+// Nothing outside the TB can see those while it runs straight-line code, so
+// the stores are put off until the insn's first op that can branch, leave
+// the TB, call a helper or access memory (tcg_gen_panda_sync), and insns
+// that do none of those cost nothing.  The TB loads the count once, at its
+// first insn, and each store writes that plus the insns since.
+static inline void gen_op_panda_insn_start(uint64_t new_pc)
 {
-    TCGv_i64 tmp_pc = tcg_const_i64(new_pc);
-    tcg_gen_st_i64(tmp_pc, cpu_env, -ENV_OFFSET + offsetof(CPUState, panda_guest_pc));
-    tcg_temp_free_i64(tmp_pc);
+    if (tcg_ctx.panda_sync_insns == 0) {
+        tcg_ctx.panda_icount_base = tcg_temp_local_new_i64();
+        tcg_gen_ld_i64(tcg_ctx.panda_icount_base, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
+    }
+    tcg_ctx.panda_sync_insns++;
+    tcg_ctx.panda_sync_pc = new_pc;
+    tcg_ctx.panda_sync_pending = true;
 }
 
 #endif
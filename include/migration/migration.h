@@ -259,6 +259,10 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+/* Send pages identical to one already sent as a reference to it. Only
+ * valid for single pass saves such as qemu_savevm_state().
+ */
+void ram_set_snapshot_dedup(bool enable);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -129,6 +129,7 @@ void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
 
 int qemu_loadvm_state(QEMUFile *f);
 int qemu_savevm_state(QEMUFile *f, Error **errp);
+int qemu_savevm_state_devices(QEMUFile *f);
 
 extern int autostart;
 
@@ -40,8 +40,8 @@ static inline uint32_t glue(address_space_ldl_internal, SUFFIX)(ARG1_DECL,
         /* I/O case */
         RR_DO_RECORD_OR_REPLAY(
             /*action*/   r = memory_region_dispatch_read(mr, addr1, &val, 4, attrs),
-            /*record*/   rr_input_4(&r); rr_input_8(&val),
-            /*replay*/   rr_input_4(&r); rr_input_8(&val),
+            /*record*/   rr_input_mmio((uint32_t *)&r, &val),
+            /*replay*/   rr_input_mmio((uint32_t *)&r, &val),
             /*location*/ RR_CALLSITE_READ_4);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -138,8 +138,8 @@ static inline uint64_t glue(address_space_ldq_internal, SUFFIX)(ARG1_DECL,
         /* I/O case */
         RR_DO_RECORD_OR_REPLAY(
             /*action*/   r = memory_region_dispatch_read(mr, addr1, &val, 8, attrs),
-            /*record*/   rr_input_4(&r); rr_input_8(&val),
-            /*replay*/   rr_input_4(&r); rr_input_8(&val),
+            /*record*/   rr_input_mmio((uint32_t *)&r, &val),
+            /*replay*/   rr_input_mmio((uint32_t *)&r, &val),
             /*location*/ RR_CALLSITE_READ_8);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -234,8 +234,8 @@ uint32_t glue(address_space_ldub, SUFFIX)(ARG1_DECL,
         /* I/O case */
         RR_DO_RECORD_OR_REPLAY(
             /*action*/   r = memory_region_dispatch_read(mr, addr1, &val, 1, attrs),
-            /*record*/   rr_input_4(&r); rr_input_8(&val),
-            /*replay*/   rr_input_4(&r); rr_input_8(&val),
+            /*record*/   rr_input_mmio((uint32_t *)&r, &val),
+            /*replay*/   rr_input_mmio((uint32_t *)&r, &val),
             /*location*/ RR_CALLSITE_READ_1);
     } else {
         /* RAM case */
@@ -280,8 +280,8 @@ static inline uint32_t glue(address_space_lduw_internal, SUFFIX)(ARG1_DECL,
         /* I/O case */
         RR_DO_RECORD_OR_REPLAY(
             /*action*/   r = memory_region_dispatch_read(mr, addr1, &val, 2, attrs),
-            /*record*/   rr_input_4(&r); rr_input_8(&val),
-            /*replay*/   rr_input_4(&r); rr_input_8(&val),
+            /*record*/   rr_input_mmio((uint32_t *)&r, &val),
+            /*replay*/   rr_input_mmio((uint32_t *)&r, &val),
             /*location*/ RR_CALLSITE_READ_2);
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
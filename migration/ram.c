@@ -61,6 +61,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_DUP_PAGE         0x200
 
 static uint8_t *ZERO_TARGET_PAGE;
 
@@ -705,6 +706,87 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/* Identical page elimination, only used for single pass snapshots: the
+ * hash of every page sent maps to its host address.
+ */
+static bool ram_dedup_enabled;
+static GHashTable *ram_dedup_table;
+
+/* On the incoming side, copies of earlier pages are made once all the
+ * pages in a section have been decompressed.
+ */
+typedef struct {
+    void *dst;
+    void *src;
+} RAMDupCopy;
+static GArray *ram_dup_copies;
+
+void ram_set_snapshot_dedup(bool enable)
+{
+    ram_dedup_enabled = enable;
+}
+
+static uint64_t ram_page_hash(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(*w); i++) {
+        h = (h ^ w[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * save_dup_page: Send a reference to an identical page sent earlier
+ *
+ * Returns: Number of pages written, or -1 if no identical page has been
+ *          sent yet.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @p: pointer to the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int save_dup_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         uint8_t *p, uint64_t *bytes_transferred)
+{
+    gpointer key, orig;
+    RAMBlock *orig_block;
+    ram_addr_t orig_offset;
+    size_t len;
+
+    if (!ram_dedup_table || !ram_bulk_stage) {
+        return -1;
+    }
+
+    key = (gpointer)(uintptr_t)ram_page_hash(p);
+    orig = g_hash_table_lookup(ram_dedup_table, key);
+    if (!orig) {
+        g_hash_table_insert(ram_dedup_table, key, p);
+        return -1;
+    }
+    if (memcmp(orig, p, TARGET_PAGE_SIZE) != 0) {
+        return -1;
+    }
+    orig_block = qemu_ram_block_from_host(orig, false, &orig_offset);
+    if (!orig_block) {
+        return -1;
+    }
+
+    acct_info.dup_pages++;
+    *bytes_transferred += save_page_header(f, block,
+                                           offset | RAM_SAVE_FLAG_DUP_PAGE);
+    len = strlen(orig_block->idstr);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *)orig_block->idstr, len);
+    qemu_put_be64(f, orig_offset);
+    *bytes_transferred += 1 + len + 8;
+    return 1;
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -764,8 +846,9 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage &&
-                   !migration_in_postcopy(migrate_get_current()) &&
+        } else if (ram_bulk_stage) {
+            pages = save_dup_page(f, block, offset, p, bytes_transferred);
+        } else if (!migration_in_postcopy(migrate_get_current()) &&
                    migrate_use_xbzrle()) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
@@ -936,6 +1019,9 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
         if (block != last_sent_block) {
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                pages = save_dup_page(f, block, offset, p, bytes_transferred);
+            }
             if (pages == -1) {
                 /* Make sure the first page is sent out before other pages */
                 bytes_xmit = save_page_header(f, block, offset |
@@ -954,6 +1040,9 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
         } else {
             offset |= RAM_SAVE_FLAG_CONTINUE;
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                pages = save_dup_page(f, block, offset, p, bytes_transferred);
+            }
             if (pages == -1) {
                 pages = compress_page_with_multi_thread(f, block, offset,
                                                         bytes_transferred);
@@ -1430,6 +1519,11 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (ram_dedup_table) {
+        g_hash_table_destroy(ram_dedup_table);
+        ram_dedup_table = NULL;
+    }
 }
 
 static void reset_ram_globals(void)
@@ -1954,6 +2048,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
          }
     }
 
+    if (ram_dedup_enabled) {
+        ram_dedup_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
     rcu_read_lock();
 
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
@@ -2233,7 +2331,10 @@ static void wait_for_decompress_done(void)
 {
     int idx, thread_count;
 
-    if (!migrate_use_compression()) {
+    /* Snapshots can carry compressed pages without the capability being
+     * set on this side, so go by whether there are threads to wait for.
+     */
+    if (!decomp_param) {
         return;
     }
 
@@ -2491,7 +2592,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_DUP_PAGE)) {
             RAMBlock *block = ram_block_from_stream(f, flags);
 
             host = host_from_ram_block_offset(block, addr);
@@ -2558,6 +2660,31 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             decompress_data_with_multi_threads(f, host, len);
             break;
 
+        case RAM_SAVE_FLAG_DUP_PAGE: {
+            RAMBlock *orig_block;
+            RAMDupCopy copy = { .dst = host };
+            char id[256];
+
+            len = qemu_get_byte(f);
+            qemu_get_buffer(f, (uint8_t *)id, len);
+            id[len] = 0;
+            addr = qemu_get_be64(f);
+            orig_block = qemu_ram_block_by_name(id);
+            copy.src = orig_block ?
+                host_from_ram_block_offset(orig_block, addr) : NULL;
+            if (!copy.src) {
+                error_report("Illegal duplicate page source %s:" RAM_ADDR_FMT,
+                             id, addr);
+                ret = -EINVAL;
+                break;
+            }
+            if (!ram_dup_copies) {
+                ram_dup_copies = g_array_new(FALSE, FALSE, sizeof(RAMDupCopy));
+            }
+            g_array_append_val(ram_dup_copies, copy);
+            break;
+        }
+
         case RAM_SAVE_FLAG_XBZRLE:
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
@@ -2584,6 +2711,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     wait_for_decompress_done();
+    if (ram_dup_copies) {
+        guint i;
+        for (i = 0; i < ram_dup_copies->len; i++) {
+            RAMDupCopy *copy = &g_array_index(ram_dup_copies, RAMDupCopy, i);
+            memcpy(copy->dst, copy->src, TARGET_PAGE_SIZE);
+        }
+        g_array_set_size(ram_dup_copies, 0);
+    }
     rcu_read_unlock();
     trace_ram_load_complete(ret, seq_iter);
     return ret;
@@ -1267,13 +1267,10 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+static int qemu_save_device_sections(QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
     cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1299,6 +1296,24 @@ static int qemu_save_device_state(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
+static int qemu_save_device_state(QEMUFile *f)
+{
+    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+
+    return qemu_save_device_sections(f);
+}
+
+/* Save everything but RAM, as a stream qemu_loadvm_state() accepts; the
+ * caller is responsible for RAM contents.
+ */
+int qemu_savevm_state_devices(QEMUFile *f)
+{
+    qemu_savevm_state_header(f);
+
+    return qemu_save_device_sections(f);
+}
+
 static SaveStateEntry *find_se(const char *idstr, int instance_id)
 {
     SaveStateEntry *se;
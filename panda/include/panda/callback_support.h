@@ -1,32 +1,94 @@
 #ifndef __PANDA_CALLBACK_SUPPORT_H__
 #define __PANDA_CALLBACK_SUPPORT_H__
 
+// The callback dispatchers are function pointers so that profiling can swap
+// in timed copies of them; see panda_callbacks_set_profiled.
+
 // exec.c
-void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write);
-void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write);
+extern void (*panda_callbacks_before_dma)(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write);
+extern void (*panda_callbacks_after_dma)(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write);
+// rr_log.c
+extern void (*panda_callbacks_replay_hd_transfer)(CPUState *cpu, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes);
+extern void (*panda_callbacks_replay_net_transfer)(CPUState *cpu, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes);
+extern void (*panda_callbacks_replay_handle_packet)(CPUState *cpu, uint8_t *buf, int size, uint8_t direction, uint64_t old_buf_addr);
 // cpu-exec.c
-void panda_callbacks_before_block_exec(CPUState *cpu, TranslationBlock *tb);
-void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb);
-void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc);
-void panda_callbacks_after_block_translate(CPUState *cpu, TranslationBlock *tb);
-bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool panda_bb_invalidate_done, bool *invalidate);
+extern void (*panda_callbacks_before_block_exec)(CPUState *cpu, TranslationBlock *tb);
+extern void (*panda_callbacks_after_block_exec)(CPUState *cpu, TranslationBlock *tb);
+extern void (*panda_callbacks_before_block_translate)(CPUState *cpu, target_ulong pc);
+extern void (*panda_callbacks_after_block_translate)(CPUState *cpu, TranslationBlock *tb);
+extern bool (*panda_callbacks_after_find_fast)(CPUState *cpu, TranslationBlock *tb, bool panda_bb_invalidate_done, bool *invalidate);
 
 // target-i386/translate.c
-bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc);
+extern bool (*panda_callbacks_insn_translate)(CPUState *env, target_ulong pc);
+// helper_impl.h
+extern void (*panda_callbacks_insn_exec)(CPUState *env, target_ulong pc);
 // softmmu_template.h
-void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
-                                     uint32_t data_size, void *ram_ptr);
-void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
-                                    uint32_t data_size, uint64_t result, void *ram_ptr);
-void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
-                                      uint32_t data_size, uint64_t result, void *ram_ptr);
-void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
-                                     uint32_t data_size, uint64_t val, void *ram_ptr);
+extern void (*panda_callbacks_before_mem_read)(CPUState *env, target_ulong pc, target_ulong addr,
+                                               uint32_t data_size, void *ram_ptr);
+extern void (*panda_callbacks_after_mem_read)(CPUState *env, target_ulong pc, target_ulong addr,
+                                              uint32_t data_size, uint64_t result, void *ram_ptr);
+extern void (*panda_callbacks_before_mem_write)(CPUState *env, target_ulong pc, target_ulong addr,
+                                                uint32_t data_size, uint64_t result, void *ram_ptr);
+extern void (*panda_callbacks_after_mem_write)(CPUState *env, target_ulong pc, target_ulong addr,
+                                               uint32_t data_size, uint64_t val, void *ram_ptr);
 // target-i386/misc_helper.c
-void panda_callbacks_cpuid(CPUState *env);
+extern void (*panda_callbacks_cpuid)(CPUState *env);
+// callbacks.c
+extern void (*panda_callbacks_monitor)(Monitor *mon, const char *cmd);
 // translate-all.c
-void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb);
+extern void (*panda_callbacks_cpu_restore_state)(CPUState *env, TranslationBlock *tb);
 // target-i386/helper.c
-void panda_callbacks_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid);
+extern void (*panda_callbacks_asid_changed)(CPUState *env, target_ulong old_asid, target_ulong new_asid);
+
+// probe.c: the insn being translated while insn_translate callbacks run
+extern bool panda_probe_translating;
+extern target_ulong panda_probe_pc;
+// some TB has probes, so unloading a plugin must flush the TBs
+extern bool panda_probes_emitted;
+
+// gate.c: panda_gate_on is set once the plugins' gates narrow
+// instrumentation down.  panda_gate_asid_mask has a bit for each gate the
+// current ASID passes; TB lookup only finds TBs translated with the same
+// answer.
+extern bool panda_gate_on;
+extern uint32_t panda_gate_asid_mask;
+// a plugin's callbacks were registered or removed
+void panda_gate_plugins_changed(void);
+// the ASID is now asid
+void panda_gate_set_asid(target_ulong asid);
+// should a TB starting at pc be instrumented
+bool panda_gate_block(CPUState *cpu, target_ulong pc);
+// is the insn at pc of interest, as it is translated or runs
+bool panda_gate_pc(CPUState *cpu, target_ulong pc);
+
+// insn_cache.c: a plugin has asked for the insn cache.  Build it for a TB
+// just translated, and free it with the TB.
+extern bool panda_insn_cache_on;
+void panda_insn_cache_build(CPUState *cpu, TranslationBlock *tb);
+void panda_insn_cache_free(TranslationBlock *tb);
+
+// deadline.c: the instruction count of the next deadline, UINT64_MAX if
+// none.  panda_deadline_chained is set when cpu_exec chains TBs, which a
+// new deadline must undo.
+extern uint64_t panda_next_deadline;
+extern bool panda_deadline_chained;
+// run the deadlines that are due
+void panda_deadline_run(CPUState *cpu);
+// drop a plugin's deadlines as it unloads
+void panda_deadline_remove_plugin(void *plugin);
+// how many insns may run before the next deadline; TBs are cut to this
+static inline uint64_t panda_num_instr_before_next_deadline(void) {
+    uint64_t now = first_cpu->rr_guest_instr_count;
+    if (panda_next_deadline == UINT64_MAX) return -1;
+    return panda_next_deadline > now ? panda_next_deadline - now : 0;
+}
+
+// common.c: guest RAM was written behind the CPU's back (DMA, or a replayed
+// skipped call), so memoized guest objects may be stale
+void panda_guest_obj_invalidate(void);
+
+// Point the dispatchers above at copies that count calls and host ticks
+// in each panda_cb_list node (true), or at the plain ones (false).
+void panda_callbacks_set_profiled(bool profiled);
 
 #endif
@@ -33,6 +33,31 @@ int panda_virtual_memory_read(CPUState *env, target_ulong addr,
 int panda_virtual_memory_write(CPUState *env, target_ulong addr,
                                uint8_t *buf, int len);
 
+// Guest objects. Rather than reading a kernel structure one field at a
+// time, each of which walks the page tables again, read the span covering
+// all the fields needed once and decode them from the copy with
+// panda_guest_get_* (guest byte order). During record and replay the spans
+// are memoized per instruction count, so reading the same object again
+// before the guest runs another instruction or a device writes to guest RAM
+// is just a memcpy. Parts on unmapped pages read as zeroes, and the return
+// value is false if there were any.
+#define PANDA_GUEST_OBJ_MAX 512
+bool panda_guest_obj_read(CPUState *env, target_ulong addr,
+                          void *buf, uint32_t len);
+
+static inline uint8_t panda_guest_get_u8(const void *obj, uint32_t off) {
+    return ((const uint8_t *)obj)[off];
+}
+static inline uint16_t panda_guest_get_u16(const void *obj, uint32_t off) {
+    return lduw_p((const uint8_t *)obj + off);
+}
+static inline uint32_t panda_guest_get_u32(const void *obj, uint32_t off) {
+    return ldl_p((const uint8_t *)obj + off);
+}
+static inline uint64_t panda_guest_get_u64(const void *obj, uint32_t off) {
+    return ldq_p((const uint8_t *)obj + off);
+}
+
 
 void panda_before_find_fast(void);
 
@@ -16,13 +16,16 @@ PANDAENDCOMMENT */
 #define __PANDA_HELPER_IMPL_H__
 
 #include "panda/plugin.h"
+#include "panda/callback_support.h"
 
 void helper_panda_insn_exec(target_ulong pc) {
     // PANDA instrumentation: before basic block
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.insn_exec(first_cpu, pc);
-    }
+    panda_callbacks_insn_exec(first_cpu, pc);
+}
+
+// A probe's callback (panda_probe_call), after its predicate held
+void helper_panda_probe_call(void *fn, void *opaque, target_ulong pc) {
+    ((panda_probe_fn) fn)(first_cpu, pc, opaque);
 }
 
 #endif
@@ -17,6 +17,13 @@ void pandalog_cc_close(void);
 //Interface for plog.c to pass a packed protobuf entry to C++ pandalog
 void pandalog_write_packed(size_t entry_size, unsigned char* buf);
 
+// Interface for plog.c to pack an entry straight into the pandalog:
+// fill in its pc and instr, get room for its entry_size packed bytes, pack
+// it there and then commit it.
+void pandalog_cc_stamp(uint64_t *pc, uint64_t *instr);
+unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr);
+void pandalog_cc_commit(size_t entry_size, uint64_t pc, uint64_t instr);
+
 // Interface for plog.c to read an entry
 unsigned char* pandalog_read_packed(void);
 
@@ -21,33 +21,87 @@ extern "C" {
 }
 
 #include <stdio.h>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <vector>
 #include <stdint.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 #include "plog.pb.h"
 
-#define PL_CURRENT_VERSION 2
+// version 3 adds the per-chunk summaries (see PlChunkSummary)
+#define PL_CURRENT_VERSION 3
 // compression level
 #define PL_Z_LEVEL 9
 // 16 MB chunk
 #define PL_CHUNKSIZE (1024 * 1024 * 16)
 // header at most this many bytes
 #define PL_HEADER_SIZE 128
+// 1 MB per-thread staging blocks
+#define PL_STAGE_SIZE (1024 * 1024)
 
 
 typedef struct pandalog_header_struct {
     uint32_t version;     // version number
     uint64_t dir_pos;     // position in file of directory
     uint32_t chunk_size;  // chunk size
+    uint64_t sidx_pos;    // position in file of chunk summaries (0 if none)
 } PlHeader;
 
-// directory mapping instructions to chunks in the outfile
-// say el[0].instr = 1234
-// that means chunk 0 contains all pandalog info for instructions 0..1234
-// and say el[1].instr = 2468
-// that means chunk 1 contains all .. for instr 12345 .. 2468
-// additionally, the data for compressed chunk 0 is in the outfile
-// from pos[0] .. pos[1]-1
+// Secondary index, written after the directory so readers can skip chunks
+// without decompressing them.  At sidx_pos:
+//   uint32_t num_chunks, uint32_t field_words
+// then for each chunk:
+//   PlChunkSummary
+//   uint64_t fields[field_words]   bit n set if some entry has field number n
+//   PlAsidRun runs[num_asid_runs]
+// Entries that were not written from the main loop (instr == -1) don't
+// count towards the instr / pc / asid ranges.
+typedef struct pandalog_chunk_summary_struct {
+    uint64_t instr_lo, instr_hi;  // range of instr over the chunk's entries
+    uint64_t pc_lo, pc_hi;        // range of pc
+    uint64_t asid_lo, asid_hi;    // range of guest asid when entries were written
+    uint32_t num_asid_runs;       // number of PlAsidRun that follow
+    uint32_t num_ranged;          // entries counted in the ranges above
+} PlChunkSummary;
+
+// entries first_entry.. of a chunk were written while asid was current
+typedef struct pandalog_asid_run_struct {
+    uint64_t asid;
+    uint32_t first_entry;
+    uint32_t pad;
+} PlAsidRun;
+
+struct PandalogCcChunkIndex {
+    PlChunkSummary summary;
+    std::vector<uint64_t> fields;
+    std::vector<PlAsidRun> asid_runs;
+};
+
+// Calls fn(field_number, value) for each top-level field of a packed
+// LogEntry without parsing it into a message.  value is only meaningful for
+// varint fields such as pc and instr.  Stops early if fn returns false.
+// Returns false if the entry is malformed.
+template <typename F>
+static inline bool pandalog_scan_fields(const unsigned char *buf, uint32_t n,
+                                        F fn) {
+    using google::protobuf::internal::WireFormatLite;
+    google::protobuf::io::CodedInputStream cis(buf, n);
+    uint32_t tag;
+    while ((tag = cis.ReadTag()) != 0) {
+        uint64_t value = 0;
+        if (WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_VARINT) {
+            if (!cis.ReadVarint64(&value)) return false;
+        } else if (!WireFormatLite::SkipField(&cis, tag)) {
+            return false;
+        }
+        if (!fn(WireFormatLite::GetTagFieldNumber(tag), value)) break;
+    }
+    return true;
+}
+
 struct PandalogCcDir {
 
     uint32_t num_chunks;       // max number of entries (chunks).  
@@ -55,6 +109,8 @@ struct PandalogCcDir {
     std::vector<uint64_t> instr;           // array of instruction counts.  instr[i] is start (first) instruction in chunk i
     std::vector<uint64_t> pos;             // array of file positions.      pos[i] is start file position for chunk i
     std::vector<uint64_t> num_entries;     // size of each chunk in number of pandalog entries
+    std::vector<PandalogCcChunkIndex> sidx; // summary of each chunk (writing only)
+    uint32_t field_words;                  // 64-bit words in each fields bitmap
 };
 
 
@@ -65,15 +121,60 @@ struct PandalogCcChunk {
     uint32_t zsize;             // in bytes of a compressed chunk. 
     unsigned char *buf;         // uncompressed chunk data
     unsigned char *buf_p;       // pointer into uncompressed chunk (used while writing)
+    uint32_t buf_size;          // allocated size of buf while writing, can exceed size
     unsigned char *zbuf;        // corresponding compressed chunk
     // these are used while writing to remember things needed for dir entry
-    uint32_t start_instr;       // first instruction in current chunk 
+    uint64_t start_instr;       // first instruction in current chunk
     uint64_t start_pos;         // pos in file of start of current chunk
     // these are used while reading and contain current chunk data, expanded into pl entries
     std::vector<std::unique_ptr<panda::LogEntry>> entries;    // this will be array of entries in current chunk 
     uint32_t num_entries;       // size of that array 
     uint32_t max_num_entries;   // capacity of that array
     uint32_t ind_entry;         // index into array of entries
+    // summary of the chunk being written
+    PandalogCcChunkIndex index;
+};
+
+// Entries aren't written into the chunk directly.  Each thread that logs
+// appends them to its own chain of staging blocks, which the merger reads
+// without the thread's help: a block is filled only by its writer and the
+// merger only reads up to committed.  Once the writer has moved on to next,
+// committed is final and the merger frees the block.
+struct PlStageBlock {
+    std::atomic<PlStageBlock *> next;
+    std::atomic<uint32_t> committed;  // bytes of whole records in data
+    uint32_t size;
+    unsigned char *data;
+};
+
+// A staged entry is this header, then the packed entry, padded to 8 bytes.
+// key orders entries in the merged stream.  It is instr for entries written
+// from the main loop and otherwise the last instr logged from it.
+typedef struct pandalog_stage_record_struct {
+    uint32_t n;
+    uint32_t pad;
+    uint64_t key;
+    uint64_t instr;
+    uint64_t pc;
+    uint64_t asid;
+} PlStageRecord;
+
+struct PlWriter {
+    PlWriter *next;                // all writers, never unlinked
+    std::atomic<bool> in_use;      // owned by a live thread
+    // no entry of this writer that the merger hasn't seen can have a key
+    // below floor.  UINT64_MAX when the writer isn't in the middle of one.
+    std::atomic<uint64_t> floor;
+    // owner only
+    PlStageBlock *cur;
+    uint32_t used;
+    uint64_t key, asid;            // from stamp_entry, for commit_entry
+    bool block_filled;             // moved on to a new block since commit
+    // backs entries from new_entry, reset when the owner fills a block
+    google::protobuf::Arena arena;
+    // merger only
+    PlStageBlock *read_blk;
+    uint32_t read_off;
 };
 
 class PandaLog {
@@ -83,12 +184,23 @@ class PandaLog {
     PandalogCcDir dir;
     PandalogCcChunk chunk;
     uint32_t chunk_num;
+    uint64_t last_key;             // key of the last entry put in chunk
+    // writers register here once and stay until the log is closed
+    std::atomic<PlWriter *> writers;
+    // highest instr stamped in the main loop so far
+    std::atomic<uint64_t> now;
+    // held by whoever is merging staged entries into chunks
+    std::atomic_flag merging = ATOMIC_FLAG_INIT;
+    // bumped when the log is closed, so threads drop their writers
+    uint32_t generation;
 
 public:    
     //default constructor
-    PandaLog(): mode(PL_MODE_UNKNOWN){
+    PandaLog(): mode(PL_MODE_UNKNOWN), writers(nullptr), now(0){
         mode = PL_MODE_UNKNOWN;
         chunk_num = 0;
+        last_key = -1;
+        generation = 0;
     };
 
     // open pandalog for write with this uncompressed chunk size
@@ -109,6 +221,28 @@ public:
 
     void write_entry(std::unique_ptr<panda::LogEntry> entry);
 
+    // An empty entry to fill in and pass to write_entry(panda::LogEntry *).
+    // It lives on the calling thread's arena, which is cleared every so
+    // often after a write_entry, so don't delete it, don't keep it past
+    // that write_entry and write it from the thread that asked for it.
+    panda::LogEntry *new_entry(void);
+
+    void write_entry(panda::LogEntry *entry);
+
+    // Lower-level writing, for entries that are already packed: get the pc
+    // and instr to put in the entry, then pack it into the n bytes that
+    // reserve_entry returns, then commit_entry.
+    // Any thread may write, without locking.  Entries are merged into
+    // chunks in instr order, those not from the main loop ordered by when
+    // they were stamped.  Threads other than the main loop's must be done
+    // writing by the time the log is closed.
+    void stamp_entry(uint64_t *pc, uint64_t *instr);
+    unsigned char *reserve_entry(size_t n, uint64_t instr);
+    void commit_entry(size_t n, uint64_t pc, uint64_t instr);
+
+    // Called when a thread that wrote entries exits
+    void retire_writer(PlWriter *w, uint32_t generation);
+
     std::unique_ptr<panda::LogEntry> read_entry(void);
 
     // seek to the element in pandalog corresponding to this instr
@@ -139,9 +273,30 @@ private:
     // Adds directory entry to list of directory entries. Does not write to log
     void add_dir_entry();
 
+    // Write the chunk summaries after the directory
+    void write_sidx();
+
+    // Fold the entry just packed at buf into the current chunk's summary
+    void add_to_summary(const unsigned char *buf, uint32_t n, uint64_t instr,
+                        uint64_t pc, uint64_t asid);
+
+    // Start a new, empty summary for the next chunk
+    void reset_summary();
+
     //Zlib compresses and writes current chunk to log
     void write_current_chunk();
 
+    // The calling thread's writer, registering one if need be
+    PlWriter *this_writer();
+
+    // Merge staged entries into chunks, as far as no writer can still
+    // add an earlier one, or all of them if all is set
+    void merge(bool all);
+
+    // Append a staged entry to the current chunk, writing it out first if
+    // it is full
+    void append_to_chunk(const PlStageRecord *rec);
+
     // Finds index of entry with this instr number
     uint32_t find_ind(uint64_t instr, uint32_t lo, uint32_t high);
 
@@ -0,0 +1,87 @@
+/**
+ *
+ * Random-access, filtered reader for C++ pandalogs.
+ *
+ * PandaLog::read_entry decompresses and parses every entry of every chunk.
+ * This reader instead uses the per-chunk summaries written after the
+ * directory (see PlChunkSummary in plog-cc.hpp) to skip chunks that cannot
+ * match a query, decompresses only the chunks that might, and scans each
+ * entry's fields without parsing it until it is known to match.  Chunks are
+ * decoded on several threads; entries are still delivered in log order.
+ *
+ * Logs written before the summaries existed (version 2) can be read too;
+ * chunks are then only skipped based on the directory's instr counts.
+ *
+ */
+
+#ifndef __PANDALOG_QUERY_H_
+#define __PANDALOG_QUERY_H_
+
+#include <functional>
+#include <vector>
+#include <stdint.h>
+
+#include "panda/plog-cc.hpp"
+
+struct PandaLogQuery {
+    // entry must have at least one of these LogEntry field numbers (empty: any)
+    std::vector<uint32_t> fields;
+    uint64_t instr_lo = 0, instr_hi = UINT64_MAX;
+    uint64_t pc_lo = 0, pc_hi = UINT64_MAX;
+    // asid is the guest asid when the entry was written, not a LogEntry field
+    bool match_asid = false;
+    uint64_t asid_lo = 0, asid_hi = UINT64_MAX;
+};
+
+class PandaLogReader {
+public:
+    PandaLogReader(): fd(-1), dir(), num_threads(1), chunks_read(0) {}
+    ~PandaLogReader() { close(); }
+
+    // returns false (and prints why) if path isn't a readable pandalog
+    bool open(const char *path);
+    void close(void);
+
+    // number of threads decoding chunks during query
+    void set_threads(unsigned n) { num_threads = n ? n : 1; }
+
+    uint32_t num_chunks(void) const { return dir.num_chunks; }
+    uint64_t chunk_entries(uint32_t c) const { return dir.num_entries[c]; }
+    uint64_t chunk_start_instr(uint32_t c) const { return dir.instr[c]; }
+    uint64_t chunk_zsize(uint32_t c) const { return dir.pos[c+1] - dir.pos[c]; }
+
+    // NULL if the log has no summaries
+    const PandalogCcChunkIndex *summary(uint32_t c) const {
+        return sidx.empty() ? NULL : &sidx[c];
+    }
+
+    // false if no entry of chunk c can match q
+    bool chunk_may_match(uint32_t c, const PandaLogQuery &q) const;
+
+    // Calls fn on each entry matching q, in log order, until fn returns false.
+    // Returns the number of entries passed to fn.
+    uint64_t query(const PandaLogQuery &q,
+                   std::function<bool(const panda::LogEntry &)> fn);
+
+    // chunks decompressed by the last query
+    uint32_t last_chunks_read(void) const { return chunks_read; }
+
+private:
+    int fd;
+    PlHeader header;
+    PandalogCcDir dir;
+    std::vector<PandalogCcChunkIndex> sidx;
+    unsigned num_threads;
+    uint32_t chunks_read;
+
+    bool read_sidx(void);
+
+    // decompress chunk c and parse the entries matching q into out
+    bool decode_chunk(uint32_t c, const PandaLogQuery &q,
+                      const std::vector<uint64_t> &field_mask,
+                      std::vector<unsigned char> &buf,
+                      std::vector<unsigned char> &zbuf,
+                      std::vector<panda::LogEntry> &out) const;
+};
+
+#endif
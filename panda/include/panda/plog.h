@@ -38,6 +38,22 @@ void pandalog_close(void);
 
 void pandalog_write_entry(Panda__LogEntry *entry);
 
+// Memory for building an entry's sub-messages and arrays.  All of it is
+// released by the next pandalog_write_entry, so don't free it, and don't
+// start building one entry while another is half built.
+void *pandalog_alloc(size_t size);
+
+// e.g. Panda__TaintedBranch *tb = pandalog_new(Panda__TaintedBranch,
+//                                             PANDA__TAINTED_BRANCH__INIT);
+#define pandalog_new(type, init) ({                                  \
+            type *_pl_new = (type *) pandalog_alloc(sizeof(type));  \
+            type _pl_init = init;                                   \
+            *_pl_new = _pl_init;                                    \
+            _pl_new;                                                \
+        })
+
+#define pandalog_new_array(type, n) ((type *) pandalog_alloc(sizeof(type) * (n)))
+
 Panda__LogEntry *pandalog_read_entry(void);
 
 void pandalog_seek(uint64_t instr);
@@ -168,6 +168,9 @@ typedef union panda_cb {
         instructions, avoiding the performance hit of instrumenting everything.
         If you do want to instrument every single instruction, just return
         true. See the documentation for PANDA_CB_INSN_EXEC for more detail.
+        For counting, recording pcs or setting flags, request a probe
+        (panda_probe_count etc.) from this callback and return false;
+        probes are inline code rather than a helper call.
 
     */
     bool (*insn_translate)(CPUState *env, target_ulong pc);
@@ -551,6 +554,9 @@ typedef union panda_cb {
         uint64_t dest_addr:   address for dest
         uint32_t num_bytes:   size of transfer in bytes
 
+       Disk addresses are byte offsets on the disk, RAM addresses guest
+       physical ones.
+
        Return value:
         unused
  */
@@ -585,14 +591,16 @@ typedef union panda_cb {
 
   /* Callback ID:   PANDA_CB_REPLAY_HANDLE_PACKET,
 
-     In replay only, we have a packet (incoming / outgoing) in hand.
+     In replay only, we have a packet (incoming / outgoing) in hand.  Each
+     call is one whole Ethernet frame.
 
      Arguments:
      CPUState *env          pointer to CPUState
      uint8_t *buf           buffer containing packet data
      int size               num bytes in buffer
-     uint8_t direction      XXX read or write.  not sure which is which.
-     uint64_t old_buf_addr  XXX this is a mystery
+     uint8_t direction      PANDA_NET_RX or PANDA_NET_TX
+     uint64_t old_buf_addr  host address of buf at record time, which is
+                            how net transfers name the card's buffers
   */
 
   int (*replay_handle_packet)(CPUState *env, uint8_t *buf, int size, uint8_t
@@ -626,6 +634,9 @@ struct _panda_cb_list {
     panda_cb_list *next;
     panda_cb_list *prev;
     bool enabled;
+    // only counted while callback profiling is on
+    uint64_t prof_calls;
+    uint64_t prof_ticks;
 };
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist);
 void panda_enable_plugin(void *plugin);
@@ -664,6 +675,138 @@ void panda_enable_tb_chaining(void);
 void panda_disable_tb_chaining(void);
 void panda_memsavep(FILE *f);
 
+// Callback profiling counts calls and host ticks for each plugin's
+// callbacks, by callback type, and for each PPP callback.  It is off unless
+// turned on with -panda-profile or the profile_plugins monitor command.
+// Functions run by probes and deadlines are not counted.
+void panda_set_cb_profiling(bool on);
+void panda_cb_profile_reset(void);
+void panda_cb_profile_dump(FILE *f, fprintf_function pf);
+
+// Probes: instrumentation that PANDA emits inline into the translated code
+// of one guest insn, instead of a call to every PANDA_CB_INSN_EXEC callback.
+// They may only be requested from a PANDA_CB_INSN_TRANSLATE callback, and
+// apply to the insn being translated; that callback can then return false.
+// Pointers passed in are baked into the code, so what they point to must
+// live until the TBs are flushed (panda_do_flush_tb) or the plugin unloads.
+
+// Called by panda_probe_call / panda_probe_call_if with the insn's pc.
+typedef void (*panda_probe_fn)(CPUState *env, target_ulong pc, void *opaque);
+
+// Ring of the pcs of probed insns, most recent at buf[(head - 1) & mask].
+// head counts appends (and wraps); readers must allow for overwrites.
+typedef struct panda_probe_ring {
+    uint64_t *buf;      // mask + 1 entries
+    uint32_t mask;      // a power of 2 minus 1, at most 0x0fffffff
+    uint32_t head;
+} panda_probe_ring;
+
+// (*counter)++ each time the insn runs
+void panda_probe_count(uint64_t *counter);
+// *flag = value each time the insn runs
+void panda_probe_set_flag(uint8_t *flag, uint8_t value);
+// append the insn's pc to ring each time the insn runs
+void panda_probe_ring_append(panda_probe_ring *ring);
+// fn(env, pc, opaque) each time the insn runs
+void panda_probe_call(panda_probe_fn fn, void *opaque);
+// fn(env, pc, opaque) when (*word & mask) != 0 as the insn runs; the test
+// is inline, so fn costs nothing until a plugin sets a bit in *word
+void panda_probe_call_if(const uint32_t *word, uint32_t mask,
+                         panda_probe_fn fn, void *opaque);
+
+// AFL style hashed coverage maps.  blocks and edges are read as the insn
+// runs, so they may be switched (e.g. per process) without retranslating;
+// mask is baked in and must not change.
+typedef struct panda_probe_cov_map {
+    uint8_t *blocks;    // mask + 1 hit counters
+    uint8_t *edges;     // mask + 1 hit counters
+    uint32_t mask;      // a power of 2 minus 1, at most 0x0fffffff
+    uint32_t prev;      // id >> 1 of the last block seen
+} panda_probe_cov_map;
+
+// blocks[id & mask]++, edges[(prev ^ id) & mask]++ and prev = id >> 1
+// each time the insn runs; call it on the first insn of a block.  The
+// counters saturate at 0xff.
+void panda_probe_cov(panda_probe_cov_map *cov, uint32_t id);
+
+// Gates: narrow instrumentation down to the code plugins care about.  Each
+// plugin has its own gate, and PANDA instruments the union of them.  A
+// plugin with block, insn, translate or memory callbacks that sets no gate
+// wants everything, so gating only takes effect once all such plugins have
+// one.  Code no gate lets through runs uninstrumented: it gets no block,
+// insn, translate or memory callbacks, no probes and no LLVM (so no taint
+// propagation either).  Code another plugin's gate lets through is still
+// instrumented, so a gate doesn't replace a plugin's own checks.  Changing
+// a gate flushes the TBs.  A plugin's gate goes when it unloads.
+// Only code in one of these ASIDs (default: any)
+void panda_gate_add_asid(void *plugin, target_ulong asid);
+void panda_gate_remove_asid(void *plugin, target_ulong asid);
+// Only code in the modes given (default: both)
+void panda_gate_set_modes(void *plugin, bool kernel, bool user);
+// Only blocks overlapping [lo, hi) and insns in it (default: everywhere)
+void panda_gate_add_pc_range(void *plugin, target_ulong lo, target_ulong hi);
+// Drop the plugin's gate: back to wanting everything
+void panda_gate_reset(void *plugin);
+
+// Deadlines: fn(env, instr, opaque) runs once, between blocks, when the
+// guest instruction count reaches instr (instr is the count it ran at).
+// TBs are cut short so that this is exact, rather than at the end of
+// whatever block the count falls in, so plugins needn't check the count
+// in a before_block_exec callback.  A count already passed runs before the
+// next block.  fn may add deadlines (e.g. the next one of a series); they
+// go when the plugin unloads.
+typedef void (*panda_deadline_fn)(CPUState *env, uint64_t instr, void *opaque);
+// returns an id for panda_deadline_cancel
+uint64_t panda_deadline_add(void *plugin, uint64_t instr,
+                            panda_deadline_fn fn, void *opaque);
+void panda_deadline_cancel(uint64_t id);
+
+// Insn cache: each TB's code and decoded insns, built once as the TB is
+// translated and shared by all plugins, so they needn't read the code back
+// from guest memory and disassemble it themselves.  Only instrumented TBs
+// (see gates) get one.
+typedef enum panda_insn_kind {
+    PANDA_INSN_OTHER = 0,   // doesn't change control flow
+    PANDA_INSN_JUMP,
+    PANDA_INSN_COND_JUMP,
+    PANDA_INSN_CALL,
+    PANDA_INSN_RET,
+    PANDA_INSN_SYSCALL,     // syscalls and software interrupts
+    PANDA_INSN_SYSRET,      // returns from them
+} panda_insn_kind;
+
+#define PANDA_INSN_DIRECT   1   // target is valid
+#define PANDA_INSN_IMM      2   // imm is valid (the trap number)
+
+typedef struct panda_insn {
+    target_ulong pc;
+    target_ulong target;    // branch target, if PANDA_INSN_DIRECT
+    uint64_t imm;           // syscall / interrupt number, if PANDA_INSN_IMM
+    uint16_t offset;        // of its bytes in panda_tb_insns.bytes
+    uint8_t len;
+    uint8_t kind;           // panda_insn_kind
+    uint8_t flags;
+} panda_insn;
+
+typedef struct panda_tb_insns {
+    uint32_t num_insns;
+    uint32_t size;          // == tb->size
+    uint8_t *bytes;         // the TB's code, as translated
+    panda_insn insns[];     // in order
+} panda_tb_insns;
+
+// Build the cache for TBs from now on (flushes the TBs the first time)
+void panda_enable_insn_cache(void);
+// tb's insns, or NULL if the cache is off, tb isn't instrumented or its
+// insns couldn't be laid out
+const panda_tb_insns *panda_tb_insns_get(TranslationBlock *tb);
+// the insn of tb at pc, or NULL
+const panda_insn *panda_tb_insn_at(TranslationBlock *tb, target_ulong pc);
+// Decode the insn being translated, from a PANDA_CB_INSN_TRANSLATE callback
+// (false elsewhere).  Its length isn't known yet, so len is 0.  Works
+// whether or not the cache is enabled.
+bool panda_insn_translating(CPUState *cpu, panda_insn *insn);
+
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
@@ -3,6 +3,8 @@
 #define __PANDA_PLUGIN_PLUGIN_H_
 
 #include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 /*
 
@@ -89,12 +91,37 @@ extern int ppp_##cb_name##_num_cb;
   And employ this where you want the callback functions to be called 
 */
  
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Callback profiling (see panda_set_cb_profiling).  While it is on,
+// PPP_RUN_CB times each callback it runs under the callback's name.
+extern bool panda_cb_profiling;
+int panda_ppp_profile_id(const char *cb_name);
+void panda_ppp_profile_add(int id, uint64_t ticks);
+uint64_t panda_profile_ticks(void);
+#ifdef __cplusplus
+}
+#endif
+
 #define PPP_RUN_CB(cb_name, ...)					\
   {									\
     int ppp_cb_ind;							\
-    for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
-      if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
-	ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;			\
+    if (__builtin_expect(panda_cb_profiling, 0)) {			\
+      static int ppp_prof_id = -1;					\
+      if (ppp_prof_id < 0) ppp_prof_id = panda_ppp_profile_id(#cb_name); \
+      for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
+        if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
+          uint64_t ppp_start = panda_profile_ticks();			\
+          ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;		\
+          panda_ppp_profile_add(ppp_prof_id, panda_profile_ticks() - ppp_start); \
+        }								\
+      }									\
+    } else {								\
+      for (ppp_cb_ind = 0; ppp_cb_ind < ppp_##cb_name##_num_cb; ppp_cb_ind++) { \
+        if (ppp_##cb_name##_cb[ppp_cb_ind] != NULL) {			\
+          ppp_##cb_name##_cb[ppp_cb_ind]( __VA_ARGS__ ) ;		\
+        }								\
       }									\
     }									\
   }
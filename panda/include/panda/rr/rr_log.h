@@ -43,11 +43,14 @@ typedef struct {
     hwaddr len;
 } RR_cpu_mem_unmap;
 
+// A live address_space_map() mapping. shadow holds the contents the mapping
+// had when we last logged it, so that only the bytes a device has modified
+// since then need to go into the log.
 typedef struct RR_MapList {
     void *ptr;
     hwaddr addr;
     hwaddr len;
-    uint32_t crc;
+    uint8_t *shadow;
     QLIST_ENTRY(RR_MapList) link;
 } RR_MapList;
 
@@ -65,11 +68,30 @@ void rr_mem_region_transaction_record(bool begin);
 // mz NOTE: make sure RR_log_entry_kind has at most 255 members
 typedef struct {
     RR_prog_point prog_point;
+    // Decoder state just before this entry was read, so that reading can be
+    // resumed at this entry. See rr_codec_rewind_to().
     uint64_t file_pos;
+    uint64_t prev_instr_count;
+    uint64_t repeat_count;
+    uint64_t repeat_delta;
     RR_log_entry_kind kind;
     RR_callsite_id callsite_loc; // mz This is used for another sanity check
 } RR_header;
 
+// A guest RAM page covered by a state digest. addr is a ram_addr_t.
+typedef struct {
+    uint64_t addr;
+    uint32_t crc;
+} RR_digest_page;
+
+// Periodic state digest: CPU registers plus every RAM page dirtied since the
+// previous digest.
+typedef struct {
+    uint32_t regs_crc;
+    uint32_t num_pages;
+    RR_digest_page *pages;
+} RR_digest_args;
+
 // mz generic args
 typedef struct {
     RR_skipped_call_kind kind;
@@ -98,6 +120,11 @@ typedef struct rr_log_entry_t {
         uint32_t input_4;
         // if log_entry.kind == RR_INPUT_8
         uint64_t input_8;
+        // if log_entry.kind == RR_INPUT_MMIO
+        struct {
+            uint32_t result;
+            uint64_t value;
+        } input_mmio;
         // if log_entry.kind == RR_INTERRUPT_REQUEST
         int32_t interrupt_request; // mz 2-bytes is enough for the interrupt
                                     // request value!
@@ -111,11 +138,68 @@ typedef struct rr_log_entry_t {
 
         // if log_entry.kind == RR_SKIPPED_CALL
         RR_skipped_call_args call_args;
+        // if log_entry.kind == RR_DIGEST
+        RR_digest_args digest;
         // if log_entry.kind == RR_LAST
         // no variant fields
     } variant;
 } RR_log_entry;
 
+// On-disk encoding of the nondet log.
+//
+// Version 1 logs start with the 8-byte instruction count of the last entry.
+// Each entry is a raw 8-byte instruction count, 1-byte kind, 1-byte callsite
+// and then the variant fields written out as their in-memory structs.
+//
+// Version 2 logs start with RR_LOG_MAGIC, a 4-byte version number and the
+// 8-byte instruction count of the last entry. Each entry is a 1-byte kind,
+// 1-byte callsite, the instruction count as a LEB128 delta from the previous
+// entry, and then the variant with every integer field LEB128-encoded (signed
+// ones zigzagged first) and buffers stored raw. MMIO reads are logged as a
+// single RR_INPUT_MMIO entry. A run of inputs identical to the previous one
+// and the same number of instructions apart is collapsed into one RR_REPEAT
+// entry, whose delta is that spacing and whose payload is the run length.
+// RR_REPEAT only exists on disk; the decoder expands it. An RR_DIGEST payload
+// is the register crc and page count, then for each page its address as a
+// LEB128 delta from the previous page and its raw 4-byte crc.
+#define RR_LOG_MAGIC 0x474f4c444e524450ULL // "PDRNDLOG"
+#define RR_LOG_VERSION_1 1
+#define RR_LOG_VERSION_2 2
+#define RR_LOG_VERSION RR_LOG_VERSION_2
+
+typedef struct RR_log_codec {
+    uint32_t version;
+    uint64_t bytes;            // bytes read or written so far, incl. header
+    uint64_t prev_instr_count; // instruction count of the previous entry
+    // Run-length state. When writing, repeat_count copies of last are being
+    // held back; when reading, repeat_count copies of last are still to be
+    // produced.
+    RR_log_entry last;
+    bool last_valid;
+    uint64_t repeat_count;
+    uint64_t repeat_delta;
+    // When reading, seek past skipped call buffers instead of loading them;
+    // they come back NULL. For tools that only need entry boundaries.
+    bool skip_buffers;
+} RR_log_codec;
+
+// All of these return false on a short read or write.
+void rr_codec_init(RR_log_codec *c, uint32_t version);
+bool rr_codec_write_header(RR_log_codec *c, FILE *fp, uint64_t last_instr_count);
+bool rr_codec_update_header(RR_log_codec *c, FILE *fp, uint64_t last_instr_count);
+bool rr_codec_read_header(RR_log_codec *c, FILE *fp, uint64_t *last_instr_count);
+bool rr_codec_write_entry(RR_log_codec *c, FILE *fp, const RR_log_entry *entry);
+bool rr_codec_flush(RR_log_codec *c, FILE *fp);
+// Buffers in skipped calls are g_malloc'd and owned by the caller afterwards.
+bool rr_codec_read_entry(RR_log_codec *c, FILE *fp, RR_log_entry *entry);
+// Entries still buffered in the decoder which don't need any more bytes.
+static inline bool rr_codec_pending(const RR_log_codec *c) {
+    return c->repeat_count != 0;
+}
+// Put the decoder back in the state it was in just before entry was read.
+// The caller must then seek the log file to c->bytes.
+void rr_codec_rewind_to(RR_log_codec *c, const RR_log_entry *entry);
+
 // a program-point indexed record/replay log
 typedef enum { RECORD, REPLAY } RR_log_type;
 typedef struct RR_log_t {
@@ -128,6 +212,7 @@ typedef struct RR_log_t {
     unsigned long long
         size; // for a log being opened for read, this will be the size in bytes
     uint64_t bytes_read;
+    RR_log_codec codec;
 } RR_log;
 
 RR_log_entry* rr_get_queue_head(void);
@@ -186,6 +271,7 @@ static inline uint64_t rr_num_instr_before_next_interrupt(void) {
         case RR_LAST:
         case RR_END_OF_LOG:
         case RR_INTERRUPT_REQUEST:
+        case RR_DIGEST:
             return last_header.prog_point.guest_instr_count -
                 rr_get_guest_instr_count();
         default:
@@ -196,4 +282,34 @@ static inline uint64_t rr_num_instr_before_next_interrupt(void) {
 uint32_t rr_checksum_memory(void);
 uint32_t rr_checksum_regs(void);
 
+// Write or read a recording's starting snapshot. A lazy snapshot keeps
+// guest RAM in a separate image that replay maps in on demand.
+int rr_save_snapshot(QEMUFile *snp);
+int rr_load_snapshot(QEMUFile *snp);
+int rr_save_lazy_snapshot(QEMUFile *snp, const char *snapshot_name);
+int rr_load_any_snapshot(QEMUFile *snp, const char *snapshot_name);
+
+// State digests. While recording with a nonzero rr_digest_interval, an
+// RR_DIGEST entry is logged at the first TB boundary at least that many
+// instructions after the previous one. Replay checks every digest it reaches
+// and stops at the first one that doesn't match.
+extern uint64_t rr_next_digest;
+extern RR_log_entry *rr_queue_head;
+void rr_record_digest(void);
+void rr_replay_digest(void);
+static inline void rr_maybe_digest(void) {
+    if (rr_in_record()) {
+        if (unlikely(rr_digest_interval &&
+                     rr_get_guest_instr_count() >= rr_next_digest)) {
+            rr_record_digest();
+        }
+    } else if (rr_in_replay()) {
+        if (rr_queue_head && rr_queue_head->header.kind == RR_DIGEST &&
+                rr_queue_head->header.prog_point.guest_instr_count ==
+                    rr_get_guest_instr_count()) {
+            rr_replay_digest();
+        }
+    }
+}
+
 #endif
@@ -61,6 +61,11 @@ extern volatile int rr_end_replay_requested;
 extern char* rr_requested_name;
 extern char* rr_snapshot_name;
 
+// Instructions between state digests while recording (-record-digest)
+extern uint64_t rr_digest_interval;
+// Keep RAM out of the recording snapshot (-record-lazy-snapshot)
+extern bool rr_lazy_snapshot;
+
 // used from monitor.c
 int rr_do_begin_record(const char* name, CPUState* cpu_state);
 void rr_do_end_record(void);
@@ -137,7 +142,7 @@ get_skipped_call_kind_string(RR_skipped_call_kind kind)
 }
 
 // Log entries come in 3 different flavors:
-// - IO input (1, 2, 4 and 8 bytes)
+// - IO input (1, 2, 4 and 8 bytes, or an MMIO read result and value)
 // - interrupt request (value is stored only when non-zero)
 // - skipped call (as described above)
 
@@ -152,6 +157,9 @@ get_skipped_call_kind_string(RR_skipped_call_kind kind)
     ACTION(RR_END_OF_LOG),\
     ACTION(RR_PENDING_INTERRUPTS), \
     ACTION(RR_EXCEPTION), \
+    ACTION(RR_INPUT_MMIO), \
+    ACTION(RR_REPEAT), \
+    ACTION(RR_DIGEST), \
     ACTION(RR_LAST),
 
 typedef enum {
@@ -194,6 +202,7 @@ static inline const char* get_log_entry_kind_string(RR_log_entry_kind kind)
     ACTION(RR_CALLSITE_CPU_PENDING_INTERRUPTS_BEFORE), \
     ACTION(RR_CALLSITE_CPU_PENDING_INTERRUPTS_AFTER), \
     ACTION(RR_CALLSITE_CPU_EXCEPTION_INDEX), \
+    ACTION(RR_CALLSITE_DIGEST), \
     ACTION(RR_CALLSITE_LAST)
 
 typedef enum {
@@ -218,6 +227,8 @@ void rr_record_input_1(RR_callsite_id call_site, uint8_t data);
 void rr_record_input_2(RR_callsite_id call_site, uint16_t data);
 void rr_record_input_4(RR_callsite_id call_site, uint32_t data);
 void rr_record_input_8(RR_callsite_id call_site, uint64_t data);
+void rr_record_input_mmio(RR_callsite_id call_site, uint32_t result,
+                          uint64_t value);
 
 void rr_record_interrupt_request(RR_callsite_id call_site,
                                  int interrupt_request);
@@ -232,6 +243,8 @@ void rr_replay_input_1(RR_callsite_id call_site, uint8_t* data);
 void rr_replay_input_2(RR_callsite_id call_site, uint16_t* data);
 void rr_replay_input_4(RR_callsite_id call_site, uint32_t* data);
 void rr_replay_input_8(RR_callsite_id call_site, uint64_t* data);
+void rr_replay_input_mmio(RR_callsite_id call_site, uint32_t* result,
+                          uint64_t* value);
 
 void rr_replay_interrupt_request(RR_callsite_id call_site,
                                  int* interrupt_request);
@@ -282,6 +295,14 @@ static inline bool rr_in_record(void) { return rr_mode == RR_RECORD; }
 static inline bool rr_off(void) { return rr_mode == RR_OFF; }
 static inline bool rr_on(void) { return !rr_off(); }
 
+// Device code may note skipped calls of its own (rr_record_hd_transfer and
+// friends), but only where replay will look for them: inside an
+// RR_DO_RECORD_OR_REPLAY action or in the main loop.
+static inline bool rr_record_device_call(void) {
+    return rr_in_record() &&
+        (rr_record_in_progress || rr_record_in_main_loop_wait);
+}
+
 // Convenience routines that perform appropriate action based on rr_mode setting
 #define RR_CONVENIENCE(name, arg_type)                                  \
     static inline void rr_ ## name ## _at(RR_callsite_id call_site,     \
@@ -306,6 +327,16 @@ RR_CONVENIENCE(input_2, uint16_t);
 RR_CONVENIENCE(input_4, uint32_t);
 RR_CONVENIENCE(input_8, uint64_t);
 
+// MMIO reads log the MemTxResult and the value read as one entry.
+static inline void rr_input_mmio(uint32_t* result, uint64_t* value) {
+    RR_callsite_id call_site = (RR_callsite_id)rr_skipped_callsite_location;
+    if (rr_in_record()) {
+        rr_record_input_mmio(call_site, *result, *value);
+    } else if (rr_in_replay()) {
+        rr_replay_input_mmio(call_site, result, value);
+    }
+}
+
 static inline void rr_replay_skipped_calls(void)
 {
     rr_replay_skipped_calls_internal(
@@ -453,6 +484,12 @@ void rr_record_hd_transfer(RR_callsite_id call_site,
 
 /* Network stuff. */
 
+// direction of a handle_packet entry
+typedef enum {
+    PANDA_NET_RX = 0,
+    PANDA_NET_TX = 1
+} Net_packet_direction;
+
 typedef enum {
     NET_TRANSFER_RAM_TO_IOB,
     NET_TRANSFER_IOB_TO_RAM,
@@ -15,15 +15,19 @@
 /*
 
   This plugin runs with no arguments and is very simple. 
-  It collects the set of asids (cr3 on x86) that are ever observed during
-  a replay (checking just before each bb executes).  For each asid,
-  the plugin, further, keeps track of the first instruction at which it
-  is observed, and also the last.  Together, these two tell us for
-  what fraction of the replay an asid (and thus the associated process)
-  existed.  Upon exit, this plugin dumps this data out to a file 
-  "asidstory" but also displays it in an asciiart graph.  At the bottom
-  of the graph is a set of indicators you can use to choose a good
-  rr instruction count for various purposes.
+  It collects the set of processes that are ever observed during
+  a replay, and for each one, the instructions at which it was first
+  and last seen running and how much it ran in each part of the replay.
+  Together, these tell us for what fraction of the replay a process
+  existed and when it was scheduled.  This data is dumped out to a file
+  "asidstory" and also displayed there in an asciiart graph.  A finer
+  grained version goes to "asidstory.tl" (see asidstory.h), which
+  timeline.py can zoom into.
+
+  OSI is only asked for the current process when the asid or the kernel
+  stack changes, and each process has a fixed number of timeline cells
+  whatever the number of context switches, so time and memory don't grow
+  with the length of the replay.
 
  */
 
@@ -34,14 +38,11 @@
 
 #include <algorithm>
 #include <map>
-#include <set>
 #include <cstdint>
 #include <cstring>
 #include <sstream>
 #include <iomanip>
 #include <vector>
-#include <algorithm>
-#include <cmath>
 
 #include "panda/plugin.h"
 #include "panda/plugin_plugin.h"
@@ -68,10 +69,22 @@ PPP_PROT_REG_CB(on_proc_change);
 PPP_CB_BOILERPLATE(on_proc_change);
 
 
+// columns in the ascii timeline
 uint32_t num_cells = 80;
-uint64_t min_instr;
+// cells in asidstory.tl
+uint32_t num_tl_cells = 4096;
+// kernel stack pointers are compared with this many low bits dropped.
+// Linux kernel stacks are 8 KiB on i386 and ARM, 16 KiB on x86_64.
+#if defined(TARGET_X86_64)
+#define DEFAULT_KSTACK_BITS 14
+#else
+#define DEFAULT_KSTACK_BITS 13
+#endif
+uint32_t kstack_bits = DEFAULT_KSTACK_BITS;
+
 uint64_t max_instr = 0;
-double scale;
+// instructions per timeline cell
+uint64_t cell_instr = 1;
 
 bool pid_ok(int pid) {
     if (pid < 4) {
@@ -80,20 +93,13 @@ bool pid_ok(int pid) {
     return true;
 }
  
-#define MILLION 1000000
-//#define NAMELEN 10
-//#define NAMELENS "10"
 #define NAMELEN 20
 #define NAMELENS "20"
 
-uint64_t a_counter = 0;
-uint64_t b_counter = 0;
-
 
 typedef std::string Name;
 typedef uint32_t Pid;
 typedef uint64_t Asid;
-typedef uint32_t Cell;
 typedef uint64_t Count;
 typedef uint64_t Instr;
 
@@ -113,17 +119,24 @@ struct NamePid {
 };
 
 struct ProcessData {
+    NamePid namepid;
     std::string shortname;   
-    std::map<Cell, Count> cells;  
-    Count count;           
+    std::vector<Count> cells;  // instructions run in each timeline cell
+    Count count;               // times it was switched to
+    Instr instr;               // instructions run
     Instr first;
     Instr last;
 
-    ProcessData() : count(0), first(0), last(0) {}
+    ProcessData(const NamePid &namepid) :
+        namepid(namepid), count(0), instr(0), first(0), last(0) {}
 };
 
-std::map<NamePid, ProcessData> process_datas;
-typedef std::pair<NamePid, ProcessData> ProcessKV;
+// processes are interned: OSI results are looked up in process_ids once
+// per switch and everything else uses the index into process_datas
+std::map<NamePid, uint32_t> process_ids;
+std::vector<ProcessData> process_datas;
+
+static std::map<std::string, unsigned> name_count;
 
 static unsigned digits(uint64_t num) {
     return std::to_string(num).size();
@@ -135,13 +148,25 @@ using std::setw;
 using std::setfill;
 using std::endl;
 
+// is there any instruction of pd's in ascii column col?
+static bool ran_in_column(const ProcessData &pd, uint32_t col) {
+    if (pd.cells.empty()) return false;
+    uint64_t lo = (uint64_t) col * num_tl_cells / num_cells;
+    uint64_t hi = std::max(lo + 1, (uint64_t) (col + 1) * num_tl_cells / num_cells);
+    for (uint64_t c = lo; c < hi; c++) {
+        if (pd.cells[c]) return true;
+    }
+    return false;
+}
+
 void spit_asidstory() {
     FILE *fp = fopen("asidstory", "w");
 
-    std::vector<ProcessKV> count_sorted_pds(process_datas.begin(), process_datas.end());
+    std::vector<const ProcessData *> count_sorted_pds;
+    for (auto &pd : process_datas) count_sorted_pds.push_back(&pd);
     std::sort(count_sorted_pds.begin(), count_sorted_pds.end(),
-            [](const ProcessKV &lhs, const ProcessKV &rhs) {
-                return lhs.second.count > rhs.second.count; });
+            [](const ProcessData *lhs, const ProcessData *rhs) {
+                return lhs->count > rhs->count; });
 
     std::stringstream head;
     head << 
@@ -152,202 +177,218 @@ void spit_asidstory() {
         "  " << setw(digits(max_instr)) << "First" << 
         "      " << setw(digits(max_instr)) << "Last" << endl;
     fprintf(fp, "%s", head.str().c_str());
-    for (auto &pd_kv : count_sorted_pds) {
-        const NamePid &namepid = pd_kv.first;
-        const ProcessData &pd = pd_kv.second;
-        //        if (pd.count >= sample_cutoff) {
-            std::stringstream ss;
-            ss <<
-                setw(digits(max_instr)) << pd.count <<
-                setw(6) << namepid.pid << "  " <<
-                setw(NAMELEN) << pd.shortname << "  " <<
-                setw(sizeof(target_ulong) * 2) <<
-                hex << namepid.asid << dec << setfill(' ') <<
-                "  " << setw(digits(max_instr)) << pd.first <<
-                "  ->  " << setw(digits(max_instr)) << pd.last << endl;
-            fprintf(fp, "%s", ss.str().c_str());
-            //        }
+    for (auto pd : count_sorted_pds) {
+        const NamePid &namepid = pd->namepid;
+        std::stringstream ss;
+        ss <<
+            setw(digits(max_instr)) << pd->count <<
+            setw(6) << namepid.pid << "  " <<
+            setw(NAMELEN) << pd->shortname << "  " <<
+            setw(sizeof(target_ulong) * 2) <<
+            hex << namepid.asid << dec << setfill(' ') <<
+            "  " << setw(digits(max_instr)) << pd->first <<
+            "  ->  " << setw(digits(max_instr)) << pd->last << endl;
+        fprintf(fp, "%s", ss.str().c_str());
     }
 
     fprintf(fp, "\n");
 
-    std::vector<ProcessKV> first_sorted_pds(process_datas.begin(), process_datas.end());
-    std::sort(first_sorted_pds.begin(), first_sorted_pds.end(),
-            [](const ProcessKV &lhs, const ProcessKV &rhs) {
-                return lhs.second.first < rhs.second.first; });
-
-    for (auto &pd_kv : first_sorted_pds) {
-        const ProcessData &pd = pd_kv.second;
-
-        //        if (pd.count >= sample_cutoff) {
-            fprintf(fp, "%" NAMELENS "s : [", pd.shortname.c_str());
-            for (unsigned i = 0; i < num_cells; i++) {
-                auto it = pd.cells.find(i);
-                if (it == pd.cells.end() || it->second < 2) {
-                    fprintf(fp, " ");
-                } else {
-                    fprintf(fp, "#");
-                }
-            }
-            fprintf(fp, "]\n");
-            //        }
+    std::vector<const ProcessData *> first_sorted_pds(count_sorted_pds);
+    std::stable_sort(first_sorted_pds.begin(), first_sorted_pds.end(),
+            [](const ProcessData *lhs, const ProcessData *rhs) {
+                return lhs->first < rhs->first; });
+
+    for (auto pd : first_sorted_pds) {
+        fprintf(fp, "%" NAMELENS "s : [", pd->shortname.c_str());
+        for (unsigned i = 0; i < num_cells; i++) {
+            fprintf(fp, "%c", ran_in_column(*pd, i) ? '#' : ' ');
+        }
+        fprintf(fp, "]\n");
     }
 
     fclose(fp);
 }
 
+void spit_timeline() {
+    FILE *fp = fopen("asidstory.tl", "wb");
+    if (!fp) {
+        perror("asidstory: can't write asidstory.tl");
+        return;
+    }
+    asidstory_tl_header_t h = {};
+    memcpy(h.magic, ASIDSTORY_TL_MAGIC, sizeof(h.magic));
+    h.version = ASIDSTORY_TL_VERSION;
+    h.num_cells = num_tl_cells;
+    h.total_instr = max_instr;
+    h.cell_instr = cell_instr;
+    h.num_procs = process_datas.size();
+    fwrite(&h, sizeof(h), 1, fp);
+
+    std::vector<Count> zeroes(num_tl_cells);
+    for (auto &pd : process_datas) {
+        asidstory_tl_proc_t p = {};
+        p.asid = pd.namepid.asid;
+        p.first = pd.first;
+        p.last = pd.last;
+        p.instr = pd.instr;
+        p.count = pd.count;
+        p.pid = pd.namepid.pid;
+        p.name_len = pd.namepid.name.size();
+        fwrite(&p, sizeof(p), 1, fp);
+        fwrite(pd.namepid.name.data(), 1, p.name_len, fp);
+        const std::vector<Count> &cells = pd.cells.empty() ? zeroes : pd.cells;
+        fwrite(cells.data(), sizeof(Count), num_tl_cells, fp);
+    }
+    fclose(fp);
+}
 
-    
-char last_name[256];
-target_ulong last_pid = 0;
-target_ulong last_asid = 0;
-
-static std::map<std::string, unsigned> name_count;
 
-bool spit_out_total_instr_once = false;
+// the process we think is running, as an index into process_datas, or -1
+// if OSI hasn't given us a good one since the last switch
+int64_t cur_proc = -1;
+// when cur_proc started running.  While cur_proc is -1 this stays at the
+// end of the last known process, so the next one found is charged for the
+// time it took to find it.
+Instr cur_since = 0;
+target_ulong cur_asid = 0;
+target_ulong cur_kstack = 0;
 
-int num_ok = 0;
-int num_not_ok = 0;
+static void *plugin_self;
+static bool spit_on_switch = false;
 
-bool proc_ok = true;
-bool asid_just_changed = false;
-OsiProc *proc_at_asid_changed = NULL;
-uint64_t instr_count_at_asid_changed;
-target_ulong asid_at_asid_changed;
+uint64_t num_asid_change = 0;
+uint64_t num_osi_lookups = 0;
 
 bool check_proc_ok(OsiProc *proc) {
     return (proc && pid_ok(proc->pid));
 }
 
+// NB: we only know max instr *after* replay has started,
+// so this code *cant* be run in init_plugin.  yuck. only triggers once
+static void init_max_instr() {
+    max_instr = replay_get_total_num_instructions();
+    if (max_instr == 0) max_instr = 1;
+    cell_instr = (max_instr + num_tl_cells - 1) / num_tl_cells;
+    printf("max_instr = %" PRId64 "\n", max_instr);
+}
 
-/* 
-   proc assumed to be ok.
-   register that we saw this proc at this instr count
-   updating first / last instr and cell counts
-*/
-void saw_proc(CPUState *env, OsiProc *proc, uint64_t instr_count) {
-    const NamePid namepid(proc->name ? proc->name : "", proc->pid, proc->asid);        
-    ProcessData &pd = process_datas[namepid];
-    if (pd.first == 0) {
-        // first encounter of this name/pid -- create reasonable shortname
-        pd.first = instr_count;
-        unsigned count = ++name_count[namepid.name];
-        std::string count_str(std::to_string(count));
-        std::string shortname(namepid.name);
-        if (shortname.size() >= 4 && shortname.compare(shortname.size() - 4, 4, ".exe") == 0) {
-            shortname = shortname.substr(0, shortname.size() - 4); 
-        }
-        if (count > 1) {
-            if (shortname.size() + count_str.size() > NAMELEN) {
-                shortname = shortname.substr(0, NAMELEN - count_str.size()) + count_str;
-            } else {
-                shortname += count_str;
-            }
-        } else if (shortname.size() > NAMELEN) {
-            shortname = shortname.substr(0, NAMELEN);
-        }
-        pd.shortname = "";
-        for (uint32_t i=0; i<shortname.length(); i++) {
-            if (isprint(shortname[i])) 
-                pd.shortname += shortname[i];
-            else
-                pd.shortname += '_';
+static uint32_t intern_proc(OsiProc *proc, Instr instr_count) {
+    const NamePid namepid(proc->name ? proc->name : "", proc->pid, proc->asid);
+    auto it = process_ids.find(namepid);
+    if (it != process_ids.end()) return it->second;
+
+    // first encounter of this name/pid -- create reasonable shortname
+    uint32_t id = process_datas.size();
+    process_ids[namepid] = id;
+    process_datas.emplace_back(namepid);
+    ProcessData &pd = process_datas.back();
+    pd.first = instr_count;
+    unsigned count = ++name_count[namepid.name];
+    std::string count_str(std::to_string(count));
+    std::string shortname(namepid.name);
+    if (shortname.size() >= 4 && shortname.compare(shortname.size() - 4, 4, ".exe") == 0) {
+        shortname = shortname.substr(0, shortname.size() - 4); 
+    }
+    if (count > 1) {
+        if (shortname.size() + count_str.size() > NAMELEN) {
+            shortname = shortname.substr(0, NAMELEN - count_str.size()) + count_str;
+        } else {
+            shortname += count_str;
         }
-        pd.shortname = shortname;
+    } else if (shortname.size() > NAMELEN) {
+        shortname = shortname.substr(0, NAMELEN);
     }
-    pd.count++;
-    uint32_t cell = instr_count * scale;
-    pd.cells[cell]++;
-    pd.last = std::max(pd.last, instr_count);
+    for (uint32_t i=0; i<shortname.length(); i++) {
+        pd.shortname += isprint(shortname[i]) ? shortname[i] : '_';
+    }
+    return id;
 }
 
+// process id ran from instr i1 up to i2
+static void saw_proc_range(uint32_t id, Instr i1, Instr i2) {
+    ProcessData &pd = process_datas[id];
+    if (pd.cells.empty()) pd.cells.resize(num_tl_cells);
+    pd.last = std::max(pd.last, i2);
+    pd.instr += i2 - i1;
+    while (i1 < i2) {
+        uint64_t c = std::min<uint64_t>(i1 / cell_instr, num_tl_cells - 1);
+        Instr end = std::min(i2, (c + 1) * cell_instr);
+        if (end <= i1) end = i2;    // past max_instr: all in the last cell
+        pd.cells[c] += end - i1;
+        i1 = end;
+    }
+}
 
-
-// proc was seen from instr i1 to i2
-void saw_proc_range(CPUState *env, OsiProc *proc, uint64_t i1, uint64_t i2) {
-    uint64_t step = floor(1.0 / scale) / 2;
-    // assume that last process was running from last asid change to basically now
-    saw_proc(env, proc, i1);
-    saw_proc(env, proc, i2);
-    for (uint64_t i=i1; i<=i2; i+=step/3) {
-        saw_proc(env, proc, i);
+static void switch_proc(CPUState *env, OsiProc *proc, target_ulong asid) {
+    Instr now = rr_get_guest_instr_count();
+    int64_t id = check_proc_ok(proc) ? (int64_t) intern_proc(proc, now) : -1;
+    if (id == cur_proc) return;
+    if (cur_proc >= 0) {
+        saw_proc_range(cur_proc, cur_since, now);
+        cur_since = now;
+    }
+    cur_proc = id;
+    if (id >= 0) {
+        process_datas[id].count++;
+        PPP_RUN_CB(on_proc_change, env, asid, proc);
+        // no replay length to pace a deadline by
+        if (spit_on_switch) spit_asidstory();
     }
 }
 
+// keep the ascii file fresh enough to watch, about once per column.
+// Outside a replay the length isn't known, so the file is written on
+// process changes instead.
+static void spit_deadline(CPUState *env, uint64_t now, void *opaque) {
+    if (max_instr == 0) init_max_instr();
+    if (cur_proc >= 0) {
+        saw_proc_range(cur_proc, cur_since, now);
+        cur_since = now;
+    }
+    spit_asidstory();
+    if (!rr_in_replay() || replay_get_total_num_instructions() == 0) {
+        spit_on_switch = true;
+        return;
+    }
+    panda_deadline_add(plugin_self,
+                       now + std::max<uint64_t>(max_instr / num_cells, 1),
+                       spit_deadline, NULL);
+}
 
-bool saw_first_reasonable = false;
+// Ask OSI for the current process if asid or (in the kernel) the kernel
+// stack changed since we last asked.  In user mode the kernel stack is
+// left as it was: the next thread switch happens in the kernel anyway.
+static void check_proc(CPUState *env, target_ulong asid) {
+    target_ulong kstack = cur_kstack;
+    if (panda_in_kernel(env)) {
+        kstack = panda_current_sp(env) >> kstack_bits;
+    }
+    if (asid == cur_asid && kstack == cur_kstack) return;
+    cur_asid = asid;
+    cur_kstack = kstack;
 
-uint64_t num_asid_change = 0;
-uint64_t num_seq_bb = 0;
+    if (max_instr == 0) init_max_instr();
+    num_osi_lookups++;
+    OsiProc *proc = get_current_process(env);
+    switch_proc(env, proc, asid);
+    free_osiproc(proc);
+}
 
-// when asid changes, try to figure out current proc, which can fail in which case
-// the before_block_exec callback will try again at the start of each subsequent
-// block until we succeed in determining current proc. 
-// also, if proc has changed, we record the fact that a process was seen to be running
-// from now back to last asid change
 int asidstory_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid) {
     // some fool trying to use asidstory for boot? 
     if (new_asid == 0) return 0;
-
-    //    printf ("%" PRId64 " %" PRId64 " ASID CHANGE %x %x\n", num_asid_change, num_seq_bb, old_asid, new_asid);
     num_asid_change ++;
-
-    uint64_t curr_instr = rr_get_guest_instr_count();
-    if (proc_at_asid_changed != NULL) {
-        saw_proc_range(env, proc_at_asid_changed, instr_count_at_asid_changed, curr_instr-100);
-    }
-    asid_at_asid_changed = new_asid;
-    instr_count_at_asid_changed = curr_instr;
-    proc_at_asid_changed = get_current_process(env);
-    proc_ok = check_proc_ok(proc_at_asid_changed);
-    if (proc_ok) {
-        PPP_RUN_CB(on_proc_change, env, new_asid, proc_at_asid_changed);
-    }
-    asid_just_changed = true;    
-    spit_asidstory();
+    check_proc(env, new_asid);
     return 0;
 }
 
-
-
-// before every bb,  really just trying to figure out current proc correctly
+// before every bb, catch kernel stack (thread) switches and get another
+// chance at the current proc if OSI couldn't tell at the asid change
 int asidstory_before_block_exec(CPUState *env, TranslationBlock *tb) {
-    num_seq_bb ++;
-
-    /*    if ((num_seq_bb % 100000000) == 0) {
-        printf ("%" PRId64 " bb executed.  %" PRId64 " instr\n", num_seq_bb, rr_get_guest_instr_count());
-    }
-    */
     target_ulong asid = panda_current_asid(env);   
     // some fool trying to use asidstory for boot? 
     if (asid == 0) return 0;
-
-    OsiProc *proc = get_current_process(env);
-    //if (proc) printf ("asid=0x" TARGET_FMT_lx "  pc=0x" TARGET_FMT_lx "  proc=%s\n", panda_current_asid(env), panda_current_pc(env), proc->name);
-    free_osiproc(proc);
-    // NB: we only know max instr *after* replay has started,
-    // so this code *cant* be run in init_plugin.  yuck. only triggers once
-    if (max_instr == 0) {
-        max_instr = replay_get_total_num_instructions();
-        scale = ((double) num_cells) / ((double) max_instr); 
-        printf("max_instr = %" PRId64 "\n", max_instr);
-    }
-    // only use rest of this callback if asid just changed and we still dont have valid proc
-    if (asid_just_changed && !proc_ok)  {
-        OsiProc *proc = get_current_process(env);
-        if (check_proc_ok(proc)) {
-            // we now have a good proc for first time after recent asid change.
-            // disable this callback until next asid change
-            asid_just_changed = false;
-            proc_at_asid_changed = proc;
-            if (proc_ok) {
-                PPP_RUN_CB(on_proc_change, env, panda_current_asid(env), proc_at_asid_changed);
-            }
-        }
-        else {
-            free_osiproc(proc);
-        }
-    }
+    check_proc(env, asid);
     return 0;
 }
 
@@ -364,17 +405,27 @@ bool init_plugin(void *self) {
     
     pcb.before_block_exec = asidstory_before_block_exec;
     panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+
+    plugin_self = self;
+    panda_deadline_add(self, 0, spit_deadline, NULL);
     
     panda_arg_list *args = panda_get_args("asidstory");
     num_cells = std::max(panda_parse_uint64_opt(args, "width", 100, "number of columns to use for display"), UINT64_C(80)) - NAMELEN - 5;
-    //    sample_rate = panda_parse_uint32(args, "sample_rate", sample_rate);
-    //    sample_cutoff = panda_parse_uint32(args, "sample_cutoff", sample_cutoff);
-    
-    min_instr = 0;   
+    num_tl_cells = panda_parse_uint32_opt(args, "cells", 4096, "number of cells in asidstory.tl");
+    num_tl_cells = std::max(num_tl_cells, num_cells);
+    kstack_bits = panda_parse_uint32_opt(args, "kstack_bits", DEFAULT_KSTACK_BITS,
+        "log2 of the kernel stack granularity used to spot thread switches");
+    panda_free_args(args);
     return true;
 }
 
 void uninit_plugin(void *self) {
-  spit_asidstory();
+    if (max_instr == 0) init_max_instr();
+    if (cur_proc >= 0) {
+        saw_proc_range(cur_proc, cur_since, rr_get_guest_instr_count());
+    }
+    printf("asidstory: %" PRIu64 " asid changes, %" PRIu64 " OSI lookups, %zu processes\n",
+           num_asid_change, num_osi_lookups, process_datas.size());
+    spit_asidstory();
+    spit_timeline();
 }
-
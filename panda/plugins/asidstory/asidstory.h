@@ -5,5 +5,38 @@
 // and we have decent OsiProc.
 typedef void (* on_proc_change_t)(CPUState *env, target_ulong asid, OsiProc *proc);
 
+// On-disk layout of asidstory.tl, the process timeline. All fields are in
+// host byte order.
+//
+//   asidstory_tl_header_t
+//   for each process: asidstory_tl_proc_t, name_len bytes of name (not
+//       NUL terminated), then uint64_t instr[num_cells]
+//
+// Cell i covers replay instructions [i * cell_instr, (i+1) * cell_instr),
+// and instr[i] is how many of those the process ran. timeline.py draws
+// any instruction range of it at any width.
+
+#define ASIDSTORY_TL_MAGIC "PANDAAST"
+#define ASIDSTORY_TL_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_cells;
+    uint64_t total_instr;
+    uint64_t cell_instr;
+    uint32_t num_procs;
+    uint32_t pad;
+} asidstory_tl_header_t;
+
+typedef struct {
+    uint64_t asid;
+    uint64_t first;     // instr count when first seen running
+    uint64_t last;      // and when last seen running
+    uint64_t instr;     // instructions run in all
+    uint64_t count;     // times it was switched to
+    uint32_t pid;
+    uint32_t name_len;
+} asidstory_tl_proc_t;
 
 #endif 
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+#
+# Draw part of an asidstory timeline (asidstory.tl) as ascii art, like the
+# bottom of the asidstory file but for any instruction range and width.
+# See asidstory.h for the format.
+#
+# Usage: timeline.py [-s start] [-e end] [-w width] [-m min_instr] [-d] asidstory.tl
+#
+# Each column covers (end - start) / width instructions.  It shows '#' if
+# the process ran in it, or with -d, a digit 1-9 for roughly how much of
+# the column it ran for.
+
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct("=8sIIQQII")
+PROC = struct.Struct("=QQQQQII")
+
+def read_timeline(fn):
+    procs = []
+    with open(fn, "rb") as f:
+        magic, version, num_cells, total_instr, cell_instr, num_procs, _ = \
+            HEADER.unpack(f.read(HEADER.size))
+        if magic != b"PANDAAST" or version != 1:
+            sys.exit("%s is not an asidstory timeline" % fn)
+        cells_fmt = struct.Struct("=%dQ" % num_cells)
+        for _ in range(num_procs):
+            asid, first, last, instr, count, pid, name_len = \
+                PROC.unpack(f.read(PROC.size))
+            name = f.read(name_len).decode(errors="replace")
+            cells = cells_fmt.unpack(f.read(cells_fmt.size))
+            procs.append(dict(asid=asid, first=first, last=last, instr=instr,
+                              count=count, pid=pid, name=name, cells=cells))
+    return total_instr, cell_instr, procs
+
+def ran(cells, cell_instr, lo, hi):
+    """ instructions run in [lo, hi), assuming they're spread evenly over
+    each cell """
+    total = 0.0
+    c = lo // cell_instr
+    while c < len(cells) and c * cell_instr < hi:
+        c_lo, c_hi = c * cell_instr, (c + 1) * cell_instr
+        overlap = min(hi, c_hi) - max(lo, c_lo)
+        total += cells[c] * overlap / cell_instr
+        c += 1
+    return total
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-s", dest="start", type=int, default=0)
+    parser.add_argument("-e", dest="end", type=int)
+    parser.add_argument("-w", dest="width", type=int, default=100)
+    parser.add_argument("-m", dest="min_instr", type=int, default=1,
+                        help="leave out processes that ran less than this in the range")
+    parser.add_argument("-d", dest="density", action="store_true")
+    parser.add_argument("timeline")
+    args = parser.parse_args()
+
+    total_instr, cell_instr, procs = read_timeline(args.timeline)
+    start = args.start
+    end = args.end if args.end is not None else total_instr
+    if end <= start:
+        sys.exit("empty range")
+    col_instr = (end - start) / args.width
+    if col_instr < cell_instr:
+        print("note: timeline cells are %d instructions, columns are %d"
+              % (cell_instr, col_instr), file=sys.stderr)
+
+    print("instructions %d to %d, %d per column" % (start, end, col_instr))
+    rows = []
+    for p in procs:
+        cols = [ran(p["cells"], cell_instr, int(start + i * col_instr),
+                    int(start + (i + 1) * col_instr)) for i in range(args.width)]
+        if sum(cols) < args.min_instr:
+            continue
+        rows.append((p, cols))
+    rows.sort(key=lambda r: r[0]["first"])
+    for p, cols in rows:
+        line = ""
+        for v in cols:
+            if v <= 0:
+                line += " "
+            elif args.density:
+                line += str(min(9, 1 + int(9 * v / col_instr)))
+            else:
+                line += "#"
+        print("%20s %6d : [%s]" % (p["name"][:20], p["pid"], line))
+
+if __name__ == "__main__":
+    main()
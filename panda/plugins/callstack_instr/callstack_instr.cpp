@@ -21,15 +21,6 @@ PANDAENDCOMMENT */
 #include <vector>
 #include <algorithm>
 
-#include <capstone/capstone.h>
-#if defined(TARGET_I386)
-#include <capstone/x86.h>
-#elif defined(TARGET_ARM)
-#include <capstone/arm.h>
-#elif defined(TARGET_PPC)
-#include <capstone/ppc.h>
-#endif
-
 #include "panda/plugin.h"
 #include "panda/plugin_plugin.h"
 
@@ -44,7 +35,6 @@ bool translate_callback(CPUState* cpu, target_ulong pc);
 int exec_callback(CPUState* cpu, target_ulong pc);
 int before_block_exec(CPUState* cpu, TranslationBlock *tb);
 int after_block_exec(CPUState* cpu, TranslationBlock *tb);
-int after_block_translate(CPUState* cpu, TranslationBlock *tb);
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
@@ -76,9 +66,6 @@ struct stack_entry {
 
 #define MAX_STACK_DIFF 5000
 
-csh cs_handle_32;
-csh cs_handle_64;
-
 // Track the different stacks we have seen to handle multiple threads
 // within a single process.
 std::map<target_ulong,std::set<target_ulong>> stacks_seen;
@@ -97,8 +84,6 @@ typedef target_ulong stackid;
 std::map<stackid, std::vector<stack_entry>> callstacks;
 // stackid -> function entry points
 std::map<stackid, std::vector<target_ulong>> function_stacks;
-// EIP -> instr_type
-std::map<target_ulong, instr_type> call_cache;
 int last_ret_size = 0;
 
 static inline bool in_kernelspace(CPUArchState* env) {
@@ -172,60 +157,19 @@ static stackid get_stackid(CPUArchState* env) {
 #endif
 }
 
-instr_type disas_block(CPUArchState* env, target_ulong pc, int size) {
-    unsigned char *buf = (unsigned char *) malloc(size);
-    int err = panda_virtual_memory_rw(ENV_GET_CPU(env), pc, buf, size, 0);
-    if (err == -1) printf("Couldn't read TB memory!\n");
-    instr_type res = INSTR_UNKNOWN;
-
-#if defined(TARGET_I386)
-    csh handle = (env->hflags & HF_LMA_MASK) ? cs_handle_64 : cs_handle_32;
-#elif defined(TARGET_ARM)
-    csh handle = cs_handle_32;
-
-    if (env->thumb){
-        cs_option(handle, CS_OPT_MODE, CS_MODE_THUMB);
-    }
-    else {
-        cs_option(handle, CS_OPT_MODE, CS_MODE_ARM);
-    }
-
-#elif defined(TARGET_PPC)
-    csh handle = cs_handle_32;
-#endif
-
-    cs_insn *insn;
-    cs_insn *end;
-    size_t count = cs_disasm(handle, buf, size, pc, 0, &insn);
-    if (count <= 0) goto done2;
-
-    for (end = insn + count - 1; end >= insn; end--) {
-        if (!cs_insn_group(handle, end, CS_GRP_INVALID)) {
-            break;
-        }
-    }
-    if (end < insn) goto done;
-
-    if (cs_insn_group(handle, end, CS_GRP_CALL)) {
-        res = INSTR_CALL;
-    } else if (cs_insn_group(handle, end, CS_GRP_RET)) {
-        res = INSTR_RET;
-    } else {
-        res = INSTR_UNKNOWN;
+// What the TB's last insn is, from PANDA's insn cache
+static instr_type block_type(TranslationBlock *tb) {
+    const panda_tb_insns *ti = panda_tb_insns_get(tb);
+    if (!ti) return INSTR_UNKNOWN;
+
+    switch (ti->insns[ti->num_insns - 1].kind) {
+    case PANDA_INSN_CALL:
+        return INSTR_CALL;
+    case PANDA_INSN_RET:
+        return INSTR_RET;
+    default:
+        return INSTR_UNKNOWN;
     }
-
-done:
-    cs_free(insn, count);
-done2:
-    free(buf);
-    return res;
-}
-
-int after_block_translate(CPUState *cpu, TranslationBlock *tb) {
-    CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    call_cache[tb->pc] = disas_block(env, tb->pc, tb->size);
-
-    return 1;
 }
 
 int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
@@ -253,7 +197,7 @@ int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
 
 int after_block_exec(CPUState* cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    instr_type tb_type = call_cache[tb->pc];
+    instr_type tb_type = block_type(tb);
 
     if (tb_type == INSTR_CALL) {
         stack_entry se = {tb->pc+tb->size,tb_type};
@@ -295,29 +239,22 @@ Panda__CallStack *pandalog_callstack_create() {
     assert (pandalog);
     CPUState *cpu = first_cpu;
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    uint32_t n = 0;
     std::vector<stack_entry> &v = callstacks[get_stackid(env)];
-    auto rit = v.rbegin();
-    for (/*no init*/; rit != v.rend() && n < CALLSTACK_MAX_SIZE; ++rit) {
-        n ++;
-    }
-    Panda__CallStack *cs = (Panda__CallStack *) malloc (sizeof(Panda__CallStack));
-    *cs = PANDA__CALL_STACK__INIT;
+    uint32_t n = std::min(v.size(), (size_t) CALLSTACK_MAX_SIZE);
+    Panda__CallStack *cs = pandalog_new(Panda__CallStack, PANDA__CALL_STACK__INIT);
     cs->n_addr = n;
-    cs->addr = (uint64_t *) malloc (sizeof(uint64_t) * n);
-    v = callstacks[get_stackid(env)];
-    rit = v.rbegin();
-    uint32_t i=0;
-    for (/*no init*/; rit != v.rend() && n < CALLSTACK_MAX_SIZE; ++rit, ++i) {
+    cs->addr = pandalog_new_array(uint64_t, n);
+    auto rit = v.rbegin();
+    for (uint32_t i = 0; i < n; ++rit, ++i) {
         cs->addr[i] = rit->pc;
     }
     return cs;
 }
 
 
+// The callstack comes from pandalog_alloc and goes away with the next
+// pandalog_write_entry.
 void pandalog_callstack_free(Panda__CallStack *cs) {
-    free(cs->addr);
-    free(cs);
 }
 
 
@@ -368,31 +305,13 @@ void get_prog_point(CPUState* cpu, prog_point *p) {
 
 
 bool init_plugin(void *self) {
-#if defined(TARGET_I386)
-    if (cs_open(CS_ARCH_X86, CS_MODE_32, &cs_handle_32) != CS_ERR_OK)
-#if defined(TARGET_X86_64)
-    if (cs_open(CS_ARCH_X86, CS_MODE_64, &cs_handle_64) != CS_ERR_OK)
-#endif
-#elif defined(TARGET_ARM)
-    if (cs_open(CS_ARCH_ARM, CS_MODE_ARM, &cs_handle_32) != CS_ERR_OK)
-#elif defined(TARGET_PPC)
-    if (cs_open(CS_ARCH_PPC, CS_MODE_32, &cs_handle_32) != CS_ERR_OK)
-#endif
-        return false;
-
-    // Need details in capstone to have instruction groupings
-    cs_option(cs_handle_32, CS_OPT_DETAIL, CS_OPT_ON);
-#if defined(TARGET_X86_64)
-    cs_option(cs_handle_64, CS_OPT_DETAIL, CS_OPT_ON);
-#endif
+    panda_enable_insn_cache();
 
     panda_cb pcb;
 
     panda_enable_memcb();
     panda_enable_precise_pc();
 
-    pcb.after_block_translate = after_block_translate;
-    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
     pcb.after_block_exec = after_block_exec;
     panda_register_callback(self, PANDA_CB_AFTER_BLOCK_EXEC, pcb);
     pcb.before_block_exec = before_block_exec;
@@ -0,0 +1,400 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "panda/plugin.h"
+#include "panda/common.h"
+
+extern "C" {
+#include "osi/osi_types.h"
+#include "osi/osi_ext.h"
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+}
+
+// Output file: a header, then one record per process name.  All integers
+// little endian.
+//   char magic[4] = "PCOV"; uint32 version; uint32 bits; uint32 num_records
+//   record: uint32 name_len; char name[name_len];
+//           uint8 blocks[1 << bits]; uint8 edges[1 << bits]
+#define COV_MAGIC "PCOV"
+#define COV_VERSION 1
+
+// hit counters for one process, and its last block for the edge hash
+struct CovMaps {
+    std::vector<uint8_t> blocks;
+    std::vector<uint8_t> edges;
+    uint32_t prev;
+};
+
+struct Module {
+    target_ulong base;
+    target_ulong size;
+    uint32_t hash;
+};
+
+// what OSI told us about an ASID.  ASIDs are reused once a process exits,
+// so this is checked again (verified) each time the ASID comes back.
+struct AsidInfo {
+    std::string name;
+    target_ulong pid;
+    bool verified;
+    CovMaps *maps;          // NULL if not in scope
+    std::vector<Module> libs;
+    std::set<target_ulong> missed;  // pages not in any lib we know of
+};
+
+static const char *proc_name;   // NULL: every process
+static void *plugin_self;
+static const char *out_file;
+static uint32_t map_bits;
+static bool user_only;
+
+static std::map<std::string, CovMaps> maps_by_name;
+static std::map<target_ulong, AsidInfo> asids;
+static std::vector<Module> kernel_mods;
+static std::set<target_ulong> kernel_missed;
+// ASIDs with user code translated before OSI could tell whose it was
+static std::set<target_ulong> unprobed;
+// counts from code running outside the scope go here
+static CovMaps discard;
+
+// what the probes read: the current process's maps
+static panda_probe_cov_map cov;
+static CovMaps *cur_maps = &discard;
+static target_ulong cur_asid;
+static AsidInfo *cur_info;
+// bit 0: check which process we're in at the top of the next block.  Only
+// i386 has an asid_changed callback to set it; elsewhere it stays set.
+static uint32_t resolve_word = 1;
+
+static target_ulong block_pc = (target_ulong) -1;
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; s && *s; s++) {
+        h = (h ^ (uint8_t) *s) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static void set_maps(CovMaps *m) {
+    cur_maps->prev = cov.prev;
+    cur_maps = m;
+    cov.blocks = m->blocks.data();
+    cov.edges = m->edges.data();
+    cov.prev = m->prev;
+}
+
+static CovMaps *maps_for(const std::string &name) {
+    CovMaps &m = maps_by_name[name];
+    if (m.blocks.empty()) {
+        m.blocks.assign(cov.mask + 1, 0);
+        m.edges.assign(cov.mask + 1, 0);
+        m.prev = 0;
+    }
+    return &m;
+}
+
+static void load_mods(std::vector<Module> &v, OsiModules *ms) {
+    v.clear();
+    if (!ms) return;
+    for (uint32_t i = 0; i < ms->num; i++) {
+        OsiModule *m = &ms->module[i];
+        v.push_back({m->base, m->size, hash_name(m->name)});
+    }
+    free_osimodules(ms);
+}
+
+// Look the current ASID up with OSI.  Only trusted in user mode: right
+// after an ASID change the kernel may still be running on the old task.
+// In the kernel an entry is returned even if it isn't verified yet.
+static AsidInfo *lookup_asid(CPUState *cpu, target_ulong asid) {
+    auto it = asids.find(asid);
+    AsidInfo *ai = it != asids.end() ? &it->second : NULL;
+    if (panda_in_kernel(cpu) || (ai && ai->verified)) return ai;
+
+    OsiProc *p = get_current_process(cpu);
+    if (!p) return ai;
+    std::string name = p->name ? p->name : "";
+    if (ai && ai->name == name && ai->pid == p->pid) {
+        ai->verified = true;
+        free_osiproc(p);
+        return ai;
+    }
+
+    bool was_in_scope = ai && ai->maps;
+    bool had_unprobed = unprobed.erase(asid) > 0;
+    if (ai || had_unprobed) {
+        // TBs of this ASID were translated for another process, or before
+        // we knew whose it was
+        panda_do_flush_tb();
+    }
+    ai = &asids[asid];
+    ai->name = name;
+    ai->pid = p->pid;
+    ai->verified = true;
+    ai->maps = NULL;
+    ai->libs.clear();
+    ai->missed.clear();
+    if (!proc_name || ai->name == proc_name) {
+        ai->maps = maps_for(ai->name);
+        load_mods(ai->libs, get_libraries(cpu, p));
+    }
+    if (proc_name && ai->maps && !was_in_scope) {
+        // nothing else needs instrumenting
+        panda_gate_add_asid(plugin_self, asid);
+    } else if (proc_name && !ai->maps && was_in_scope) {
+        panda_gate_remove_asid(plugin_self, asid);
+    }
+    free_osiproc(p);
+    return ai;
+}
+
+// Called from the top of each covered block while resolve_word is set
+static void resolve(CPUState *cpu, target_ulong pc, void *opaque) {
+    target_ulong asid = panda_current_asid(cpu);
+    if (asid != cur_asid) {
+        cur_asid = asid;
+        cur_info = NULL;
+        auto it = asids.find(asid);
+        if (it != asids.end()) it->second.verified = false;
+    }
+    if (cur_info && cur_info->verified) return;
+    cur_info = lookup_asid(cpu, asid);
+    set_maps(cur_info && cur_info->maps ? cur_info->maps : &discard);
+#if defined(TARGET_I386)
+    if (cur_info && cur_info->verified) resolve_word = 0;
+#endif
+}
+
+static int cov_asid_changed(CPUState *cpu, target_ulong old_asid, target_ulong new_asid) {
+    auto it = asids.find(new_asid);
+    if (it != asids.end()) it->second.verified = false;
+    cur_info = NULL;
+    resolve_word = 1;
+    return 0;
+}
+
+// User code of an ASID OSI couldn't place when it was translated: keep
+// asking, and retranslate with probes once it can.
+static void retry_lookup(CPUState *cpu, target_ulong pc, void *opaque) {
+    if (panda_in_kernel(cpu)) return;
+    lookup_asid(cpu, panda_current_asid(cpu));
+}
+
+static const Module *find_mod(const std::vector<Module> &v, target_ulong pc) {
+    for (const Module &m : v) {
+        if (m.base <= pc && pc - m.base < m.size) return &m;
+    }
+    return NULL;
+}
+
+// The block's id: a hash of its module and offset, so it doesn't move
+// with ASLR.  Code outside any module is hashed by its address.  ai is
+// only used for user code.
+static uint32_t block_id(CPUState *cpu, AsidInfo *ai, target_ulong pc) {
+    std::vector<Module> *mods = &kernel_mods;
+    std::set<target_ulong> *missed = &kernel_missed;
+    if (!panda_in_kernel(cpu)) {
+        mods = &ai->libs;
+        missed = &ai->missed;
+    }
+    const Module *m = find_mod(*mods, pc);
+    if (!m && missed->insert(pc & TARGET_PAGE_MASK).second) {
+        // maybe it was loaded since we last asked
+        if (mods == &kernel_mods) {
+            load_mods(kernel_mods, get_modules(cpu));
+        } else {
+            OsiProc *p = get_current_process(cpu);
+            if (p) load_mods(ai->libs, get_libraries(cpu, p));
+            free_osiproc(p);
+        }
+        m = find_mod(*mods, pc);
+    }
+    if (!m) return mix32((uint32_t) pc ^ (uint32_t) ((uint64_t) pc >> 32));
+    return mix32(m->hash ^ (uint32_t) (pc - m->base));
+}
+
+static int cov_before_block_translate(CPUState *cpu, target_ulong pc) {
+    block_pc = pc;
+    return 0;
+}
+
+static bool cov_insn_translate(CPUState *cpu, target_ulong pc) {
+    if (pc != block_pc) return false;
+    block_pc = (target_ulong) -1;
+    // our gate only speeds this up: another plugin's gate, or one without
+    // any, can still have this code translated with callbacks
+    if (user_only && panda_in_kernel(cpu)) return false;
+
+    target_ulong asid = panda_current_asid(cpu);
+    AsidInfo *ai = lookup_asid(cpu, asid);
+    // kernel code is shared by every process, and counted against the
+    // current one; user code of a process out of scope isn't counted
+    if (!panda_in_kernel(cpu)) {
+        if (!ai) {
+            unprobed.insert(asid);
+            panda_probe_call(retry_lookup, NULL);
+            return false;
+        }
+        if (!ai->maps) return false;
+    }
+    panda_probe_call_if(&resolve_word, 1, resolve, NULL);
+    panda_probe_cov(&cov, block_id(cpu, ai, pc));
+    return false;
+}
+
+static void put32(FILE *f, uint32_t v) {
+    uint8_t b[4] = { (uint8_t) v, (uint8_t) (v >> 8), (uint8_t) (v >> 16),
+                     (uint8_t) (v >> 24) };
+    fwrite(b, 1, 4, f);
+}
+
+static bool get32(FILE *f, uint32_t *v) {
+    uint8_t b[4];
+    if (fread(b, 1, 4, f) != 4) return false;
+    *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+    return true;
+}
+
+static void add_sat(std::vector<uint8_t> &to, const std::vector<uint8_t> &from) {
+    for (size_t i = 0; i < to.size(); i++) {
+        unsigned v = to[i] + from[i];
+        to[i] = v > 0xff ? 0xff : v;
+    }
+}
+
+// Add the counts already in out_file, if it has maps of the same size, so
+// one file can collect coverage across many replays
+static void merge_old(void) {
+    FILE *f = fopen(out_file, "rb");
+    if (!f) return;
+    char magic[4];
+    uint32_t version, bits, n, len;
+    size_t size = (size_t) cov.mask + 1;
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, COV_MAGIC, 4)
+            || !get32(f, &version) || version != COV_VERSION
+            || !get32(f, &bits) || !get32(f, &n)) {
+        printf("coverage: %s isn't a coverage file, overwriting it\n", out_file);
+        fclose(f);
+        return;
+    }
+    if (bits != map_bits) {
+        printf("coverage: %s has %u bit maps, not %u; overwriting it\n",
+               out_file, bits, map_bits);
+        fclose(f);
+        return;
+    }
+    std::vector<uint8_t> blocks(size), edges(size);
+    for (uint32_t i = 0; i < n; i++) {
+        if (!get32(f, &len)) break;
+        std::string name(len, '\0');
+        if (fread(&name[0], 1, len, f) != len
+                || fread(blocks.data(), 1, size, f) != size
+                || fread(edges.data(), 1, size, f) != size) {
+            break;
+        }
+        CovMaps *m = maps_for(name);
+        add_sat(m->blocks, blocks);
+        add_sat(m->edges, edges);
+    }
+    fclose(f);
+}
+
+static void write_maps(void) {
+    FILE *f = fopen(out_file, "wb");
+    if (!f) {
+        perror("coverage: can't write output");
+        return;
+    }
+    size_t size = (size_t) cov.mask + 1;
+    fwrite(COV_MAGIC, 1, 4, f);
+    put32(f, COV_VERSION);
+    put32(f, map_bits);
+    put32(f, maps_by_name.size());
+    for (auto &kv : maps_by_name) {
+        put32(f, kv.first.size());
+        fwrite(kv.first.data(), 1, kv.first.size(), f);
+        fwrite(kv.second.blocks.data(), 1, size, f);
+        fwrite(kv.second.edges.data(), 1, size, f);
+    }
+    fclose(f);
+}
+
+bool init_plugin(void *self) {
+    plugin_self = self;
+    panda_arg_list *args = panda_get_args("coverage");
+    proc_name = panda_parse_string_opt(args, "process", NULL,
+        "only cover processes with this name (default: all)");
+    out_file = panda_parse_string_opt(args, "file", "coverage.cov",
+        "output file; counts already in it are added to");
+    map_bits = panda_parse_uint32_opt(args, "bits", 16,
+        "log2 of the number of entries in each map");
+    user_only = panda_parse_bool_opt(args, "user_only",
+        "leave kernel code out");
+    if (map_bits < 8 || map_bits > 28) {
+        printf("coverage: bits must be between 8 and 28\n");
+        return false;
+    }
+
+    panda_require("osi");
+    assert(init_osi_api());
+
+    cov.mask = (1u << map_bits) - 1;
+    discard.blocks.assign(cov.mask + 1, 0);
+    discard.edges.assign(cov.mask + 1, 0);
+    discard.prev = 0;
+    set_maps(&discard);
+
+    if (user_only) {
+        panda_gate_set_modes(self, false, true);
+    }
+
+    panda_cb pcb;
+    pcb.before_block_translate = cov_before_block_translate;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_TRANSLATE, pcb);
+    pcb.insn_translate = cov_insn_translate;
+    panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
+    pcb.asid_changed = cov_asid_changed;
+    panda_register_callback(self, PANDA_CB_ASID_CHANGED, pcb);
+
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    cur_maps->prev = cov.prev;
+    merge_old();
+    write_maps();
+    uint64_t blocks = 0, edges = 0;
+    for (auto &kv : maps_by_name) {
+        for (uint8_t c : kv.second.blocks) blocks += c != 0;
+        for (uint8_t c : kv.second.edges) edges += c != 0;
+    }
+    printf("coverage: %zu processes, %" PRIu64 " block and %" PRIu64
+           " edge slots hit, written to %s\n",
+           maps_by_name.size(), blocks, edges, out_file);
+}
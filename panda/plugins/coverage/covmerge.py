@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+#
+# Merge coverage files written by the coverage plugin and report how much
+# of each map was hit.  The format is described in coverage.cpp.
+#
+# Usage: covmerge.py [-o out.cov] file.cov [file.cov ...]
+#
+# Counts for the same process name are added (saturating at 255), so the
+# merged file is what one replay covering everything would have written.
+# Files must have been written with the same bits.
+
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct("<4sIII")
+U32 = struct.Struct("<I")
+
+def read_cov(fn):
+    maps = {}
+    with open(fn, "rb") as f:
+        magic, version, bits, num = HEADER.unpack(f.read(HEADER.size))
+        if magic != b"PCOV" or version != 1:
+            sys.exit("%s is not a coverage file" % fn)
+        size = 1 << bits
+        for _ in range(num):
+            name_len, = U32.unpack(f.read(U32.size))
+            name = f.read(name_len).decode(errors="replace")
+            blocks = f.read(size)
+            edges = f.read(size)
+            maps[name] = (blocks, edges)
+    return bits, maps
+
+def add(a, b):
+    return bytes(min(x + y, 255) for x, y in zip(a, b))
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-o", dest="out")
+    parser.add_argument("files", nargs="+")
+    args = parser.parse_args()
+
+    bits, merged = None, {}
+    for fn in args.files:
+        b, maps = read_cov(fn)
+        if bits is None:
+            bits = b
+        elif b != bits:
+            sys.exit("%s has %d bit maps, not %d" % (fn, b, bits))
+        for name, (blocks, edges) in maps.items():
+            if name in merged:
+                blocks = add(merged[name][0], blocks)
+                edges = add(merged[name][1], edges)
+            merged[name] = (blocks, edges)
+
+    print("%-24s %10s %10s" % ("process", "blocks", "edges"))
+    for name in sorted(merged):
+        blocks, edges = merged[name]
+        print("%-24s %10d %10d" % (name, sum(1 for c in blocks if c),
+                                   sum(1 for c in edges if c)))
+
+    if args.out:
+        with open(args.out, "wb") as f:
+            f.write(HEADER.pack(b"PCOV", 1, bits, len(merged)))
+            for name in sorted(merged):
+                enc = name.encode()
+                f.write(U32.pack(len(enc)))
+                f.write(enc)
+                f.write(merged[name][0])
+                f.write(merged[name][1])
+
+if __name__ == "__main__":
+    main()
@@ -69,44 +69,6 @@ void file_taint_enable_read_callback(void) {
     read_callback = true;
 }
 
-// label this virtual address.  might fail, so
-// returns true iff byte was labeled
-bool label_byte(CPUState *cpu, target_ulong virt_addr, uint32_t label_num) {
-    hwaddr pa = panda_virt_to_phys(cpu, virt_addr);
-    if (pa == (hwaddr) -1) {
-        printf ("label_byte: virtual addr " TARGET_FMT_lx " not available\n", virt_addr);
-        return false;
-    }
-    if (no_taint) {
-        // don't print a message -- you'd have too many in this case
-        return false;
-    }
-    if (positional_labels) {
-        taint2_label_ram(pa, label_num);
-    }
-    else {
-        taint2_label_ram(pa, 1);
-    }
-    if (pandalog) {
-        Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-        ple.has_taint_label_virtual_addr = 1;
-        ple.has_taint_label_physical_addr = 1;
-        ple.has_taint_label_number = 1;
-        ple.taint_label_virtual_addr = virt_addr;
-        ple.taint_label_physical_addr = pa;
-        if (positional_labels) {
-            ple.taint_label_number = label_num;
-        }
-        else {
-            ple.taint_label_number = 1;
-        }
-        pandalog_write_entry(&ple);
-    }
-    return true;
-}
-
-
-
 char *last_open_filename;
 uint32_t last_open_asid;
 
@@ -290,21 +252,22 @@ void read_return(CPUState *cpu, target_ulong pc, uint32_t buf, uint32_t actual_c
             printf("*** applying %s taint labels %u..%u to buffer @ %lu\n",
                     positional_labels ? "positional" : "uniform",
                     range_start, range_end - 1, rr_get_guest_instr_count());
+            // where file offset range_start landed in the buffer
+            target_ulong range_buf = read_info.buf + (range_start - read_start);
             uint32_t num_labeled = 0;
-            uint32_t i = 0;
-            for (uint32_t l = range_start; l < range_end; l++) {
+            if (read_callback) {
                 // pass address and byte number to a callback instead of
                 // tainting
-                if (read_callback) {
-                    PPP_RUN_CB(on_file_byte_read, cpu, read_info.buf + i, l)
-                } else {
-                    if (label_byte(cpu, read_info.buf + i,
-                                positional_labels ? l : 1))
-                        num_labeled++;
+                for (uint32_t l = range_start; l < range_end; l++) {
+                    PPP_RUN_CB(on_file_byte_read, cpu, range_buf + (l - range_start), l)
                 }
-                i++;
+                num_labeled = range_end - range_start;
+            } else if (!no_taint) {
+                num_labeled = taint2_label_ram_range(cpu, range_buf,
+                        range_end - range_start,
+                        positional_labels ? range_start : 1, positional_labels);
             }
-            printf("%u bytes labeled for this read\n", range_end - range_start);
+            printf("%u bytes labeled for this read\n", num_labeled);
         }
         last_pos += actual_count;
         seen_reads.erase(it);
@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+#
+# Rebuild raw memory images from a memsavep delta chain. The base image is
+# copied to out, and each delta is then applied to it in order; see
+# memsavep.h for the format.
+#
+# Usage: applydelta.py base.raw out.raw delta1.delta [delta2.delta ...]
+
+import shutil
+import struct
+import sys
+
+HEADER = struct.Struct("=8sIIQQQ")
+
+def apply(out, delta):
+    with open(delta, "rb") as f:
+        magic, version, page_size, instr_count, ram_size, num_pages = \
+            HEADER.unpack(f.read(HEADER.size))
+        if magic != b"PANDAMSD" or version != 1:
+            sys.exit("%s is not a memsavep delta" % delta)
+        addrs = struct.unpack("=%dQ" % num_pages, f.read(8 * num_pages))
+        for addr in addrs:
+            out.seek(addr)
+            out.write(f.read(page_size))
+    print("%s: %d pages, instruction count %d" % (delta, num_pages, instr_count))
+
+def main():
+    if len(sys.argv) < 4:
+        sys.exit("usage: applydelta.py base.raw out.raw delta...")
+    shutil.copyfile(sys.argv[1], sys.argv[2])
+    with open(sys.argv[2], "r+b") as out:
+        for delta in sys.argv[3:]:
+            apply(out, delta)
+
+if __name__ == "__main__":
+    main()
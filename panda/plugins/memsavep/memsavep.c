@@ -1,15 +1,15 @@
 /* PANDABEGINCOMMENT
- * 
+ *
  * Authors:
  *  Tim Leek               tleek@ll.mit.edu
  *  Ryan Whelan            rwhelan@ll.mit.edu
  *  Joshua Hodosh          josh.hodosh@ll.mit.edu
  *  Michael Zhivich        mzhivich@ll.mit.edu
  *  Brendan Dolan-Gavitt   brendandg@gatech.edu
- * 
- * This work is licensed under the terms of the GNU GPL, version 2. 
- * See the COPYING file in the top-level directory. 
- * 
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
 PANDAENDCOMMENT */
 // This needs to be defined before anything is included in order to get
 // the PRIx64 macro
@@ -18,61 +18,372 @@ PANDAENDCOMMENT */
 #include "panda/plugin.h"
 #include "panda/rr/rr_log.h"
 
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "sysemu/sysemu.h"
+
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "memsavep.h"
 
 bool dump_done = false;
 
 static bool should_close_after_dump = true;
-static double percent = -1;
-static uint64_t instr_count = 0;
 static const char *filename = NULL;
+static const char *prefix = NULL;
+
+// Dump points as instruction counts, sorted; percentages are converted
+// once the replay is open.
+static GArray *points;
+static GArray *percents;
+static guint next_point;
+
+// Write dumps from a forked child, so the replay only waits for the fork.
+static bool background = true;
+static uint32_t max_jobs;
+static uint32_t num_jobs;
+
+// Store only the pages written since the previous dump.
+static bool delta = false;
+static bool have_base = false;
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int before_block_exec(CPUState *env, TranslationBlock *tb);
 void dump_memory(void);
 
-void dump_memory(void){
-    FILE* out = fopen(filename, "wb");
-    panda_memsavep(out);
-    fclose(out);
-    dump_done = true;
+static void *plugin_self;
+
+// A stretch of guest physical memory below ram_size. host is NULL for
+// anything that isn't RAM, which reads back as zeroes.
+typedef struct {
+    hwaddr addr;
+    hwaddr len;
+    uint8_t *host;
+    ram_addr_t ram_addr;
+} mem_range_t;
+
+static GArray *collect_ranges(void) {
+    GArray *ranges = g_array_new(false, false, sizeof(mem_range_t));
+    hwaddr addr = 0;
+
+    rcu_read_lock();
+    while (addr < ram_size) {
+        hwaddr xlat, len = ram_size - addr;
+        MemoryRegion *mr = address_space_translate(&address_space_memory,
+                                                   addr, &xlat, &len, false);
+        mem_range_t r = { .addr = addr, .len = MAX(len, 1) };
+        if (memory_region_is_ram(mr)) {
+            r.host = qemu_map_ram_ptr(mr->ram_block, xlat);
+            r.ram_addr = memory_region_get_ram_addr(mr) + xlat;
+        }
+        g_array_append_val(ranges, r);
+        addr += r.len;
+    }
+    rcu_read_unlock();
+    return ranges;
+}
+
+// Pick out the pages written since the last call, and mark them clean.
+static GArray *collect_dirty_pages(GArray *ranges) {
+    GArray *pages = g_array_new(false, false, sizeof(uint64_t));
+    const hwaddr chunk_len = 64 * TARGET_PAGE_SIZE;
+
+    for (guint i = 0; i < ranges->len; i++) {
+        mem_range_t *r = &g_array_index(ranges, mem_range_t, i);
+        if (!r->host) continue;
+        for (hwaddr chunk = 0; chunk < r->len; chunk += chunk_len) {
+            hwaddr chunk_end = MIN(chunk + chunk_len, r->len);
+            if (!cpu_physical_memory_get_dirty(r->ram_addr + chunk,
+                        chunk_end - chunk, DIRTY_MEMORY_MIGRATION)) {
+                continue;
+            }
+            for (hwaddr page = chunk; page < chunk_end;
+                    page += TARGET_PAGE_SIZE) {
+                if (cpu_physical_memory_test_and_clear_dirty(
+                            r->ram_addr + page, TARGET_PAGE_SIZE,
+                            DIRTY_MEMORY_MIGRATION)) {
+                    uint64_t addr = r->addr + page;
+                    g_array_append_val(pages, addr);
+                }
+            }
+        }
+    }
+    return pages;
+}
+
+static void clear_dirty_pages(GArray *ranges) {
+    for (guint i = 0; i < ranges->len; i++) {
+        mem_range_t *r = &g_array_index(ranges, mem_range_t, i);
+        if (!r->host) continue;
+        cpu_physical_memory_test_and_clear_dirty(r->ram_addr, r->len,
+                                                 DIRTY_MEMORY_MIGRATION);
+    }
+}
 
-    if(should_close_after_dump)
-        rr_end_replay_requested = 1;
+// Only async-signal-safe calls from here down to run_job: these run in a
+// child forked from a multithreaded process.
+static bool write_full(int fd, const void *buf, size_t len, off_t *pos) {
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = pos ? pwrite(fd, p, len, *pos) : write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        if (pos) *pos += n;
+    }
+    return true;
 }
 
-int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    if (dump_done) return 0;
+// Raw image of the first ram_size bytes of guest physical memory. Anything
+// that isn't RAM is left as a hole in the file, which reads as zeroes.
+static bool write_raw(int fd, GArray *ranges) {
+    if (ftruncate(fd, ram_size) != 0) return false;
+    for (guint i = 0; i < ranges->len; i++) {
+        mem_range_t *r = &g_array_index(ranges, mem_range_t, i);
+        off_t pos = r->addr;
+        if (r->host && !write_full(fd, r->host, MIN(r->len, ram_size - r->addr), &pos)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (instr_count && rr_get_guest_instr_count() > instr_count) {
-        printf("memsavep: Instruction count reached, saving memory to %s.\n", filename);
-        dump_memory();
-    } else if (rr_get_percentage() > percent) {
-        printf("memsavep: Replay percentage reached, saving memory to %s.\n", filename);
-        dump_memory();
+static uint8_t *page_host(GArray *ranges, uint64_t addr) {
+    for (guint i = 0; i < ranges->len; i++) {
+        mem_range_t *r = &g_array_index(ranges, mem_range_t, i);
+        if (addr >= r->addr && addr - r->addr < r->len) {
+            return r->host + (addr - r->addr);
+        }
+    }
+    return NULL;
+}
+
+static bool write_delta(int fd, GArray *ranges, GArray *pages,
+                        uint64_t instr_count) {
+    memsavep_delta_header_t hdr = {
+        .magic = MEMSAVEP_DELTA_MAGIC,
+        .version = MEMSAVEP_DELTA_VERSION,
+        .page_size = TARGET_PAGE_SIZE,
+        .instr_count = instr_count,
+        .ram_size = ram_size,
+        .num_pages = pages->len,
+    };
+    if (!write_full(fd, &hdr, sizeof(hdr), NULL)
+            || !write_full(fd, pages->data, pages->len * sizeof(uint64_t), NULL)) {
+        return false;
     }
+    for (guint i = 0; i < pages->len; i++) {
+        uint8_t *host = page_host(ranges, g_array_index(pages, uint64_t, i));
+        if (!write_full(fd, host, TARGET_PAGE_SIZE, NULL)) return false;
+    }
+    return true;
+}
+
+static bool run_job(int fd, GArray *ranges, GArray *pages, uint64_t instr_count) {
+    bool ok = pages ? write_delta(fd, ranges, pages, instr_count)
+                    : write_raw(fd, ranges);
+    return close(fd) == 0 && ok;
+}
 
+// The guest RAM mappings are kept out of forked children (for KVM's sake).
+// Let the next fork see them.
+static int set_ram_fork(const char *block_name, void *host_addr,
+                        ram_addr_t offset, ram_addr_t length, void *opaque) {
+#if defined(MADV_DOFORK) && defined(MADV_DONTFORK)
+    madvise(host_addr, length, *(bool *)opaque ? MADV_DOFORK : MADV_DONTFORK);
+#endif
     return 0;
 }
 
+static void reap_jobs(bool block) {
+    int status;
+    pid_t pid;
+    while (num_jobs && (pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+        num_jobs--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("memsavep: dump process %d failed.\n", pid);
+        }
+        block = false;
+    }
+}
+
+static void dump_to(const char *fname, uint64_t instr_count) {
+    int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("memsavep: can't open %s: %s\n", fname, strerror(errno));
+        return;
+    }
+
+    GArray *ranges = collect_ranges();
+    GArray *pages = NULL;
+    if (delta) {
+        if (!have_base) {
+            // Everything is new in the first dump. Track writes from here.
+            memory_global_dirty_log_start();
+            clear_dirty_pages(ranges);
+            have_base = true;
+        } else {
+            pages = collect_dirty_pages(ranges);
+            printf("memsavep: %u pages changed.\n", pages->len);
+        }
+    }
+
+    pid_t pid = -1;
+    if (background) {
+        while (num_jobs >= max_jobs) reap_jobs(true);
+        bool dofork = true;
+        qemu_ram_foreach_block(set_ram_fork, &dofork);
+        pid = fork();
+        dofork = false;
+        qemu_ram_foreach_block(set_ram_fork, &dofork);
+        if (pid == 0) {
+            _exit(run_job(fd, ranges, pages, instr_count) ? 0 : 1);
+        }
+        if (pid < 0) {
+            printf("memsavep: fork failed, dumping in the foreground.\n");
+        }
+    }
+    if (pid > 0) {
+        // The child has its own copy-on-write view of RAM as of now.
+        num_jobs++;
+        close(fd);
+    } else if (!run_job(fd, ranges, pages, instr_count)) {
+        printf("memsavep: writing %s failed.\n", fname);
+    }
+
+    g_array_free(ranges, true);
+    if (pages) g_array_free(pages, true);
+}
+
+void dump_memory(void){
+    uint64_t instr_count = rr_get_guest_instr_count();
+    if (prefix) {
+        char *fname = g_strdup_printf("%s-%" PRIu64 ".%s", prefix, instr_count,
+                                      delta && have_base ? "delta" : "raw");
+        printf("memsavep: saving memory to %s.\n", fname);
+        dump_to(fname, instr_count);
+        g_free(fname);
+    } else {
+        dump_to(filename, instr_count);
+    }
+    reap_jobs(false);
+
+    if (next_point == points->len) {
+        dump_done = true;
+        if(should_close_after_dump)
+            rr_end_replay_requested = 1;
+    }
+}
+
+static gint compare_points(gconstpointer a, gconstpointer b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The replay isn't open when the plugin loads, so percentages are turned
+// into instruction counts at the first deadline, at 0.
+static void resolve_points(void) {
+    uint64_t total = replay_get_total_num_instructions();
+    for (guint i = 0; i < percents->len; i++) {
+        uint64_t count = g_array_index(percents, double, i) / 100.0 * total;
+        g_array_append_val(points, count);
+    }
+    g_array_sort(points, compare_points);
+    g_array_free(percents, true);
+    percents = NULL;
+}
+
+static void dump_deadline(CPUState *env, uint64_t count, void *opaque);
+
+// A point is reached once the insn at it has run.
+static void add_next_deadline(void) {
+    if (next_point < points->len) {
+        uint64_t point = g_array_index(points, uint64_t, next_point);
+        panda_deadline_add(plugin_self, point + 1, dump_deadline, NULL);
+    }
+}
+
+static void dump_deadline(CPUState *env, uint64_t count, void *opaque) {
+    if (unlikely(percents != NULL)) {
+        resolve_points();
+        add_next_deadline();
+        return;
+    }
+
+    // Several points may be equal, or passed already; one dump covers them.
+    while (next_point < points->len &&
+           count > g_array_index(points, uint64_t, next_point)) {
+        next_point++;
+    }
+    printf("memsavep: Dump point reached at instruction count %" PRIu64 ".\n",
+           count);
+    dump_memory();
+    add_next_deadline();
+}
+
+// Parse a colon-separated list into an array of T.
+#define PARSE_LIST(arr, T, conv, spec) do {              \
+        gchar **items = g_strsplit(spec, ":", -1);       \
+        for (gchar **it = items; *it; it++) {            \
+            if (**it == '\0') continue;                  \
+            T val = conv(*it, NULL);                     \
+            g_array_append_val(arr, val);                \
+        }                                                \
+        g_strfreev(items);                               \
+    } while (0)
+
+static uint64_t parse_u64(const char *s, char **end) {
+    return strtoull(s, end, 0);
+}
+
 bool init_plugin(void *self) {
-    panda_cb pcb = { .before_block_exec = before_block_exec };
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    plugin_self = self;
 
     panda_arg_list *args = panda_get_args("memsavep");
-    percent = panda_parse_double_opt(args, "percent", 200, "dump memory after a given percentage of the replay is reached");
-    instr_count = panda_parse_uint64_opt(args, "instrcount", 0, "dump memory after a given instruction count is reached");
+    double percent = panda_parse_double_opt(args, "percent", 200, "dump memory after a given percentage of the replay is reached");
+    uint64_t instr_count = panda_parse_uint64_opt(args, "instrcount", 0, "dump memory after a given instruction count is reached");
     filename = panda_parse_string_opt(args, "file", "memsavep.raw", "filename of the memory dump to create");
+    const char *instrcounts = panda_parse_string_opt(args, "instrcounts", NULL, "colon-separated instruction counts to dump memory at");
+    const char *percent_list = panda_parse_string_opt(args, "percents", NULL, "colon-separated replay percentages to dump memory at");
+    prefix = panda_parse_string_opt(args, "prefix", "memsavep", "with instrcounts or percents, dumps go to <prefix>-<instr count>.raw");
+    delta = panda_parse_bool_opt(args, "delta", "after the first dump, only store the pages changed since the previous one");
+    background = !panda_parse_bool_opt(args, "foreground", "write dumps from the replay process instead of a forked child");
+    max_jobs = panda_parse_uint32_opt(args, "jobs", 4, "maximum number of dumps being written at once");
+    should_close_after_dump = !panda_parse_bool_opt(args, "continue", "keep replaying after the last dump");
 
-    if(!instr_count && percent > 100.0){
+    points = g_array_new(false, false, sizeof(uint64_t));
+    percents = g_array_new(false, false, sizeof(double));
+    if (instrcounts || percent_list) {
+        if (instrcounts) PARSE_LIST(points, uint64_t, parse_u64, instrcounts);
+        if (percent_list) PARSE_LIST(percents, double, strtod, percent_list);
+    } else {
+        // A single dump, written to file.
+        prefix = NULL;
+        delta = false;
+        if (instr_count) {
+            g_array_append_val(points, instr_count);
+        } else if (percent <= 100.0) {
+            g_array_append_val(percents, percent);
+        }
+    }
+
+    if(points->len == 0 && percents->len == 0){
         printf("memsavep: You should specify either one of percent or instrcount");
         return false;
     }
+    if (max_jobs == 0) max_jobs = 1;
+
+    panda_deadline_add(self, 0, dump_deadline, NULL);
 
     return true;
 }
 
 void uninit_plugin(void *self) {
-
-}
\ No newline at end of file
+    while (num_jobs) reap_jobs(true);
+    if (have_base) memory_global_dirty_log_stop();
+    g_array_free(points, true);
+    if (percents) g_array_free(percents, true);
+}
@@ -0,0 +1,26 @@
+#ifndef __MEMSAVEP_H_
+#define __MEMSAVEP_H_
+
+// A delta dump holds only the pages written since the previous dump:
+//
+//   memsavep_delta_header_t
+//   uint64_t addr[num_pages]    guest physical address of each page
+//   num_pages pages of page_size bytes, in the same order
+//
+// All fields are in host byte order. Applying the deltas in order on top
+// of the first (raw) dump gives the raw image at each dump point; see
+// applydelta.py.
+
+#define MEMSAVEP_DELTA_MAGIC "PANDAMSD"
+#define MEMSAVEP_DELTA_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t instr_count;
+    uint64_t ram_size;
+    uint64_t num_pages;
+} memsavep_delta_header_t;
+
+#endif
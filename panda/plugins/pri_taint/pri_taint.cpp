@@ -53,8 +53,7 @@ bool debug = false;
 #define dprintf(...) if (debug) { printf(__VA_ARGS__); fflush(stdout); }
 
 Panda__SrcInfoPri *pandalog_src_info_pri_create(const char *src_filename, uint64_t src_linenum, const char *src_ast_node_name, unsigned ast_loc_id) {
-    Panda__SrcInfoPri *si = (Panda__SrcInfoPri *) malloc(sizeof(Panda__SrcInfoPri));
-    *si = PANDA__SRC_INFO_PRI__INIT;
+    Panda__SrcInfoPri *si = pandalog_new(Panda__SrcInfoPri, PANDA__SRC_INFO_PRI__INIT);
 
     si->filename = (char *) src_filename;
     si->astnodename = (char *) src_ast_node_name;
@@ -206,10 +205,6 @@ void lava_taint_query(target_ulong buf, LocType loc_t, target_ulong buf_len, con
     Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
     ple.taint_query_pri = &tqh;
     pandalog_write_entry(&ple);
-
-    pandalog_callstack_free(tqh.call_stack);
-    free(tqh.src_info);
-    for (Panda__TaintQuery *ptq : tq) pandalog_taint_query_free(ptq);
 }
 #endif
 struct args {
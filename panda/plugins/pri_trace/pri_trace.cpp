@@ -58,6 +58,11 @@ bool init_plugin(void *self) {
     panda_arg_list *args = panda_get_args("general");
     const char *asid_s = panda_parse_string_req(args, "asid", "asid of the process to follow for pri_trace");
     asid_of_interest = strtoul(asid_s, NULL, 16);
+    bool gate = panda_parse_bool_opt(args, "gate",
+        "only ask for instrumentation of this asid");
+    if (gate) {
+        panda_gate_add_asid(self, asid_of_interest);
+    }
     panda_require("pri");
     //    assert(init_pri_api());
     PPP_REG_CB("pri", on_before_line_change, on_line_change);
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#
+# Decode a replaymovie capture (.pmv) into a YUV4MPEG2 stream, which ffmpeg,
+# avconv and most players read directly. See replaymovie.h for the format.
+#
+# Usage: movie.py [-f first] [-n count] replay_movie.pmv out.y4m
+#        (out.y4m can be - for stdout)
+
+import argparse
+import struct
+import sys
+import zlib
+
+HEADER = struct.Struct("=8sII")
+FRAME = struct.Struct("=QIIII")
+INDEX = struct.Struct("=QQII")
+TRAILER = struct.Struct("=QQ8s")
+
+KEY, DELTA, REPEAT = range(3)
+
+def read_index(f):
+    f.seek(0, 2)
+    end = f.tell()
+    if end >= HEADER.size + TRAILER.size:
+        f.seek(end - TRAILER.size)
+        index_offset, num_frames, magic = TRAILER.unpack(f.read(TRAILER.size))
+        if magic == b"PANDAIDX":
+            f.seek(index_offset)
+            return [INDEX.unpack(f.read(INDEX.size)) for _ in range(num_frames)]
+    # No index: the capture was cut short. Walk the frames instead.
+    print("no frame index, scanning", file=sys.stderr)
+    index = []
+    f.seek(HEADER.size)
+    while True:
+        offset = f.tell()
+        buf = f.read(FRAME.size)
+        if len(buf) < FRAME.size:
+            break
+        instr, width, height, ftype, size = FRAME.unpack(buf)
+        if len(f.read(size)) < size:
+            break
+        index.append((instr, offset, ftype, 0))
+    return index
+
+def read_size(f, entry):
+    f.seek(entry[1])
+    return FRAME.unpack(f.read(FRAME.size))[1:3]
+
+def read_frame(f, entry):
+    f.seek(entry[1])
+    instr, width, height, ftype, size = FRAME.unpack(f.read(FRAME.size))
+    data = zlib.decompress(f.read(size)) if size else None
+    return width, height, ftype, data
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument("-f", "--first", type=int, default=0,
+                    help="first frame to output")
+    ap.add_argument("-n", "--count", type=int, default=None,
+                    help="number of frames to output")
+    ap.add_argument("movie")
+    ap.add_argument("out")
+    args = ap.parse_args()
+
+    f = open(args.movie, "rb")
+    magic, version, fps = HEADER.unpack(f.read(HEADER.size))
+    if magic != b"PANDAMOV" or version != 1:
+        sys.exit("%s is not a replaymovie capture" % args.movie)
+
+    index = read_index(f)
+    last = len(index) if args.count is None else min(len(index), args.first + args.count)
+    if args.first >= last:
+        sys.exit("no frames to output")
+
+    # The output has one size throughout, so smaller frames get padded.
+    sizes = [read_size(f, e) for e in index if e[2] != REPEAT]
+    out_w = max(w for w, h in sizes) + 1 & ~1
+    out_h = max(h for w, h in sizes) + 1 & ~1
+    out = sys.stdout.buffer if args.out == "-" else open(args.out, "wb")
+    out.write(b"YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n" % (out_w, out_h, fps))
+
+    # Start decoding at the key frame before the first frame we want.
+    start = args.first
+    while start > 0 and index[start][2] != KEY:
+        start -= 1
+
+    picture = None
+    width = height = 0
+    for i in range(start, last):
+        w, h, ftype, data = read_frame(f, index[i])
+        if ftype == KEY:
+            picture, width, height = bytearray(data), w, h
+        elif ftype == DELTA:
+            picture = bytearray(a ^ b for a, b in zip(picture, data))
+        if i < args.first or picture is None:
+            continue
+        out.write(b"FRAME\n")
+        out.write(pad(picture, width, height, out_w, out_h))
+    out.close()
+
+def pad(picture, width, height, out_w, out_h):
+    cw, ch = (width + 1) // 2, (height + 1) // 2
+    planes = [(picture[:4 * cw * ch], 2 * cw, 2 * ch, 16, out_w, out_h),
+              (picture[4 * cw * ch:5 * cw * ch], cw, ch, 128, out_w // 2, out_h // 2),
+              (picture[5 * cw * ch:], cw, ch, 128, out_w // 2, out_h // 2)]
+    if 2 * cw == out_w and 2 * ch == out_h:
+        return bytes(picture)
+    res = bytearray()
+    for plane, pw, ph, fill, ow, oh in planes:
+        for y in range(oh):
+            row = plane[y * pw:(y + 1) * pw] if y < ph else b""
+            res += row + bytes([fill]) * (ow - len(row))
+    return bytes(res)
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,15 @@
 # NOTE: you may need to apt-get install the following:
 # ffmpeg
 #
+# Usage: movie.sh [replay_movie.pmv]
+# Without a capture file, stitches the replay_movie_NNN.ppm files that
+# replaymovie writes with ppm=true.
+
+if [ -n "$1" ]; then
+    "$(dirname "$0")/movie.py" "$1" - | \
+        ffmpeg -y -threads 0 -i - replay.mp4 -qscale 5 -b 9600
+    exit ${PIPESTATUS[1]}
+fi
 
 ffmpeg -y -threads 0 -r 20 -i replay_movie_%03d.ppm replay.mp4 -qscale 5 -b 9600 || \
 avconv -y -threads 0 -r 20 -i replay_movie_%03d.ppm replay.mp4 -qscale 5 -b 9600
@@ -1,58 +1,284 @@
 /* PANDABEGINCOMMENT
- * 
+ *
  * Authors:
  *  Tim Leek               tleek@ll.mit.edu
  *  Ryan Whelan            rwhelan@ll.mit.edu
  *  Joshua Hodosh          josh.hodosh@ll.mit.edu
  *  Michael Zhivich        mzhivich@ll.mit.edu
  *  Brendan Dolan-Gavitt   brendandg@gatech.edu
- * 
- * This work is licensed under the terms of the GNU GPL, version 2. 
- * See the COPYING file in the top-level directory. 
- * 
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
 PANDAENDCOMMENT */
 
+#include <zlib.h>
+
 #include "panda/plugin.h"
 #include "qmp-commands.h"
+#include "ui/console.h"
 
-int before_block_callback(CPUState *env, TranslationBlock *tb);
+#include "replaymovie.h"
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
 
-int num = 0;
+static void *plugin_self;
 
-int before_block_callback(CPUState *env, TranslationBlock *tb) {
-    assert(rr_in_replay());
+// Instruction count at which the next frame is due, and the spacing.
+static uint64_t next_frame;
+static uint64_t interval;
+static uint32_t frames;
+
+// Legacy mode: one PPM file per frame.
+static bool ppm;
+static int num = 0;
+
+static FILE *movie;
+static const char *movie_name;
+static uint32_t keyint;
+static uint32_t since_key;
+static GArray *frame_index;
+
+// The framebuffer as last captured, to spot frames that didn't change.
+static uint8_t *prev_fb;
+static size_t prev_fb_size;
+static int prev_width, prev_height, prev_stride;
+static pixman_format_code_t prev_format;
+
+// YUV 4:2:0 planes of the last frame written, and scratch space.
+static uint8_t *prev_yuv, *yuv, *zbuf;
+static size_t yuv_size;
+static uLongf zbuf_size;
+static pixman_image_t *linebuf;
+static int linebuf_width;
+
+static inline uint8_t clamp8(int v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 RGB -> I420, with odd sizes padded out by repeating the last
+// row/column.
+static void convert_frame(DisplaySurface *ds, int width, int height) {
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    uint8_t *Y = yuv, *U = yuv + 2 * cw * 2 * ch, *V = U + cw * ch;
+    int ystride = 2 * cw;
+
+    for (int y = 0; y < 2 * ch; y++) {
+        qemu_pixman_linebuf_fill(linebuf, ds->image, width, 0,
+                                 MIN(y, height - 1));
+        uint32_t *px = (uint32_t *) pixman_image_get_data(linebuf);
+        for (int x = 0; x < 2 * cw; x++) {
+            uint32_t p = px[MIN(x, width - 1)];
+            int r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+            Y[y * ystride + x] = clamp8(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            if ((x & 1) == 0 && (y & 1) == 0) {
+                U[(y / 2) * cw + x / 2] =
+                    clamp8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                V[(y / 2) * cw + x / 2] =
+                    clamp8(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+    }
+}
+
+static void write_record(uint64_t instr_count, uint32_t type,
+                         const uint8_t *data, uint32_t size) {
+    movie_frame_t rec = {
+        .instr_count = instr_count,
+        .width = prev_width,
+        .height = prev_height,
+        .type = type,
+        .size = size,
+    };
+    movie_index_t idx = {
+        .instr_count = instr_count,
+        .offset = ftell(movie),
+        .type = type,
+    };
+    g_array_append_val(frame_index, idx);
+    fwrite(&rec, sizeof(rec), 1, movie);
+    if (size) fwrite(data, 1, size, movie);
+}
+
+// Make sure the buffers fit a width x height frame.
+static void resize_buffers(int width, int height) {
+    size_t size = (size_t) 6 * ((width + 1) / 2) * ((height + 1) / 2);
+    if (size != yuv_size) {
+        yuv_size = size;
+        yuv = g_realloc(yuv, size);
+        prev_yuv = g_realloc(prev_yuv, size);
+        zbuf_size = compressBound(size);
+        zbuf = g_realloc(zbuf, zbuf_size);
+    }
+    if (width != linebuf_width) {
+        qemu_pixman_image_unref(linebuf);
+        linebuf = qemu_pixman_linebuf_create(PIXMAN_x8r8g8b8, width);
+        linebuf_width = width;
+    }
+}
+
+static void capture_frame(uint64_t instr_count) {
+    QemuConsole *con = qemu_console_lookup_by_index(0);
+    if (con == NULL) return;
+    graphic_hw_update(con);
+    DisplaySurface *ds = qemu_console_surface(con);
+    if (ds == NULL) return;
+
+    int width = surface_width(ds), height = surface_height(ds);
+    int stride = surface_stride(ds);
+    size_t fb_size = (size_t) stride * height;
+    bool same_mode = width == prev_width && height == prev_height
+        && stride == prev_stride && surface_format(ds) == prev_format;
+
+    // Unchanged framebuffer: just note that the last frame is shown again.
+    if (same_mode && fb_size == prev_fb_size
+            && memcmp(surface_data(ds), prev_fb, fb_size) == 0) {
+        write_record(instr_count, MOVIE_FRAME_REPEAT, NULL, 0);
+        return;
+    }
+    prev_fb = g_realloc(prev_fb, fb_size);
+    memcpy(prev_fb, surface_data(ds), fb_size);
+    prev_fb_size = fb_size;
+    prev_width = width;
+    prev_height = height;
+    prev_stride = stride;
+    prev_format = surface_format(ds);
+
+    resize_buffers(width, height);
+    convert_frame(ds, width, height);
+
+    // Changes between frames are mostly small, so the XOR against the
+    // previous frame is mostly zeroes and compresses very well.
+    uint32_t type = MOVIE_FRAME_KEY;
+    const uint8_t *src = yuv;
+    if (same_mode && since_key + 1 < keyint) {
+        for (size_t i = 0; i < yuv_size; i++) {
+            prev_yuv[i] ^= yuv[i];
+        }
+        type = MOVIE_FRAME_DELTA;
+        src = prev_yuv;
+        since_key++;
+    } else {
+        since_key = 0;
+    }
+
+    uLongf zlen = zbuf_size;
+    if (compress2(zbuf, &zlen, src, yuv_size, Z_BEST_SPEED) != Z_OK) {
+        fprintf(stderr, "replaymovie: compressing frame failed\n");
+        return;
+    }
+    write_record(instr_count, type, zbuf, zlen);
+
+    uint8_t *tmp = prev_yuv;
+    prev_yuv = yuv;
+    yuv = tmp;
+}
+
+static void save_ppm(int n) {
+    Error *errp = NULL;
     char fname[256] = {0};
-    static uint64_t total_insns = 0;
-    if (total_insns == 0) total_insns = replay_get_total_num_instructions();
-    if (rr_get_percentage() >= num) {
-        Error *errp;
-        snprintf(fname, 255, "replay_movie_%03d.ppm", (int)num);
-        qmp_screendump(fname, &errp);
-        num += 1;
+    snprintf(fname, 255, "replay_movie_%03d.ppm", n);
+    qmp_screendump(fname, &errp);
+    if (errp) error_free(errp);
+}
+
+static void frame_deadline(CPUState *env, uint64_t count, void *opaque) {
+    assert(rr_in_replay());
+    if (interval == 0) {
+        // The log isn't open yet when the plugin is loaded.
+        interval = replay_get_total_num_instructions() / MAX(frames, 1);
+        if (interval == 0) interval = 1;
     }
-    return 1;
+
+    if (ppm) {
+        save_ppm(num++);
+    } else {
+        // Keep frames evenly spaced in instructions even if the replay got
+        // past some deadlines before we could run (e.g. it started from a
+        // checkpoint): they show the same picture as the last one.
+        while (next_frame + interval <= count) {
+            if (frame_index->len) {
+                write_record(next_frame, MOVIE_FRAME_REPEAT, NULL, 0);
+            }
+            next_frame += interval;
+        }
+        capture_frame(count);
+    }
+    next_frame += interval;
+    if (next_frame <= count) next_frame = count + 1;
+    panda_deadline_add(plugin_self, next_frame, frame_deadline, NULL);
 }
 
 bool init_plugin(void *self) {
-    panda_cb pcb;
+    plugin_self = self;
+
+    panda_arg_list *args = panda_get_args("replaymovie");
+    frames = panda_parse_uint32_opt(args, "frames", 100,
+            "number of frames to take over the whole replay");
+    interval = panda_parse_uint64_opt(args, "interval", 0,
+            "instructions between frames (overrides frames)");
+    uint32_t fps = panda_parse_uint32_opt(args, "fps", 20,
+            "playback frame rate stored in the movie");
+    keyint = panda_parse_uint32_opt(args, "keyint", 50,
+            "store a full frame at least this often");
+    movie_name = panda_parse_string_opt(args, "name", "replay_movie.pmv",
+            "output movie file");
+    ppm = panda_parse_bool_opt(args, "ppm",
+            "write one replay_movie_NNN.ppm per frame instead of a movie");
+
+    if (keyint == 0) keyint = 1;
+    next_frame = 0;
+
+    if (!ppm) {
+        movie = fopen(movie_name, "wb");
+        if (movie == NULL) {
+            perror("replaymovie: opening output");
+            return false;
+        }
+        movie_header_t hdr = {
+            .magic = MOVIE_MAGIC,
+            .version = MOVIE_VERSION,
+            .fps = fps,
+        };
+        fwrite(&hdr, sizeof(hdr), 1, movie);
+        frame_index = g_array_new(false, false, sizeof(movie_index_t));
+    }
 
     // In general you should always register your callbacks last, because
     // if you return false your plugin will be unloaded and there may be stale
     // pointers hanging around.
-    pcb.before_block_exec = before_block_callback;
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    panda_deadline_add(self, next_frame, frame_deadline, NULL);
 
     return true;
 }
 
 void uninit_plugin(void *self) {
     // Save the last frame
-    Error *errp;
-    char fname[256] = {0};
-    snprintf(fname, 255, "replay_movie_%03d.ppm", num);
-    qmp_screendump(fname, &errp);
+    if (ppm) {
+        save_ppm(num);
+    } else if (movie) {
+        capture_frame(rr_get_guest_instr_count());
+
+        // The index goes at the end so frames can be streamed out as they
+        // are captured.
+        movie_trailer_t trailer = {
+            .index_offset = ftell(movie),
+            .num_frames = frame_index->len,
+            .magic = MOVIE_INDEX_MAGIC,
+        };
+        fwrite(frame_index->data, sizeof(movie_index_t), frame_index->len, movie);
+        fwrite(&trailer, sizeof(trailer), 1, movie);
+        fclose(movie);
+        printf("replaymovie: wrote %u frames to %s\n", frame_index->len,
+               movie_name);
+
+        g_array_free(frame_index, true);
+        g_free(prev_fb);
+        g_free(prev_yuv);
+        g_free(yuv);
+        g_free(zbuf);
+        qemu_pixman_image_unref(linebuf);
+    }
     printf("Unloading replaymovie plugin.\n");
 }
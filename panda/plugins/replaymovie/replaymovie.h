@@ -0,0 +1,56 @@
+#ifndef __REPLAYMOVIE_H_
+#define __REPLAYMOVIE_H_
+
+// On-disk layout of a replaymovie capture (.pmv). All fields are in host
+// byte order.
+//
+//   movie_header_t
+//   for each frame: movie_frame_t, then size bytes of zlib data
+//   movie_index_t[num_frames]
+//   movie_trailer_t
+//
+// Frame data is a width x height picture as I420 (Y, then U, then V, with
+// odd sizes rounded up to even). A key frame is stored as is, a delta frame
+// as its XOR with the previous frame, and a repeat frame has no data and
+// shows the previous frame again. The index lets a reader jump to any frame
+// and back up to the nearest key frame. A capture cut short has no index or
+// trailer; the frames can still be read front to back.
+
+#define MOVIE_MAGIC "PANDAMOV"
+#define MOVIE_INDEX_MAGIC "PANDAIDX"
+#define MOVIE_VERSION 1
+
+enum {
+    MOVIE_FRAME_KEY,
+    MOVIE_FRAME_DELTA,
+    MOVIE_FRAME_REPEAT,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t fps;       // playback frame rate
+} movie_header_t;
+
+typedef struct {
+    uint64_t instr_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t type;
+    uint32_t size;      // bytes of zlib data that follow
+} movie_frame_t;
+
+typedef struct {
+    uint64_t instr_count;
+    uint64_t offset;    // of the frame's movie_frame_t
+    uint32_t type;
+    uint32_t pad;
+} movie_index_t;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t num_frames;
+    char magic[8];
+} movie_trailer_t;
+
+#endif
@@ -4,6 +4,9 @@
  * to control beginning and end of new replay. Output goes to
  * a new replay named "scissors" by default (-panda-arg scissors:name
  * to change)
+ *
+ * Use -panda-arg scissors:windows=s1-e1:s2-e2:... instead to cut
+ * several replays in the same pass; window i goes to "<name>-i".
  */
 
 #include <stdio.h>
@@ -19,25 +22,37 @@
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int before_block_exec(CPUState *env, TranslationBlock *tb);
 
-static uint64_t start_count;
-static uint64_t actual_start_count;
-static uint64_t end_count;
+#define MAX_WINDOWS 64
+
+// One replay being cut out of the original.
+typedef struct {
+    uint64_t start_count;
+    uint64_t actual_start_count;
+    uint64_t end_count;
+
+    char nondet_name[128];
+    char snp_name[128];
+
+    FILE *newlog;
+    // Encoder state for the new log.
+    RR_log_codec newcodec;
+
+    bool snipping;
+    bool done;
+} window_t;
 
-static char nondet_name[128];
-static char snp_name[128];
+static window_t windows[MAX_WINDOWS];
+static int num_windows;
+
+static void *plugin_self;
 
 static FILE *oldlog = NULL;
-static FILE *newlog = NULL;
+// Scratch space for bulk copies from oldlog.
+static uint8_t copy_buf[1 << 16];
 
-//static RR_log_entry entry;
 static RR_prog_point orig_last_prog_point = {0};
 
-static bool snipping = false;
-static bool done = false;
-
-static RR_prog_point copy_entry(void);
 static void sassert(bool condition, int which);
 
 static void sassert(bool condition, int which) {
@@ -49,267 +64,309 @@ static void sassert(bool condition, int which) {
 
 #define INLINEIT inline
 
-static INLINEIT size_t rr_fwrite(void *ptr, size_t size, size_t nmemb, FILE *f) {
-    size_t result = fwrite(ptr, size, nmemb, f);
-    sassert(result == nmemb, 1);
-    return result;
+static INLINEIT void write_entry(window_t *w, RR_log_entry *item) {
+    sassert(rr_codec_write_entry(&w->newcodec, w->newlog, item), 1);
 }
 
-static INLINEIT size_t rr_fread(void *ptr, size_t size, size_t nmemb, FILE *f) {
-    size_t result = fread(ptr, size, nmemb, f);
-    sassert(result == nmemb, 2);
-    return result;
+static INLINEIT void free_entry_params(RR_log_entry *item) {
+    if (item->header.kind == RR_DIGEST) {
+        g_free(item->variant.digest.pages);
+        return;
+    }
+    if (item->header.kind != RR_SKIPPED_CALL) return;
+    RR_skipped_call_args *args = &item->variant.call_args;
+    switch (args->kind) {
+        case RR_CALL_CPU_MEM_RW:
+            g_free(args->variant.cpu_mem_rw_args.buf);
+            break;
+        case RR_CALL_CPU_MEM_UNMAP:
+            g_free(args->variant.cpu_mem_unmap.buf);
+            break;
+        case RR_CALL_MEM_REGION_CHANGE:
+            g_free(args->variant.mem_region_change_args.name);
+            break;
+        case RR_CALL_HANDLE_PACKET:
+            g_free(args->variant.handle_packet_args.buf);
+            break;
+        default:
+            break;
+    }
 }
 
-static INLINEIT void rr_fcopy(void *ptr, size_t size, size_t nmemb, FILE *oldlog, FILE *newlog) {
-    rr_fread(ptr, size, nmemb, oldlog);
-    rr_fwrite(ptr, size, nmemb, newlog);
+static INLINEIT bool rr_log_is_empty(RR_log_codec *codec) {
+    return codec->bytes == rr_nondet_log->size && !rr_codec_pending(codec);
 }
 
-static INLINEIT RR_log_entry *alloc_new_entry(void) 
-{
-    static RR_log_entry *new_entry = NULL;
-    if(!new_entry) new_entry = g_new(RR_log_entry, 1);
-    memset(new_entry, 0, sizeof(RR_log_entry));
-    return new_entry;
+static INLINEIT bool past_window(window_t *w, RR_log_entry *item) {
+    return item->header.prog_point.guest_instr_count > w->end_count
+        || item->header.kind == RR_END_OF_LOG;
 }
 
-static INLINEIT bool rr_log_is_empty(void) {
-    if (rr_nondet_log->type == REPLAY){
-        long pos = ftell(oldlog);
-        return pos == rr_nondet_log->size;
-    } else {
+// Decode one entry from the old log and re-encode it into the new one.
+// Returns false, copying nothing, once past the end of the window.
+static bool copy_entry(window_t *w, RR_log_codec *oldcodec) {
+    RR_log_entry item;
+    memset(&item, 0, sizeof(item));
+
+    sassert(rr_codec_read_entry(oldcodec, oldlog, &item), 2);
+
+    if (past_window(w, &item)) {
+        // We don't want to copy this one.
+        //ph We don't copy RR_END_OF_LOG here; write out afterwards.
+        free_entry_params(&item);
         return false;
     }
+
+    //ph Fix up instruction count
+    item.header.prog_point.guest_instr_count -= w->actual_start_count;
+    write_entry(w, &item);
+    free_entry_params(&item);
+    return true;
 }
 
-// Returns guest instr count (in old replay counting mode)
-static RR_prog_point copy_entry(void) {
-    // Code copied from rr_log.c.
-    // Copy entry.
-    RR_log_entry *item = alloc_new_entry();
+// Copy bytes [from, to) of the old log verbatim to the new one.
+static void copy_bytes(window_t *w, uint64_t from, uint64_t to) {
+    sassert(fseek(oldlog, from, SEEK_SET) == 0, 12);
+    while (from < to) {
+        size_t n = MIN(to - from, sizeof(copy_buf));
+        sassert(fread(copy_buf, 1, n, oldlog) == n, 13);
+        sassert(fwrite(copy_buf, 1, n, w->newlog) == n, 14);
+        from += n;
+    }
+}
 
-    rr_fread(&(item->header.prog_point.guest_instr_count), sizeof(item->header.prog_point.guest_instr_count), 1, oldlog);
+// Copy the part of the old log that falls inside the window, starting at
+// the position oldcodec was left in. Instruction counts are delta coded, so
+// once the two logs agree on the previous count and the run-length state
+// the records in between are the same bytes in both, and get copied as a
+// block. Only the entries around the ends of the window, and all of a
+// version 1 log, are decoded and re-encoded.
+static void copy_window_log(window_t *w, RR_log_codec *oldcodec) {
+    RR_log_entry item;
 
-    if (item->header.prog_point.guest_instr_count > end_count) {
-        // We don't want to copy this one.
-        return item->header.prog_point;
+    sassert(fseek(oldlog, oldcodec->bytes, SEEK_SET) == 0, 15);
+
+    if (oldcodec->version == RR_LOG_VERSION_1) {
+        while (!rr_log_is_empty(oldcodec) && copy_entry(w, oldcodec));
+        return;
     }
 
-    //ph Fix up instruction count
-    RR_prog_point original_prog_point = item->header.prog_point;
-    item->header.prog_point.guest_instr_count -= actual_start_count;
-    rr_fwrite(&item->header.prog_point, sizeof(item->header.prog_point), 1, newlog);
-
-#define RR_COPY_ITEM(field) rr_fcopy(&(field), sizeof(field), 1, oldlog, newlog)
-    //rw only read 1 byte for kind and callsite_loc even though it's an enum, due to mz's optimization (see rr_log.h)
-    rr_fcopy(&(item->header.kind), 1, 1, oldlog, newlog);
-    rr_fcopy(&(item->header.callsite_loc), 1, 1, oldlog, newlog);
-
-    //mz read the rest of the item
-    switch (item->header.kind) {
-        case RR_INPUT_1:
-            RR_COPY_ITEM(item->variant.input_1);
-            break;
-        case RR_INPUT_2:
-            RR_COPY_ITEM(item->variant.input_2);
-            break;
-        case RR_INPUT_4:
-            RR_COPY_ITEM(item->variant.input_4);
-            break;
-        case RR_INPUT_8:
-            RR_COPY_ITEM(item->variant.input_8);
-            break;
-        case RR_INTERRUPT_REQUEST:
-            RR_COPY_ITEM(item->variant.interrupt_request);
-            break;
-        case RR_PENDING_INTERRUPTS:
-            RR_COPY_ITEM(item->variant.pending_interrupts);
-            break;
-        case RR_EXCEPTION:
-            RR_COPY_ITEM(item->variant.exception_index);
-            break;
-        case RR_EXIT_REQUEST:
-            RR_COPY_ITEM(item->variant.exit_request);
-            break;
-        case RR_SKIPPED_CALL: {
-            RR_skipped_call_args *args = &item->variant.call_args;
-            //mz read kind first!
-            rr_fcopy(&args->kind, 1, 1, oldlog, newlog);
-
-            switch(args->kind) {
-                case RR_CALL_CPU_MEM_RW:
-                    RR_COPY_ITEM(args->variant.cpu_mem_rw_args);
-                    args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
-                    rr_fcopy(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len,
-                            oldlog, newlog);
-                    break;
-                case RR_CALL_CPU_MEM_UNMAP:
-                    RR_COPY_ITEM(args->variant.cpu_mem_unmap);
-                    args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fcopy(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len,
-                                oldlog, newlog);
-                    break;
-                case RR_CALL_MEM_REGION_CHANGE:
-                    RR_COPY_ITEM(args->variant.mem_region_change_args);
-                    args->variant.mem_region_change_args.name =
-                        g_malloc0(args->variant.mem_region_change_args.len + 1);
-                    rr_fcopy(args->variant.mem_region_change_args.name, 1,
-                            args->variant.mem_region_change_args.len,
-                            oldlog, newlog);
-                    break;
-                case RR_CALL_HD_TRANSFER:
-                    RR_COPY_ITEM(args->variant.hd_transfer_args);
-                    break;
-                case RR_CALL_NET_TRANSFER:
-                    RR_COPY_ITEM(args->variant.net_transfer_args);
-                    break;
-                case RR_CALL_HANDLE_PACKET:
-                    RR_COPY_ITEM(args->variant.handle_packet_args);
-                    args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
-                    rr_fcopy(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1,
-                            oldlog, newlog);
-                    break;
-                default:
-                    //mz unimplemented
-                    sassert(0, 3);
-            }
-        } break;
-        case RR_END_OF_LOG:
-            //mz nothing to read
-            //ph We don't copy RR_END_OF_LOG here; write out afterwards.
-            break;
-        default:
-            //mz unimplemented
-            sassert(0, 4);
+    // The first entry's delta is relative to something outside the window,
+    // and it may be in the middle of a run; re-encode up to the end of it.
+    do {
+        if (rr_log_is_empty(oldcodec) || !copy_entry(w, oldcodec)) return;
+    } while (rr_codec_pending(oldcodec));
+    sassert(rr_codec_flush(&w->newcodec, w->newlog), 16);
+
+    // Find the start of the record holding the first entry past the window.
+    RR_log_codec scan = *oldcodec;
+    RR_log_codec boundary = scan;
+    bool found = false;
+    scan.skip_buffers = true;
+    while (!found && !rr_log_is_empty(&scan)) {
+        if (!rr_codec_pending(&scan)) boundary = scan;
+        memset(&item, 0, sizeof(item));
+        sassert(rr_codec_read_entry(&scan, oldlog, &item), 17);
+        free_entry_params(&item);
+        found = past_window(w, &item);
     }
+    if (!found) boundary = scan;
+    boundary.skip_buffers = false;
+
+    copy_bytes(w, oldcodec->bytes, boundary.bytes);
+    w->newcodec.bytes += boundary.bytes - oldcodec->bytes;
+    w->newcodec.prev_instr_count =
+        boundary.prev_instr_count - w->actual_start_count;
+    w->newcodec.last = boundary.last;
+    w->newcodec.last_valid = boundary.last_valid;
+
+    // That record may be a run which only partly falls inside the window.
+    *oldcodec = boundary;
+    sassert(fseek(oldlog, oldcodec->bytes, SEEK_SET) == 0, 18);
+    while (!rr_log_is_empty(oldcodec) && copy_entry(w, oldcodec));
+}
 
-    return original_prog_point;
+static void start_snip(window_t *w, uint64_t count) {
+    if (oldlog == NULL) {
+        sassert((oldlog = fopen(rr_nondet_log->name, "r")), 8);
+        RR_log_codec hdr;
+        sassert(rr_codec_read_header(&hdr, oldlog,
+                    &orig_last_prog_point.guest_instr_count), 9);
+        printf("Original ending prog point: ");
+        rr_spit_prog_point(orig_last_prog_point);
+    }
+
+    w->actual_start_count = count;
+    printf("Saving snapshot at instr count %lu...\n", count);
+
+    // Force running state
+    global_state_store_running();
+    printf("writing snapshot:\t%s\n", w->snp_name);
+    QIOChannelFile* ioc =
+        qio_channel_file_new_path(w->snp_name, O_WRONLY | O_CREAT, 0660, NULL);
+    QEMUFile* snp = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
+    rr_save_snapshot(snp);
+    qemu_fclose(snp);
+
+    printf("Beginning cut-and-paste process at prog point:\n");
+    rr_spit_prog_point(rr_prog_point());
+    printf("Writing entries to %s...\n", w->nondet_name);
+    w->newlog = fopen(w->nondet_name, "w");
+    sassert(w->newlog, 10);
+    // We'll fix this up later.
+    rr_codec_init(&w->newcodec, RR_LOG_VERSION);
+    sassert(rr_codec_write_header(&w->newcodec, w->newlog, 0), 11);
+
+    // Pick up decoding where the replay left off.
+    RR_log_codec oldcodec = rr_nondet_log->codec;
+
+    // If there are items in the queue, then start copying the log
+    // from there
+    RR_log_entry *item = rr_get_queue_head();
+    if (item != NULL) rr_codec_rewind_to(&oldcodec, item);
+
+    //rw: For some reason I need to add an interrupt entry at the beginning of the log?
+    RR_log_entry temp;
+
+    memset(&temp, 0, sizeof(RR_log_entry));
+    temp.header.kind = RR_INTERRUPT_REQUEST;
+    temp.header.callsite_loc = RR_CALLSITE_CPU_HANDLE_INTERRUPT_BEFORE;
+    temp.variant.pending_interrupts = 2;
+    write_entry(w, &temp);
+
+    copy_window_log(w, &oldcodec);
+
+    if (rr_log_is_empty(&oldcodec)) {
+        printf("Reached end of old nondet log.\n");
+    } else {
+        printf("Past desired ending point for log.\n");
+    }
+
+    w->snipping = true;
+    printf("Continuing with replay.\n");
 }
 
-static void end_snip(void) {
+static void end_snip(window_t *w) {
     RR_prog_point prog_point = rr_prog_point();
     printf("Ending cut-and-paste on prog point:\n");
     rr_spit_prog_point(prog_point);
-    prog_point.guest_instr_count -= actual_start_count;
-
-    RR_header end;
-    end.kind = RR_END_OF_LOG;
-    end.callsite_loc = RR_CALLSITE_LAST;
-    end.prog_point = prog_point;
-    sassert(fwrite(&(end.prog_point.guest_instr_count),
-                sizeof(end.prog_point.guest_instr_count), 1, newlog) == 1, 5);
-    sassert(fwrite(&(end.kind), 1, 1, newlog) == 1, 6);
-    sassert(fwrite(&(end.callsite_loc), 1, 1, newlog) == 1, 7);
-
-    rewind(newlog);
-    fwrite(&prog_point.guest_instr_count,
-            sizeof(prog_point.guest_instr_count), 1, newlog);
-    fclose(newlog);
-
-    done = true;
+    prog_point.guest_instr_count -= w->actual_start_count;
+
+    RR_log_entry end;
+    memset(&end, 0, sizeof(end));
+    end.header.kind = RR_END_OF_LOG;
+    end.header.callsite_loc = RR_CALLSITE_LAST;
+    end.header.prog_point = prog_point;
+    write_entry(w, &end);
+    sassert(rr_codec_flush(&w->newcodec, w->newlog), 19);
+
+    sassert(rr_codec_update_header(&w->newcodec, w->newlog,
+                prog_point.guest_instr_count), 5);
+    fclose(w->newlog);
+
+    w->done = true;
 }
 
-int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    uint64_t count = rr_get_guest_instr_count();
-    if (!snipping && count+tb->icount > start_count) {
-        sassert((oldlog = fopen(rr_nondet_log->name, "r")), 8);
-        sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1, 9);
-        printf("Original ending prog point: ");
-        rr_spit_prog_point(orig_last_prog_point);
+static void window_deadline(CPUState *env, uint64_t count, void *opaque);
 
-        actual_start_count = count;
-        printf("Saving snapshot at instr count %lu...\n", count);
-
-        // Force running state
-        global_state_store_running();
-        printf("writing snapshot:\t%s\n", snp_name);
-        QIOChannelFile* ioc =
-            qio_channel_file_new_path(snp_name, O_WRONLY | O_CREAT, 0660, NULL);
-        QEMUFile* snp = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
-        qemu_savevm_state(snp, NULL);
-        qemu_fclose(snp);
-
-        printf("Beginning cut-and-paste process at prog point:\n");
-        rr_spit_prog_point(rr_prog_point());
-        printf("Writing entries to %s...\n", nondet_name);
-        newlog = fopen(nondet_name, "w");
-        sassert(newlog, 10);
-        // We'll fix this up later.
-        RR_prog_point prog_point = {0};
-        fwrite(&prog_point.guest_instr_count,
-                sizeof(prog_point.guest_instr_count), 1, newlog);
-
-        fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
-
-        // If there are items in the queue, then start copying the log
-        // from there
-        RR_log_entry *item = rr_get_queue_head();
-        if (item != NULL) fseek(oldlog, item->header.file_pos, SEEK_SET);
-
-        //rw: For some reason I need to add an interrupt entry at the beginning of the log?
-        RR_log_entry temp;
-
-        memset(&temp, 0, sizeof(RR_log_entry));
-        temp.header.kind = RR_INTERRUPT_REQUEST;
-        temp.header.callsite_loc = RR_CALLSITE_CPU_HANDLE_INTERRUPT_BEFORE;
-        temp.variant.pending_interrupts = 2;
-
-        fwrite(&temp.header.prog_point, sizeof(temp.header.prog_point), 1, newlog);
-        fwrite(&temp.header.kind, 1, 1, newlog);
-        fwrite(&temp.header.callsite_loc, 1, 1, newlog);
-        fwrite(&temp.variant.pending_interrupts, sizeof(temp.variant.pending_interrupts), 1, newlog);
-
-        while (prog_point.guest_instr_count < end_count && !rr_log_is_empty()) {
-            prog_point = copy_entry();
-        }
-        
-        if (!feof(oldlog)) { // prog_point is the first one AFTER what we want
-            printf("Reached end of old nondet log.\n");
-        } else {
-            printf("Past desired ending point for log.\n");
-        }
-
-        snipping = true;
-        printf("Continuing with replay.\n");
+// A window starts right before the insn at its start count and ends right
+// after the one at its end count.
+static void add_window_deadline(window_t *w) {
+    if (!w->snipping) {
+        panda_deadline_add(plugin_self, w->start_count, window_deadline, w);
+    } else if (!w->done && w->end_count != UINT64_MAX) {
+        panda_deadline_add(plugin_self, w->end_count + 1, window_deadline, w);
     }
+}
 
-    if (snipping && !done && count > end_count) {
-        end_snip();
+static void window_deadline(CPUState *env, uint64_t count, void *opaque) {
+    window_t *w = opaque;
+    if (!w->snipping) {
+        start_snip(w, count);
+    } else {
+        end_snip(w);
+    }
+    add_window_deadline(w);
 
+    bool all_done = true;
+    for (int i = 0; i < num_windows; i++) {
+        all_done &= windows[i].done;
+    }
+    if (all_done) {
         rr_end_replay_requested = 1;
     }
+}
 
-    return 0;
+static bool add_window(const char *name, uint64_t start, uint64_t end) {
+    if (num_windows == MAX_WINDOWS) {
+        printf("scissors: at most %d windows\n", MAX_WINDOWS);
+        return false;
+    }
+    if (start > end) {
+        printf("scissors: window %lu-%lu is empty\n", start, end);
+        return false;
+    }
+    window_t *w = &windows[num_windows++];
+    w->start_count = start;
+    w->end_count = end;
+    snprintf(w->nondet_name, 128, "%s-rr-nondet.log", name);
+    snprintf(w->snp_name, 128, "%s-rr-snp", name);
+    return true;
+}
+
+// Parse "s1-e1:s2-e2:..." into windows named <name>-0, <name>-1, ...
+static bool parse_windows(const char *name, const char *spec) {
+    char wname[112];
+    const char *p = spec;
+    while (*p) {
+        char *q;
+        uint64_t start = strtoull(p, &q, 0);
+        if (q == p || *q != '-') goto bad;
+        p = q + 1;
+        uint64_t end = strtoull(p, &q, 0);
+        if (q == p || (*q != ':' && *q != '\0')) goto bad;
+        p = *q ? q + 1 : q;
+        snprintf(wname, sizeof(wname), "%s-%d", name, num_windows);
+        if (!add_window(wname, start, end)) return false;
+    }
+    return num_windows > 0;
+bad:
+    printf("scissors: can't parse windows \"%s\"\n", spec);
+    return false;
 }
 
 bool init_plugin(void *self) {
-    panda_cb pcb = { .before_block_exec = before_block_exec };
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    plugin_self = self;
 
-    start_count = 0;
-    end_count = UINT64_MAX;
+    uint64_t start_count = 0;
+    uint64_t end_count = UINT64_MAX;
     const char *name = "scissors";
+    const char *spec = NULL;
 
     panda_arg_list *args = panda_get_args("scissors");
     if (args != NULL) {
         name = panda_parse_string_req(args, "name", "name of the scissored replay");
         start_count = panda_parse_uint64_opt(args, "start", 0, "starting instruction count");
         end_count = panda_parse_uint64_opt(args, "end", UINT64_MAX, "ending instruction count");
+        spec = panda_parse_string_opt(args, "windows", NULL,
+                "colon-separated start-end instruction count pairs to cut out in one pass");
     }
 
-    snprintf(nondet_name, 128, "%s-rr-nondet.log", name);
-    snprintf(snp_name, 128, "%s-rr-snp", name);
+    if (spec != NULL) {
+        if (!parse_windows(name, spec)) return false;
+    } else if (!add_window(name, start_count, end_count)) {
+        return false;
+    }
 
+    for (int i = 0; i < num_windows; i++) {
+        add_window_deadline(&windows[i]);
+    }
     return true;
 }
 
 void uninit_plugin(void *self) {
-    if (snipping && !done) end_snip();
+    for (int i = 0; i < num_windows; i++) {
+        if (windows[i].snipping && !windows[i].done) end_snip(&windows[i]);
+    }
+    if (oldlog) fclose(oldlog);
 }
@@ -32,7 +32,7 @@ PANDAENDCOMMENT */
 #include "syscalls_common.h"
 
 bool translate_callback(CPUState *cpu, target_ulong pc);
-int exec_callback(CPUState *cpu, target_ulong pc);
+void exec_callback(CPUState *cpu, target_ulong pc, void *opaque);
 
 extern "C" {
 bool init_plugin(void *);
@@ -420,84 +420,64 @@ static uint32_t impossibleToReadPCs = 0;
 
 // Check if the instruction is sysenter (0F 34),
 // syscall (0F 05) or int 0x80 (CD 80)
+// Uses PANDA's decoder on the insn being translated, which reads it
+// through the code TLB rather than walking the page tables again.
 int isCurrentInstructionASyscall(CPUState *cpu, target_ulong pc) {
-#if defined(TARGET_I386)
-    unsigned char buf[2] = {};
-
-    int res = panda_virtual_memory_rw(cpu, pc, buf, 2, 0);
-    if(res <0){
+#if defined(TARGET_I386) || defined(TARGET_ARM)
+    panda_insn insn;
+    if (!panda_insn_translating(cpu, &insn)) {
         return -1;
     }
-
-    // Check if the instruction is syscall (0F 05)
-    if (buf[0]== 0x0F && buf[1] == 0x05) {
-        return true;
+    if (insn.kind != PANDA_INSN_SYSCALL) {
+        return false;
     }
-    // Check if the instruction is int 0x80 (CD 80)
-    else if (buf[0]== 0xCD && buf[1] == 0x80) {
+#endif
+#if defined(TARGET_I386)
+    // syscall and sysenter, or int 0x80
+    return !(insn.flags & PANDA_INSN_IMM) || insn.imm == 0x80;
+#elif defined(TARGET_ARM)
+    // EABI: svc 0 in ARM or Thumb mode
+    if (insn.imm == 0) {
         return true;
     }
-    // Check if the instruction is sysenter (0F 34)
-    else if (buf[0]== 0x0F && buf[1] == 0x34) {
+#if defined(CAPTURE_ARM_OABI)
+    // old ABI: svc 0x900000 + nr, ARM mode only
+    CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    if (env->thumb == 0 && (insn.imm & 0xff0000) == 0x900000) {
         return true;
     }
-    else {
-        return false;
-    }
-#elif defined(TARGET_ARM)
-    unsigned char buf[4] = {};
-
-    // Check for ARM mode syscall
-    CPUArchState *env = (CPUArchState*)cpu->env_ptr;
-    if(env->thumb == 0) {
-        panda_virtual_memory_rw(cpu, pc, buf, 4, 0);
-        // EABI
-        if ( ((buf[3] & 0x0F) ==  0x0F)  && (buf[2] == 0) && (buf[1] == 0) && (buf[0] == 0) ) {
-            return true;
-        }
-#if defined(CAPTURE_ARM_OABI)
-        else if (((buf[3] & 0x0F) == 0x0F)  && (buf[2] == 0x90)) {  // old ABI
-            return true;
-        }
 #endif
-    }
-    else {
-        panda_virtual_memory_rw(cpu, pc, buf, 2, 0);
-        // check for Thumb mode syscall
-        if (buf[1] == 0xDF && buf[0] == 0){
-            return true;
-        }
-    }
     return false;
 #elif defined(TARGET_PPC)
     return false;
 #endif
 }
 
-// This will only be called for instructions where the
-// translate_callback returned true
-int exec_callback(CPUState *cpu, target_ulong pc) {
-    int res = isCurrentInstructionASyscall(cpu,pc);
+// Called through a probe on each syscall insn found by translate_callback
+void exec_callback(CPUState *cpu, target_ulong pc, void *opaque) {
+    // run any code we need to update our state
+    for(const auto callback : preExecCallbacks){
+        callback(cpu, pc);
+    }
+    syscalls_profile->enter_switch(cpu, pc);
+#ifdef DEBUG
+    syscallCounter[panda_current_asid(cpu)]++;
+#endif
+}
+
+// Probing the syscall insns directly means other plugins' insn_translate
+// results no longer make us re-read and re-check every insn they pick.
+bool translate_callback(CPUState* cpu, target_ulong pc){
+    int res = isCurrentInstructionASyscall(cpu, pc);
 #ifdef DEBUG
     if(res < 0){
         impossibleToReadPCs++;
     }
 #endif
     if(res == 1){
-        // run any code we need to update our state
-        for(const auto callback : preExecCallbacks){
-            callback(cpu, pc);
-        }
-        syscalls_profile->enter_switch(cpu, pc);
-#ifdef DEBUG
-        syscallCounter[panda_current_asid(cpu)]++;
-#endif
+        panda_probe_call(exec_callback, NULL);
     }
-    return 0;
-}
-
-bool translate_callback(CPUState* cpu, target_ulong pc){
-    return isCurrentInstructionASyscall(cpu, pc) == 1;
+    return false;
 }
 
 
@@ -553,8 +533,6 @@ bool init_plugin(void *self) {
     panda_cb pcb;
     pcb.insn_translate = translate_callback;
     panda_register_callback(self, PANDA_CB_INSN_TRANSLATE, pcb);
-    pcb.insn_exec = exec_callback;
-    panda_register_callback(self, PANDA_CB_INSN_EXEC, pcb);
     pcb.before_block_exec = returned_check_callback;
     panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
 
@@ -579,7 +557,7 @@ void uninit_plugin(void *self) {
     }
     std::cout<< std::endl;
     if(impossibleToReadPCs){
-        std::cout << "syscalls2: DEBUG some instructions couldn't be read on insn_exec: " << impossibleToReadPCs << std::endl;
+        std::cout << "syscalls2: DEBUG some instructions couldn't be read on insn_translate: " << impossibleToReadPCs << std::endl;
     }
 #endif
 }
@@ -202,6 +202,35 @@ public:
         if (change) taint_state_changed(this, addr, 1);
     }
 
+    // Set range_size bytes from addr at once, byte addr + i to td(i).  Any
+    // change is reported as one range rather than byte by byte.
+    template <typename F>
+    inline void set_range(uint64_t addr, uint64_t range_size, F td) {
+        tassert(addr + range_size >= addr);
+        tassert(addr + range_size <= size);
+
+        bool change = false;
+        TaintData *p = get_td_p(addr);
+        for (uint64_t i = 0; i < range_size; i++) {
+            TaintData new_td = td(i);
+            change |= !(new_td == p[i]);
+            p[i] = new_td;
+        }
+
+        if (change) taint_state_changed(this, addr, range_size);
+    }
+
+    // Number of tainted bytes among range_size bytes from addr.
+    inline uint64_t count_tainted(uint64_t addr, uint64_t range_size) {
+        tassert(addr + range_size <= size);
+        uint64_t n = 0;
+        TaintData *p = get_td_p(addr);
+        for (uint64_t i = 0; i < range_size; i++) {
+            n += (p[i].ls != nullptr);
+        }
+        return n;
+    }
+
     inline uint32_t query_tcn(uint64_t addr) {
         return (query_full(addr)).tcn;
     }
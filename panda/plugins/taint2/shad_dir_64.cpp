@@ -29,6 +29,7 @@ PANDAENDCOMMENT */
 #include <cstdint>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
 
 #include "shad_dir_64.h"
 
@@ -406,6 +407,103 @@ LabelSetP shad_dir_find_64(SdDir64 *shad_dir, uint64_t addr) {
   return ls;
 }
 
+
+// Returns the page for addr, or NULL if there is none
+static SdPage *__shad_dir_find_page_64(SdDir64 *shad_dir, uint64_t addr) {
+  SD_GET_LABELSET_64(
+    addr,
+    return NULL,
+    return NULL,
+    return NULL,
+    return NULL,
+    SD_DO_NOTHING
+  )
+  return page;
+}
+
+
+// Returns the page for addr, adding it (and its tables) if need be
+static SdPage *__shad_dir_get_page_64(SdDir64 *shad_dir, uint64_t addr) {
+  SD_GET_LABELSET_64(
+    addr,
+    table1 = __shad_dir_add_table_to_dir_64(shad_dir, di),
+    table2 = __shad_dir_add_something_to_table_64(shad_dir, table1, t1i, 1),
+    table3 = __shad_dir_add_something_to_table_64(shad_dir, table2, t2i, 0),
+    page = __shad_dir_add_page_to_table_64(shad_dir, table3, t3i),
+    SD_DO_NOTHING
+  )
+  return page;
+}
+
+
+/*
+  copies the labelsets of the len addrs from addr into labels, a page at a
+  time.  labels[i] is NULL if addr+i has none.
+  returns the number of addrs that have one.
+*/
+uint64_t shad_dir_get_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len,
+                               LabelSetP *labels) {
+  uint64_t num_labeled = 0;
+  while (len > 0) {
+    uint64_t offset = addr & shad_dir->page_mask;
+    uint64_t n = shad_dir->page_size - offset;
+    if (n > len) n = len;
+    SdPage *page = __shad_dir_find_page_64(shad_dir, addr);
+    if (page == NULL) {
+      memset(labels, 0, n * sizeof(LabelSetP));
+    }
+    else {
+      memcpy(labels, page->labels + offset, n * sizeof(LabelSetP));
+      uint64_t i;
+      for (i=0; i<n; i++) {
+        num_labeled += (labels[i] != NULL);
+      }
+    }
+    addr += n;
+    labels += n;
+    len -= n;
+  }
+  return num_labeled;
+}
+
+
+/*
+  maps each of the len addrs from addr to labels[i], a page at a time.
+  a NULL labels[i] removes the mapping.  labelsets are *not* copied.
+  no page is added unless something is to be mapped in it.
+*/
+void shad_dir_set_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len,
+                           const LabelSetP *labels) {
+  while (len > 0) {
+    uint64_t offset = addr & shad_dir->page_mask;
+    uint64_t n = shad_dir->page_size - offset;
+    if (n > len) n = len;
+    uint64_t i, num_labeled = 0;
+    for (i=0; i<n; i++) {
+      num_labeled += (labels[i] != NULL);
+    }
+    if (num_labeled == 0) {
+      // just removals, which may free the page
+      if (__shad_dir_find_page_64(shad_dir, addr) != NULL) {
+        for (i=0; i<n; i++) {
+          shad_dir_remove_64(shad_dir, addr + i);
+        }
+      }
+    }
+    else {
+      SdPage *page = __shad_dir_get_page_64(shad_dir, addr);
+      for (i=0; i<n; i++) {
+        LabelSetP ls = page->labels[offset + i];
+        page->num_non_empty += (labels[i] != NULL) - (ls != NULL);
+        page->labels[offset + i] = labels[i];
+      }
+    }
+    addr += n;
+    labels += n;
+    len -= n;
+  }
+}
+
 #define SD_TESTING
 #ifndef SD_TESTING
 
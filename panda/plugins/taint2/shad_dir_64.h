@@ -85,6 +85,18 @@ int shad_dir_free_aux_64(uint64_t pa, SdPage *page, void *stuff);
 // Returns NULL if none
 /*inline*/ LabelSetP shad_dir_find_64(SdDir64 *shad_dir, uint64_t addr);
 
+/*
+  copies the labelsets of the len addrs from addr into labels (NULL where
+  there is none), a page at a time.  returns how many addrs have one.
+*/
+uint64_t shad_dir_get_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len, LabelSetP *labels);
+
+/*
+  maps each of the len addrs from addr to labels[i], a page at a time.
+  NULL removes the mapping.  pages are only added for non-NULL labelsets.
+*/
+void shad_dir_set_range_64(SdDir64 *shad_dir, uint64_t addr, uint64_t len, const LabelSetP *labels);
+
 #ifndef SD_TESTING
 // marshall shad_dir to file
 void shad_dir_save_64(void * /* QEMUFile * */ f, SdDir64 *shad_dir);
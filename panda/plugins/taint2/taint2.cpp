@@ -27,6 +27,9 @@
 #undef NDEBUG
 #endif
 
+#include <algorithm>
+#include <vector>
+
 #include "panda/plugin.h"
 #include "panda/tcg-llvm.h"
 
@@ -81,10 +84,19 @@ bool track_taint_state = false;
 
 int asid_changed_callback(CPUState *env, target_ulong oldval, target_ulong newval);
 
+int hd_transfer_callback(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes);
+int net_transfer_callback(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes);
+
 }
 
 ShadowState *shadow = nullptr; // Global shadow memory
 
+// for the stats printed at uninit, see taint_ops.cpp
+extern uint64_t taint_ops_count;
+static uint64_t taint_enable_instr;
+
 // Pointer passed in init_plugin()
 void *plugin_ptr = nullptr;
 
@@ -126,6 +138,78 @@ int phys_mem_read_callback(CPUState *cpu, target_ulong pc, target_ulong addr,
     return 0;
 }
 
+/*
+ * Device transfers, noted by the IDE/AHCI, virtio-blk and e1000 models while
+ * recording, move taint in bulk between RAM and the sparse shadows of the
+ * disk (shadow->hd, by byte offset on disk; all disks share it) and of the
+ * network card's buffers (shadow->io, by host address at record time).
+ */
+static void shad_dir_to_ram(SdDir64 *dir, uint64_t src, uint64_t pa,
+                            uint32_t num_bytes) {
+    if (pa >= shadow->ram.get_size()) return;
+    num_bytes = std::min<uint64_t>(num_bytes, shadow->ram.get_size() - pa);
+    std::vector<LabelSetP> labels(num_bytes);
+    shad_dir_get_range_64(dir, src, num_bytes, labels.data());
+    shadow->ram.set_range(pa, num_bytes, [&labels](uint64_t i) {
+        return TaintData(labels[i]);
+    });
+}
+
+static void ram_to_shad_dir(uint64_t pa, SdDir64 *dir, uint64_t dest,
+                            uint32_t num_bytes) {
+    std::vector<LabelSetP> labels(num_bytes, nullptr);
+    for (uint64_t i = 0; i < num_bytes && pa + i < shadow->ram.get_size(); i++) {
+        labels[i] = shadow->ram.query(pa + i);
+    }
+    shad_dir_set_range_64(dir, dest, num_bytes, labels.data());
+}
+
+static void shad_dir_to_shad_dir(SdDir64 *src_dir, uint64_t src,
+                                 SdDir64 *dest_dir, uint64_t dest,
+                                 uint32_t num_bytes) {
+    std::vector<LabelSetP> labels(num_bytes);
+    shad_dir_get_range_64(src_dir, src, num_bytes, labels.data());
+    shad_dir_set_range_64(dest_dir, dest, num_bytes, labels.data());
+}
+
+int hd_transfer_callback(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes) {
+    switch (type) {
+        case HD_TRANSFER_HD_TO_RAM:
+            shad_dir_to_ram(shadow->hd, src_addr, dest_addr, num_bytes);
+            break;
+        case HD_TRANSFER_RAM_TO_HD:
+            ram_to_shad_dir(src_addr, shadow->hd, dest_addr, num_bytes);
+            break;
+        case HD_TRANSFER_HD_TO_IOB:
+            shad_dir_to_shad_dir(shadow->hd, src_addr, shadow->io, dest_addr, num_bytes);
+            break;
+        case HD_TRANSFER_IOB_TO_HD:
+            shad_dir_to_shad_dir(shadow->io, src_addr, shadow->hd, dest_addr, num_bytes);
+            break;
+        default:
+            // port transfers: no device in this tree notes them
+            break;
+    }
+    return 0;
+}
+
+int net_transfer_callback(CPUState *cpu, uint32_t type, uint64_t src_addr,
+        uint64_t dest_addr, uint32_t num_bytes) {
+    switch (type) {
+        case NET_TRANSFER_RAM_TO_IOB:
+            ram_to_shad_dir(src_addr, shadow->io, dest_addr, num_bytes);
+            break;
+        case NET_TRANSFER_IOB_TO_RAM:
+            shad_dir_to_ram(shadow->io, src_addr, dest_addr, num_bytes);
+            break;
+        case NET_TRANSFER_IOB_TO_IOB:
+            shad_dir_to_shad_dir(shadow->io, src_addr, shadow->io, dest_addr, num_bytes);
+            break;
+    }
+    return 0;
+}
+
 void verify(void) {
     llvm::Module *mod = tcg_llvm_ctx->getModule();
     std::string err;
@@ -143,6 +227,7 @@ void taint2_enable_taint(void) {
     if(taintEnabled) {return;}
     printf ("taint2: __taint_enable_taint\n");
     taintEnabled = true;
+    taint_enable_instr = rr_get_guest_instr_count();
     panda_cb pcb;
 
     pcb.before_block_exec_invalidate_opt = before_block_exec_invalidate_opt;
@@ -153,6 +238,10 @@ void taint2_enable_taint(void) {
     panda_register_callback(plugin_ptr, PANDA_CB_PHYS_MEM_BEFORE_WRITE, pcb);
     pcb.asid_changed = asid_changed_callback;
     panda_register_callback(plugin_ptr, PANDA_CB_ASID_CHANGED, pcb);
+    pcb.replay_hd_transfer = hd_transfer_callback;
+    panda_register_callback(plugin_ptr, PANDA_CB_REPLAY_HD_TRANSFER, pcb);
+    pcb.replay_net_transfer = net_transfer_callback;
+    panda_register_callback(plugin_ptr, PANDA_CB_REPLAY_NET_TRANSFER, pcb);
 
     panda_enable_precise_pc(); //before_block_exec requires precise_pc for panda_current_asid
 
@@ -271,8 +360,7 @@ void panda_virtual_string_read(CPUState *cpu, target_ulong vaddr, char *str) {
  */
 
 Panda__SrcInfo *pandalog_src_info_create(PandaHypercallStruct phs) {
-    Panda__SrcInfo *si = (Panda__SrcInfo *) malloc(sizeof(Panda__SrcInfo));
-    *si = PANDA__SRC_INFO__INIT;
+    Panda__SrcInfo *si = pandalog_new(Panda__SrcInfo, PANDA__SRC_INFO__INIT);
     si->filename = phs.src_filename;
     si->astnodename = phs.src_ast_node_name;
     si->linenum = phs.src_linenum;
@@ -323,8 +411,8 @@ void taint_query_hypercall(PandaHypercallStruct phs) {
         if (num_tainted) {
             // ok at least one byte in the extent is tainted
             // 1. write the pandalog entry that tells us something was tainted on this extent
-            Panda__TaintQueryHypercall *tqh = (Panda__TaintQueryHypercall *) malloc (sizeof (Panda__TaintQueryHypercall));
-            *tqh = PANDA__TAINT_QUERY_HYPERCALL__INIT;
+            Panda__TaintQueryHypercall *tqh = pandalog_new(Panda__TaintQueryHypercall,
+                                                           PANDA__TAINT_QUERY_HYPERCALL__INIT);
             tqh->buf = phs.buf;
             tqh->len = len;
             tqh->num_tainted = num_tainted;
@@ -361,36 +449,26 @@ void taint_query_hypercall(PandaHypercallStruct phs) {
                 }
             }
             tqh->n_taint_query = tq.size();
-            tqh->taint_query = (Panda__TaintQuery **) malloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
+            tqh->taint_query = pandalog_new_array(Panda__TaintQuery *, tqh->n_taint_query);
             for (uint32_t i=0; i<tqh->n_taint_query; i++) {
                 tqh->taint_query[i] = tq[i];
             }
             Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
             ple.taint_query_hypercall = tqh;
             pandalog_write_entry(&ple);
-            free(tqh->src_info);
-            pandalog_callstack_free(tqh->call_stack);
-            for (uint32_t i=0; i<tqh->n_taint_query; i++) {
-                pandalog_taint_query_free(tqh->taint_query[i]);
-            }
-            free(tqh);
         }
     }
 }
 
 void lava_attack_point(PandaHypercallStruct phs) {
     if (pandalog) {
-        Panda__AttackPoint *ap = (Panda__AttackPoint *) malloc (sizeof (Panda__AttackPoint));
-        *ap = PANDA__ATTACK_POINT__INIT;
+        Panda__AttackPoint *ap = pandalog_new(Panda__AttackPoint, PANDA__ATTACK_POINT__INIT);
         ap->info = phs.info;
         Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
         ple.attack_point = ap;
         ple.attack_point->src_info = pandalog_src_info_create(phs);
         ple.attack_point->call_stack = pandalog_callstack_create();
         pandalog_write_entry(&ple);
-        free(ple.attack_point->src_info);
-        pandalog_callstack_free(ple.attack_point->call_stack);
-        free(ap);
     }
 }
 
@@ -546,6 +624,12 @@ bool init_plugin(void *self) {
 
 
 void uninit_plugin(void *self) {
+    if (taintEnabled) {
+        uint64_t instr = rr_get_guest_instr_count() - taint_enable_instr;
+        printf("taint2: %" PRIu64 " taint ops over %" PRIu64
+               " instructions, %.3f per instruction\n", taint_ops_count,
+               instr, instr ? (double) taint_ops_count / instr : 0.0);
+    }
     if (shadow) {
         delete shadow;
         shadow = nullptr;
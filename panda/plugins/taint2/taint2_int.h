@@ -1,4 +1,6 @@
 
+typedef void target_ulong;
+typedef void CPUState;
 typedef void *LabelSetP;
 typedef void Panda__TaintQuery;
 
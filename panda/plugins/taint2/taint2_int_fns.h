@@ -22,6 +22,19 @@ void taint2_label_ram(uint64_t pa, uint32_t l);
 // to this address are removed.
 void taint2_label_reg(int reg_num, int offset, uint32_t l);
 
+// label the len bytes of guest virtual memory at va with label l, or, if
+// positional, byte i with label l + i.  any previous labels are removed.
+// translates once per page and writes the shadow a page at a time, skipping
+// unmapped pages, and writes one TaintLabelRange entry to pandalog.
+// returns the number of bytes labeled.
+uint32_t taint2_label_ram_range(CPUState *cpu, target_ulong va, uint32_t len, uint32_t l, bool positional);
+
+// label the len bytes of the disk at byte offset with label l, or, if
+// positional, byte i with label l + i.  any previous labels are removed.
+// the labels reach RAM when the guest reads those bytes (in replay, through
+// IDE/AHCI or virtio-blk).  all disks share one shadow.
+void taint2_label_hd_range(uint64_t offset, uint32_t len, uint32_t l, bool positional);
+
 // add label l to this phys addr in memory. any previous labels applied to this
 // address are not removed.
 void taint2_label_ram_additive(uint64_t pa, uint32_t l);
@@ -68,6 +81,21 @@ void taint2_labelset_ram_iter(uint64_t pa, int (*app)(uint32_t el, void *stuff1)
 // offset is byte offset withing that reg.
 void taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 
+// number of tainted bytes among the len bytes of guest virtual memory at va,
+// translating once per page. unmapped bytes count as untainted.
+uint32_t taint2_query_ram_range(CPUState *cpu, target_ulong va, uint32_t len);
+
+// number of tainted bytes among the len bytes of the disk at byte offset
+uint32_t taint2_query_hd_range(uint64_t offset, uint32_t len);
+
+// number of tainted bytes among the len bytes starting at a (a.off counts up)
+uint32_t taint2_query_range(Addr a, uint32_t len);
+
+// apply this fn once to each label in the union of the label sets of the len
+// bytes starting at a, e.g. a whole register. returns the number of tainted
+// bytes. app may be NULL to only count.
+uint32_t taint2_labelset_range_iter(Addr a, uint32_t len, int (*app)(uint32_t el, void *stuff1), void *stuff2);
+
 // just tells how big that labels_applied set will be
 uint32_t taint2_num_labels_applied(void);
 
@@ -84,8 +84,27 @@ static void tp_labelset_put(const Addr &a, LabelSetP ls) {
     if (loc.first) loc.first->set_full(loc.second, TaintData(ls));
 }
 
-// used to keep track of labels that have been applied
-std::set<uint32_t> labels_applied;
+// Labels that have been applied, as disjoint [lo, hi) ranges, so that
+// positionally labeling a large buffer is one range rather than a set entry
+// per byte.
+static std::map<uint64_t, uint64_t> labels_applied;
+static uint64_t num_labels_applied = 0;
+
+static void note_labels_applied(uint64_t lo, uint64_t hi) {
+    auto it = labels_applied.upper_bound(lo);
+    if (it != labels_applied.begin() && std::prev(it)->second >= lo) {
+        it = std::prev(it);
+    }
+    // absorb every range that overlaps or touches [lo, hi)
+    while (it != labels_applied.end() && it->first <= hi) {
+        lo = std::min(lo, it->first);
+        hi = std::max(hi, it->second);
+        num_labels_applied -= it->second - it->first;
+        it = labels_applied.erase(it);
+    }
+    labels_applied[lo] = hi;
+    num_labels_applied += hi - lo;
+}
 
 // label -- associate label l, and only label l, with address a. any previous
 // labels applied to the address are removed.
@@ -94,7 +113,7 @@ static void tp_label(Addr a, uint32_t l) {
 
     LabelSetP ls = label_set_singleton(l);
     tp_labelset_put(a, ls);
-    labels_applied.insert(l);
+    note_labels_applied(l, (uint64_t) l + 1);
 }
 
 // label -- add label l to the label set of address a. previous labels applied
@@ -110,7 +129,7 @@ static void tp_label_additive(Addr a, uint32_t l) {
     LabelSetP new_ls = label_set_union(ls_at_a, ls_of_l);
     if (new_ls) {
         tp_labelset_put(a, new_ls);
-        labels_applied.insert(l);
+        note_labels_applied(l, (uint64_t) l + 1);
 	}
 }
 
@@ -145,51 +164,126 @@ void taint2_label_reg_additive(int reg_num, int offset, uint32_t l) {
     tp_label_additive(a, l);
 }
 
-void label_byte(CPUState *cpu, target_ulong virt_addr, uint32_t label_num) {
-    hwaddr pa = panda_virt_to_phys(cpu, virt_addr);
+// Calls fn(va, pa, n) for each run of n bytes of [va, va + len) that is in
+// one guest page and backed by RAM, translating once per page.  Returns the
+// physical address of each page (of va itself for the first), or -1 for a
+// page that is unmapped or outside RAM.
+template <typename F>
+static std::vector<uint64_t> ram_range_iter(CPUState *cpu, target_ulong va,
+                                            uint32_t len, F fn) {
+    std::vector<uint64_t> pages;
+    uint32_t done = 0;
+    while (done < len) {
+        target_ulong page_va = va + done;
+        uint32_t n = std::min<uint64_t>(len - done,
+            TARGET_PAGE_SIZE - (page_va & ~TARGET_PAGE_MASK));
+        hwaddr pa = panda_virt_to_phys(cpu, page_va);
+        if (pa == (hwaddr) -1 || pa + n > shadow->ram.get_size()) {
+            pages.push_back((uint64_t) -1);
+        } else {
+            pages.push_back(pa);
+            fn(page_va, pa, n);
+        }
+        done += n;
+    }
+    return pages;
+}
+
+uint32_t taint2_label_ram_range(CPUState *cpu, target_ulong va, uint32_t len,
+                                uint32_t l, bool positional) {
+    assert(shadow);
+    if (debug_taint) start_debugging();
+
+    uint32_t num_labeled = 0;
+    LabelSetP ls = label_set_singleton(l);
+    std::vector<uint64_t> pages = ram_range_iter(cpu, va, len,
+            [&](target_ulong page_va, hwaddr pa, uint32_t n) {
+        if (positional) {
+            uint32_t first = l + (page_va - va);
+            shadow->ram.set_range(pa, n, [first](uint64_t i) {
+                return TaintData(label_set_singleton(first + i));
+            });
+        } else {
+            shadow->ram.set_range(pa, n, [ls](uint64_t i) {
+                return TaintData(ls);
+            });
+        }
+        num_labeled += n;
+    });
+    if (num_labeled == 0) return 0;
+    note_labels_applied(l, (uint64_t) l + (positional ? len : 1));
+
     if (pandalog) {
+        Panda__TaintLabelRange *tlr = pandalog_new(Panda__TaintLabelRange,
+                                                   PANDA__TAINT_LABEL_RANGE__INIT);
+        tlr->vaddr = va;
+        tlr->len = len;
+        tlr->label = l;
+        tlr->positional = positional;
+        tlr->n_paddr = pages.size();
+        tlr->paddr = pandalog_new_array(uint64_t, pages.size());
+        std::copy(pages.begin(), pages.end(), tlr->paddr);
         Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-        ple.has_taint_label_virtual_addr = 1;
-        ple.has_taint_label_physical_addr = 1;
-        ple.has_taint_label_number = 1;
-        ple.taint_label_virtual_addr = virt_addr;
-        ple.taint_label_physical_addr = pa;
-        ple.taint_label_number = label_num;
+        ple.taint_label_range = tlr;
         pandalog_write_entry(&ple);
     }
-    taint2_label_ram(pa, label_num);
+    return num_labeled;
 }
 
+uint32_t taint2_query_ram_range(CPUState *cpu, target_ulong va, uint32_t len) {
+    assert(shadow);
+    uint32_t num_tainted = 0;
+    ram_range_iter(cpu, va, len, [&](target_ulong page_va, hwaddr pa, uint32_t n) {
+        num_tainted += shadow->ram.count_tainted(pa, n);
+    });
+    return num_tainted;
+}
+
+// The disk shadow is only written by transfers replayed from devices
+// (see hd_transfer_callback), so labels put here reach RAM when the guest
+// reads the blocks.
+void taint2_label_hd_range(uint64_t offset, uint32_t len, uint32_t l,
+                           bool positional) {
+    assert(shadow);
+    if (len == 0) return;
+    std::vector<LabelSetP> labels(len);
+    for (uint32_t i = 0; i < len; i++) {
+        labels[i] = label_set_singleton(positional ? l + i : l);
+    }
+    shad_dir_set_range_64(shadow->hd, offset, len, labels.data());
+    note_labels_applied(l, (uint64_t) l + (positional ? len : 1));
+}
+
+uint32_t taint2_query_hd_range(uint64_t offset, uint32_t len) {
+    assert(shadow);
+    std::vector<LabelSetP> labels(len);
+    return shad_dir_get_range_64(shadow->hd, offset, len, labels.data());
+}
+
+static void report_range_labeled(uint64_t addr, uint32_t length,
+                                 uint32_t num_labeled) {
+    if (num_labeled < length) {
+        printf("taint2: %u of %u bytes at 0x%lx not labeled: mmu hasn't "
+               "mapped virt->phys, i.e., they aren't actually there.\n",
+               length - num_labeled, length, addr);
+    }
+}
 
 // Apply positional taint to a buffer of memory
 void taint2_add_taint_ram_pos(CPUState *cpu, uint64_t addr, uint32_t length, uint32_t start_label){
-    for (unsigned i = 0; i < length; i++){
-        hwaddr pa = panda_virt_to_phys(cpu, addr + i);
-        if (pa == (hwaddr)(-1)) {
-            printf("can't label addr=0x%lx: mmu hasn't mapped virt->phys, "
-                "i.e., it isnt actually there.\n", addr +i);
-            continue;
-        }
-        printf("taint2: adding positional taint label %d\n", i+start_label);
-        label_byte(cpu, addr+i, i+start_label);
-    }
+    printf("taint2: adding positional taint labels %u..%u\n", start_label,
+           start_label + length - 1);
+    uint32_t n = taint2_label_ram_range(cpu, addr, length, start_label, true);
+    report_range_labeled(addr, length, n);
 }
 
 
 // Apply single label taint to a buffer of memory
 void taint2_add_taint_ram_single_label(CPUState *cpu, uint64_t addr,
         uint32_t length, long label){
-    for (unsigned i = 0; i < length; i++){
-        hwaddr pa = panda_virt_to_phys(cpu, addr + i);
-        if (pa == (hwaddr)(-1)) {
-            printf("can't label addr=0x%lx: mmu hasn't mapped virt->phys, "
-                "i.e., it isnt actually there.\n", addr +i);
-            continue;
-        }
-        //taint2_label_ram(pa, label);
-        printf("taint2: adding single taint label %lu\n", label);
-        label_byte(cpu, addr+i, label);
-    }
+    printf("taint2: adding single taint label %lu to %u bytes\n", label, length);
+    uint32_t n = taint2_label_ram_range(cpu, addr, length, label, false);
+    report_range_labeled(addr, length, n);
 }
 
 uint32_t taint2_query(Addr a) {
@@ -260,7 +354,7 @@ uint64_t taint2_query_cb_mask(Addr a, uint8_t size) {
 }
 
 uint32_t taint2_num_labels_applied(void) {
-    return labels_applied.size();
+    return num_labels_applied;
 }
 
 void taint2_delete_ram(uint64_t pa) {
@@ -285,6 +379,29 @@ void taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, v
     tp_ls_iter(tp_labelset_get(make_greg(reg_num, offset)), app, stuff2);
 }
 
+uint32_t taint2_query_range(Addr a, uint32_t len) {
+    uint32_t num_tainted = 0;
+    for (uint32_t i = 0; i < len; i++, a.off++) {
+        num_tainted += (tp_labelset_get(a) != nullptr);
+    }
+    return num_tainted;
+}
+
+// Neighbouring bytes mostly share a label set, and unions are memoized, so
+// this is usually a few pointer compares per byte.
+uint32_t taint2_labelset_range_iter(Addr a, uint32_t len, int (*app)(uint32_t el, void *stuff1), void *stuff2) {
+    LabelSetP ls = nullptr;
+    uint32_t num_tainted = 0;
+    for (uint32_t i = 0; i < len; i++, a.off++) {
+        LabelSetP ls_at_a = tp_labelset_get(a);
+        if (ls_at_a == nullptr) continue;
+        num_tainted++;
+        ls = label_set_union(ls, ls_at_a);
+    }
+    if (app) tp_ls_iter(ls, app, stuff2);
+    return num_tainted;
+}
+
 void taint2_track_taint_state(void) {
     track_taint_state = true;
 }
@@ -323,8 +440,7 @@ Panda__TaintQuery *taint2_query_pandalog (Addr a, uint32_t offset) {
 
     LabelSetP ls = tp_labelset_get(a);
     if (ls) {
-        Panda__TaintQuery *tq = (Panda__TaintQuery *) malloc(sizeof(Panda__TaintQuery));
-        *tq = PANDA__TAINT_QUERY__INIT;
+        Panda__TaintQuery *tq = pandalog_new(Panda__TaintQuery, PANDA__TAINT_QUERY__INIT);
 
         // Returns true if insertion took place, i.e. we should plog this LS.
         if (ls_returned.insert(ls).second) {
@@ -333,12 +449,11 @@ Panda__TaintQuery *taint2_query_pandalog (Addr a, uint32_t offset) {
             // write out mapping from ls pointer to labelset contents
             // as its own separate log entry
             Panda__TaintQueryUniqueLabelSet *tquls =
-                (Panda__TaintQueryUniqueLabelSet *)
-                malloc (sizeof (Panda__TaintQueryUniqueLabelSet));
-            *tquls = PANDA__TAINT_QUERY_UNIQUE_LABEL_SET__INIT;
+                pandalog_new(Panda__TaintQueryUniqueLabelSet,
+                             PANDA__TAINT_QUERY_UNIQUE_LABEL_SET__INIT);
             tquls->ptr = (uint64_t) ls;
             tquls->n_label = ls ? ls->size() : 0;
-            tquls->label = (uint32_t *) malloc (sizeof(uint32_t) * tquls->n_label);
+            tquls->label = pandalog_new_array(uint32_t, tquls->n_label);
             el_arr_ind = 0;
             tp_ls_iter(ls, collect_query_labels_pandalog, (void *) tquls->label);
             tq->unique_label_set = tquls;
@@ -352,13 +467,9 @@ Panda__TaintQuery *taint2_query_pandalog (Addr a, uint32_t offset) {
     return nullptr;
 }
 
+// The query comes from pandalog_alloc and goes away with the next
+// pandalog_write_entry, so there is nothing left to do here.
 void pandalog_taint_query_free(Panda__TaintQuery *tq) {
-    if (tq->unique_label_set) {
-        if (tq->unique_label_set->label) {
-            free(tq->unique_label_set->label);
-        }
-        free(tq->unique_label_set);
-    }
 }
 
 extern bool taintEnabled;
@@ -14,6 +14,12 @@ void taint2_label_reg_additive(int reg_num, int offset, uint32_t l);
 void taint2_add_taint_ram_pos(CPUState *cpu, uint64_t addr, uint32_t length, uint32_t start_label);
 void taint2_add_taint_ram_single_label(CPUState *cpu, uint64_t addr,
     uint32_t length, long label);
+uint32_t taint2_label_ram_range(CPUState *cpu, target_ulong va, uint32_t len,
+    uint32_t l, bool positional);
+uint32_t taint2_query_ram_range(CPUState *cpu, target_ulong va, uint32_t len);
+void taint2_label_hd_range(uint64_t offset, uint32_t len, uint32_t l,
+    bool positional);
+uint32_t taint2_query_hd_range(uint64_t offset, uint32_t len);
 void taint2_delete_ram(uint64_t pa);
 void taint2_delete_reg(int reg_num, int offset);
 
@@ -38,6 +44,8 @@ uint64_t taint2_query_cb_mask(Addr a, uint8_t size);
 
 void taint2_labelset_addr_iter(Addr addr, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void taint2_labelset_ram_iter(uint64_t pa, int (*app)(uint32_t el, void *stuff1), void *stuff2);
+uint32_t taint2_query_range(Addr a, uint32_t len);
+uint32_t taint2_labelset_range_iter(Addr a, uint32_t len, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void taint2_labelset_llvm_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 
@@ -32,6 +32,8 @@ PANDAENDCOMMENT */
 #include "taint_ops.h"
 
 uint64_t labelset_count;
+// taint ops run by the mapped functions below, for taint2 stats
+uint64_t taint_ops_count;
 
 extern "C" {
 
@@ -92,6 +94,7 @@ void taint_copy(
         FastShad *shad_dest, uint64_t dest,
         FastShad *shad_src, uint64_t src,
         uint64_t size, llvm::Instruction *I) {
+    taint_ops_count++;
     if (unlikely(src >= shad_src->get_size() || dest >= shad_dest->get_size())) {
         taint_log("  Ignoring IO RW\n");
         return;
@@ -111,6 +114,7 @@ void taint_parallel_compute(
         uint64_t dest, uint64_t ignored,
         uint64_t src1, uint64_t src2, uint64_t src_size,
         llvm::Instruction *I) {
+    taint_ops_count++;
     uint64_t shad_size = shad->get_size();
     if (unlikely(dest >= shad_size || src1 >= shad_size || src2 >= shad_size)) {
         taint_log("  Ignoring IO RW\n");
@@ -179,6 +183,7 @@ void taint_mix_compute(
         uint64_t dest, uint64_t dest_size,
         uint64_t src1, uint64_t src2, uint64_t src_size,
         llvm::Instruction *ignored) {
+    taint_ops_count++;
     TaintData td = TaintData::make_union(
             mixed_labels(shad, src1, src_size, false),
             mixed_labels(shad, src2, src_size, false),
@@ -190,6 +195,7 @@ void taint_mix_compute(
 }
 
 void taint_delete(FastShad *shad, uint64_t dest, uint64_t size) {
+    taint_ops_count++;
     taint_log("remove: %s[%lx+%lx]\n", shad->name(), dest, size);
     if (unlikely(dest >= shad->get_size())) {
         taint_log("Ignoring IO RW\n");
@@ -201,6 +207,7 @@ void taint_delete(FastShad *shad, uint64_t dest, uint64_t size) {
 void taint_set(
         FastShad *shad_dest, uint64_t dest, uint64_t dest_size,
         FastShad *shad_src, uint64_t src) {
+    taint_ops_count++;
     bulk_set(shad_dest, dest, dest_size, shad_src->query_full(src));
 }
 
@@ -209,6 +216,7 @@ void taint_mix(
         uint64_t dest, uint64_t dest_size,
         uint64_t src, uint64_t src_size,
         llvm::Instruction *I) {
+    taint_ops_count++;
     TaintData td = mixed_labels(shad, src, src_size, true);
     bulk_set(shad, dest, dest_size, td);
     taint_log("mix: %s[%lx+%lx] <- %lx+%lx ",
@@ -231,6 +239,7 @@ void taint_pointer(
         FastShad *shad_ptr, uint64_t ptr, uint64_t ptr_size,
         FastShad *shad_src, uint64_t src, uint64_t size, 
         uint64_t is_store) {
+    taint_ops_count++;
     taint_log("ptr: %s[%lx+%lx] <- %s[%lx] @ %s[%lx+%lx]\n",
             shad_dest->name(), dest, size,
             shad_src->name(), src, shad_ptr->name(), ptr, ptr_size);
@@ -266,6 +275,7 @@ void taint_pointer(
 }
 
 void taint_sext(FastShad *shad, uint64_t dest, uint64_t dest_size, uint64_t src, uint64_t src_size) {
+    taint_ops_count++;
     taint_log("taint_sext\n");
     FastShad::copy(shad, dest, shad, src, src_size);
     bulk_set(shad, dest + src_size, dest_size - src_size,
@@ -277,6 +287,7 @@ void taint_select(
         FastShad *shad,
         uint64_t dest, uint64_t size, uint64_t selector,
         ...) {
+    taint_ops_count++;
     va_list argp;
     uint64_t src, srcsel;
 
@@ -344,6 +355,7 @@ void taint_host_copy(
         FastShad *llv, uint64_t llv_offset,
         FastShad *greg, FastShad *gspec,
         uint64_t size, uint64_t labels_per_reg, bool is_store) {
+    taint_ops_count++;
     int64_t offset = addr - env_ptr;
     if (is_irrelevant(offset)) {
         // Irrelevant
@@ -376,6 +388,7 @@ void taint_host_memcpy(
         uint64_t env_ptr, uint64_t dest, uint64_t src,
         FastShad *greg, FastShad *gspec,
         uint64_t size, uint64_t labels_per_reg) {
+    taint_ops_count++;
     int64_t dest_offset = dest - env_ptr, src_offset = src - env_ptr;
     if (dest_offset < 0 || (size_t)dest_offset >= sizeof(CPUArchState) || 
             src_offset < 0 || (size_t)src_offset >= sizeof(CPUArchState)) {
@@ -402,6 +415,7 @@ void taint_host_delete(
         uint64_t env_ptr, uint64_t dest_addr,
         FastShad *greg, FastShad *gspec,
         uint64_t size, uint64_t labels_per_reg) {
+    taint_ops_count++;
     int64_t offset = dest_addr - env_ptr;
 
     if (offset < 0 || (size_t)offset >= sizeof(CPUArchState)) {
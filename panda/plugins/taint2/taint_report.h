@@ -0,0 +1,94 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __TAINT_REPORT_H_
+#define __TAINT_REPORT_H_
+
+// Accumulators for plugins that summarize taint over a whole replay, like
+// tainted_branch and tainted_instr. These get updated on every tainted
+// branch or instruction, so they avoid ordered containers; only the final
+// report is sorted.
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// A count per taint label. Labels are usually positions in an input file,
+// so they are small and dense and index straight into an array. The odd
+// huge label goes in a hash table instead.
+class LabelCounter {
+    static const uint32_t max_dense = 1 << 26;
+    std::vector<uint64_t> dense;
+    std::unordered_map<uint32_t, uint64_t> sparse;
+
+public:
+    void inc(uint32_t l) {
+        if (l >= max_dense) {
+            sparse[l]++;
+            return;
+        }
+        if (l >= dense.size()) {
+            dense.resize(std::min<size_t>(max_dense,
+                        std::max<size_t>(l + 1, 2 * dense.size())));
+        }
+        dense[l]++;
+    }
+
+    uint64_t get(uint32_t l) const {
+        if (l < dense.size()) return dense[l];
+        auto it = sparse.find(l);
+        return it == sparse.end() ? 0 : it->second;
+    }
+
+    // For taint2_labelset_*_iter, with the LabelCounter as stuff.
+    static int inc_iter(uint32_t l, void *stuff) {
+        static_cast<LabelCounter *>(stuff)->inc(l);
+        return 0;
+    }
+};
+
+// The set of PCs seen in each address space.
+class AsidPcSet {
+    typedef std::unordered_set<uint64_t> PcSet;
+    std::unordered_map<uint64_t, PcSet> pcs;
+    // Consecutive inserts are nearly always for the same ASID.
+    uint64_t last_asid = 0;
+    PcSet *last = nullptr;
+
+public:
+    void insert(uint64_t asid, uint64_t pc) {
+        if (last == nullptr || asid != last_asid) {
+            last = &pcs[asid];
+            last_asid = asid;
+        }
+        last->insert(pc);
+    }
+
+    // All (asid, pc) pairs, in order.
+    std::vector<std::pair<uint64_t, uint64_t>> sorted() const {
+        std::vector<std::pair<uint64_t, uint64_t>> res;
+        for (auto &kvp : pcs) {
+            for (uint64_t pc : kvp.second) {
+                res.push_back(std::make_pair(kvp.first, pc));
+            }
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+};
+
+#endif
@@ -24,6 +24,7 @@ PANDAENDCOMMENT */
 
 #include "taint2/label_set.h"
 #include "taint2/taint2.h"
+#include "taint2/taint_report.h"
 
 extern "C" {
 #include "panda/rr/rr_log.h"
@@ -59,27 +60,18 @@ void uninit_plugin(void *);
 bool summary = false;
 bool liveness = false;
 
-#include <map>
-#include <set>
-
-// map from asid -> pc
-std::map<uint64_t,std::set<uint64_t>> tainted_branch;
+// asid -> pcs of tainted branches
+AsidPcSet tainted_branch;
 
 
 // a taint label is just a uint32
 typedef uint32_t Tlabel;
 
 // liveness[pos] is # of branches byte pos in file was used to decide up to this point
-std::map <Tlabel, uint64_t> liveness_map;
+LabelCounter liveness_map;
 
 uint64_t get_liveness(Tlabel l) {
-    return liveness_map[l];
-}
-
-// keep track of number of branches each label involved in
-int taint_branch_aux(Tlabel ln, void *stuff) {
-    liveness_map[ln] ++;
-    return 0; // continue iter
+    return liveness_map.get(l);
 }
 
 
@@ -87,32 +79,23 @@ void tbranch_on_branch_taint2(Addr a, uint64_t size) {
     if (pandalog) {
         // a is an llvm reg
         assert (a.typ == LADDR);
-        // count number of tainted bytes on this reg
-        uint32_t num_tainted = 0;
-        Addr ao = a;
-        for (uint32_t o=0; o<size; o++) {
-            ao.off = o;
-            num_tainted += (taint2_query(ao) != 0);
-        }
+        // count number of tainted bytes on this reg and, if we want
+        // liveness, bump the count of every input byte it derives from
+        uint32_t num_tainted = liveness
+            ? taint2_labelset_range_iter(a, size, LabelCounter::inc_iter, &liveness_map)
+            : taint2_query_range(a, size);
         if (num_tainted > 0) {
-            if (liveness) {
-                // update liveness info for all input bytes from which lval derives
-                for (uint32_t o=0; o<size; o++) {
-                    ao.off = o;
-                    taint2_labelset_addr_iter(a, taint_branch_aux, NULL);
-                }        
-            }
             if (summary) {
                 CPUState *cpu = first_cpu;
                 target_ulong asid = panda_current_asid(cpu);
-                tainted_branch[asid].insert(panda_current_pc(cpu));
+                tainted_branch.insert(asid, panda_current_pc(cpu));
             }
             else {
-                Panda__TaintedBranch *tb = (Panda__TaintedBranch *) malloc(sizeof(Panda__TaintedBranch));
-                *tb = PANDA__TAINTED_BRANCH__INIT;
+                Panda__TaintedBranch *tb = pandalog_new(Panda__TaintedBranch,
+                                                        PANDA__TAINTED_BRANCH__INIT);
                 tb->call_stack = pandalog_callstack_create();
                 tb->n_taint_query = num_tainted;
-                tb->taint_query = (Panda__TaintQuery **) malloc (sizeof (Panda__TaintQuery *) * num_tainted);
+                tb->taint_query = pandalog_new_array(Panda__TaintQuery *, num_tainted);
                 uint32_t i=0;
                 for (uint32_t o=0; o<size; o++) {
                     Addr ao = a;
@@ -124,11 +107,6 @@ void tbranch_on_branch_taint2(Addr a, uint64_t size) {
                 Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
                 ple.tainted_branch = tb;
                 pandalog_write_entry(&ple);
-                pandalog_callstack_free(tb->call_stack);
-                for (uint32_t i=0; i<num_tainted; i++) {
-                    pandalog_taint_query_free(tb->taint_query[i]);
-                }
-                free(tb);
             }
         }
     }
@@ -162,16 +140,13 @@ bool init_plugin(void *self) {
 void uninit_plugin(void *self) {
     if (summary) {
         Panda__TaintedBranchSummary *tbs = (Panda__TaintedBranchSummary *) malloc(sizeof(Panda__TaintedBranchSummary));
-        for (auto kvp : tainted_branch) {
-            uint64_t asid = kvp.first;
-            for (auto pc : kvp.second) {
-                *tbs = PANDA__TAINTED_BRANCH_SUMMARY__INIT;
-                tbs->asid = asid;
-                tbs->pc = pc;
-                Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-                ple.tainted_branch_summary = tbs;
-                pandalog_write_entry(&ple);
-            }
+        for (auto kvp : tainted_branch.sorted()) {
+            *tbs = PANDA__TAINTED_BRANCH_SUMMARY__INIT;
+            tbs->asid = kvp.first;
+            tbs->pc = kvp.second;
+            Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+            ple.tainted_branch_summary = tbs;
+            pandalog_write_entry(&ple);
         }
         free(tbs);
     }    
@@ -22,6 +22,7 @@ extern "C" {
 #include "panda/plugin.h"
 
 #include "taint2/taint2.h"
+#include "taint2/taint_report.h"
 
 extern "C" {
 #include "taint2/taint2_ext.h"
@@ -50,11 +51,8 @@ uint64_t num_tainted_instr = 0;
 uint64_t num_tainted_instr_observed = 0;
 bool replay_ended = false;
 
-#include <map>
-#include <set>
-
-// map from asid -> pc
-std::map<uint64_t,std::set<uint64_t>> tainted_instr;
+// asid -> pcs of tainted instructions
+AsidPcSet tainted_instr;
 
 target_ulong last_asid = 0;
 target_ulong last_pc = 0;
@@ -73,22 +71,18 @@ void taint_change(Addr a, uint64_t size) {
     CPUState *env = first_cpu; // cpu_single_env;
     target_ulong asid = panda_current_asid(env);
     target_ulong pc = panda_current_pc(env);
-    uint32_t num_tainted = 0;
-    for (uint32_t i=0; i<size; i++) {
-        a.off = i;
-        num_tainted += (taint2_query(a) != 0);
-    }
+    uint32_t num_tainted = taint2_query_range(a, size);
     if (num_tainted > 0) {            
         if (summary) {
-            tainted_instr[asid].insert(pc);
+            tainted_instr.insert(asid, pc);
         }
         else {
             if (pandalog) {
-                Panda__TaintedInstr *ti = (Panda__TaintedInstr *) malloc(sizeof(Panda__TaintedInstr));
-                *ti = PANDA__TAINTED_INSTR__INIT;
+                Panda__TaintedInstr *ti = pandalog_new(Panda__TaintedInstr,
+                                                       PANDA__TAINTED_INSTR__INIT);
                 ti->call_stack = pandalog_callstack_create();
                 ti->n_taint_query = num_tainted;
-                ti->taint_query = (Panda__TaintQuery **) malloc (sizeof(Panda__TaintQuery *) * num_tainted);
+                ti->taint_query = pandalog_new_array(Panda__TaintQuery *, num_tainted);
                 uint32_t j = 0;
                 for (uint32_t i=0; i<size; i++) {
                     a.off = i;
@@ -101,11 +95,6 @@ void taint_change(Addr a, uint64_t size) {
                 if (pandalog) {
                     pandalog_write_entry(&ple);
                 }
-                pandalog_callstack_free(ti->call_stack);
-                for (uint32_t i=0; i<num_tainted; i++) {
-                    pandalog_taint_query_free(ti->taint_query[i]);
-                }
-                free(ti);
             }
             else {
                 printf ("  pc = 0x%" PRIx64 "\n", (uint64_t) pc);
@@ -152,22 +141,25 @@ bool init_plugin(void *self) {
 void uninit_plugin(void *self) {
     if (summary) {
         Panda__TaintedInstrSummary *tis = (Panda__TaintedInstrSummary *) malloc (sizeof (Panda__TaintedInstrSummary));
-        for (auto kvp : tainted_instr) {
+        bool first = true;
+        uint64_t last_asid = 0;
+        for (auto kvp : tainted_instr.sorted()) {
             uint64_t asid = kvp.first;
-            if (!pandalog) 
+            uint64_t pc = kvp.second;
+            if (!pandalog && (first || asid != last_asid))
                 printf ("tainted_instr: asid=0x%" PRIx64 "\n", asid);
-            for (auto pc : kvp.second) {
-                if (pandalog) {
-                    *tis = PANDA__TAINTED_INSTR_SUMMARY__INIT;
-                    tis->asid = asid;
-                    tis->pc = pc;
-                    Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
-                    ple.tainted_instr_summary = tis;
-                    pandalog_write_entry(&ple);
-                }
-                else {
-                    printf ("  pc=0x%" PRIx64 "\n", (uint64_t) pc);
-                }
+            first = false;
+            last_asid = asid;
+            if (pandalog) {
+                *tis = PANDA__TAINTED_INSTR_SUMMARY__INIT;
+                tis->asid = asid;
+                tis->pc = pc;
+                Panda__LogEntry ple = PANDA__LOG_ENTRY__INIT;
+                ple.tainted_instr_summary = tis;
+                pandalog_write_entry(&ple);
+            }
+            else {
+                printf ("  pc=0x%" PRIx64 "\n", (uint64_t) pc);
             }
         }
         free(tis);
@@ -54,21 +54,19 @@ bool done_labeling = false;
 
 void *plugin_self;
 
-// turn on taint at right instr count
-int tstringsearch_enable_taint(CPUState *env, target_ulong pc) {
-    // enable taint if close to instruction count
-    uint64_t ic = rr_get_guest_instr_count();
+// turn on taint at right instr count (a deadline), or with no first_instr
+// once there's something to label
+static void tstringsearch_enable_taint(CPUState *env, uint64_t ic, void *opaque) {
     if (!taint2_enabled()) {
-        if (ic + 100 > enable_taint_instr_count) {
-            printf ("enabling taint at instr count %" PRIu64 "\n", ic);
-            taint2_enable_taint();           
-        }
+        printf ("enabling taint at instr count %" PRIu64 "\n", ic);
+        taint2_enable_taint();           
     }
-    return 0;
 }
 
 int tstringsearch_label(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size) {
-    tstringsearch_enable_taint(env, pc);
+    if (enable_taint_instr_count == 0) {
+        tstringsearch_enable_taint(env, rr_get_guest_instr_count(), NULL);
+    }
 
     if (tstringsearch_label_on == false) {
         return 0;
@@ -183,6 +181,11 @@ bool init_plugin(void *self) {
     // this sets up the taint api fn ptrs so we have access
     assert(init_taint2_api());
 
+    if (enable_taint_instr_count > 0) {
+        panda_deadline_add(self, enable_taint_instr_count,
+                           tstringsearch_enable_taint, NULL);
+    }
+
     // register the tstringsearch_match fn to be called at the on_ssm site within panda_stringsearch
     PPP_REG_CB("stringsearch", on_ssm, tstringsearch_match) ;
 
@@ -68,25 +68,35 @@ void on_free_osimodules(OsiModules *ms);
 // a 32-bit OS will run on x86_64-softmmu
 #define PTR uint32_t
 
+// Spans of the kernel objects that cover every field we use, so that each
+// object is fetched with a single panda_guest_obj_read.
+#define EPROC_SPAN         (EPROC_PEB_OFF + sizeof(PTR))
+#define LDR_SPAN           (LDR_BASENAME_OFF + USTR_SIZE)
+#define USTR_SIZE          8     // _UNICODE_STRING
+#define USTR_LEN_OFF       0x0   // _UNICODE_STRING.Length
+#define USTR_BUF_OFF       0x4   // _UNICODE_STRING.Buffer
+
 static inline char * make_pagedstr() {
     char *m = (char *)malloc(8);
     strcpy(m, "(paged)");
     return m;
 }
 
-// Gets a unicode string. Does its own mem allocation.
+// Reads one guest pointer. Returns 0 if it isn't mapped.
+static inline PTR read_ptr(CPUState *cpu, PTR addr) {
+    uint8_t buf[sizeof(PTR)];
+    if (!panda_guest_obj_read(cpu, addr, buf, sizeof(buf))) return 0;
+    return panda_guest_get_u32(buf, 0);
+}
+
+// Decodes a unicode string from a local copy of its _UNICODE_STRING.
+// Does its own mem allocation.
 // Output is a null-terminated UTF8 string
-char * get_unicode_str(CPUState *cpu, PTR ustr) {
-    uint16_t size = 0;
-    PTR str_ptr = 0;
-    if (-1 == panda_virtual_memory_rw(cpu, ustr, (uint8_t *)&size, 2, false)) {
-        return make_pagedstr();
-    }
+static char * decode_unicode_str(CPUState *cpu, const uint8_t *ustr) {
+    uint16_t size = panda_guest_get_u16(ustr, USTR_LEN_OFF);
+    PTR str_ptr = panda_guest_get_u32(ustr, USTR_BUF_OFF);
     // Clamp size
     if (size > 1024) size = 1024;
-    if (-1 == panda_virtual_memory_rw(cpu, ustr+4, (uint8_t *)&str_ptr, 4, false)) {
-        return make_pagedstr();
-    }
     gchar *in_str = (gchar *)g_malloc0(size);
     if (-1 == panda_virtual_memory_rw(cpu, str_ptr, (uint8_t *)in_str, size, false)) {
         g_free(in_str);
@@ -107,49 +117,40 @@ char * get_unicode_str(CPUState *cpu, PTR ustr) {
     return ret;
 }
 
+// Gets a unicode string. Does its own mem allocation.
+// Output is a null-terminated UTF8 string
+char * get_unicode_str(CPUState *cpu, PTR ustr) {
+    uint8_t buf[USTR_SIZE];
+    if (!panda_guest_obj_read(cpu, ustr, buf, sizeof(buf))) {
+        return make_pagedstr();
+    }
+    return decode_unicode_str(cpu, buf);
+}
+
 // Process introspection
 static PTR get_next_proc(CPUState *cpu, PTR eproc) {
-    PTR next;
-    if (-1 == panda_virtual_memory_rw(cpu, eproc+EPROC_LINKS_OFF, (uint8_t *)&next, sizeof(PTR), false)) 
-        return 0;
+    PTR next = read_ptr(cpu, eproc+EPROC_LINKS_OFF);
+    if (!next) return 0;
     next -= EPROC_LINKS_OFF;
     return next;
 }
 
 static PTR get_pid(CPUState *cpu, PTR eproc) {
-    PTR pid;
-    panda_virtual_memory_rw(cpu, eproc+EPROC_PID_OFF, (uint8_t *)&pid, sizeof(PTR), false);
-    return pid;
-}
-
-static PTR get_ppid(CPUState *cpu, PTR eproc) {
-    PTR ppid;
-    panda_virtual_memory_rw(cpu, eproc+EPROC_PPID_OFF, (uint8_t *)&ppid, sizeof(PTR), false);
-    return ppid;
-}
-
-static PTR get_dtb(CPUState *cpu, PTR eproc) {
-    PTR dtb;
-    panda_virtual_memory_rw(cpu, eproc+EPROC_DTB_OFF, (uint8_t *)&dtb, sizeof(PTR), false);
-    return dtb;
-}
-
-// *must* be called on a buffer of size 17 or greater
-static void get_procname(CPUState *cpu, PTR eproc, char *name) {
-    panda_virtual_memory_rw(cpu, eproc+EPROC_NAME_OFF, (uint8_t *)name, 16, false);
-    name[16] = '\0';
+    return read_ptr(cpu, eproc+EPROC_PID_OFF);
 }
 
 // XXX: this will have to change for 64-bit
 static PTR get_kpcr(CPUState *cpu) {
     // Read the kernel-mode FS segment base
+    uint8_t desc[8];
     uint32_t e1, e2;
     PTR fs_base;
 
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
     // Read out the two 32-bit ints that make up a segment descriptor
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS, (uint8_t *)&e1, sizeof(PTR), false);
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS + 4, (uint8_t *)&e2, sizeof(PTR), false);
+    panda_guest_obj_read(cpu, env->gdt.base + KMODE_FS, desc, sizeof(desc));
+    e1 = panda_guest_get_u32(desc, 0);
+    e2 = panda_guest_get_u32(desc, 4);
 
     // Turn wacky segment into base
     fs_base = (e1 >> 16) | ((e2 & 0xff) << 16) | (e2 & 0xff000000);
@@ -160,17 +161,15 @@ static PTR get_kpcr(CPUState *cpu) {
 static PTR get_kdbg(CPUState *cpu) {
     PTR kpcr = get_kpcr(cpu);
     PTR kdversion, kddl, kddlp;
-    if (-1 == panda_virtual_memory_rw(cpu, kpcr+KPCR_KDVERSION_OFF, (uint8_t *)&kdversion, sizeof(PTR), false)) {
+    if (!(kdversion = read_ptr(cpu, kpcr+KPCR_KDVERSION_OFF))) {
         return 0;
     }
     // DebuggerDataList is a pointer to a pointer to the _KDDEBUGGER_DATA64
     // So we need to dereference it twice.
-    if (-1 == panda_virtual_memory_rw(cpu, kdversion+KDVERSION_DDL_OFF, (uint8_t *)&kddlp, sizeof(PTR), false)) {
-        return 0;
-    }
-    if (-1 == panda_virtual_memory_rw(cpu, kddlp, (uint8_t *)&kddl, sizeof(PTR), false)) {
+    if (!(kddlp = read_ptr(cpu, kdversion+KDVERSION_DDL_OFF))) {
         return 0;
     }
+    kddl = read_ptr(cpu, kddlp);
     return kddl;
 }
 
@@ -179,71 +178,49 @@ static PTR get_current_proc(CPUState *cpu) {
     PTR kpcr = get_kpcr(cpu);
 
     // Read KPCR->CurrentThread->Process
-    panda_virtual_memory_rw(cpu, kpcr+KPCR_CURTHREAD_OFF, (uint8_t *)&thread, sizeof(PTR), false);
-    panda_virtual_memory_rw(cpu, thread+KTHREAD_KPROC_OFF, (uint8_t *)&proc, sizeof(PTR), false);
+    thread = read_ptr(cpu, kpcr+KPCR_CURTHREAD_OFF);
+    proc = read_ptr(cpu, thread+KTHREAD_KPROC_OFF);
 
     return proc;
 }
 
-static bool is_valid_process(CPUState *cpu, PTR eproc) {
-    uint8_t type;
-    uint8_t size;
-
-    panda_virtual_memory_rw(cpu, eproc+EPROC_TYPE_OFF, (uint8_t *)&type, 1, false);
-    panda_virtual_memory_rw(cpu, eproc+EPROC_SIZE_OFF, (uint8_t *)&size, 1, false);
-
-    return (type == EPROC_TYPE && size == EPROC_SIZE);
+static bool is_valid_process(const uint8_t *ep) {
+    return (panda_guest_get_u8(ep, EPROC_TYPE_OFF) == EPROC_TYPE &&
+            panda_guest_get_u8(ep, EPROC_SIZE_OFF) == EPROC_SIZE);
 }
 
 // Module stuff
-static const char *get_mod_basename(CPUState *cpu, PTR mod) {
-    return get_unicode_str(cpu, mod+LDR_BASENAME_OFF);
-}
-
-static const char *get_mod_filename(CPUState *cpu, PTR mod) {
-    return get_unicode_str(cpu, mod+LDR_FILENAME_OFF);
-}
-
-static PTR get_mod_base(CPUState *cpu, PTR mod) {
-    PTR base;
-    panda_virtual_memory_rw(cpu, mod+LDR_BASE_OFF, (uint8_t *)&base, sizeof(PTR), false);
-    return base;
-}
-
-static PTR get_mod_size(CPUState *cpu, PTR mod) {
-    uint32_t size;
-    panda_virtual_memory_rw(cpu, mod+LDR_SIZE_OFF, (uint8_t *)&size, sizeof(uint32_t), false);
-    return size;
-}
-
 static PTR get_next_mod(CPUState *cpu, PTR mod) {
-    PTR next;
-    if (-1 == panda_virtual_memory_rw(cpu, mod+LDR_LOAD_LINKS_OFF, (uint8_t *)&next, sizeof(PTR), false))
-        return 0;
+    PTR next = read_ptr(cpu, mod+LDR_LOAD_LINKS_OFF);
+    if (!next) return 0;
     next -= LDR_LOAD_LINKS_OFF;
     return next;
 }
 
-static void fill_osiproc(CPUState *cpu, OsiProc *p, PTR eproc) {
+// ep is a local copy of the first EPROC_SPAN bytes of the _EPROCESS.
+static void fill_osiproc(OsiProc *p, PTR eproc, const uint8_t *ep) {
     p->offset = eproc;
     char *name = (char *)malloc(17);
-    get_procname(cpu, eproc, name);
+    memcpy(name, ep+EPROC_NAME_OFF, 16);
+    name[16] = '\0';
     p->name = name;
-    p->asid = get_dtb(cpu, eproc);
+    p->asid = panda_guest_get_u32(ep, EPROC_DTB_OFF);
     p->pages = NULL;
-    p->pid = get_pid(cpu, eproc);
-    p->ppid = get_ppid(cpu, eproc);
+    p->pid = panda_guest_get_u32(ep, EPROC_PID_OFF);
+    p->ppid = panda_guest_get_u32(ep, EPROC_PPID_OFF);
 }
 
 static void fill_osimod(CPUState *cpu, OsiModule *m, PTR mod) {
+    uint8_t ldr[LDR_SPAN];
+    panda_guest_obj_read(cpu, mod, ldr, sizeof(ldr));
     m->offset = mod;
-    m->file = (char *)get_mod_filename(cpu, mod);
-    m->base = get_mod_base(cpu, mod);
-    m->size = get_mod_size(cpu, mod);
-    m->name = (char *)get_mod_basename(cpu, mod);
+    m->file = decode_unicode_str(cpu, ldr+LDR_FILENAME_OFF);
+    m->base = panda_guest_get_u32(ldr, LDR_BASE_OFF);
+    m->size = panda_guest_get_u32(ldr, LDR_SIZE_OFF);
+    m->name = decode_unicode_str(cpu, ldr+LDR_BASENAME_OFF);
 }
 
-static void add_proc(CPUState *cpu, OsiProcs *ps, PTR eproc) {
+static void add_proc(OsiProcs *ps, PTR eproc, const uint8_t *ep) {
     static uint32_t capacity = 16;
     if (ps->proc == NULL) {
         ps->proc = (OsiProc *)malloc(sizeof(OsiProc) * capacity);
@@ -254,7 +231,7 @@ static void add_proc(CPUState *cpu, OsiProcs *ps, PTR eproc) {
     }
 
     OsiProc *p = &ps->proc[ps->num++];
-    fill_osiproc(cpu, p, eproc);
+    fill_osiproc(p, eproc, ep);
 }
 
 static void add_mod(CPUState *cpu, OsiModules *ms, PTR mod) {
@@ -274,7 +251,9 @@ static void add_mod(CPUState *cpu, OsiModules *ms, PTR mod) {
 void on_get_current_process(CPUState *cpu, OsiProc **out_p) {
     OsiProc *p = (OsiProc *) malloc(sizeof(OsiProc));
     PTR eproc = get_current_proc(cpu);
-    fill_osiproc(cpu, p, eproc);
+    uint8_t ep[EPROC_SPAN];
+    panda_guest_obj_read(cpu, eproc, ep, sizeof(ep));
+    fill_osiproc(p, eproc, ep);
     *out_p = p;
 }
 
@@ -293,14 +272,17 @@ void on_get_processes(CPUState *cpu, OsiProcs **out_ps) {
     ps->proc = NULL;
 
     do {
+        uint8_t ep[EPROC_SPAN];
+        panda_guest_obj_read(cpu, current, ep, sizeof(ep));
         // One of these will be the loop head,
         // which we don't want to include
-        if (is_valid_process(cpu, current)) {
-            add_proc(cpu, ps, current);
+        if (is_valid_process(ep)) {
+            add_proc(ps, current, ep);
         }
 
-        current = get_next_proc(cpu, current);
+        current = panda_guest_get_u32(ep, EPROC_LINKS_OFF);
         if (!current) break;
+        current -= EPROC_LINKS_OFF;
     } while (current != first);
 
     *out_ps = ps;
@@ -329,8 +311,8 @@ void on_get_libraries(CPUState *cpu, OsiProc *p, OsiModules **out_ms) {
     ms->module = NULL;
     PTR peb = 0, ldr = 0;
     // PEB->Ldr->InMemoryOrderModuleList
-    if (-1 == panda_virtual_memory_rw(cpu, eproc+EPROC_PEB_OFF, (uint8_t *)&peb, sizeof(PTR), false) ||
-        -1 == panda_virtual_memory_rw(cpu, peb+PEB_LDR_OFF, (uint8_t *)&ldr, sizeof(PTR), false)) {
+    if (!(peb = read_ptr(cpu, eproc+EPROC_PEB_OFF)) ||
+        !(ldr = read_ptr(cpu, peb+PEB_LDR_OFF))) {
         *out_ms = NULL; return;
     }
 
@@ -358,7 +340,7 @@ void on_get_modules(CPUState *cpu, OsiModules **out_ms) {
     ms->module = NULL;
     PTR PsLoadedModuleList;
     // Dbg.PsLoadedModuleList
-    if (-1 == panda_virtual_memory_rw(cpu, kdbg+KDBG_PSLML, (uint8_t *)&PsLoadedModuleList, sizeof(PTR), false)) {
+    if (!(PsLoadedModuleList = read_ptr(cpu, kdbg+KDBG_PSLML))) {
         *out_ms = NULL;
         return;
     }
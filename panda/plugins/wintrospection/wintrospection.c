@@ -43,33 +43,42 @@ void uninit_plugin(void *);
 #define EPROC_PID_OFF      0x0b4
 #define EPROC_NAME_OFF     0x16c
 
+// All reads go through panda_guest_obj_read, so looking up the same thing
+// again before the guest moves on (e.g. get_current_proc from several
+// callbacks on one block) doesn't touch the page tables.
+static inline uint32_t read_u32(CPUState *cpu, uint32_t addr) {
+    uint8_t buf[4];
+    panda_guest_obj_read(cpu, addr, buf, sizeof(buf));
+    return panda_guest_get_u32(buf, 0);
+}
+
 uint32_t get_pid(CPUState *cpu, uint32_t eproc) {
-    uint32_t pid;
-    panda_virtual_memory_rw(cpu, eproc+EPROC_PID_OFF, (uint8_t *)&pid, 4, false);
-    return pid;
+    return read_u32(cpu, eproc+EPROC_PID_OFF);
 }
 
 void get_procname(CPUState *cpu, uint32_t eproc, char *name) {
-    panda_virtual_memory_rw(cpu, eproc+EPROC_NAME_OFF, (uint8_t *)name, 16, false);
+    panda_guest_obj_read(cpu, eproc+EPROC_NAME_OFF, name, 16);
     name[16] = '\0';
 }
 
 uint32_t get_current_proc(CPUState *cpu) {
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
     // Read the kernel-mode FS segment base
+    uint8_t desc[8];
     uint32_t e1, e2;
     uint32_t fs_base, thread, proc;
 
     // Read out the two 32-bit ints that make up a segment descriptor
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS, (uint8_t *)&e1, 4, false);
-    panda_virtual_memory_rw(cpu, env->gdt.base + KMODE_FS + 4, (uint8_t *)&e2, 4, false);
+    panda_guest_obj_read(cpu, env->gdt.base + KMODE_FS, desc, sizeof(desc));
+    e1 = panda_guest_get_u32(desc, 0);
+    e2 = panda_guest_get_u32(desc, 4);
 
     // Turn wacky segment into base
     fs_base = (e1 >> 16) | ((e2 & 0xff) << 16) | (e2 & 0xff000000);
 
     // Read KPCR->CurrentThread->Process
-    panda_virtual_memory_rw(cpu, fs_base+KPCR_CURTHREAD_OFF, (uint8_t *)&thread, 4, false);
-    panda_virtual_memory_rw(cpu, thread+KTHREAD_KPROC_OFF, (uint8_t *)&proc, 4, false);
+    thread = read_u32(cpu, fs_base+KPCR_CURTHREAD_OFF);
+    proc = read_u32(cpu, thread+KTHREAD_KPROC_OFF);
 
     return proc;
 }
@@ -92,6 +101,9 @@ uint32_t get_current_proc(CPUState *cpu) {
 #define TABLE_MASK ~LEVEL_MASK
 #define ADDR_SIZE 4
 #define HANDLE_TABLE_ENTRY_SIZE 8
+#define OBJHDR_TYPE_OFF 0xc
+#define OBJHDR_SIZE 0x18
+#define USTR_SIZE 8
 
 
 // Win7 Obj Type Indices
@@ -142,9 +154,8 @@ typedef enum {
 
 
 static uint32_t handle_table_code(CPUState *cpu, uint32_t table_vaddr) {
-    uint32_t tableCode;
     // HANDLE_TABLE.TableCode is offest 0
-    panda_virtual_memory_rw(cpu, table_vaddr, (uint8_t *)&tableCode, 4, false);
+    uint32_t tableCode = read_u32(cpu, table_vaddr);
     return (tableCode & TABLE_MASK);
 }
 
@@ -184,7 +195,7 @@ static uint32_t handle_table_L3_entry(uint32_t table_vaddr, uint32_t L2_table, u
 uint32_t get_handle_table_entry(CPUState *cpu, uint32_t pHandleTable, uint32_t handle) {
     uint32_t tableCode, tableLevels;
     // get tablecode
-    panda_virtual_memory_rw(cpu, pHandleTable, (uint8_t *)&tableCode, 4, false);
+    tableCode = read_u32(cpu, pHandleTable);
     //printf ("tableCode = 0x%x\n", tableCode);
     // extract levels
     tableLevels = tableCode & LEVEL_MASK;
@@ -201,27 +212,25 @@ uint32_t get_handle_table_entry(CPUState *cpu, uint32_t pHandleTable, uint32_t h
     if (tableLevels == 1) {
         uint32_t L1_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L1_table_off = handle_table_L1_addr(cpu, pHandleTable, L1_index);
-        uint32_t L1_table;
-        panda_virtual_memory_rw(cpu, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        uint32_t L1_table = read_u32(cpu, L1_table_off);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L2_entry(pHandleTable, L1_table, index);
     }
     if (tableLevels == 2) {
         uint32_t L1_index = (handle & HANDLE_MASK3) >> HANDLE_SHIFT3;
         uint32_t L1_table_off = handle_table_L1_addr(cpu, pHandleTable, L1_index);
-        uint32_t L1_table;
-        panda_virtual_memory_rw(cpu, L1_table_off, (uint8_t *) &L1_table, 4, false);
+        uint32_t L1_table = read_u32(cpu, L1_table_off);
         uint32_t L2_index = (handle & HANDLE_MASK2) >> HANDLE_SHIFT2;
         uint32_t L2_table_off = handle_table_L2_addr(L1_table, L2_index);
-        uint32_t L2_table;
-        panda_virtual_memory_rw(cpu, L2_table_off, (uint8_t *) &L2_table, 4, false);
+        uint32_t L2_table = read_u32(cpu, L2_table_off);
         uint32_t index = (handle & HANDLE_MASK1) >> HANDLE_SHIFT1;
         pEntry = handle_table_L3_entry(pHandleTable, L2_table, index);
     }
-    uint32_t pObjectHeader;
-    if ((panda_virtual_memory_rw(cpu, pEntry, (uint8_t *) &pObjectHeader, 4, false)) == -1) {
+    uint8_t entry[4];
+    if (!panda_guest_obj_read(cpu, pEntry, entry, sizeof(entry))) {
         return 0;
     }
+    uint32_t pObjectHeader = panda_guest_get_u32(entry, 0);
     //  printf ("processHandle_to_pid pObjectHeader = 0x%x\n", pObjectHeader);
     pObjectHeader &= ~0x00000007;
 
@@ -237,15 +246,15 @@ static void unicode_to_ascii(char *uni, char *ascii, int len) {
 }
 
 char *read_unicode_string(CPUState *cpu, uint32_t pUstr) {
+    uint8_t ustr[USTR_SIZE];
     uint16_t fileNameLen;
     uint32_t fileNamePtr;
     char *fileName = (char *)calloc(1, 260);
     char fileNameUnicode[260*2] = {};
 
-    panda_virtual_memory_rw(cpu, pUstr,
-            (uint8_t *) &fileNameLen, 2, false);
-    panda_virtual_memory_rw(cpu, pUstr+4,
-            (uint8_t *) &fileNamePtr, 4, false);
+    panda_guest_obj_read(cpu, pUstr, ustr, sizeof(ustr));
+    fileNameLen = panda_guest_get_u16(ustr, 0);
+    fileNamePtr = panda_guest_get_u32(ustr, 4);
 
     if (fileNameLen > 259*2) {
         fileNameLen = 259*2;
@@ -258,10 +267,7 @@ char *read_unicode_string(CPUState *cpu, uint32_t pUstr) {
 
 
 char * get_objname(CPUState *cpu, uint32_t obj) {
-  uint32_t pObjectName;
-
-  panda_virtual_memory_rw(cpu, obj+OBJNAME_OFF,
-              (uint8_t *) &pObjectName, 4, false);
+  uint32_t pObjectName = read_u32(cpu, obj+OBJNAME_OFF);
   return read_unicode_string(cpu, pObjectName);
 }
 
@@ -272,25 +278,28 @@ char *get_file_obj_name(CPUState *cpu, uint32_t fobj) {
 
 #define FILE_OBJECT_POS_OFF 0x38
 int64_t get_file_obj_pos(CPUState *cpu, uint32_t fobj) {
-    int64_t file_pos = -1;
-    if (-1 == panda_virtual_memory_rw(cpu, fobj+FILE_OBJECT_POS_OFF, (uint8_t *)&file_pos, 8, false))
+    uint8_t pos[8];
+    if (!panda_guest_obj_read(cpu, fobj+FILE_OBJECT_POS_OFF, pos, sizeof(pos)))
         return -1;
     else
-        return file_pos;
+        return panda_guest_get_u64(pos, 0);
 }
 
 HandleObject *get_handle_object(CPUState *cpu, uint32_t eproc, uint32_t handle) {
-    uint32_t pObjectTable;
-    if (-1 == panda_virtual_memory_rw(cpu, eproc+EPROC_OBJTABLE_OFF, (uint8_t *)&pObjectTable, 4, false)) {
+    uint8_t table[4];
+    if (!panda_guest_obj_read(cpu, eproc+EPROC_OBJTABLE_OFF, table, sizeof(table))) {
         return NULL;
     }
+    uint32_t pObjectTable = panda_guest_get_u32(table, 0);
     uint32_t pObjHeader = get_handle_table_entry(cpu, pObjectTable, handle);
     if (pObjHeader == 0) return NULL;
-    uint32_t pObj = pObjHeader + 0x18;
-    uint8_t objType = 0;
-    if (-1 == panda_virtual_memory_rw(cpu, pObjHeader+0xc, &objType, 1, false)) {
+    uint32_t pObj = pObjHeader + OBJHDR_SIZE;
+    // _OBJECT_HEADER, which the object body follows
+    uint8_t hdr[OBJHDR_SIZE];
+    if (!panda_guest_obj_read(cpu, pObjHeader, hdr, sizeof(hdr))) {
         return NULL;
     }
+    uint8_t objType = panda_guest_get_u8(hdr, OBJHDR_TYPE_OFF);
     HandleObject *ho = (HandleObject *) malloc(sizeof(HandleObject));
     ho->objType = objType;
     ho->pObj = pObj;
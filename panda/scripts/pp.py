@@ -111,6 +111,7 @@ f = open(pproto_filename, "w")
 f.write ("""
 syntax = "proto2";
 package panda;
+option cc_enable_arenas = true;
 
 """)
 
@@ -40,7 +40,11 @@ outf.write(RRPACK_MAGIC)
 outf.write(struct.pack("<Q", num_guest_insns))
 outf.write("\0" * 16) # Placeholder for checksum
 outf.flush()
-subprocess.check_call(['tar', 'cJf', '-', base + '-rr-snp', base + '-rr-nondet.log'], stdout=outf)
+files = [base + '-rr-snp', base + '-rr-nondet.log']
+# Lazy snapshots keep guest RAM in a separate, sparse image
+if os.path.exists(base + '-rr-snp.ram'):
+    files.append(base + '-rr-snp.ram')
+subprocess.check_call(['tar', '-S', '-cJf', '-'] + files, stdout=outf)
 outf.close()
 
 print "Calculating checksum...",
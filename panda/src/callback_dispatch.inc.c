@@ -0,0 +1,251 @@
+/*
+ * PANDA callback dispatchers.
+ *
+ * Included twice by callback_support.c: once with PCB_CALL just making the
+ * call, and once with PCB_CALL also timing it into the callback's
+ * panda_cb_list node.  PCB_NAME gives each copy its own function names.
+ */
+
+// These are used in exec.c
+static void PCB_NAME(before_dma)(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
+    if (rr_mode == RR_REPLAY) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_DMA];
+             plist != NULL; plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
+        }
+    }
+}
+
+static void PCB_NAME(after_dma)(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
+    if (rr_mode == RR_REPLAY) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_DMA];
+             plist != NULL; plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
+        }
+    }
+}
+
+// These are used in rr_log.c, as the transfers recorded by device code are
+// replayed
+static void PCB_NAME(replay_hd_transfer)(CPUState *cpu, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_REPLAY_HD_TRANSFER];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.replay_hd_transfer(cpu, type, src_addr, dest_addr, num_bytes));
+    }
+}
+
+static void PCB_NAME(replay_net_transfer)(CPUState *cpu, uint32_t type, uint64_t src_addr, uint64_t dest_addr, uint32_t num_bytes) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_REPLAY_NET_TRANSFER];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.replay_net_transfer(cpu, type, src_addr, dest_addr, num_bytes));
+    }
+}
+
+static void PCB_NAME(replay_handle_packet)(CPUState *cpu, uint8_t *buf, int size, uint8_t direction, uint64_t old_buf_addr) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_REPLAY_HANDLE_PACKET];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.replay_handle_packet(cpu, buf, size, direction, old_buf_addr));
+    }
+}
+
+// These are used in cpu-exec.c
+static void PCB_NAME(before_block_exec)(CPUState *cpu, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.before_block_exec(cpu, tb));
+    }
+}
+
+
+static void PCB_NAME(after_block_exec)(CPUState *cpu, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.after_block_exec(cpu, tb));
+    }
+}
+
+
+static void PCB_NAME(before_block_translate)(CPUState *cpu, target_ulong pc) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.before_block_translate(cpu, pc));
+    }
+}
+
+
+static void PCB_NAME(after_block_translate)(CPUState *cpu, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE];
+         plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.after_block_translate(cpu, tb));
+    }
+}
+
+
+static bool PCB_NAME(after_find_fast)(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done, bool *invalidate) {
+    panda_cb_list *plist;
+    if (!bb_invalidate_done) {
+        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
+            plist != NULL; plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, *invalidate |=
+                plist->entry.before_block_exec_invalidate_opt(cpu, tb));
+        }
+        return true;
+    }
+    return false;
+}
+
+
+// These are used in target-i386/translate.c
+static bool PCB_NAME(insn_translate)(CPUState *env, target_ulong pc) {
+    panda_cb_list *plist;
+    bool panda_exec_cb = false;
+    if (!panda_gate_pc(env, pc)) return false;
+    // callbacks may emit probes (probe.c) for this insn
+    panda_probe_pc = pc;
+    panda_probe_translating = true;
+    for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, panda_exec_cb |= plist->entry.insn_translate(env, pc));
+    }
+    panda_probe_translating = false;
+    return panda_exec_cb;
+}
+
+// helper_impl.h
+static void PCB_NAME(insn_exec)(CPUState *env, target_ulong pc) {
+    panda_cb_list *plist;
+    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.insn_exec(env, pc));
+    }
+}
+
+// These are used in softmmu_template.h
+// ram_ptr is a possible pointer into host memory from the TLB code. Can be NULL.
+static void PCB_NAME(before_mem_read)(CPUState *env, target_ulong pc,
+                                      target_ulong addr, uint32_t data_size,
+                                      void *ram_ptr) {
+    panda_cb_list *plist;
+    if (panda_gate_on && !panda_gate_pc(env, env->panda_guest_pc)) return;
+    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
+                                                          data_size));
+    }
+    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
+        hwaddr paddr = get_paddr(env, addr, ram_ptr);
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.phys_mem_before_read(env, env->panda_guest_pc, paddr,
+                                                              data_size));
+        }
+    }
+}
+
+
+static void PCB_NAME(after_mem_read)(CPUState *env, target_ulong pc,
+                                     target_ulong addr, uint32_t data_size,
+                                     uint64_t result, void *ram_ptr) {
+    panda_cb_list *plist;
+    if (panda_gate_on && !panda_gate_pc(env, env->panda_guest_pc)) return;
+    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
+                                                         data_size, &result));
+    }
+    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
+        hwaddr paddr = get_paddr(env, addr, ram_ptr);
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
+                                                             data_size, &result));
+        }
+    }
+}
+
+
+static void PCB_NAME(before_mem_write)(CPUState *env, target_ulong pc,
+                                       target_ulong addr, uint32_t data_size,
+                                       uint64_t val, void *ram_ptr) {
+    panda_cb_list *plist;
+    if (panda_gate_on && !panda_gate_pc(env, env->panda_guest_pc)) return;
+    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
+                                                           data_size, &val));
+    }
+    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
+        hwaddr paddr = get_paddr(env, addr, ram_ptr);
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
+                                                               data_size, &val));
+        }
+    }
+}
+
+
+static void PCB_NAME(after_mem_write)(CPUState *env, target_ulong pc,
+                                      target_ulong addr, uint32_t data_size,
+                                      uint64_t val, void *ram_ptr) {
+    panda_cb_list *plist;
+    if (panda_gate_on && !panda_gate_pc(env, env->panda_guest_pc)) return;
+    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
+                                                          data_size, &val));
+    }
+    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
+        hwaddr paddr = get_paddr(env, addr, ram_ptr);
+        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
+            plist = panda_cb_list_next(plist)) {
+            PCB_CALL(plist, plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
+                                                              data_size, &val));
+        }
+    }
+}
+
+
+// target-i386/misc_helpers.c
+static void PCB_NAME(cpuid)(CPUState *env) {
+    panda_cb_list *plist;
+    for(plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.guest_hypercall(env));
+    }
+}
+
+
+// callbacks.c, for the plugin_cmd monitor command
+static void PCB_NAME(monitor)(Monitor *mon, const char *cmd) {
+    panda_cb_list *plist;
+    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.monitor(mon, cmd));
+    }
+}
+
+
+static void PCB_NAME(cpu_restore_state)(CPUState *env, TranslationBlock *tb) {
+    panda_cb_list *plist;
+    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
+        plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.cb_cpu_restore_state(env, tb));
+    }
+}
+
+
+static void PCB_NAME(asid_changed)(CPUState *env, target_ulong old_asid, target_ulong new_asid) {
+    panda_cb_list *plist;
+    panda_gate_set_asid(new_asid);
+    for(plist = panda_cbs[PANDA_CB_ASID_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
+        PCB_CALL(plist, plist->entry.asid_changed(env, old_asid, new_asid));
+    }
+}
@@ -9,65 +9,9 @@
 #include "panda/rr/rr_log.h"
 #include "exec/cpu-common.h"
 #include "exec/ram_addr.h"
+#include "qemu/timer.h"
 
 
-// These are used in exec.c
-void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
-    if (rr_mode == RR_REPLAY) {
-        panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_DMA];
-             plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
-        }
-    }
-}
-
-void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
-    if (rr_mode == RR_REPLAY) {
-        panda_cb_list *plist;
-       for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_DMA];
-            plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
-        }
-    }
-}
-
-// These are used in cpu-exec.c
-void panda_callbacks_before_block_exec(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_exec(cpu, tb);
-    }
-}
-
-
-void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_exec(cpu, tb);
-    }
-}
-
-
-void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_translate(cpu, pc);
-    }
-}
-
-
-void panda_callbacks_after_block_translate(CPUState *cpu, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_translate(cpu, tb);
-    }
-}
-
 void panda_before_find_fast(void) {
     if (panda_plugin_to_unload){
         panda_plugin_to_unload = false;
@@ -85,31 +29,6 @@ void panda_before_find_fast(void) {
 }
 
 
-bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done, bool *invalidate) {
-    panda_cb_list *plist;
-    if (!bb_invalidate_done) {
-        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-            plist != NULL; plist = panda_cb_list_next(plist)) {
-            *invalidate |=
-                plist->entry.before_block_exec_invalidate_opt(cpu, tb);
-        }
-        return true;
-    }
-    return false;
-}
-
-
-// These are used in target-i386/translate.c
-bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc) {
-    panda_cb_list *plist;
-    bool panda_exec_cb = false;
-    for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        panda_exec_cb |= plist->entry.insn_translate(env, pc);
-    }
-    return panda_exec_cb;
-}
-
 static inline hwaddr get_paddr(CPUState *cpu, target_ulong addr, void *ram_ptr) {
     if (!ram_ptr) {
         return panda_virt_to_phys(cpu, addr);
@@ -125,111 +44,49 @@ static inline hwaddr get_paddr(CPUState *cpu, target_ulong addr, void *ram_ptr)
     }
 }
 
-// These are used in softmmu_template.h
-// ram_ptr is a possible pointer into host memory from the TLB code. Can be NULL.
-void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc,
-                                     target_ulong addr, uint32_t data_size,
-                                     void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
-                                          data_size);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_read(env, env->panda_guest_pc, paddr,
-                                              data_size);
-        }
-    }
-}
-
-
-void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc,
-                                    target_ulong addr, uint32_t data_size,
-                                    uint64_t result, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
-                                         data_size, &result);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
-                                             data_size, &result);
-        }
-    }
+// Each dispatcher is built twice from callback_dispatch.inc.c, and
+// panda_callbacks_* point at the plain or the profiled copy.  Switching
+// copies (panda_callbacks_set_profiled) keeps profiling from costing
+// anything when it is off.  Every panda_cbs list is walked by one of these
+// dispatchers; plugin code that PANDA calls some other way (probe calls
+// from translated code, deadline functions from cpu_exec) is not timed.
+#define PCB_NAME(name) panda_callbacks_##name##_plain
+#define PCB_CALL(plist, call) call
+#include "callback_dispatch.inc.c"
+#undef PCB_NAME
+#undef PCB_CALL
+
+// Times are inclusive: a callback that triggers others (e.g. by touching
+// guest memory) is charged for them too.
+#define PCB_NAME(name) panda_callbacks_##name##_prof
+#define PCB_CALL(plist, call) do {                              \
+        uint64_t pcb_start = cpu_get_host_ticks();              \
+        call;                                                   \
+        (plist)->prof_ticks += cpu_get_host_ticks() - pcb_start; \
+        (plist)->prof_calls++;                                  \
+    } while (0)
+#include "callback_dispatch.inc.c"
+#undef PCB_NAME
+#undef PCB_CALL
+
+#define PANDA_DISPATCHERS(X)                                            \
+    X(before_dma) X(after_dma) X(before_block_exec) X(after_block_exec) \
+    X(replay_hd_transfer) X(replay_net_transfer)                        \
+    X(replay_handle_packet)                                             \
+    X(before_block_translate) X(after_block_translate)                  \
+    X(after_find_fast) X(insn_translate) X(insn_exec)                   \
+    X(before_mem_read) X(after_mem_read)                                \
+    X(before_mem_write) X(after_mem_write)                              \
+    X(cpuid) X(monitor) X(cpu_restore_state) X(asid_changed)
+
+#define PCB_POINTER(name) \
+    typeof(panda_callbacks_##name##_plain) *panda_callbacks_##name = \
+        panda_callbacks_##name##_plain;
+PANDA_DISPATCHERS(PCB_POINTER)
+
+void panda_callbacks_set_profiled(bool profiled) {
+#define PCB_SWAP(name) \
+    panda_callbacks_##name = profiled ? panda_callbacks_##name##_prof \
+                                      : panda_callbacks_##name##_plain;
+    PANDA_DISPATCHERS(PCB_SWAP)
 }
-
-
-void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc,
-                                      target_ulong addr, uint32_t data_size,
-                                      uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
-                                           data_size, &val);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
-                                               data_size, &val);
-        }
-    }
-}
-
-
-void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc,
-                                     target_ulong addr, uint32_t data_size,
-                                     uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
-                                          data_size, &val);
-    }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
-        hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
-                                              data_size, &val);
-        }
-    }
-}
-
-
-// target-i386/misc_helpers.c
-void panda_callbacks_cpuid(CPUState *env) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.guest_hypercall(env);
-    }
-}
-
-
-void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.cb_cpu_restore_state(env, tb);
-    }
-}
-
-
-void panda_callbacks_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_ASID_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.asid_changed(env, old_asid, new_asid);
-    }
-}
-
-
@@ -36,6 +36,8 @@ PANDAENDCOMMENT */
 #include <string.h>
 
 #include "panda/common.h"
+#include "panda/callback_support.h"
+#include "qemu/timer.h"
 
 //void spit_cbs(void) ;
 
@@ -185,7 +187,13 @@ void panda_do_unload_plugin(int plugin_idx){
         uninit_fn(plugin);
     }
     panda_unregister_callbacks(plugin);
+    panda_deadline_remove_plugin(plugin);
+    panda_gate_reset(plugin);
     panda_delete_plugin(plugin_idx);
+    // probes in translated code may point into the plugin
+    if (panda_probes_emitted) {
+        panda_do_flush_tb();
+    }
     dlclose(plugin);
 }
 
@@ -240,6 +248,7 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     else {
         panda_cbs[type] = new_list;
     }
+    panda_gate_plugins_changed();
 }
 
 
@@ -297,6 +306,7 @@ void panda_unregister_callbacks(void *plugin) {
         // update head
         panda_cbs[i] = plist_head;
     }
+    panda_gate_plugins_changed();
     //  printf ("panda_unregister_callbacks(%x) exit\n", plugin);  spit_cbs();  printf ("\n\n");
 }
 
@@ -425,6 +435,175 @@ void panda_memsavep(FILE *f) {
 #endif
 }
 
+
+// Callback profiling.  Per-callback counts live in the panda_cb_list nodes
+// and are gathered up by owner when dumped, so a plugin's counts go away if
+// it is unloaded.  PPP callbacks are counted by name in ppp_profile.
+bool panda_cb_profiling = false;
+
+#define PPP_PROFILE_MAX 256
+
+typedef struct {
+    char name[64];
+    uint64_t calls;
+    uint64_t ticks;
+} PPPProfile;
+
+static PPPProfile ppp_profile[PPP_PROFILE_MAX];
+static int ppp_profile_num = 0;
+
+static const char *panda_cb_type_names[PANDA_CB_LAST] = {
+    [PANDA_CB_BEFORE_BLOCK_TRANSLATE] = "before_block_translate",
+    [PANDA_CB_AFTER_BLOCK_TRANSLATE] = "after_block_translate",
+    [PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT] = "before_block_exec_invalidate_opt",
+    [PANDA_CB_BEFORE_BLOCK_EXEC] = "before_block_exec",
+    [PANDA_CB_AFTER_BLOCK_EXEC] = "after_block_exec",
+    [PANDA_CB_INSN_TRANSLATE] = "insn_translate",
+    [PANDA_CB_INSN_EXEC] = "insn_exec",
+    [PANDA_CB_VIRT_MEM_BEFORE_READ] = "virt_mem_before_read",
+    [PANDA_CB_VIRT_MEM_BEFORE_WRITE] = "virt_mem_before_write",
+    [PANDA_CB_PHYS_MEM_BEFORE_READ] = "phys_mem_before_read",
+    [PANDA_CB_PHYS_MEM_BEFORE_WRITE] = "phys_mem_before_write",
+    [PANDA_CB_VIRT_MEM_AFTER_READ] = "virt_mem_after_read",
+    [PANDA_CB_VIRT_MEM_AFTER_WRITE] = "virt_mem_after_write",
+    [PANDA_CB_PHYS_MEM_AFTER_READ] = "phys_mem_after_read",
+    [PANDA_CB_PHYS_MEM_AFTER_WRITE] = "phys_mem_after_write",
+    [PANDA_CB_GUEST_HYPERCALL] = "guest_hypercall",
+    [PANDA_CB_MONITOR] = "monitor",
+    [PANDA_CB_CPU_RESTORE_STATE] = "cpu_restore_state",
+    [PANDA_CB_ASID_CHANGED] = "asid_changed",
+    [PANDA_CB_REPLAY_BEFORE_DMA] = "replay_before_dma",
+    [PANDA_CB_REPLAY_AFTER_DMA] = "replay_after_dma",
+    [PANDA_CB_REPLAY_HD_TRANSFER] = "replay_hd_transfer",
+    [PANDA_CB_REPLAY_NET_TRANSFER] = "replay_net_transfer",
+    [PANDA_CB_REPLAY_HANDLE_PACKET] = "replay_handle_packet",
+};
+
+typedef struct {
+    const char *plugin;
+    const char *cb;
+    uint64_t calls;
+    uint64_t ticks;
+} CBProfileRow;
+
+uint64_t panda_profile_ticks(void) {
+    return cpu_get_host_ticks();
+}
+
+int panda_ppp_profile_id(const char *cb_name) {
+    int i;
+    for (i = 0; i < ppp_profile_num; i++) {
+        if (strcmp(ppp_profile[i].name, cb_name) == 0) return i;
+    }
+    if (ppp_profile_num == PPP_PROFILE_MAX) return -1;
+    PPPProfile *p = &ppp_profile[ppp_profile_num];
+    snprintf(p->name, sizeof(p->name), "%s", cb_name);
+    return ppp_profile_num++;
+}
+
+void panda_ppp_profile_add(int id, uint64_t ticks) {
+    if (id < 0) return;
+    ppp_profile[id].calls++;
+    ppp_profile[id].ticks += ticks;
+}
+
+void panda_set_cb_profiling(bool on) {
+    panda_cb_profiling = on;
+    panda_callbacks_set_profiled(on);
+}
+
+void panda_cb_profile_reset(void) {
+    int i;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            plist->prof_calls = 0;
+            plist->prof_ticks = 0;
+        }
+    }
+    for (i = 0; i < ppp_profile_num; i++) {
+        ppp_profile[i].calls = 0;
+        ppp_profile[i].ticks = 0;
+    }
+}
+
+static int cb_profile_row_cmp(const void *a, const void *b) {
+    const CBProfileRow *ra = a, *rb = b;
+    if (ra->ticks != rb->ticks) return ra->ticks < rb->ticks ? 1 : -1;
+    return 0;
+}
+
+static const char *panda_plugin_name(void *plugin) {
+    int i;
+    for (i = 0; i < nb_panda_plugins; i++) {
+        if (panda_plugins[i].plugin == plugin) return panda_plugins[i].name;
+    }
+    return "?";
+}
+
+// Print the counts, biggest ticks first, one line per plugin and callback
+// type and then one per PPP callback.
+void panda_cb_profile_dump(FILE *f, fprintf_function pf) {
+    int num_rows = 0, max_rows = ppp_profile_num;
+    int i, j;
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            max_rows++;
+        }
+    }
+    CBProfileRow *rows = g_new0(CBProfileRow, max_rows + 1);
+    uint64_t total = 0;
+
+    for (i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_list *plist;
+        int first = num_rows;
+        for (plist = panda_cbs[i]; plist != NULL; plist = plist->next) {
+            if (plist->prof_calls == 0) continue;
+            // a plugin may have registered more than one callback of a type
+            const char *name = panda_plugin_name(plist->owner);
+            for (j = first; j < num_rows && rows[j].plugin != name; j++);
+            if (j == num_rows) {
+                rows[j].plugin = name;
+                rows[j].cb = panda_cb_type_names[i];
+                num_rows++;
+            }
+            rows[j].calls += plist->prof_calls;
+            rows[j].ticks += plist->prof_ticks;
+            total += plist->prof_ticks;
+        }
+    }
+    qsort(rows, num_rows, sizeof(rows[0]), cb_profile_row_cmp);
+
+    pf(f, "%-20s %-32s %14s %16s %10s %6s\n", "plugin", "callback",
+       "calls", "ticks", "ticks/call", "%");
+    for (i = 0; i < num_rows; i++) {
+        pf(f, "%-20s %-32s %14" PRIu64 " %16" PRIu64 " %10" PRIu64 " %5.1f%%\n",
+           rows[i].plugin, rows[i].cb ? rows[i].cb : "?",
+           rows[i].calls, rows[i].ticks, rows[i].ticks / rows[i].calls,
+           total ? 100.0 * rows[i].ticks / total : 0.0);
+    }
+
+    num_rows = 0;
+    for (i = 0; i < ppp_profile_num; i++) {
+        if (ppp_profile[i].calls == 0) continue;
+        rows[num_rows].plugin = "ppp";
+        rows[num_rows].cb = ppp_profile[i].name;
+        rows[num_rows].calls = ppp_profile[i].calls;
+        rows[num_rows].ticks = ppp_profile[i].ticks;
+        num_rows++;
+    }
+    qsort(rows, num_rows, sizeof(rows[0]), cb_profile_row_cmp);
+    // PPP callbacks run inside the callbacks above, so their ticks are
+    // already counted there and aren't shown as a share of the total
+    for (i = 0; i < num_rows; i++) {
+        pf(f, "%-20s %-32s %14" PRIu64 " %16" PRIu64 " %10" PRIu64 "\n",
+           rows[i].plugin, rows[i].cb, rows[i].calls, rows[i].ticks,
+           rows[i].ticks / rows[i].calls);
+    }
+    g_free(rows);
+}
+
 // Parse out arguments and return them to caller
 static panda_arg_list *panda_get_args_internal(const char *plugin_name, bool check_only) {
     panda_arg_list *ret = NULL;
@@ -889,10 +1068,25 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
-    panda_cb_list *plist;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.monitor(mon, cmd);
+    panda_callbacks_monitor(mon, cmd);
+}
+
+void hmp_panda_profile_plugins(Monitor *mon, const QDict *qdict) {
+    const char *cmd = qdict_get_try_str(qdict, "cmd");
+    if (cmd == NULL) {
+        if (!panda_cb_profiling) {
+            monitor_printf(mon, "callback profiling is off\n");
+        }
+        panda_cb_profile_dump((FILE *) mon, monitor_fprintf);
+    } else if (strcmp(cmd, "on") == 0) {
+        panda_set_cb_profiling(true);
+    } else if (strcmp(cmd, "off") == 0) {
+        panda_set_cb_profiling(false);
+    } else if (strcmp(cmd, "reset") == 0) {
+        panda_cb_profile_reset();
+    } else {
+        monitor_printf(mon, "usage: profile_plugins [on|off|reset]\n");
     }
 }
 
@@ -38,7 +38,7 @@ extern unsigned long long rr_max_num_queue_entries;
 
 typedef struct Checkpoint {
     uint64_t guest_instr_count;
-    size_t nondet_log_position;
+    RR_log_codec nondet_log_codec;
 
     unsigned long long number_of_log_entries[RR_LAST];
     unsigned long long size_of_log_entries[RR_LAST];
@@ -82,9 +82,10 @@ void *panda_checkpoint(void) {
     }
 
     checkpoint->guest_instr_count = instr_count;
-    checkpoint->nondet_log_position = rr_queue_head
-        ? rr_queue_head->header.file_pos
-        : rr_nondet_log->bytes_read;
+    checkpoint->nondet_log_codec = rr_nondet_log->codec;
+    if (rr_queue_head) {
+        rr_codec_rewind_to(&checkpoint->nondet_log_codec, rr_queue_head);
+    }
 
     memcpy(checkpoint->number_of_log_entries, rr_number_of_log_entries,
             sizeof(rr_number_of_log_entries));
@@ -132,8 +133,9 @@ void panda_restart(void *opaque) {
 
     first_cpu->rr_guest_instr_count = checkpoint->guest_instr_count;
     first_cpu->panda_guest_pc = panda_current_pc(first_cpu);
-    rr_nondet_log->bytes_read = checkpoint->nondet_log_position;
-    fseek(rr_nondet_log->fp, checkpoint->nondet_log_position, SEEK_SET);
+    rr_nondet_log->codec = checkpoint->nondet_log_codec;
+    rr_nondet_log->bytes_read = rr_nondet_log->codec.bytes;
+    fseek(rr_nondet_log->fp, rr_nondet_log->bytes_read, SEEK_SET);
     rr_queue_head = rr_queue_tail = NULL;
 
     memcpy(rr_number_of_log_entries, checkpoint->number_of_log_entries,
@@ -7,6 +7,7 @@
 #include "panda/common.h"
 #include "panda/plog.h"
 #include "panda/plog-cc-bridge.h"
+#include "panda/callback_support.h"
 
 target_ulong panda_current_pc(CPUState *cpu) {
     target_ulong pc, cs_base;
@@ -228,7 +229,17 @@ void panda_set_os_name(char *os_name) {
     printf ("os_type=%d bits=%d os_details=[%s]\n", panda_os_type, panda_os_bits, panda_os_details); 
 }
 
+// Bumped by every write through the panda memory API and by every device
+// write to guest RAM, so that memoized guest objects don't outlive a plugin
+// or a DMA (recorded, or replayed from the log) changing guest memory.
+static uint64_t guest_obj_generation;
+
+void panda_guest_obj_invalidate(void) {
+    guest_obj_generation++;
+}
+
 int panda_physical_memory_rw(hwaddr addr, uint8_t *buf, int len, int is_write) {
+    if (is_write) guest_obj_generation++;
     return cpu_physical_memory_rw_ex(addr, buf, len, is_write, true);
 }
 
@@ -285,7 +296,70 @@ int panda_virtual_memory_write(CPUState *env, target_ulong addr,
 }
 
 
+// Memoized guest objects, direct mapped by address.
+#define GUEST_OBJ_CACHE_SIZE 64
+
+typedef struct {
+    uint64_t instr_count;
+    uint64_t generation;
+    target_ulong asid;
+    target_ulong addr;
+    uint32_t len;       // 0 if the slot is unused
+    bool ok;
+    uint8_t data[PANDA_GUEST_OBJ_MAX];
+} GuestObjCacheEntry;
+
+static GuestObjCacheEntry guest_obj_cache[GUEST_OBJ_CACHE_SIZE];
+
+// Page at a time, so one bad page doesn't lose the rest of the object.
+static bool guest_obj_fetch(CPUState *env, target_ulong addr,
+                            uint8_t *buf, uint32_t len) {
+    bool ok = true;
+    while (len > 0) {
+        uint32_t l = MIN(len, TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK));
+        if (panda_virtual_memory_rw(env, addr, buf, l, 0) < 0) {
+            memset(buf, 0, l);
+            ok = false;
+        }
+        len -= l;
+        buf += l;
+        addr += l;
+    }
+    return ok;
+}
+
+bool panda_guest_obj_read(CPUState *env, target_ulong addr,
+                          void *buf, uint32_t len) {
+    // The instruction count only moves when record/replay is counting.
+    if (rr_mode == RR_OFF || len > PANDA_GUEST_OBJ_MAX || len == 0) {
+        return guest_obj_fetch(env, addr, buf, len);
+    }
+
+    uint64_t instr_count = rr_get_guest_instr_count();
+    target_ulong asid = panda_current_asid(env);
+    GuestObjCacheEntry *e = &guest_obj_cache[
+        ((addr >> 3) ^ (addr >> 12)) % GUEST_OBJ_CACHE_SIZE];
+    if (e->len != len || e->addr != addr || e->asid != asid
+            || e->instr_count != instr_count
+            || e->generation != guest_obj_generation) {
+        e->ok = guest_obj_fetch(env, addr, e->data, len);
+        e->addr = addr;
+        e->len = len;
+        e->asid = asid;
+        e->instr_count = instr_count;
+        e->generation = guest_obj_generation;
+    }
+    memcpy(buf, e->data, len);
+    return e->ok;
+}
+
+
 void panda_cleanup(void) {
+    // before unloading, which throws the plugins' counts away
+    if (panda_cb_profiling) {
+        printf("PANDA callback profile:\n");
+        panda_cb_profile_dump(stdout, fprintf);
+    }
     // PANDA: unload plugins
     panda_unload_plugins();
     if (pandalog) {
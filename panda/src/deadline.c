@@ -0,0 +1,142 @@
+/*
+ * PANDA instruction count deadlines: run plugin code at instruction N.
+ *
+ * Plugins that want to do something at given points of a replay (take a
+ * screenshot, dump memory, start cutting out a new replay) used to check
+ * the instruction count in a before_block_exec callback, paying for a call
+ * on every block and only getting as close as the end of a block.  Here
+ * they register the count instead.  The deadlines are kept in a binary
+ * heap; cpu_exec runs the due ones between blocks, and the translators cut
+ * TBs short so that a block boundary falls exactly on the next deadline,
+ * the way they do for replayed interrupts.  Nothing is paid per block but
+ * a compare while no deadline is near.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+
+#include "panda/plugin.h"
+#include "panda/callback_support.h"
+#include "panda/rr/rr_log.h"
+
+typedef struct {
+    uint64_t instr;
+    uint64_t id;
+    void *plugin;
+    panda_deadline_fn fn;
+    void *opaque;
+} Deadline;
+
+uint64_t panda_next_deadline = UINT64_MAX;
+bool panda_deadline_chained = false;
+
+// min-heap on (instr, id), so deadlines at the same count run in the order
+// they were added
+static Deadline *heap;
+static size_t heap_len, heap_cap;
+static uint64_t next_id = 1;
+
+static bool deadline_before(const Deadline *a, const Deadline *b) {
+    return a->instr < b->instr || (a->instr == b->instr && a->id < b->id);
+}
+
+static void heap_swap(size_t i, size_t j) {
+    Deadline t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+}
+
+static void sift_up(size_t i) {
+    while (i > 0 && deadline_before(&heap[i], &heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < heap_len && deadline_before(&heap[l], &heap[min])) min = l;
+        if (r < heap_len && deadline_before(&heap[r], &heap[min])) min = r;
+        if (min == i) return;
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void heap_remove(size_t i) {
+    heap_len--;
+    if (i == heap_len) return;
+    heap[i] = heap[heap_len];
+    sift_down(i);
+    sift_up(i);
+}
+
+static void deadline_changed(void) {
+    panda_next_deadline = heap_len ? heap[0].instr : UINT64_MAX;
+}
+
+uint64_t panda_deadline_add(void *plugin, uint64_t instr,
+                            panda_deadline_fn fn, void *opaque) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? 2 * heap_cap : 16;
+        heap = g_renew(Deadline, heap, heap_cap);
+    }
+    uint64_t id = next_id++;
+    Deadline *d = &heap[heap_len++];
+    d->instr = instr;
+    d->id = id;
+    d->plugin = plugin;
+    d->fn = fn;
+    d->opaque = opaque;
+    sift_up(heap_len - 1);
+    deadline_changed();
+
+    // Chained TBs run into each other without coming back to cpu_exec;
+    // unchain them so it gets a chance to cut and run at the deadline.
+    if (panda_deadline_chained) {
+        panda_deadline_chained = false;
+        panda_do_flush_tb();
+    }
+    return id;
+}
+
+void panda_deadline_cancel(uint64_t id) {
+    size_t i;
+    for (i = 0; i < heap_len; i++) {
+        if (heap[i].id == id) {
+            heap_remove(i);
+            deadline_changed();
+            return;
+        }
+    }
+}
+
+void panda_deadline_remove_plugin(void *plugin) {
+    size_t i, n = 0;
+    for (i = 0; i < heap_len; i++) {
+        if (heap[i].plugin != plugin) {
+            heap[n++] = heap[i];
+        }
+    }
+    heap_len = n;
+    for (i = heap_len / 2; i-- > 0; ) {
+        sift_down(i);
+    }
+    deadline_changed();
+}
+
+void panda_deadline_run(CPUState *cpu) {
+    uint64_t now = rr_get_guest_instr_count();
+    while (heap_len && heap[0].instr <= now) {
+        Deadline d = heap[0];
+        heap_remove(0);
+        deadline_changed();
+        // may add deadlines, or cancel some
+        d.fn(cpu, now, d.opaque);
+    }
+}
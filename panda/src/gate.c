@@ -0,0 +1,255 @@
+/*
+ * PANDA instrumentation gates: run code nobody is interested in bare.
+ *
+ * Plugins declare which ASIDs, which of kernel and user mode and which pc
+ * ranges they care about.  Each plugin has its own gate, and PANDA
+ * instruments the union of them; a plugin with instrumentation callbacks
+ * (block, insn, translate or memory) but no gate wants everything, and
+ * turns gating off.  A TB no gate lets through is translated and run
+ * without any instrumentation: no block or insn callbacks, no probes and
+ * no LLVM, so replaying it costs about as much as plain replay.  Memory
+ * callbacks are checked as they happen, since they can't be left out of
+ * the translated code per TB.
+ *
+ * The ASID isn't part of what identifies a TB, so each TB also records
+ * which gates' ASID sets passed when it was translated, and TB lookup only
+ * finds TBs that agree with the current ASID.  Code shared between
+ * processes (the kernel, libraries) gets one TB for each answer rather
+ * than one per ASID.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+
+#include "panda/plugin.h"
+#include "panda/common.h"
+#include "panda/callback_support.h"
+
+typedef struct {
+    target_ulong lo, hi;
+} GateRange;
+
+typedef struct {
+    void *plugin;       // NULL if the slot is free
+    // sorted, so checking an ASID is a binary search
+    target_ulong *asids;
+    size_t num_asids;
+    bool kernel, user;
+    GateRange *ranges;
+    size_t num_ranges;
+} Gate;
+
+// one bit of panda_gate_asid_mask per slot
+QEMU_BUILD_BUG_ON(MAX_PANDA_PLUGINS > 32);
+
+bool panda_gate_on = false;
+uint32_t panda_gate_asid_mask = 0;
+
+static Gate gates[MAX_PANDA_PLUGINS];
+// last ASID passed to panda_gate_set_asid
+static target_ulong gate_cur_asid;
+
+// callbacks that gates leave out; a plugin with any of these and no gate
+// wants everything instrumented
+static const panda_cb_type gated_cb_types[] = {
+    PANDA_CB_BEFORE_BLOCK_TRANSLATE, PANDA_CB_AFTER_BLOCK_TRANSLATE,
+    PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT, PANDA_CB_BEFORE_BLOCK_EXEC,
+    PANDA_CB_AFTER_BLOCK_EXEC, PANDA_CB_INSN_TRANSLATE, PANDA_CB_INSN_EXEC,
+    PANDA_CB_VIRT_MEM_BEFORE_READ, PANDA_CB_VIRT_MEM_BEFORE_WRITE,
+    PANDA_CB_PHYS_MEM_BEFORE_READ, PANDA_CB_PHYS_MEM_BEFORE_WRITE,
+    PANDA_CB_VIRT_MEM_AFTER_READ, PANDA_CB_VIRT_MEM_AFTER_WRITE,
+    PANDA_CB_PHYS_MEM_AFTER_READ, PANDA_CB_PHYS_MEM_AFTER_WRITE,
+};
+
+static Gate *gate_find(void *plugin) {
+    size_t i;
+    for (i = 0; i < MAX_PANDA_PLUGINS; i++) {
+        if (gates[i].plugin == plugin) return &gates[i];
+    }
+    return NULL;
+}
+
+// a plugin's gate, made (letting everything through) on first use
+static Gate *gate_get(void *plugin) {
+    Gate *g = gate_find(plugin);
+    if (g) return g;
+    g = gate_find(NULL);
+    assert(g);
+    g->plugin = plugin;
+    g->kernel = g->user = true;
+    return g;
+}
+
+static bool gate_asid_in_set(Gate *g, target_ulong asid) {
+    size_t lo = 0, hi = g->num_asids;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (g->asids[mid] == asid) return true;
+        if (g->asids[mid] < asid) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+static uint32_t gate_asid_mask(target_ulong asid) {
+    uint32_t mask = 0;
+    size_t i;
+    for (i = 0; i < MAX_PANDA_PLUGINS; i++) {
+        Gate *g = &gates[i];
+        if (g->plugin && (g->num_asids == 0 || gate_asid_in_set(g, asid))) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+static bool gate_mode_ok(Gate *g, CPUState *cpu) {
+    if (g->kernel && g->user) return true;
+    return panda_in_kernel(cpu) ? g->kernel : g->user;
+}
+
+// does [lo, hi) overlap any of the gate's ranges
+static bool gate_range_ok(Gate *g, target_ulong lo, target_ulong hi) {
+    size_t i;
+    if (g->num_ranges == 0) return true;
+    for (i = 0; i < g->num_ranges; i++) {
+        if (lo < g->ranges[i].hi && g->ranges[i].lo < hi) return true;
+    }
+    return false;
+}
+
+static bool gate_pc_ok(Gate *g, target_ulong pc) {
+    size_t i;
+    if (g->num_ranges == 0) return true;
+    for (i = 0; i < g->num_ranges; i++) {
+        if (g->ranges[i].lo <= pc && pc < g->ranges[i].hi) return true;
+    }
+    return false;
+}
+
+// Gating is on if some plugin has a gate, and every plugin with callbacks
+// that gating would leave out has one too.
+static bool gate_compute_on(void) {
+    size_t i;
+    bool any = false;
+    for (i = 0; i < MAX_PANDA_PLUGINS; i++) {
+        if (gates[i].plugin) any = true;
+    }
+    if (!any) return false;
+    for (i = 0; i < ARRAY_SIZE(gated_cb_types); i++) {
+        panda_cb_list *plist;
+        for (plist = panda_cbs[gated_cb_types[i]]; plist != NULL;
+             plist = plist->next) {
+            if (!gate_find(plist->owner)) return false;
+        }
+    }
+    return true;
+}
+
+// TBs already translated were gated under the old settings
+static void gate_changed(void) {
+    panda_gate_on = gate_compute_on();
+    panda_gate_asid_mask = gate_asid_mask(gate_cur_asid);
+    panda_do_flush_tb();
+}
+
+void panda_gate_plugins_changed(void) {
+    bool on = gate_compute_on();
+    if (on != panda_gate_on) {
+        gate_changed();
+    }
+}
+
+void panda_gate_add_asid(void *plugin, target_ulong asid) {
+    Gate *g = gate_get(plugin);
+    size_t i;
+    if (gate_asid_in_set(g, asid)) return;
+    g->asids = g_renew(target_ulong, g->asids, g->num_asids + 1);
+    for (i = g->num_asids; i > 0 && g->asids[i - 1] > asid; i--) {
+        g->asids[i] = g->asids[i - 1];
+    }
+    g->asids[i] = asid;
+    g->num_asids++;
+    gate_changed();
+}
+
+void panda_gate_remove_asid(void *plugin, target_ulong asid) {
+    Gate *g = gate_find(plugin);
+    size_t i;
+    if (!g) return;
+    for (i = 0; i < g->num_asids; i++) {
+        if (g->asids[i] == asid) {
+            memmove(&g->asids[i], &g->asids[i + 1],
+                    (g->num_asids - i - 1) * sizeof(target_ulong));
+            g->num_asids--;
+            gate_changed();
+            return;
+        }
+    }
+}
+
+void panda_gate_set_modes(void *plugin, bool kernel, bool user) {
+    Gate *g = gate_get(plugin);
+    g->kernel = kernel;
+    g->user = user;
+    gate_changed();
+}
+
+void panda_gate_add_pc_range(void *plugin, target_ulong lo, target_ulong hi) {
+    Gate *g = gate_get(plugin);
+    assert(lo < hi);
+    g->ranges = g_renew(GateRange, g->ranges, g->num_ranges + 1);
+    g->ranges[g->num_ranges].lo = lo;
+    g->ranges[g->num_ranges].hi = hi;
+    g->num_ranges++;
+    gate_changed();
+}
+
+void panda_gate_reset(void *plugin) {
+    Gate *g = gate_find(plugin);
+    if (!g) return;
+    g_free(g->asids);
+    g_free(g->ranges);
+    memset(g, 0, sizeof(*g));
+    gate_changed();
+}
+
+void panda_gate_set_asid(target_ulong asid) {
+    gate_cur_asid = asid;
+    if (panda_gate_on) {
+        panda_gate_asid_mask = gate_asid_mask(asid);
+    }
+}
+
+bool panda_gate_block(CPUState *cpu, target_ulong pc) {
+    // a TB spans at most two pages
+    target_ulong end = (pc & TARGET_PAGE_MASK) + 2 * TARGET_PAGE_SIZE;
+    size_t i;
+    if (!panda_gate_on) return true;
+    if (end <= pc) end = (target_ulong) -1;
+    for (i = 0; i < MAX_PANDA_PLUGINS; i++) {
+        Gate *g = &gates[i];
+        if ((panda_gate_asid_mask & (1u << i)) && gate_mode_ok(g, cpu)
+                && gate_range_ok(g, pc, end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool panda_gate_pc(CPUState *cpu, target_ulong pc) {
+    size_t i;
+    if (!panda_gate_on) return true;
+    for (i = 0; i < MAX_PANDA_PLUGINS; i++) {
+        Gate *g = &gates[i];
+        if ((panda_gate_asid_mask & (1u << i)) && gate_mode_ok(g, cpu)
+                && gate_pc_ok(g, pc)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,426 @@
+/*
+ * PANDA insn cache: the decoded insns of each TB, shared by all plugins.
+ *
+ * Plugins that want to know where a TB's insns start, what they are or
+ * where they branch to used to read the code back with
+ * panda_virtual_memory_rw (a page walk each time) and decode it
+ * themselves, each on its own.  Once panda_enable_insn_cache is called,
+ * every TB gets a copy of its code, the bounds of its insns from the
+ * insn_start data the translator emitted, and what kind of control flow
+ * each insn is.  It lives and dies with the TB.
+ *
+ * The kind is worked out here from the first few bytes of the insn; we
+ * don't decode operands in general.  Direct branch targets and trap
+ * numbers are filled in, and the bytes are there for anything else.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/cpu_ldst.h"
+#include "tcg.h"
+
+#include "panda/plugin.h"
+#include "panda/callback_support.h"
+
+bool panda_insn_cache_on = false;
+
+// Where the decoder gets an insn's bytes: the TB's copy once it has been
+// translated, or the code TLB, like the translator, while it is being
+// translated.  The decoder only asks for bytes that belong to the insn.
+typedef struct {
+    CPUArchState *env;
+    target_ulong pc;
+    const uint8_t *buf;
+    int len;
+} InsnBytes;
+
+static int insn_byte(InsnBytes *b, int i) {
+    if (b->buf) return i < b->len ? b->buf[i] : -1;
+    return cpu_ldub_code(b->env, b->pc + i);
+}
+
+// n little endian bytes at i, sign extended
+static bool insn_simm(InsnBytes *b, int i, int n, int64_t *val) {
+    uint64_t v = 0;
+    int k;
+    for (k = n - 1; k >= 0; k--) {
+        int c = insn_byte(b, i + k);
+        if (c < 0) return false;
+        v = (v << 8) | c;
+    }
+    *val = (int64_t) (v << (64 - 8 * n)) >> (64 - 8 * n);
+    return true;
+}
+
+static void insn_direct(panda_insn *insn, uint8_t kind, target_ulong target) {
+    insn->kind = kind;
+    insn->target = target;
+    insn->flags |= PANDA_INSN_DIRECT;
+}
+
+static void insn_trap(panda_insn *insn, uint8_t kind, uint64_t imm) {
+    insn->kind = kind;
+    insn->imm = imm;
+    insn->flags |= PANDA_INSN_IMM;
+}
+
+#if defined(TARGET_I386)
+
+static void decode_insn(InsnBytes *b, uint32_t flags, target_ulong cs_base,
+                        panda_insn *insn) {
+    bool code64 = false, op16;
+    int i = 0, op, c;
+    int64_t rel;
+#ifdef TARGET_X86_64
+    code64 = flags & HF_CS64_MASK;
+#endif
+    op16 = !code64 && !(flags & HF_CS32_MASK);
+
+    for (;; i++) {
+        op = insn_byte(b, i);
+        if (op < 0) return;
+        if (op == 0x66) {
+            if (!code64) op16 = !!(flags & HF_CS32_MASK);
+        } else if (op == 0x67 || op == 0xf0 || op == 0xf2 || op == 0xf3
+                   || op == 0x2e || op == 0x36 || op == 0x3e || op == 0x26
+                   || op == 0x64 || op == 0x65
+                   || (code64 && (op & 0xf0) == 0x40)) {
+            // other prefixes and REX don't change the kind
+        } else {
+            break;
+        }
+    }
+    i++;
+
+    int kind = PANDA_INSN_OTHER, immsize = 0;
+    switch (op) {
+    case 0xe8: kind = PANDA_INSN_CALL; immsize = op16 ? 2 : 4; break;
+    case 0xe9: kind = PANDA_INSN_JUMP; immsize = op16 ? 2 : 4; break;
+    case 0xeb: kind = PANDA_INSN_JUMP; immsize = 1; break;
+    case 0x70 ... 0x7f:
+    case 0xe0 ... 0xe3: kind = PANDA_INSN_COND_JUMP; immsize = 1; break;
+    case 0x9a: insn->kind = PANDA_INSN_CALL; return;
+    case 0xea: insn->kind = PANDA_INSN_JUMP; return;
+    case 0xc2: case 0xc3: case 0xca: case 0xcb:
+        insn->kind = PANDA_INSN_RET;
+        return;
+    case 0xcf: insn->kind = PANDA_INSN_SYSRET; return;
+    case 0xcc: insn_trap(insn, PANDA_INSN_SYSCALL, 3); return;
+    case 0xce: insn_trap(insn, PANDA_INSN_SYSCALL, 4); return;
+    case 0xcd:
+        if ((c = insn_byte(b, i)) >= 0) insn_trap(insn, PANDA_INSN_SYSCALL, c);
+        return;
+    case 0xff:
+        if ((c = insn_byte(b, i)) < 0) return;
+        switch ((c >> 3) & 7) {
+        case 2: case 3: insn->kind = PANDA_INSN_CALL; break;
+        case 4: case 5: insn->kind = PANDA_INSN_JUMP; break;
+        }
+        return;
+    case 0x0f:
+        if ((c = insn_byte(b, i++)) < 0) return;
+        if (c == 0x05 || c == 0x34) {
+            insn->kind = PANDA_INSN_SYSCALL;
+        } else if (c == 0x07 || c == 0x35) {
+            insn->kind = PANDA_INSN_SYSRET;
+        } else if (c >= 0x80 && c <= 0x8f) {
+            kind = PANDA_INSN_COND_JUMP;
+            immsize = op16 ? 2 : 4;
+            break;
+        }
+        return;
+    default:
+        return;
+    }
+
+    if (!insn_simm(b, i, immsize, &rel)) return;
+    // rel is from the end of the insn, within the code segment
+    target_ulong eip = insn->pc + i + immsize - cs_base + rel;
+    if (op16) {
+        eip &= 0xffff;
+    } else if (!code64) {
+        eip = (uint32_t) eip;
+    }
+    insn_direct(insn, kind, cs_base + eip);
+}
+
+#elif defined(TARGET_ARM)
+
+static void decode_a64(uint32_t w, panda_insn *insn) {
+    int64_t off;
+    if ((w & 0x7c000000) == 0x14000000) {
+        // B, BL
+        off = sextract64(w, 0, 26) * 4;
+        insn_direct(insn, (w >> 31) ? PANDA_INSN_CALL : PANDA_INSN_JUMP,
+                    insn->pc + off);
+    } else if ((w & 0xff000010) == 0x54000000) {
+        // B.cond
+        off = sextract64(w, 5, 19) * 4;
+        insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + off);
+    } else if ((w & 0x7e000000) == 0x34000000) {
+        // CBZ, CBNZ
+        off = sextract64(w, 5, 19) * 4;
+        insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + off);
+    } else if ((w & 0x7e000000) == 0x36000000) {
+        // TBZ, TBNZ
+        off = sextract64(w, 5, 14) * 4;
+        insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + off);
+    } else if ((w & 0xfffffc1f) == 0xd63f0000) {
+        insn->kind = PANDA_INSN_CALL;
+    } else if ((w & 0xfffffc1f) == 0xd61f0000) {
+        insn->kind = PANDA_INSN_JUMP;
+    } else if ((w & 0xfffffc1f) == 0xd65f0000) {
+        insn->kind = PANDA_INSN_RET;
+    } else if ((w & 0xffe0001f) == 0xd4000001) {
+        insn_trap(insn, PANDA_INSN_SYSCALL, (w >> 5) & 0xffff);
+    } else if (w == 0xd69f03e0) {
+        insn->kind = PANDA_INSN_SYSRET;
+    }
+}
+
+static void decode_a32(uint32_t w, panda_insn *insn) {
+    int64_t off = sextract64(w, 0, 24) * 4;
+    uint32_t cond = w >> 28;
+    if (cond == 0xf) {
+        // BLX imm switches to Thumb
+        if ((w & 0x0e000000) == 0x0a000000) {
+            insn_direct(insn, PANDA_INSN_CALL,
+                        insn->pc + 8 + off + ((w >> 23) & 2));
+        }
+        return;
+    }
+    if ((w & 0x0f000000) == 0x0b000000) {
+        insn_direct(insn, PANDA_INSN_CALL, insn->pc + 8 + off);
+    } else if ((w & 0x0f000000) == 0x0a000000) {
+        insn_direct(insn, cond == 0xe ? PANDA_INSN_JUMP : PANDA_INSN_COND_JUMP,
+                    insn->pc + 8 + off);
+    } else if ((w & 0x0ffffff0) == 0x012fff30) {
+        insn->kind = PANDA_INSN_CALL;
+    } else if ((w & 0x0ffffff0) == 0x012fff10) {
+        insn->kind = (w & 0xf) == 14 ? PANDA_INSN_RET : PANDA_INSN_JUMP;
+    } else if ((w & 0x0e108000) == 0x08108000) {
+        // LDM with pc in the list; pop {..., pc} is a return
+        insn->kind = ((w >> 16) & 0xf) == 13 ? PANDA_INSN_RET : PANDA_INSN_JUMP;
+    } else if ((w & 0x0fffffff) == 0x049df004 || (w & 0x0fffffff) == 0x01a0f00e) {
+        // ldr pc, [sp], #4 and mov pc, lr
+        insn->kind = PANDA_INSN_RET;
+    } else if ((w & 0x0f000000) == 0x0f000000) {
+        insn_trap(insn, PANDA_INSN_SYSCALL, w & 0xffffff);
+    }
+}
+
+static void decode_t16(uint32_t h, panda_insn *insn) {
+    int64_t off;
+    if ((h & 0xff87) == 0x4780) {
+        insn->kind = PANDA_INSN_CALL;
+    } else if ((h & 0xff87) == 0x4700) {
+        insn->kind = ((h >> 3) & 0xf) == 14 ? PANDA_INSN_RET : PANDA_INSN_JUMP;
+    } else if ((h & 0xff00) == 0xbd00) {
+        insn->kind = PANDA_INSN_RET;
+    } else if ((h & 0xff00) == 0xdf00) {
+        insn_trap(insn, PANDA_INSN_SYSCALL, h & 0xff);
+    } else if ((h & 0xf000) == 0xd000 && (h & 0x0e00) != 0x0e00) {
+        off = (int8_t) (h & 0xff);
+        insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + 4 + off * 2);
+    } else if ((h & 0xf800) == 0xe000) {
+        off = sextract64(h, 0, 11);
+        insn_direct(insn, PANDA_INSN_JUMP, insn->pc + 4 + off * 2);
+    } else if ((h & 0xf500) == 0xb100) {
+        off = ((h >> 2) & 0x3e) | ((h >> 3) & 0x40);
+        insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + 4 + off);
+    }
+}
+
+static void decode_t32(uint32_t h1, uint32_t h2, panda_insn *insn) {
+    if ((h1 & 0xf800) == 0xf000 && (h2 & 0x8000)) {
+        uint32_t s = (h1 >> 10) & 1;
+        uint32_t j1 = (h2 >> 13) & 1, j2 = (h2 >> 11) & 1;
+        int64_t off;
+        if ((h2 & 0xd000) == 0x8000) {
+            // B<c>.W; conditions 14 and 15 are other insns
+            if (((h1 >> 6) & 0xf) >= 0xe) return;
+            off = (s << 20) | (j2 << 19) | (j1 << 18)
+                | ((h1 & 0x3f) << 12) | ((h2 & 0x7ff) << 1);
+            off = sextract64(off, 0, 21);
+            insn_direct(insn, PANDA_INSN_COND_JUMP, insn->pc + 4 + off);
+            return;
+        }
+        off = (s << 24) | ((!(j1 ^ s)) << 23) | ((!(j2 ^ s)) << 22)
+            | ((h1 & 0x3ff) << 12) | ((h2 & 0x7ff) << 1);
+        off = sextract64(off, 0, 25);
+        switch (h2 & 0xd000) {
+        case 0xd000:    // BL
+            insn_direct(insn, PANDA_INSN_CALL, insn->pc + 4 + off);
+            break;
+        case 0xc000:    // BLX, to ARM
+            insn_direct(insn, PANDA_INSN_CALL, ((insn->pc + 4) & ~3) + off);
+            break;
+        case 0x9000:    // B.W
+            insn_direct(insn, PANDA_INSN_JUMP, insn->pc + 4 + off);
+            break;
+        }
+    } else if (h1 == 0xe8bd && (h2 & 0x8000)) {
+        insn->kind = PANDA_INSN_RET;
+    } else if (h1 == 0xf85d && h2 == 0xfb04) {
+        insn->kind = PANDA_INSN_RET;
+    }
+}
+
+static void decode_insn(InsnBytes *b, uint32_t flags, target_ulong cs_base,
+                        panda_insn *insn) {
+    int c[4], k;
+    bool a64 = false;
+#ifdef TARGET_AARCH64
+    a64 = ARM_TBFLAG_AARCH64_STATE(flags);
+#endif
+    if (!a64 && ARM_TBFLAG_THUMB(flags)) {
+        for (k = 0; k < 2; k++) {
+            if ((c[k] = insn_byte(b, k)) < 0) return;
+        }
+        uint32_t h1 = c[0] | (c[1] << 8);
+        if ((h1 >> 11) < 0x1d) {
+            decode_t16(h1, insn);
+            return;
+        }
+        for (k = 2; k < 4; k++) {
+            if ((c[k] = insn_byte(b, k)) < 0) return;
+        }
+        decode_t32(h1, c[2] | (c[3] << 8), insn);
+        return;
+    }
+    for (k = 0; k < 4; k++) {
+        if ((c[k] = insn_byte(b, k)) < 0) return;
+    }
+    uint32_t w = c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t) c[3] << 24);
+    if (a64) decode_a64(w, insn);
+    else decode_a32(w, insn);
+}
+
+#elif defined(TARGET_PPC)
+
+static void decode_insn(InsnBytes *b, uint32_t flags, target_ulong cs_base,
+                        panda_insn *insn) {
+    int c[4], k;
+    bool le = flags & (1 << MSR_LE);
+    for (k = 0; k < 4; k++) {
+        if ((c[k] = insn_byte(b, k)) < 0) return;
+    }
+    uint32_t w = le ? (c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t) c[3] << 24))
+                    : (((uint32_t) c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3]);
+    bool lk = w & 1, aa = w & 2;
+    int64_t off;
+    switch (w >> 26) {
+    case 18:    // b, bl
+        off = sextract64(w & 0x03fffffc, 0, 26);
+        insn_direct(insn, lk ? PANDA_INSN_CALL : PANDA_INSN_JUMP,
+                    (aa ? 0 : insn->pc) + off);
+        break;
+    case 16:    // bc
+        off = (int16_t) (w & 0xfffc);
+        insn_direct(insn, lk ? PANDA_INSN_CALL : PANDA_INSN_COND_JUMP,
+                    (aa ? 0 : insn->pc) + off);
+        break;
+    case 19:
+        switch ((w >> 1) & 0x3ff) {
+        case 16:    // bclr
+            insn->kind = lk ? PANDA_INSN_CALL : PANDA_INSN_RET;
+            break;
+        case 528:   // bcctr
+            insn->kind = lk ? PANDA_INSN_CALL : PANDA_INSN_JUMP;
+            break;
+        case 50:    // rfi
+            insn->kind = PANDA_INSN_SYSRET;
+            break;
+        }
+        break;
+    case 17:    // sc
+        insn_trap(insn, PANDA_INSN_SYSCALL, (w >> 5) & 0x7f);
+        break;
+    }
+}
+
+#endif
+
+void panda_enable_insn_cache(void) {
+    if (!panda_insn_cache_on) {
+        panda_insn_cache_on = true;
+        panda_do_flush_tb();
+    }
+}
+
+bool panda_insn_translating(CPUState *cpu, panda_insn *insn) {
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong pc, cs_base;
+    uint32_t flags;
+    if (!panda_probe_translating) return false;
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    memset(insn, 0, sizeof(*insn));
+    insn->pc = panda_probe_pc;
+    InsnBytes b = { env, panda_probe_pc, NULL, 0 };
+    decode_insn(&b, flags, cs_base, insn);
+    return true;
+}
+
+void panda_insn_cache_build(CPUState *cpu, TranslationBlock *tb) {
+    CPUArchState *env = cpu->env_ptr;
+    uint32_t n = tb->icount, i;
+    if (n == 0) return;
+
+    panda_tb_insns *ti = g_malloc(sizeof(*ti) + n * sizeof(panda_insn)
+                                  + tb->size);
+    ti->num_insns = n;
+    ti->size = tb->size;
+    ti->bytes = (uint8_t *) &ti->insns[n];
+    // the translator has just read all of these through the code TLB
+    for (i = 0; i < tb->size; i++) {
+        ti->bytes[i] = cpu_ldub_code(env, tb->pc + i);
+    }
+
+    for (i = 0; i < n; i++) {
+        panda_insn *insn = &ti->insns[i];
+        target_ulong pc = tcg_ctx.gen_insn_data[i][0];
+        target_ulong end = i + 1 < n ? tcg_ctx.gen_insn_data[i + 1][0]
+                                     : tb->pc + tb->size;
+        if (pc < tb->pc || end <= pc || end > tb->pc + tb->size
+            || end - pc > 0xff) {
+            // not laid out the way we expect; better no cache than a wrong one
+            g_free(ti);
+            return;
+        }
+        memset(insn, 0, sizeof(*insn));
+        insn->pc = pc;
+        insn->offset = pc - tb->pc;
+        insn->len = end - pc;
+        InsnBytes b = { env, pc, ti->bytes + insn->offset, insn->len };
+        decode_insn(&b, tb->flags, tb->cs_base, insn);
+    }
+    tb->panda_insns = ti;
+}
+
+void panda_insn_cache_free(TranslationBlock *tb) {
+    g_free(tb->panda_insns);
+    tb->panda_insns = NULL;
+}
+
+const panda_tb_insns *panda_tb_insns_get(TranslationBlock *tb) {
+    return tb->panda_insns;
+}
+
+const panda_insn *panda_tb_insn_at(TranslationBlock *tb, target_ulong pc) {
+    const panda_tb_insns *ti = tb->panda_insns;
+    uint32_t lo = 0, hi;
+    if (!ti) return NULL;
+    hi = ti->num_insns;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        const panda_insn *insn = &ti->insns[mid];
+        if (pc < insn->pc) hi = mid;
+        else if (pc >= insn->pc + insn->len) lo = mid + 1;
+        else return insn;
+    }
+    return NULL;
+}
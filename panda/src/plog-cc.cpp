@@ -3,6 +3,7 @@
 #include <math.h>
 #include <fstream>
 #include <memory>
+#include <algorithm>
 #include "panda/plog-cc.hpp"
 #include "panda/plog-cc-bridge.h"
 
@@ -12,6 +13,25 @@ using namespace std;
 extern int panda_in_main_loop;
 #endif
 
+static inline uint32_t stage_record_size(size_t n){
+    return sizeof(PlStageRecord) + ((n + 7) & ~(size_t) 7);
+}
+
+static PlStageBlock *new_stage_block(uint32_t size){
+    PlStageBlock *b = new PlStageBlock();
+    b->next.store(nullptr, std::memory_order_relaxed);
+    b->committed.store(0, std::memory_order_relaxed);
+    b->size = size;
+    b->data = (unsigned char *) malloc(size);
+    assert (b->data != NULL);
+    return b;
+}
+
+static void free_stage_block(PlStageBlock *b){
+    free(b->data);
+    delete b;
+}
+
 void PandaLog::create(uint32_t chunk_size) {
     this->chunk.size = chunk_size;
     this->chunk.zsize = chunk_size;
@@ -19,13 +39,61 @@ void PandaLog::create(uint32_t chunk_size) {
     // the invariant that all log entries for an instruction reside in same
     // chunk.  this should be big enough but don't worry, we'll be monitoring it.
     this->chunk.buf = (unsigned char *) malloc(this->chunk.size);
+    this->chunk.buf_size = this->chunk.size;
     this->chunk.buf_p = this->chunk.buf;
     this->chunk.zbuf = (unsigned char *) malloc(this->chunk.zsize);
     this->chunk.start_pos = PL_HEADER_SIZE;
     this->chunk.entries = std::vector<std::unique_ptr<panda::LogEntry>>();
+
+    // one bit per LogEntry field number in each chunk summary
+    const google::protobuf::Descriptor *desc = panda::LogEntry::descriptor();
+    int max_field = 0;
+    for (int i = 0; i < desc->field_count(); i++) {
+        max_field = std::max(max_field, desc->field(i)->number());
+    }
+    this->dir.field_words = max_field / 64 + 1;
+    reset_summary();
     return;
 }
 
+void PandaLog::reset_summary() {
+    PandalogCcChunkIndex *ci = &(this->chunk.index);
+    memset(&ci->summary, 0, sizeof(ci->summary));
+    ci->fields.assign(this->dir.field_words, 0);
+    ci->asid_runs.clear();
+}
+
+void PandaLog::add_to_summary(const unsigned char *buf, uint32_t n,
+                              uint64_t instr, uint64_t pc, uint64_t asid) {
+    PandalogCcChunkIndex *ci = &(this->chunk.index);
+    pandalog_scan_fields(buf, n, [ci](uint32_t field, uint64_t) {
+        if (field / 64 < ci->fields.size()) {
+            ci->fields[field / 64] |= 1ULL << (field % 64);
+        }
+        return true;
+    });
+
+    if (instr == (uint64_t) -1) return;
+    PlChunkSummary *s = &ci->summary;
+    if (s->num_ranged == 0) {
+        s->instr_lo = s->instr_hi = instr;
+        s->pc_lo = s->pc_hi = pc;
+        s->asid_lo = s->asid_hi = asid;
+    } else {
+        s->instr_lo = std::min(s->instr_lo, instr);
+        s->instr_hi = std::max(s->instr_hi, instr);
+        s->pc_lo = std::min(s->pc_lo, pc);
+        s->pc_hi = std::max(s->pc_hi, pc);
+        s->asid_lo = std::min(s->asid_lo, asid);
+        s->asid_hi = std::max(s->asid_hi, asid);
+    }
+    s->num_ranged++;
+    if (ci->asid_runs.empty() || ci->asid_runs.back().asid != asid) {
+        PlAsidRun run = { asid, this->chunk.ind_entry, 0 };
+        ci->asid_runs.push_back(run);
+    }
+}
+
 void PandaLog::read_dir(){
     PlHeader *plh = read_header();
 
@@ -63,7 +131,7 @@ void PandaLog::read_dir(){
     }
 
     // a little hack so unmarshall_chunk will work
-    this->dir.pos[num_chunks] = plh->dir_pos;
+    this->dir.pos.push_back(plh->dir_pos);
 }
 
 PlHeader* PandaLog::read_header(){
@@ -215,6 +283,7 @@ void PandaLog::write_dir(){
     
     plh.dir_pos = this->file->tellp();
     plh.chunk_size = this->chunk.size;
+    plh.sidx_pos = 0;
 
     printf("header: version=%d  dir_pos=%lu chunk_size=%d\n",
             plh.version, plh.dir_pos, plh.chunk_size);
@@ -229,9 +298,26 @@ void PandaLog::write_dir(){
         this->file->write((char*) &this->dir.num_entries[i], sizeof(this->dir.num_entries[i]));
     }
 
+    plh.sidx_pos = this->file->tellp();
+    write_sidx();
+
     write_header(&plh);
 }
 
+void PandaLog::write_sidx(){
+    uint32_t num_chunks = this->dir.sidx.size();
+    this->file->write((char*) &num_chunks, sizeof(num_chunks));
+    this->file->write((char*) &this->dir.field_words, sizeof(this->dir.field_words));
+
+    for (auto &ci : this->dir.sidx) {
+        this->file->write((char*) &ci.summary, sizeof(ci.summary));
+        this->file->write((char*) ci.fields.data(),
+                          ci.fields.size() * sizeof(uint64_t));
+        this->file->write((char*) ci.asid_runs.data(),
+                          ci.asid_runs.size() * sizeof(PlAsidRun));
+    }
+}
+
 void PandaLog::add_dir_entry(){
     // this is start instr and start file position for this chunk
     this->dir.instr.push_back(this->chunk.start_instr);
@@ -243,9 +329,23 @@ void PandaLog::add_dir_entry(){
 int PandaLog::close(){
 
     if (this->mode == PL_MODE_WRITE){
+        // other threads are done writing, so everything staged can go
+        while (this->merging.test_and_set(std::memory_order_acquire)) {}
+        merge(true);
         write_current_chunk();
         add_dir_entry();
         write_dir();
+
+        PlWriter *w = this->writers.exchange(nullptr);
+        while (w != nullptr) {
+            PlWriter *next = w->next;
+            free_stage_block(w->read_blk);
+            delete w;
+            w = next;
+        }
+        this->generation++;
+        this->mode = PL_MODE_UNKNOWN;
+        this->merging.clear(std::memory_order_release);
     }
 
     this->file->close();
@@ -265,6 +365,7 @@ void PandaLog::write_current_chunk(){
     // loop allows compress2 to fail and resize output buffer as needed
     uint32_t i;
     for (i=0; i<10; i++) {
+        ccs = this->chunk.zsize;
         ret = compress2(this->chunk.zbuf, &ccs, this->chunk.buf, chunk_sz, Z_BEST_COMPRESSION);
         
         if (ret == Z_OK) break;
@@ -286,8 +387,10 @@ void PandaLog::write_current_chunk(){
     this->file->write((char*)this->chunk.zbuf, ccs);
     //assert(this->)
     add_dir_entry();
-    // reset start instr / pos
-    this->chunk.start_instr = rr_get_guest_instr_count();
+    this->chunk.index.summary.num_asid_runs = this->chunk.index.asid_runs.size();
+    this->dir.sidx.push_back(this->chunk.index);
+    reset_summary();
+    // reset start pos, start instr comes with the next entry
     this->chunk.start_pos = this->file->tellg();
     // rewind chunk buf and inc chunk #
     this->chunk.buf_p = this->chunk.buf;
@@ -296,53 +399,219 @@ void PandaLog::write_current_chunk(){
 #endif
 }
 
-uint64_t last_instr_entry = -1;
+// Ties a thread to its writer, and gives the writer back when the thread
+// exits.  generation tells us if the log was closed since.
+struct PlThreadWriter {
+    PandaLog *log;
+    PlWriter *w;
+    uint32_t generation;
+    ~PlThreadWriter() {
+        if (log) log->retire_writer(w, generation);
+    }
+};
+
+static thread_local PlThreadWriter this_thread_writer;
 
-void PandaLog::write_entry(std::unique_ptr<panda::LogEntry> entry){
+PlWriter *PandaLog::this_writer(){
+    PlThreadWriter *tw = &this_thread_writer;
+    if (tw->log == this && tw->generation == this->generation) return tw->w;
+
+    // take over the writer of a thread that has exited, if there is one
+    PlWriter *w;
+    for (w = this->writers.load(); w != nullptr; w = w->next) {
+        bool busy = false;
+        if (w->in_use.compare_exchange_strong(busy, true)) break;
+    }
+    if (w == nullptr) {
+        w = new PlWriter();
+        w->in_use.store(true, std::memory_order_relaxed);
+        w->floor.store(UINT64_MAX, std::memory_order_relaxed);
+        w->cur = w->read_blk = new_stage_block(PL_STAGE_SIZE);
+        w->used = w->read_off = 0;
+        w->block_filled = false;
+        w->next = this->writers.load();
+        while (!this->writers.compare_exchange_weak(w->next, w)) {}
+    }
+    tw->log = this;
+    tw->w = w;
+    tw->generation = this->generation;
+    return w;
+}
+
+void PandaLog::retire_writer(PlWriter *w, uint32_t generation){
+    if (generation != this->generation) return;
+    w->floor.store(UINT64_MAX);
+    w->in_use.store(false, std::memory_order_release);
+}
+
+void PandaLog::stamp_entry(uint64_t *pc, uint64_t *instr){
+    PlWriter *w = this_writer();
+    // the floor must be up before we read now to key the entry, see merge
+    uint64_t floor = this->now.load();
+    w->floor.store(floor);
+    w->key = this->now.load();
+    w->asid = 0;
+    *pc = -1;
+    *instr = -1;
 #ifndef PLOG_READER
-    if (panda_in_main_loop) {
-        entry->set_pc(panda_current_pc(first_cpu));
-        entry->set_instr(rr_get_guest_instr_count());
+    // only vCPU threads have a current_cpu
+    CPUState *cpu = current_cpu;
+    if (panda_in_main_loop && cpu) {
+        *pc = panda_current_pc(cpu);
+        *instr = rr_get_guest_instr_count();
+        w->asid = panda_current_asid(cpu);
+        w->key = std::max(*instr, floor);
+        uint64_t seen = floor;
+        while (seen < w->key && !this->now.compare_exchange_weak(seen, w->key)) {}
     }
-    else {
-        entry->set_pc(-1);
-        entry->set_instr(-1);
+#endif
+}
+
+unsigned char *PandaLog::reserve_entry(size_t n, uint64_t instr){
+    PlWriter *w = this_writer();
+    uint32_t rec = stage_record_size(n);
+    if (w->used + rec > w->cur->size) {
+        // this block is done, the merger frees it once it has read it
+        PlStageBlock *b = new_stage_block(std::max(rec, (uint32_t) PL_STAGE_SIZE));
+        w->cur->next.store(b, std::memory_order_release);
+        w->cur = b;
+        w->used = 0;
+        w->block_filled = true;
     }
+    return w->cur->data + w->used + sizeof(PlStageRecord);
+}
 
-    size_t n = entry->ByteSize();
+void PandaLog::commit_entry(size_t n, uint64_t pc, uint64_t instr){
+    PlWriter *w = this_writer();
+    PlStageRecord *rec = (PlStageRecord *) (w->cur->data + w->used);
+    rec->n = n;
+    rec->pad = 0;
+    rec->key = w->key;
+    rec->instr = instr;
+    rec->pc = pc;
+    rec->asid = w->asid;
+    w->used += stage_record_size(n);
+    // publish the entry before dropping the floor, see merge
+    w->cur->committed.store(w->used, std::memory_order_release);
+    w->floor.store(UINT64_MAX);
+
+    if (w->block_filled) {
+        w->block_filled = false;
+        // arena entries are dead once serialized
+        w->arena.Reset();
+        // if someone else is merging they will pick up our entries
+        if (this->mode == PL_MODE_WRITE
+            && !this->merging.test_and_set(std::memory_order_acquire)) {
+            merge(false);
+            this->merging.clear(std::memory_order_release);
+        }
+    }
+}
 
-    // invariant: all log entries for an instruction belong in a single chunk
-    if(last_instr_entry != -1 
-        && (last_instr_entry != entry->instr())
-        && (this->chunk.buf_p + n  >= this->chunk.buf + this->chunk.size)) {
-        // if entry won't fit in current chunk
-        // and new entry is a different instr from last entry written
-            write_current_chunk();
+// next entry of this writer's the merger hasn't taken, or NULL
+static const PlStageRecord *next_staged(PlWriter *w){
+    while (true) {
+        PlStageBlock *b = w->read_blk;
+        if (w->read_off < b->committed.load(std::memory_order_acquire)) {
+            return (const PlStageRecord *) (b->data + w->read_off);
+        }
+        PlStageBlock *next = b->next.load(std::memory_order_acquire);
+        if (next == nullptr) return nullptr;
+        // committed is final now that the writer has moved on
+        if (w->read_off < b->committed.load(std::memory_order_acquire)) continue;
+        w->read_blk = next;
+        w->read_off = 0;
+        free_stage_block(b);
     }
+}
 
-    // create another chunk
-    if (this->chunk.buf_p + sizeof(uint32_t) + n
-        >= this->chunk.buf + ((int)(floor(this->chunk.size)))) {
+void PandaLog::merge(bool all){
+    // A writer raises its floor before reading now to key an entry, and
+    // only drops it after committing.  So reading now first and then the
+    // floors, no entry we can't see yet can be keyed below limit.  That
+    // holds for writers that register after we look, too.
+    uint64_t limit = UINT64_MAX;
+    if (!all) {
+        limit = this->now.load();
+        for (PlWriter *w = this->writers.load(); w != nullptr; w = w->next) {
+            limit = std::min(limit, w->floor.load());
+        }
+    }
 
-        uint32_t offset = this->chunk.buf_p - this->chunk.buf;
-        uint32_t new_size = offset * 2;
-        this->chunk.buf = (unsigned char *) realloc(this->chunk.buf, new_size);
-        this->chunk.buf_p = this->chunk.buf + offset;
+    // each writer's entries are in key order, so merge them
+    while (true) {
+        PlWriter *best = nullptr;
+        const PlStageRecord *best_rec = nullptr;
+        for (PlWriter *w = this->writers.load(); w != nullptr; w = w->next) {
+            const PlStageRecord *rec = next_staged(w);
+            if (rec == nullptr || (!all && rec->key >= limit)) continue;
+            if (best_rec == nullptr || rec->key < best_rec->key) {
+                best = w;
+                best_rec = rec;
+            }
+        }
+        if (best == nullptr) break;
+        append_to_chunk(best_rec);
+        best->read_off += stage_record_size(best_rec->n);
+    }
+}
+
+void PandaLog::append_to_chunk(const PlStageRecord *rec){
+    uint32_t n = rec->n;
+    // invariant: all log entries for an instruction belong in a single chunk
+    // nothing keyed last_key can come after a different key, so if this
+    // entry won't fit and starts a new key the chunk can go
+    if (this->chunk.ind_entry > 0
+        && rec->key != this->last_key
+        && (this->chunk.buf_p + n >= this->chunk.buf + this->chunk.size)) {
+        write_current_chunk();
+    }
+
+    // grow the chunk buffer to keep this instr's entries together
+    uint32_t offset = this->chunk.buf_p - this->chunk.buf;
+    if (offset + sizeof(uint32_t) + n >= this->chunk.buf_size) {
+        while (offset + sizeof(uint32_t) + n >= this->chunk.buf_size) {
+            this->chunk.buf_size *= 2;
+        }
+        this->chunk.buf = (unsigned char *) realloc(this->chunk.buf, this->chunk.buf_size);
         assert (this->chunk.buf != NULL);
+        this->chunk.buf_p = this->chunk.buf + offset;
     }
 
-    // now write the entry itself to the buffer.  size then entry itself
+    if (this->chunk.ind_entry == 0) this->chunk.start_instr = rec->key;
+
+    // entry goes in the buffer as its size then the entry itself (packed)
     *((uint32_t *) this->chunk.buf_p) = n;
-    this->chunk.buf_p += sizeof(uint32_t);
-    // and then the entry itself (packed)
-    entry->SerializeToArray(this->chunk.buf_p, n);
-    this->chunk.buf_p += n;
-    // remember instr for last entry
-    last_instr_entry = entry->instr();
+    unsigned char *p = this->chunk.buf_p + sizeof(uint32_t);
+    memcpy(p, rec + 1, n);
+    add_to_summary(p, n, rec->instr, rec->pc, rec->asid);
+    this->chunk.buf_p = p + n;
+    this->last_key = rec->key;
     this->chunk.ind_entry ++;
+}
+
+panda::LogEntry *PandaLog::new_entry(){
+    return google::protobuf::Arena::CreateMessage<panda::LogEntry>(&this_writer()->arena);
+}
+
+void PandaLog::write_entry(panda::LogEntry *entry){
+#ifndef PLOG_READER
+    uint64_t pc, instr;
+    stamp_entry(&pc, &instr);
+    entry->set_pc(pc);
+    entry->set_instr(instr);
+
+    size_t n = entry->ByteSizeLong();
+    unsigned char *p = reserve_entry(n, instr);
+    entry->SerializeWithCachedSizesToArray(p);
+    commit_entry(n, pc, instr);
 #endif
 }
 
+void PandaLog::write_entry(std::unique_ptr<panda::LogEntry> entry){
+    write_entry(entry.get());
+}
+
 void PandaLog::unmarshall_chunk(uint32_t chunk_num){  
     printf ("unmarshalling chunk %d\n", chunk_num);
     PandalogCcChunk *chunk = &(this->chunk);
@@ -506,10 +775,23 @@ void pandalog_cc_close(){
 // and write it to the log
 void pandalog_write_packed(size_t entry_size, unsigned char* buf){
     
-    std::unique_ptr<panda::LogEntry> ple (new panda::LogEntry());
+    panda::LogEntry *ple = globalLog.new_entry();
     ple->ParseFromArray(buf, entry_size);
     
-    globalLog.write_entry(std::move(ple));
+    globalLog.write_entry(ple);
+}
+
+// plog.c packs C entries straight into the staging buffers with these
+void pandalog_cc_stamp(uint64_t *pc, uint64_t *instr){
+    globalLog.stamp_entry(pc, instr);
+}
+
+unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr){
+    return globalLog.reserve_entry(entry_size, instr);
+}
+
+void pandalog_cc_commit(size_t entry_size, uint64_t pc, uint64_t instr){
+    globalLog.commit_entry(entry_size, pc, instr);
 }
 
 // Pack an entry into binary protobuf data
@@ -0,0 +1,276 @@
+/**
+ *
+ * Random-access, filtered reader for C++ pandalogs.
+ * See plog-query.hpp for an overview and plog-cc.hpp for the file format.
+ *
+ */
+
+// Reading only needs the file format, not the rr / cpu state used to write.
+#define PLOG_READER
+
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "panda/plog-query.hpp"
+
+using namespace std;
+
+static bool pread_all(int fd, void *buf, size_t len, uint64_t off) {
+    unsigned char *p = (unsigned char *) buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n <= 0) return false;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool PandaLogReader::open(const char *path) {
+    close();
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("pandalog open for read failed");
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    if (!pread_all(fd, &header, sizeof(header), 0)) {
+        fprintf(stderr, "%s: short pandalog header\n", path);
+        close();
+        return false;
+    }
+    if (header.version < 2 || header.version > PL_CURRENT_VERSION) {
+        fprintf(stderr, "%s: unsupported pandalog version %u\n", path,
+                header.version);
+        close();
+        return false;
+    }
+    // version 2 logs have zeroes where sidx_pos goes
+    if (header.version < 3) header.sidx_pos = 0;
+
+    uint32_t num_chunks;
+    if (!pread_all(fd, &num_chunks, sizeof(num_chunks), header.dir_pos)) {
+        fprintf(stderr, "%s: can't read pandalog directory\n", path);
+        close();
+        return false;
+    }
+    vector<uint64_t> raw(3 * (size_t) num_chunks);
+    if (num_chunks && !pread_all(fd, raw.data(), raw.size() * sizeof(uint64_t),
+                                 header.dir_pos + sizeof(num_chunks))) {
+        fprintf(stderr, "%s: truncated pandalog directory\n", path);
+        close();
+        return false;
+    }
+    dir.num_chunks = num_chunks;
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        dir.instr.push_back(raw[3*i]);
+        dir.pos.push_back(raw[3*i+1]);
+        dir.num_entries.push_back(raw[3*i+2]);
+    }
+    // chunk i's compressed data ends where chunk i+1 (or the dir) starts
+    dir.pos.push_back(header.dir_pos);
+
+    if (header.sidx_pos && !read_sidx()) {
+        fprintf(stderr, "%s: ignoring bad chunk summaries\n", path);
+        sidx.clear();
+    }
+    return true;
+}
+
+bool PandaLogReader::read_sidx(void) {
+    uint32_t hdr[2];
+    uint64_t off = header.sidx_pos;
+    if (!pread_all(fd, hdr, sizeof(hdr), off)) return false;
+    off += sizeof(hdr);
+    if (hdr[0] != dir.num_chunks) return false;
+    dir.field_words = hdr[1];
+
+    sidx.resize(dir.num_chunks);
+    for (auto &ci : sidx) {
+        if (!pread_all(fd, &ci.summary, sizeof(ci.summary), off)) return false;
+        off += sizeof(ci.summary);
+        ci.fields.resize(dir.field_words);
+        if (!pread_all(fd, ci.fields.data(), dir.field_words * sizeof(uint64_t), off)) {
+            return false;
+        }
+        off += dir.field_words * sizeof(uint64_t);
+        ci.asid_runs.resize(ci.summary.num_asid_runs);
+        size_t runs_size = ci.asid_runs.size() * sizeof(PlAsidRun);
+        if (runs_size && !pread_all(fd, ci.asid_runs.data(), runs_size, off)) {
+            return false;
+        }
+        off += runs_size;
+    }
+    return true;
+}
+
+void PandaLogReader::close(void) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    dir = PandalogCcDir();
+    sidx.clear();
+}
+
+static inline bool overlaps(uint64_t lo1, uint64_t hi1, uint64_t lo2, uint64_t hi2) {
+    return lo1 <= hi2 && lo2 <= hi1;
+}
+
+bool PandaLogReader::chunk_may_match(uint32_t c, const PandaLogQuery &q) const {
+    if (sidx.empty()) {
+        // only the directory to go on: chunk c holds instrs from its start
+        // up to the next chunk's start
+        uint64_t hi = (c + 1 < dir.num_chunks) ? dir.instr[c+1] : UINT64_MAX;
+        return overlaps(dir.instr[c], hi, q.instr_lo, q.instr_hi);
+    }
+
+    const PandalogCcChunkIndex &ci = sidx[c];
+    if (!q.fields.empty()) {
+        bool any = false;
+        for (uint32_t f : q.fields) {
+            // fields the writer didn't know about can't be ruled out
+            if (f / 64 >= ci.fields.size() || (ci.fields[f / 64] >> (f % 64)) & 1) {
+                any = true;
+                break;
+            }
+        }
+        if (!any) return false;
+    }
+
+    const PlChunkSummary &s = ci.summary;
+    // entries written outside the main loop have instr == pc == -1 and
+    // aren't in the ranges
+    bool unranged = s.num_ranged < dir.num_entries[c];
+    if (unranged && !q.match_asid && q.instr_hi == UINT64_MAX
+            && q.pc_hi == UINT64_MAX) {
+        return true;
+    }
+    if (s.num_ranged == 0) return false;
+    return overlaps(s.instr_lo, s.instr_hi, q.instr_lo, q.instr_hi)
+        && overlaps(s.pc_lo, s.pc_hi, q.pc_lo, q.pc_hi)
+        && (!q.match_asid || overlaps(s.asid_lo, s.asid_hi, q.asid_lo, q.asid_hi));
+}
+
+bool PandaLogReader::decode_chunk(uint32_t c, const PandaLogQuery &q,
+                                  const vector<uint64_t> &field_mask,
+                                  vector<unsigned char> &buf,
+                                  vector<unsigned char> &zbuf,
+                                  vector<panda::LogEntry> &out) const {
+    uint64_t zsize = chunk_zsize(c);
+    zbuf.resize(zsize);
+    if (!pread_all(fd, zbuf.data(), zsize, dir.pos[c])) {
+        fprintf(stderr, "pandalog: can't read chunk %u\n", c);
+        return false;
+    }
+
+    if (buf.size() < header.chunk_size) buf.resize(header.chunk_size);
+    unsigned long size;
+    int ret;
+    while (true) {
+        size = buf.size();
+        ret = uncompress(buf.data(), &size, zbuf.data(), zsize);
+        if (ret != Z_BUF_ERROR) break;
+        // writer grows chunks past chunk_size to keep an instr's entries together
+        buf.resize(buf.size() * 2);
+    }
+    if (ret != Z_OK) {
+        fprintf(stderr, "pandalog: decompressing chunk %u failed (%d)\n", c, ret);
+        return false;
+    }
+
+    const PandalogCcChunkIndex *ci = summary(c);
+    size_t run = 0;
+    const unsigned char *p = buf.data(), *end = buf.data() + size;
+    for (uint32_t e = 0; e < dir.num_entries[c] && p + sizeof(uint32_t) <= end; e++) {
+        uint32_t n = *(const uint32_t *) p;
+        p += sizeof(uint32_t);
+        if (p + n > end) break;
+
+        uint64_t pc = 0, instr = 0;
+        bool has_field = q.fields.empty();
+        pandalog_scan_fields(p, n, [&](uint32_t field, uint64_t value) {
+            if (field == panda::LogEntry::kPcFieldNumber) pc = value;
+            if (field == panda::LogEntry::kInstrFieldNumber) instr = value;
+            if (field / 64 < field_mask.size()
+                    && (field_mask[field / 64] >> (field % 64)) & 1) {
+                has_field = true;
+            }
+            return true;
+        });
+
+        bool match = has_field
+            && q.instr_lo <= instr && instr <= q.instr_hi
+            && q.pc_lo <= pc && pc <= q.pc_hi;
+        if (match && q.match_asid) {
+            // asid runs only cover entries written from the main loop
+            while (ci && run + 1 < ci->asid_runs.size()
+                    && ci->asid_runs[run+1].first_entry <= e) {
+                run++;
+            }
+            match = ci && instr != (uint64_t) -1 && run < ci->asid_runs.size()
+                && ci->asid_runs[run].first_entry <= e
+                && q.asid_lo <= ci->asid_runs[run].asid
+                && ci->asid_runs[run].asid <= q.asid_hi;
+        }
+        if (match) {
+            out.emplace_back();
+            out.back().ParseFromArray(p, n);
+        }
+        p += n;
+    }
+    return true;
+}
+
+uint64_t PandaLogReader::query(const PandaLogQuery &q,
+                               function<bool(const panda::LogEntry &)> fn) {
+    chunks_read = 0;
+    if (fd < 0) return 0;
+
+    vector<uint32_t> todo;
+    for (uint32_t c = 0; c < dir.num_chunks; c++) {
+        if (chunk_may_match(c, q)) todo.push_back(c);
+    }
+
+    vector<uint64_t> field_mask;
+    for (uint32_t f : q.fields) {
+        if (f / 64 >= field_mask.size()) field_mask.resize(f / 64 + 1);
+        field_mask[f / 64] |= 1ULL << (f % 64);
+    }
+
+    // Decode a batch of chunks in parallel, then hand their entries out in
+    // order.  Batches keep memory bounded to a few chunks per thread.
+    uint64_t delivered = 0;
+    size_t batch = 2 * num_threads;
+    vector<vector<panda::LogEntry>> results(batch);
+    for (size_t first = 0; first < todo.size(); first += batch) {
+        size_t count = min(batch, todo.size() - first);
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            vector<unsigned char> buf, zbuf;
+            size_t i;
+            while ((i = next++) < count) {
+                results[i].clear();
+                decode_chunk(todo[first + i], q, field_mask, buf, zbuf, results[i]);
+            }
+        };
+        vector<thread> threads;
+        for (unsigned t = 1; t < min<size_t>(num_threads, count); t++) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &t : threads) t.join();
+        chunks_read += count;
+
+        for (size_t i = 0; i < count; i++) {
+            for (const auto &entry : results[i]) {
+                delivered++;
+                if (!fn(entry)) return delivered;
+            }
+        }
+    }
+    return delivered;
+}
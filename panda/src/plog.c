@@ -26,6 +26,14 @@
   next compressed chunk data will go right after the previous
   compressed chunk data.
 
+  Entries can be written from any thread.  Each thread packs its
+  entries into its own staging blocks, and whichever thread fills a
+  block merges what has been staged into the chunk buffer in order of
+  instruction count (entries written outside the main loop are
+  ordered by the last instruction logged before them).  Entries are
+  only merged once no thread can still write an earlier one, so the
+  chunks come out sorted just as with a single writer.
+
   CHUNKS section is just a sequence of compressed chunk data, varying
   in length.  Only way to tell where one compressed chunk starts and
   next ends is via the DIRECTORY.
@@ -58,6 +66,7 @@
 #include "panda/rr/rr_log.h"
 #endif
 
+#include <assert.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -74,19 +83,65 @@ extern void pandalog_cc_init_write(const char* path);
 extern void pandalog_cc_init_read_bwd(const char* path);
 extern void pandalog_cc_seek(uint64_t);
 extern void pandalog_cc_close(void);
+extern void pandalog_cc_stamp(uint64_t *pc, uint64_t *instr);
+extern unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr);
+extern void pandalog_cc_commit(size_t entry_size, uint64_t pc, uint64_t instr);
 
 void pandalog_open_read(const char *path, uint32_t pl_mode);
 
 
+// Scratch memory for the sub-messages of entries being built.  It is a
+// list of blocks that are bumped through and rewound after each entry is
+// written, so once warmed up building an entry doesn't malloc at all.
+// Each thread that logs gets its own list.
+#define PL_SCRATCH_BLOCK (64 * 1024)
+
+typedef struct pandalog_scratch_struct {
+    struct pandalog_scratch_struct *next;
+    size_t size;
+    size_t used;
+    uint64_t data[];
+} PlScratch;
+
+static __thread PlScratch *scratch_head, *scratch_cur;
+
+void *pandalog_alloc(size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    while (scratch_cur == NULL || scratch_cur->used + size > scratch_cur->size) {
+        PlScratch *next = scratch_cur ? scratch_cur->next : scratch_head;
+        if (next == NULL || next->size < size) {
+            size_t bsize = size > PL_SCRATCH_BLOCK ? size : PL_SCRATCH_BLOCK;
+            PlScratch *b = malloc(sizeof(PlScratch) + bsize);
+            assert(b != NULL);
+            b->size = bsize;
+            b->next = next;
+            if (scratch_cur) scratch_cur->next = b;
+            else scratch_head = b;
+            next = b;
+        }
+        next->used = 0;
+        scratch_cur = next;
+    }
+    void *p = (unsigned char *) scratch_cur->data + scratch_cur->used;
+    scratch_cur->used += size;
+    return p;
+}
+
+static void pandalog_scratch_reset(void) {
+    scratch_cur = scratch_head;
+    if (scratch_cur) scratch_cur->used = 0;
+}
+
 void pandalog_write_entry(Panda__LogEntry *entry) {
-	// Pack this entry and pass it on to a C++ interface
-		
+#ifndef PLOG_READER
+	// Pack this entry straight into this thread's staging block
+	pandalog_cc_stamp(&entry->pc, &entry->instr);
 	size_t packed_size = panda__log_entry__get_packed_size(entry);
-	unsigned char* buf = malloc(packed_size);
+	unsigned char *buf = pandalog_cc_reserve(packed_size, entry->instr);
 	panda__log_entry__pack(entry, buf);
-
-	pandalog_write_packed(packed_size, buf);
-  free(buf);
+	pandalog_cc_commit(packed_size, entry->pc, entry->instr);
+#endif
+	pandalog_scratch_reset();
 }
 
 void pandalog_open_read(const char *path, uint32_t pl_mode) {
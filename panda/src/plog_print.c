@@ -291,6 +291,17 @@ void pprint_ple(Panda__LogEntry *ple) {
     if (ple->has_taint_label_physical_addr) {
         printf (" pa=0x%" PRIx64 , ple->taint_label_physical_addr);
     }
+    // from taint2_label_ram_range
+    if (ple->taint_label_range) {
+        Panda__TaintLabelRange *tlr = ple->taint_label_range;
+        printf (" taint_label_range va=0x%" PRIx64 " len=%u tl=%u%s pa=[",
+                tlr->vaddr, tlr->len, tlr->label,
+                tlr->positional ? " positional" : "");
+        for (size_t i = 0; i < tlr->n_paddr; i++) {
+            printf ("%s0x%" PRIx64, i ? "," : "", tlr->paddr[i]);
+        }
+        printf ("]");
+    }
 
     if (ple->call_stack) {
         pprint_call_stack(ple->call_stack);
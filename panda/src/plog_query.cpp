@@ -0,0 +1,158 @@
+/*
+ * Query a C++ pandalog without reading all of it.
+ *
+ * Prints the entries that match the given filters, one per line in protobuf
+ * text format.  Chunks whose summaries rule out a match are never
+ * decompressed, and the rest are decoded in parallel (see plog-query.hpp).
+ *
+ * Built as part of Panda's make as plog_query in each softmmu build dir.
+ *
+ * USAGE: plog_query [options] <plog>
+ *   -f name[,name...]  only entries with one of these LogEntry fields,
+ *                      e.g. -f tainted_branch,tainted_instr
+ *   -i lo-hi           only entries with instr in [lo, hi]
+ *   -p lo-hi           only entries with pc in [lo, hi]
+ *   -a lo[-hi]         only entries written while the guest asid was in [lo, hi]
+ *   -j threads         decode this many chunks at once (default: #cpus)
+ *   -n max             stop after max entries
+ *   -c                 just count matching entries
+ *   -s                 print the chunk directory and summaries
+ *
+ * Either end of a range may be left out, e.g. -i 1000000- or -p -0x80000000.
+ * Numbers may be decimal or 0x hex.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+    #include <inttypes.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <stdint.h>
+    #include <string.h>
+    #include <unistd.h>
+}
+
+#include <string>
+#include <thread>
+
+#include "panda/plog-query.hpp"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "USAGE: %s [-f field,...] [-i lo-hi] [-p lo-hi] [-a lo-hi]\n"
+            "          [-j threads] [-n max] [-c] [-s] <plog>\n", prog);
+    exit(1);
+}
+
+static bool parse_num(const char *s, const char *end, uint64_t *val) {
+    if (s == end) return true;   // leave default
+    char *e;
+    *val = strtoull(s, &e, 0);
+    return e == end;
+}
+
+// "lo-hi", "lo-", "-hi" or a single value
+static void parse_range(const char *prog, const char *arg, uint64_t *lo, uint64_t *hi) {
+    const char *dash = strchr(arg, '-');
+    const char *end = arg + strlen(arg);
+    bool ok;
+    if (dash == NULL) {
+        ok = parse_num(arg, end, lo);
+        *hi = *lo;
+    } else {
+        ok = parse_num(arg, dash, lo) && parse_num(dash + 1, end, hi);
+    }
+    if (!ok || *lo > *hi) {
+        fprintf(stderr, "bad range %s\n", arg);
+        usage(prog);
+    }
+}
+
+static void parse_fields(const char *prog, const char *arg, std::vector<uint32_t> &fields) {
+    const google::protobuf::Descriptor *desc = panda::LogEntry::descriptor();
+    std::string names(arg);
+    size_t start = 0;
+    while (start <= names.size()) {
+        size_t comma = names.find(',', start);
+        if (comma == std::string::npos) comma = names.size();
+        std::string name = names.substr(start, comma - start);
+        const google::protobuf::FieldDescriptor *fd = desc->FindFieldByName(name);
+        if (fd == NULL) {
+            fprintf(stderr, "LogEntry has no field %s\n", name.c_str());
+            usage(prog);
+        }
+        fields.push_back(fd->number());
+        start = comma + 1;
+    }
+}
+
+static void print_summaries(PandaLogReader &plr) {
+    for (uint32_t c = 0; c < plr.num_chunks(); c++) {
+        printf("chunk %u: start_instr=%" PRIu64 " entries=%" PRIu64 " zsize=%" PRIu64 "\n",
+               c, plr.chunk_start_instr(c), plr.chunk_entries(c), plr.chunk_zsize(c));
+        const PandalogCcChunkIndex *ci = plr.summary(c);
+        if (ci == NULL) continue;
+        const PlChunkSummary &s = ci->summary;
+        printf("  instr %" PRIu64 "-%" PRIu64 " pc 0x%" PRIx64 "-0x%" PRIx64
+               " asid 0x%" PRIx64 "-0x%" PRIx64 " (%u asid runs)\n",
+               s.instr_lo, s.instr_hi, s.pc_lo, s.pc_hi, s.asid_lo, s.asid_hi,
+               s.num_asid_runs);
+        printf("  fields:");
+        const google::protobuf::Descriptor *desc = panda::LogEntry::descriptor();
+        for (size_t w = 0; w < ci->fields.size(); w++) {
+            for (int b = 0; b < 64; b++) {
+                if (!((ci->fields[w] >> b) & 1)) continue;
+                const google::protobuf::FieldDescriptor *fd =
+                    desc->FindFieldByNumber(w * 64 + b);
+                if (fd) printf(" %s", fd->name().c_str());
+                else printf(" #%zu", w * 64 + b);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main (int argc, char **argv) {
+    PandaLogQuery q;
+    unsigned threads = std::thread::hardware_concurrency();
+    uint64_t max = UINT64_MAX;
+    bool count_only = false, summaries = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:i:p:a:j:n:cs")) != -1) {
+        switch (opt) {
+        case 'f': parse_fields(argv[0], optarg, q.fields); break;
+        case 'i': parse_range(argv[0], optarg, &q.instr_lo, &q.instr_hi); break;
+        case 'p': parse_range(argv[0], optarg, &q.pc_lo, &q.pc_hi); break;
+        case 'a':
+            q.match_asid = true;
+            parse_range(argv[0], optarg, &q.asid_lo, &q.asid_hi);
+            break;
+        case 'j': threads = strtoul(optarg, NULL, 0); break;
+        case 'n': max = strtoull(optarg, NULL, 0); break;
+        case 'c': count_only = true; break;
+        case 's': summaries = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    PandaLogReader plr;
+    if (!plr.open(argv[optind])) exit(1);
+    plr.set_threads(threads);
+
+    if (summaries) {
+        print_summaries(plr);
+        return 0;
+    }
+
+    uint64_t n = plr.query(q, [&](const panda::LogEntry &ple) {
+        if (!count_only) printf("%s\n", ple.ShortDebugString().c_str());
+        return --max != 0;
+    });
+    if (count_only) printf("%" PRIu64 "\n", n);
+    fprintf(stderr, "%" PRIu64 " entries from %u of %u chunks\n", n,
+            plr.last_chunks_read(), plr.num_chunks());
+    return 0;
+}
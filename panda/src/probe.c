@@ -0,0 +1,156 @@
+/*
+ * PANDA probes: inline instrumentation for single guest insns.
+ *
+ * A PANDA_CB_INSN_TRANSLATE callback that only wants to count an insn,
+ * note its pc or set a flag would otherwise have to return true and pay
+ * for a helper call, plus a walk of the PANDA_CB_INSN_EXEC list, every time
+ * the insn runs.  Instead it can ask for a probe here, and the TCG ops for
+ * it are emitted right away, ahead of the insn's own ops.  The only probes
+ * that leave generated code are panda_probe_call*, and panda_probe_call_if
+ * tests its predicate inline first.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg-op.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
+
+#include "panda/plugin.h"
+#include "panda/callback_support.h"
+
+bool panda_probe_translating = false;
+target_ulong panda_probe_pc;
+bool panda_probes_emitted = false;
+
+static void probe_start(void) {
+    assert(panda_probe_translating);
+    panda_probes_emitted = true;
+}
+
+void panda_probe_count(uint64_t *counter) {
+    probe_start();
+    TCGv_ptr ptr = tcg_const_ptr(counter);
+    TCGv_i64 val = tcg_temp_new_i64();
+    tcg_gen_ld_i64(val, ptr, 0);
+    tcg_gen_addi_i64(val, val, 1);
+    tcg_gen_st_i64(val, ptr, 0);
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(ptr);
+}
+
+void panda_probe_set_flag(uint8_t *flag, uint8_t value) {
+    probe_start();
+    TCGv_ptr ptr = tcg_const_ptr(flag);
+    TCGv_i32 val = tcg_const_i32(value);
+    tcg_gen_st8_i32(val, ptr, 0);
+    tcg_temp_free_i32(val);
+    tcg_temp_free_ptr(ptr);
+}
+
+void panda_probe_ring_append(panda_probe_ring *ring) {
+    probe_start();
+    // the slot offset is computed in 32 bits and sign extended
+    assert(ring->mask <= 0x0fffffff && (ring->mask & (ring->mask + 1)) == 0);
+
+    // buf[head & mask] = pc; head++
+    TCGv_ptr rp = tcg_const_ptr(ring);
+    TCGv_i32 head = tcg_temp_new_i32();
+    TCGv_i32 off = tcg_temp_new_i32();
+    tcg_gen_ld_i32(head, rp, offsetof(panda_probe_ring, head));
+    tcg_gen_andi_i32(off, head, ring->mask);
+    tcg_gen_shli_i32(off, off, 3);
+    tcg_gen_addi_i32(head, head, 1);
+    tcg_gen_st_i32(head, rp, offsetof(panda_probe_ring, head));
+    tcg_temp_free_i32(head);
+    tcg_temp_free_ptr(rp);
+
+    TCGv_ptr slot = tcg_temp_new_ptr();
+    TCGv_ptr buf = tcg_const_ptr(ring->buf);
+    tcg_gen_ext_i32_ptr(slot, off);
+    tcg_gen_add_ptr(slot, slot, buf);
+    TCGv_i64 pc = tcg_const_i64(panda_probe_pc);
+    tcg_gen_st_i64(pc, slot, 0);
+    tcg_temp_free_i64(pc);
+    tcg_temp_free_ptr(buf);
+    tcg_temp_free_ptr(slot);
+    tcg_temp_free_i32(off);
+}
+
+static void gen_probe_call(panda_probe_fn fn, void *opaque) {
+    TCGv_ptr fnp = tcg_const_ptr(fn);
+    TCGv_ptr op = tcg_const_ptr(opaque);
+    TCGv pc = tcg_const_tl(panda_probe_pc);
+    gen_helper_panda_probe_call(fnp, op, pc);
+    tcg_temp_free(pc);
+    tcg_temp_free_ptr(op);
+    tcg_temp_free_ptr(fnp);
+}
+
+void panda_probe_call(panda_probe_fn fn, void *opaque) {
+    probe_start();
+    gen_probe_call(fn, opaque);
+}
+
+void panda_probe_call_if(const uint32_t *word, uint32_t mask,
+                         panda_probe_fn fn, void *opaque) {
+    probe_start();
+    TCGLabel *skip = gen_new_label();
+    TCGv_ptr ptr = tcg_const_ptr(word);
+    TCGv_i32 val = tcg_temp_new_i32();
+    tcg_gen_ld_i32(val, ptr, 0);
+    tcg_gen_andi_i32(val, val, mask);
+    tcg_temp_free_ptr(ptr);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, val, 0, skip);
+    tcg_temp_free_i32(val);
+    gen_probe_call(fn, opaque);
+    gen_set_label(skip);
+}
+
+// (*slot)++, saturating at 0xff so a hot block never reads back as unhit:
+// 0x100 >> 8 is the 1 to take back off
+static void gen_cov_bump(TCGv_ptr slot, TCGv_i32 val) {
+    TCGv_i32 carry = tcg_temp_new_i32();
+    tcg_gen_ld8u_i32(val, slot, 0);
+    tcg_gen_addi_i32(val, val, 1);
+    tcg_gen_shri_i32(carry, val, 8);
+    tcg_gen_sub_i32(val, val, carry);
+    tcg_gen_st8_i32(val, slot, 0);
+    tcg_temp_free_i32(carry);
+}
+
+void panda_probe_cov(panda_probe_cov_map *cov, uint32_t id) {
+    probe_start();
+    assert(cov->mask <= 0x0fffffff && (cov->mask & (cov->mask + 1)) == 0);
+
+    // blocks[id & mask]++
+    TCGv_ptr cp = tcg_const_ptr(cov);
+    TCGv_ptr slot = tcg_temp_new_ptr();
+    TCGv_i32 val = tcg_temp_new_i32();
+    tcg_gen_ld_ptr(slot, cp, offsetof(panda_probe_cov_map, blocks));
+    tcg_gen_addi_ptr(slot, slot, id & cov->mask);
+    gen_cov_bump(slot, val);
+
+    // edges[(prev ^ id) & mask]++; prev = id >> 1
+    TCGv_i32 idx = tcg_temp_new_i32();
+    TCGv_ptr off = tcg_temp_new_ptr();
+    tcg_gen_ld_i32(idx, cp, offsetof(panda_probe_cov_map, prev));
+    tcg_gen_xori_i32(idx, idx, id);
+    tcg_gen_andi_i32(idx, idx, cov->mask);
+    tcg_gen_ext_i32_ptr(off, idx);
+    tcg_gen_ld_ptr(slot, cp, offsetof(panda_probe_cov_map, edges));
+    tcg_gen_add_ptr(slot, slot, off);
+    gen_cov_bump(slot, val);
+    tcg_gen_movi_i32(idx, id >> 1);
+    tcg_gen_st_i32(idx, cp, offsetof(panda_probe_cov_map, prev));
+
+    tcg_temp_free_ptr(off);
+    tcg_temp_free_i32(idx);
+    tcg_temp_free_i32(val);
+    tcg_temp_free_ptr(slot);
+    tcg_temp_free_ptr(cp);
+}
@@ -48,9 +48,13 @@
 #include "migration/migration.h"
 #include "include/exec/address-spaces.h"
 #include "include/exec/exec-all.h"
+#include "include/exec/ram_addr.h"
+#include "qemu/cutils.h"
 #include "migration/qemu-file.h"
 #include "io/channel-file.h"
 #include "sysemu/sysemu.h"
+#include "panda/plugin.h"
+#include "panda/callback_support.h"
 /******************************************************************************************/
 /* GLOBALS */
 /******************************************************************************************/
@@ -72,6 +76,12 @@ volatile sig_atomic_t rr_skipped_callsite_location = 0;
 // mz the log of non-deterministic events
 RR_log* rr_nondet_log = NULL;
 
+// Instructions between state digests while recording; 0 turns them off.
+uint64_t rr_digest_interval = 0;
+uint64_t rr_next_digest = 0;
+// Whether to record with a lazy snapshot; see rr_save_lazy_snapshot().
+bool rr_lazy_snapshot = false;
+
 #define RR_RECORD_FROM_REQUEST 2
 #define RR_RECORD_REQUEST 1
 
@@ -88,7 +98,8 @@ inline double rr_get_percentage(void) {
 
 static inline uint8_t rr_log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size == rr_nondet_log->bytes_read)) {
+        (rr_nondet_log->size == rr_nondet_log->bytes_read) &&
+        !rr_codec_pending(&rr_nondet_log->codec)) {
         return 1;
     } else {
         return 0;
@@ -171,6 +182,10 @@ static void rr_spit_log_entry(RR_log_entry item)
         printf("\tRR_INPUT_8 from %s\n",
                get_callsite_string(item.header.callsite_loc));
         break;
+    case RR_INPUT_MMIO:
+        printf("\tRR_INPUT_MMIO from %s\n",
+               get_callsite_string(item.header.callsite_loc));
+        break;
     case RR_INTERRUPT_REQUEST:
         printf("\tRR_INTERRUPT_REQUEST from %s\n",
                get_callsite_string(item.header.callsite_loc));
@@ -184,6 +199,9 @@ static void rr_spit_log_entry(RR_log_entry item)
                get_skipped_call_kind_string(item.variant.call_args.kind),
                get_callsite_string(item.header.callsite_loc));
         break;
+    case RR_DIGEST:
+        printf("\tRR_DIGEST (%u pages)\n", item.variant.digest.num_pages);
+        break;
     case RR_END_OF_LOG:
         printf("\tRR_END_OF_LOG\n");
         break;
@@ -256,12 +274,6 @@ static inline void rr_assert_fail(const char* exp, const char* file, int line,
 /* RECORD */
 /******************************************************************************************/
 
-static inline size_t rr_fwrite(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fwrite(ptr, size, nmemb, rr_nondet_log->fp);
-    rr_assert(result == nmemb);
-    return result;
-}
-
 // mz write the current log item to file
 static inline void rr_write_item(RR_log_entry item)
 {
@@ -269,82 +281,13 @@ static inline void rr_write_item(RR_log_entry item)
     if (!rr_in_record()) return;
     rr_assert(rr_nondet_log != NULL);
 
-#define RR_WRITE_ITEM(field) rr_fwrite(&(field), sizeof(field), 1)
-    // keep replay format the same.
-    RR_WRITE_ITEM(item.header.prog_point.guest_instr_count);
-    rr_fwrite(&(item.header.kind), 1, 1);
-    rr_fwrite(&(item.header.callsite_loc), 1, 1);
-
     // mz also save the program point in the log structure to ensure that our
     // header will include the latest program point.
     rr_nondet_log->last_prog_point = item.header.prog_point;
 
-    switch (item.header.kind) {
-        case RR_INPUT_1:
-            RR_WRITE_ITEM(item.variant.input_1);
-            break;
-        case RR_INPUT_2:
-            RR_WRITE_ITEM(item.variant.input_2);
-            break;
-        case RR_INPUT_4:
-            RR_WRITE_ITEM(item.variant.input_4);
-            break;
-        case RR_INPUT_8:
-            RR_WRITE_ITEM(item.variant.input_8);
-            break;
-        case RR_INTERRUPT_REQUEST:
-            RR_WRITE_ITEM(item.variant.interrupt_request);
-            break;
-        case RR_EXIT_REQUEST:
-            RR_WRITE_ITEM(item.variant.exit_request);
-            break;
-        case RR_PENDING_INTERRUPTS:
-            RR_WRITE_ITEM(item.variant.pending_interrupts);
-            break;
-        case RR_EXCEPTION:
-            RR_WRITE_ITEM(item.variant.exception_index);
-            break;
-        case RR_SKIPPED_CALL: {
-            RR_skipped_call_args* args = &item.variant.call_args;
-            rr_fwrite(&(args->kind), 1, 1);
-            switch (args->kind) {
-                case RR_CALL_CPU_MEM_RW:
-                    RR_WRITE_ITEM(args->variant.cpu_mem_rw_args);
-                    rr_fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len);
-                    break;
-                case RR_CALL_CPU_MEM_UNMAP:
-                    RR_WRITE_ITEM(args->variant.cpu_mem_unmap);
-                    rr_fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len);
-                    break;
-                case RR_CALL_MEM_REGION_CHANGE:
-                    RR_WRITE_ITEM(args->variant.mem_region_change_args);
-                    rr_fwrite(args->variant.mem_region_change_args.name, 1,
-                            args->variant.mem_region_change_args.len);
-                    break;
-                case RR_CALL_HD_TRANSFER:
-                    RR_WRITE_ITEM(args->variant.hd_transfer_args);
-                    break;
-                case RR_CALL_NET_TRANSFER:
-                    RR_WRITE_ITEM(args->variant.net_transfer_args);
-                    break;
-                case RR_CALL_HANDLE_PACKET:
-                    RR_WRITE_ITEM(args->variant.handle_packet_args);
-                    rr_fwrite(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1);
-                    break;
-                default:
-                    // mz unimplemented
-                    rr_assert(0 && "Unimplemented skipped call!");
-            }
-        } break;
-        case RR_END_OF_LOG:
-            // mz nothing to read
-            break;
-        default:
-            // mz unimplemented
-            rr_assert(0 && "Unimplemented replay log entry!");
+    if (!rr_codec_write_entry(&rr_nondet_log->codec, rr_nondet_log->fp, &item)) {
+        // mz unimplemented, or out of disk
+        rr_assert(0 && "Failed to write log entry!");
     }
 }
 
@@ -389,6 +332,15 @@ void rr_record_input_8(RR_callsite_id call_site, uint64_t data) {
     });
 }
 
+// record the result and value of an MMIO read to log file
+void rr_record_input_mmio(RR_callsite_id call_site, uint32_t result,
+                          uint64_t value) {
+    rr_write_item((RR_log_entry) {
+        .header = rr_header(RR_INPUT_MMIO, call_site),
+        .variant.input_mmio = { .result = result, .value = value }
+    });
+}
+
 /**
  * Save every time cpu->interrupt_request is different than the last time
  * we observed it (panda_current_interrupt_request. In replay, we use these
@@ -480,19 +432,129 @@ void rr_device_mem_rw_call_record(hwaddr addr, const uint8_t* buf,
     });
 }
 
+// Device DMA paths note where guest data moved to and from the disk and
+// the network card, so that replay can tell plugins (PANDA_CB_REPLAY_HD_TRANSFER
+// and friends).  Nothing is replayed into the machine for these.
+void rr_record_hd_transfer(RR_callsite_id call_site,
+                           Hd_transfer_type transfer_type, uint64_t src_addr,
+                           uint64_t dest_addr, uint32_t num_bytes) {
+    rr_write_item((RR_log_entry) {
+        .header = rr_header(RR_SKIPPED_CALL, call_site),
+        .variant.call_args = {
+            .kind = RR_CALL_HD_TRANSFER,
+            .variant.hd_transfer_args = {
+                .type = transfer_type,
+                .src_addr = src_addr,
+                .dest_addr = dest_addr,
+                .num_bytes = num_bytes
+            }
+        }
+    });
+}
+
+void rr_record_net_transfer(RR_callsite_id call_site,
+                            Net_transfer_type transfer_type, uint64_t src_addr,
+                            uint64_t dest_addr, uint32_t num_bytes) {
+    rr_write_item((RR_log_entry) {
+        .header = rr_header(RR_SKIPPED_CALL, call_site),
+        .variant.call_args = {
+            .kind = RR_CALL_NET_TRANSFER,
+            .variant.net_transfer_args = {
+                .type = transfer_type,
+                .src_addr = src_addr,
+                .dest_addr = dest_addr,
+                .num_bytes = num_bytes
+            }
+        }
+    });
+}
+
+// buf's host address goes in the log too (old_buf_addr), which is how
+// net_transfer entries name the card's buffers.
+void rr_record_handle_packet_call(RR_callsite_id call_site, uint8_t* buf,
+                                  int size, uint8_t direction) {
+    rr_write_item((RR_log_entry) {
+        .header = rr_header(RR_SKIPPED_CALL, call_site),
+        .variant.call_args = {
+            .kind = RR_CALL_HANDLE_PACKET,
+            .variant.handle_packet_args = {
+                .buf = buf,
+                .size = size,
+                .direction = direction
+            },
+            .old_buf_addr = (uintptr_t)buf
+        }
+    });
+}
+
 extern QLIST_HEAD(rr_map_list, RR_MapList) rr_map_list;
 
+// Mapped buffers are diffed against their shadow copy in granules of this
+// many bytes. Runs of dirty granules separated by fewer than
+// RR_MAP_DIFF_MERGE clean bytes are logged as a single patch, since every
+// log entry carries ~40 bytes of header overhead.
+#define RR_MAP_DIFF_GRANULE 64
+#define RR_MAP_DIFF_MERGE 64
+
+static inline bool rr_map_granule_dirty(RR_MapList *region, hwaddr off,
+                                        hwaddr size) {
+    return memcmp((uint8_t *)region->ptr + off, region->shadow + off, size) != 0;
+}
+
+static inline void rr_map_region_record_run(RR_MapList *region, hwaddr start,
+                                            hwaddr end) {
+    uint8_t *cur = region->ptr;
+    rr_device_mem_rw_call_record(region->addr + start, cur + start,
+                                 end - start, 1);
+    // Update it so we don't keep recording it
+    memcpy(region->shadow + start, cur + start, end - start);
+}
+
+// Log only the byte ranges of a mapped buffer that changed since we last
+// looked at it, and bring the shadow copy up to date. Whole pages are
+// compared first so that clean pages of a large mapping are cheap to skip.
+// The shadow is only written where something changed.
+static void rr_map_region_record_diff(RR_MapList *region) {
+    hwaddr off = 0;
+    hwaddr run_start = 0, run_end = 0;
+    bool in_run = false;
+
+    while (off < region->len) {
+        hwaddr page_len = MIN(TARGET_PAGE_SIZE - (off & ~TARGET_PAGE_MASK),
+                              region->len - off);
+        if (!rr_map_granule_dirty(region, off, page_len)) {
+            off += page_len;
+            continue;
+        }
+
+        hwaddr page_end = off + page_len;
+        while (off < page_end) {
+            hwaddr size = MIN(RR_MAP_DIFF_GRANULE, page_end - off);
+            if (rr_map_granule_dirty(region, off, size)) {
+                if (in_run && off - run_end > RR_MAP_DIFF_MERGE) {
+                    rr_map_region_record_run(region, run_start, run_end);
+                    in_run = false;
+                }
+                if (!in_run) {
+                    run_start = off;
+                    in_run = true;
+                }
+                run_end = off + size;
+            }
+            off += size;
+        }
+    }
+    if (in_run) {
+        rr_map_region_record_run(region, run_start, run_end);
+    }
+}
+
 void rr_tracked_mem_regions_record(void) {
     RR_MapList *region;
     QLIST_FOREACH(region, &rr_map_list, link) {
-        uint32_t crc = crc32(0, Z_NULL, 0);
-        crc = crc32(crc, region->ptr, region->len);
-        if (crc != region->crc) {
-            // Pretend this is just a mem_rw call
-            rr_device_mem_rw_call_record(region->addr, region->ptr, region->len, 1);
-        }
-        // Update it so we don't keep recording it
-        region->crc = crc;
+        // Pretend each modified range is just a mem_rw call; replay applies
+        // them as independent patches to guest memory.
+        rr_map_region_record_diff(region);
     }
 }
 
@@ -544,6 +606,10 @@ static inline void free_entry_params(RR_log_entry* entry)
         default: break;
         }
         break;
+    case RR_DIGEST:
+        g_free(entry->variant.digest.pages);
+        entry->variant.digest.pages = NULL;
+        break;
     case RR_INPUT_1:
     case RR_INPUT_2:
     case RR_INPUT_4:
@@ -554,13 +620,6 @@ static inline void free_entry_params(RR_log_entry* entry)
     }
 }
 
-static inline size_t rr_fread(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fread(ptr, size, nmemb, rr_nondet_log->fp);
-    rr_nondet_log->bytes_read += nmemb * size;
-    rr_assert(result == nmemb);
-    return result;
-}
-
 static inline int rr_queue_size(void) {
     int distance = rr_queue_tail - rr_queue_head + 1 + RR_QUEUE_MAX_LEN;
     return distance % RR_QUEUE_MAX_LEN;
@@ -616,105 +675,16 @@ static RR_log_entry *rr_read_item(void) {
     rr_assert(!rr_log_is_empty());
     rr_assert(rr_nondet_log->fp != NULL);
 
-    item->header.file_pos = rr_nondet_log->bytes_read;
-
-#define RR_READ_ITEM(field) rr_fread(&(field), sizeof(field), 1)
-    // mz read header
-    RR_READ_ITEM(item->header.prog_point.guest_instr_count);
-    rr_fread(&(item->header.kind), 1, 1);
-    rr_fread(&(item->header.callsite_loc), 1, 1);
-
-    // mz read the rest of the item
-    switch (item->header.kind) {
-        case RR_INPUT_1:
-            RR_READ_ITEM(item->variant.input_1);
-            break;
-        case RR_INPUT_2:
-            RR_READ_ITEM(item->variant.input_2);
-            break;
-        case RR_INPUT_4:
-            RR_READ_ITEM(item->variant.input_4);
-            break;
-        case RR_INPUT_8:
-            RR_READ_ITEM(item->variant.input_8);
-            break;
-        case RR_INTERRUPT_REQUEST:
-            RR_READ_ITEM(item->variant.interrupt_request);
-            break;
-        case RR_PENDING_INTERRUPTS:
-            RR_READ_ITEM(item->variant.pending_interrupts);
-            break;
-        case RR_EXCEPTION:
-            RR_READ_ITEM(item->variant.exception_index);
-            break;
-        case RR_EXIT_REQUEST:
-            RR_READ_ITEM(item->variant.exit_request);
-            break;
-        case RR_SKIPPED_CALL: {
-            RR_skipped_call_args* args = &item->variant.call_args;
-            rr_fread(&(args->kind), 1, 1);
-            switch (args->kind) {
-                case RR_CALL_CPU_MEM_RW:
-                    RR_READ_ITEM(args->variant.cpu_mem_rw_args);
-                    // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
-                    // mz read the buffer
-                    rr_fread(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len);
-                    break;
-                case RR_CALL_CPU_MEM_UNMAP:
-                    RR_READ_ITEM(args->variant.cpu_mem_unmap);
-                    args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fread(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len);
-                    break;
-                case RR_CALL_MEM_REGION_CHANGE:
-                    RR_READ_ITEM(args->variant.mem_region_change_args);
-                    args->variant.mem_region_change_args.name =
-                        g_malloc0(args->variant.mem_region_change_args.len + 1);
-                    rr_fread(args->variant.mem_region_change_args.name, 1,
-                            args->variant.mem_region_change_args.len);
-                    break;
-                case RR_CALL_HD_TRANSFER:
-                    RR_READ_ITEM(args->variant.hd_transfer_args);
-                    break;
-
-                case RR_CALL_NET_TRANSFER:
-                    RR_READ_ITEM(args->variant.net_transfer_args);
-                    break;
-
-                case RR_CALL_HANDLE_PACKET:
-                    RR_READ_ITEM(args->variant.handle_packet_args);
-                    // mz XXX HACK
-                    args->old_buf_addr = (uint64_t)args->variant.handle_packet_args.buf;
-                    // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    // mz always allocate a new one. we free it when the item is added
-                    // to the recycle list
-                    args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
-                    // mz read the buffer
-                    rr_fread(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1);
-                    break;
-
-                default:
-                    // mz unimplemented
-                    rr_assert(0 && "Unimplemented skipped call!");
-            }
-        } break;
-        case RR_END_OF_LOG:
-            // mz nothing to read
-            break;
-        default:
-            // mz unimplemented
-            rr_assert(0 && "Unimplemented replay log entry!");
+    uint64_t file_pos = rr_nondet_log->bytes_read;
+    if (!rr_codec_read_entry(&rr_nondet_log->codec, rr_nondet_log->fp, item)) {
+        // mz unimplemented, or truncated log
+        rr_assert(0 && "Failed to read log entry!");
     }
+    rr_nondet_log->bytes_read = rr_nondet_log->codec.bytes;
 
     // mz let's do some counting
     rr_size_of_log_entries[item->header.kind] +=
-        rr_nondet_log->bytes_read - item->header.file_pos;
+        rr_nondet_log->bytes_read - file_pos;
     rr_number_of_log_entries[item->header.kind]++;
 
     return item;
@@ -735,9 +705,11 @@ void rr_fill_queue(void) {
 
         if ((header.kind == RR_SKIPPED_CALL
                     && header.callsite_loc == RR_CALLSITE_MAIN_LOOP_WAIT)
-                || header.kind == RR_INTERRUPT_REQUEST) {
+                || header.kind == RR_INTERRUPT_REQUEST
+                || header.kind == RR_DIGEST) {
             // Cut off queue so we don't run out of memory on long runs of
-            // non-interrupts
+            // non-interrupts. Digests have to be checked at the exact
+            // instruction count, so they end a queue the same way.
             break;
         }
     }
@@ -823,6 +795,22 @@ void rr_replay_input_8(RR_callsite_id call_site, uint64_t* data) {
     rr_queue_pop_front();
 }
 
+// replay the result and value of an MMIO read
+void rr_replay_input_mmio(RR_callsite_id call_site, uint32_t* result,
+                          uint64_t* value) {
+    if (rr_nondet_log->codec.version == RR_LOG_VERSION_1) {
+        // Version 1 logs have these as two separate entries.
+        rr_replay_input_4(call_site, result);
+        rr_replay_input_8(call_site, value);
+        return;
+    }
+    RR_log_entry* current_item = get_next_entry_checked(RR_INPUT_MMIO, call_site, true);
+    rr_assert(current_item);
+    *result = current_item->variant.input_mmio.result;
+    *value = current_item->variant.input_mmio.value;
+    rr_queue_pop_front();
+}
+
 /**
  * Update the panda_currrent_interrupt_request state machine, if necessary,
  * and use it to return the correct value for cpu->interrupt_requested
@@ -968,6 +956,21 @@ void rr_replay_skipped_calls_internal(RR_callsite_id call_site)
                                           /*is_write=*/1,
                                           args.variant.cpu_mem_unmap.len);
             } break;
+            case RR_CALL_HD_TRANSFER: {
+                RR_hd_transfer_args *hdt = &args.variant.hd_transfer_args;
+                panda_callbacks_replay_hd_transfer(first_cpu, hdt->type,
+                        hdt->src_addr, hdt->dest_addr, hdt->num_bytes);
+            } break;
+            case RR_CALL_NET_TRANSFER: {
+                RR_net_transfer_args *nt = &args.variant.net_transfer_args;
+                panda_callbacks_replay_net_transfer(first_cpu, nt->type,
+                        nt->src_addr, nt->dest_addr, nt->num_bytes);
+            } break;
+            case RR_CALL_HANDLE_PACKET: {
+                RR_handle_packet_args *hp = &args.variant.handle_packet_args;
+                panda_callbacks_replay_handle_packet(first_cpu, hp->buf,
+                        hp->size, hp->direction, args.old_buf_addr);
+            } break;
             default:
                 // mz sanity check
                 rr_assert(0);
@@ -1006,8 +1009,9 @@ void rr_create_record_log(const char* filename)
     // This way, when we print progress, we can use something better than size
     // of log consumed
     //(as that can jump //sporadically).
-    rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
-            sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    rr_codec_init(&rr_nondet_log->codec, RR_LOG_VERSION);
+    rr_assert(rr_codec_write_header(&rr_nondet_log->codec, rr_nondet_log->fp,
+                rr_nondet_log->last_prog_point.guest_instr_count));
 }
 
 // create replay log
@@ -1032,8 +1036,12 @@ void rr_create_replay_log(const char* filename)
                  rr_nondet_log->size);
     }
     // mz read the last program point from the log header.
-    rr_fread(&(rr_nondet_log->last_prog_point.guest_instr_count),
-            sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    rr_assert(rr_codec_read_header(&rr_nondet_log->codec, rr_nondet_log->fp,
+                &rr_nondet_log->last_prog_point.guest_instr_count));
+    rr_nondet_log->bytes_read = rr_nondet_log->codec.bytes;
+    if (rr_debug_whisper()) {
+        qemu_log("nondet log version %u\n", rr_nondet_log->codec.version);
+    }
 }
 
 // close file and free associated memory
@@ -1042,9 +1050,10 @@ void rr_destroy_log(void)
     if (rr_nondet_log->fp) {
         // mz if in record, update the header with the last written prog point.
         if (rr_nondet_log->type == RECORD) {
-            rewind(rr_nondet_log->fp);
-            rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
-                    sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+            rr_assert(rr_codec_flush(&rr_nondet_log->codec, rr_nondet_log->fp));
+            rr_assert(rr_codec_update_header(&rr_nondet_log->codec,
+                        rr_nondet_log->fp,
+                        rr_nondet_log->last_prog_point.guest_instr_count));
         }
         fclose(rr_nondet_log->fp);
         rr_nondet_log->fp = NULL;
@@ -1219,6 +1228,273 @@ void hmp_end_replay(Monitor* mon, const QDict* qdict)
 
 static time_t rr_start_time;
 
+#ifdef CONFIG_SOFTMMU
+// Recording snapshots are written with QEMU's multithreaded page
+// compression, and a page identical to one already written is stored as a
+// reference to it.
+int rr_save_snapshot(QEMUFile *snp)
+{
+    MigrationState *s = migrate_get_current();
+    bool compress = s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+    int ret;
+
+    s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS] = true;
+    migrate_compress_threads_create();
+    ram_set_snapshot_dedup(true);
+    ret = qemu_savevm_state(snp, NULL);
+    ram_set_snapshot_dedup(false);
+    migrate_compress_threads_join();
+    s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS] = compress;
+    return ret;
+}
+
+// Compressed pages are decompressed by a pool of threads as the snapshot
+// streams in. Plain snapshots load the same way.
+int rr_load_snapshot(QEMUFile *snp)
+{
+    int ret;
+
+    migration_incoming_state_new(snp);
+    migrate_decompress_threads_create();
+    ret = qemu_loadvm_state(snp);
+    migrate_decompress_threads_join();
+    migration_incoming_state_destroy();
+    return ret;
+}
+
+// Lazy snapshots leave RAM out of the savevm stream and put it in a raw
+// image next to it, <name>-rr-snp.ram. Replay maps the image copy-on-write
+// over guest RAM, so a page is only read from disk when it is first
+// touched. Device state still loads eagerly from the stream.
+//
+// The image starts with RR_RAM_IMAGE_MAGIC, a 4-byte block count and, for
+// each RAM block, its name (1-byte length), length and file offset. Block
+// contents follow at host-page-aligned offsets, with all-zero pages left as
+// holes. All integers are little-endian.
+
+#define RR_RAM_IMAGE_MAGIC 0x4d4152444e524450ULL // "PDRNDRAM"
+
+typedef struct {
+    char name[256];
+    void *host;
+    uint64_t length;
+    uint64_t file_offset;
+} RR_ram_image_block;
+
+static inline void rr_get_ram_image_file_name(const char *snapshot_name,
+                                              char *file_name,
+                                              size_t file_name_len)
+{
+    snprintf(file_name, file_name_len, "%s.ram", snapshot_name);
+}
+
+static int rr_ram_image_add_block(const char *block_name, void *host_addr,
+                                  ram_addr_t offset, ram_addr_t length,
+                                  void *opaque)
+{
+    GArray *blocks = opaque;
+    RR_ram_image_block block = {
+        .host = host_addr,
+        .length = length
+    };
+
+    pstrcpy(block.name, sizeof(block.name), block_name);
+    g_array_append_val(blocks, block);
+    return 0;
+}
+
+static bool rr_pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+    return lseek(fd, offset, SEEK_SET) == offset &&
+        qemu_write_full(fd, buf, len) == len;
+}
+
+// Write out each run of non-zero pages in a block.
+static bool rr_ram_image_write_block(int fd, RR_ram_image_block *block)
+{
+    uint8_t *host = block->host;
+    uint64_t start, end;
+
+    for (start = 0; start < block->length; start = end) {
+        if (buffer_is_zero(host + start, TARGET_PAGE_SIZE)) {
+            end = start + TARGET_PAGE_SIZE;
+            continue;
+        }
+        end = start + TARGET_PAGE_SIZE;
+        while (end < block->length &&
+               !buffer_is_zero(host + end, TARGET_PAGE_SIZE)) {
+            end += TARGET_PAGE_SIZE;
+        }
+        if (!rr_pwrite_full(fd, host + start, end - start,
+                            block->file_offset + start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int rr_write_ram_image(const char *file_name)
+{
+    GArray *blocks = g_array_new(FALSE, FALSE, sizeof(RR_ram_image_block));
+    GByteArray *header = g_byte_array_new();
+    uint64_t magic = cpu_to_le64(RR_RAM_IMAGE_MAGIC);
+    uint64_t pos, length, file_offset;
+    uint32_t num_blocks;
+    int fd, ret = -1;
+    guint i;
+
+    qemu_ram_foreach_block(rr_ram_image_add_block, blocks);
+
+    pos = sizeof(magic) + sizeof(num_blocks);
+    for (i = 0; i < blocks->len; i++) {
+        RR_ram_image_block *block =
+            &g_array_index(blocks, RR_ram_image_block, i);
+        pos += 1 + strlen(block->name) + sizeof(length) + sizeof(file_offset);
+    }
+    pos = ROUND_UP(pos, qemu_real_host_page_size);
+
+    num_blocks = cpu_to_le32(blocks->len);
+    g_byte_array_append(header, (uint8_t *)&magic, sizeof(magic));
+    g_byte_array_append(header, (uint8_t *)&num_blocks, sizeof(num_blocks));
+    for (i = 0; i < blocks->len; i++) {
+        RR_ram_image_block *block =
+            &g_array_index(blocks, RR_ram_image_block, i);
+        uint8_t name_len = strlen(block->name);
+        block->file_offset = pos;
+        pos += ROUND_UP(block->length, qemu_real_host_page_size);
+        length = cpu_to_le64(block->length);
+        file_offset = cpu_to_le64(block->file_offset);
+        g_byte_array_append(header, &name_len, 1);
+        g_byte_array_append(header, (uint8_t *)block->name, name_len);
+        g_byte_array_append(header, (uint8_t *)&length, sizeof(length));
+        g_byte_array_append(header, (uint8_t *)&file_offset,
+                            sizeof(file_offset));
+    }
+
+    fd = qemu_open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        goto out;
+    }
+    if (ftruncate(fd, pos) < 0 ||
+            !rr_pwrite_full(fd, header->data, header->len, 0)) {
+        goto out_close;
+    }
+    for (i = 0; i < blocks->len; i++) {
+        if (!rr_ram_image_write_block(fd,
+                    &g_array_index(blocks, RR_ram_image_block, i))) {
+            goto out_close;
+        }
+    }
+    ret = 0;
+
+out_close:
+    qemu_close(fd);
+out:
+    g_byte_array_free(header, TRUE);
+    g_array_free(blocks, TRUE);
+    return ret;
+}
+
+static bool rr_read_full(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len) == len;
+}
+
+// Map a RAM image over guest RAM. Returns 0 on success, 1 if there is no
+// image for this snapshot and -1 on failure.
+static int rr_map_ram_image(const char *file_name)
+{
+    uint64_t magic, length, file_offset;
+    uint32_t num_blocks, i;
+    uint8_t name_len;
+    char name[256];
+    int fd, ret = -1;
+
+    fd = qemu_open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (!rr_read_full(fd, &magic, sizeof(magic)) ||
+            le64_to_cpu(magic) != RR_RAM_IMAGE_MAGIC ||
+            !rr_read_full(fd, &num_blocks, sizeof(num_blocks))) {
+        fprintf(stderr, "%s is not a RAM image\n", file_name);
+        goto out;
+    }
+    num_blocks = le32_to_cpu(num_blocks);
+
+    rcu_read_lock();
+    for (i = 0; i < num_blocks; i++) {
+        RAMBlock *block;
+
+        if (!rr_read_full(fd, &name_len, 1) ||
+                !rr_read_full(fd, name, name_len) ||
+                !rr_read_full(fd, &length, sizeof(length)) ||
+                !rr_read_full(fd, &file_offset, sizeof(file_offset))) {
+            fprintf(stderr, "%s: truncated header\n", file_name);
+            goto out_unlock;
+        }
+        name[name_len] = 0;
+        length = le64_to_cpu(length);
+        file_offset = le64_to_cpu(file_offset);
+
+        block = qemu_ram_block_by_name(name);
+        if (!block || block->used_length != length) {
+            fprintf(stderr, "%s: RAM block %s doesn't match this machine\n",
+                    file_name, name);
+            goto out_unlock;
+        }
+        if (mmap(block->host, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, file_offset) == MAP_FAILED) {
+            perror("mmap RAM image");
+            goto out_unlock;
+        }
+    }
+    ret = 0;
+
+out_unlock:
+    rcu_read_unlock();
+out:
+    // The mappings keep the file open.
+    qemu_close(fd);
+    return ret;
+}
+
+// Write a lazy snapshot: RAM goes to the image, everything else to snp.
+int rr_save_lazy_snapshot(QEMUFile *snp, const char *snapshot_name)
+{
+    char ram_name[1024];
+
+    rr_get_ram_image_file_name(snapshot_name, ram_name, sizeof(ram_name));
+    printf("writing RAM image:\t%s\n", ram_name);
+    if (rr_write_ram_image(ram_name) < 0) {
+        fprintf(stderr, "Failed to write RAM image %s\n", ram_name);
+        return -1;
+    }
+    return qemu_savevm_state_devices(snp);
+}
+
+// Load a snapshot written by either rr_save_snapshot() or
+// rr_save_lazy_snapshot().
+int rr_load_any_snapshot(QEMUFile *snp, const char *snapshot_name)
+{
+    char ram_name[1024];
+    int ret;
+
+    // RAM goes in first, since device post_load hooks may read it.
+    rr_get_ram_image_file_name(snapshot_name, ram_name, sizeof(ram_name));
+    ret = rr_map_ram_image(ram_name);
+    if (ret < 0) {
+        return ret;
+    } else if (ret == 0) {
+        printf("mapped RAM image %s\n", ram_name);
+    }
+    return rr_load_snapshot(snp);
+}
+#endif
+
+static void rr_digest_start(bool record);
+static void rr_digest_stop(void);
+
 // mz file_name_full should be full path to desired record/replay log file
 int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
 {
@@ -1250,7 +1526,16 @@ int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
         QIOChannelFile* ioc =
             qio_channel_file_new_path(name_buf, O_WRONLY | O_CREAT, 0660, NULL);
         QEMUFile* snp = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
-        snapshot_ret = qemu_savevm_state(snp, NULL);
+        if (rr_lazy_snapshot) {
+            snapshot_ret = rr_save_lazy_snapshot(snp, name_buf);
+        } else {
+            // Don't let replay pick up a RAM image left by an earlier
+            // recording of the same name.
+            char ram_name[1024];
+            rr_get_ram_image_file_name(name_buf, ram_name, sizeof(ram_name));
+            unlink(ram_name);
+            snapshot_ret = rr_save_snapshot(snp);
+        }
         qemu_fclose(snp);
         // log_all_cpu_states();
     }
@@ -1264,6 +1549,7 @@ int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
     rr_create_record_log(name_buf);
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    rr_digest_start(/*record=*/true);
     g_free(rr_path_base);
     g_free(rr_name_base);
     // set global to turn on recording
@@ -1296,6 +1582,7 @@ void rr_do_end_record(void)
 
     // log_all_cpu_states();
 
+    rr_digest_stop();
     rr_destroy_log();
 
     g_free(rr_path_base);
@@ -1338,10 +1625,8 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     QEMUFile* snp = qemu_fopen_channel_input(QIO_CHANNEL(ioc));
 
     qemu_system_reset(VMRESET_SILENT);
-    migration_incoming_state_new(snp);
-    snapshot_ret = qemu_loadvm_state(snp);
+    snapshot_ret = rr_load_any_snapshot(snp, name_buf);
     qemu_fclose(snp);
-    migration_incoming_state_destroy();
 
     if (snapshot_ret < 0) {
         fprintf(stderr, "Failed to load vmstate\n");
@@ -1359,6 +1644,7 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     rr_create_replay_log(name_buf);
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    rr_digest_start(/*record=*/false);
     // set global to turn on replay
     rr_mode = RR_REPLAY;
 
@@ -1494,6 +1780,133 @@ uint32_t rr_checksum_regs(void) {
     return crc;
 }
 
+/******************************************************************************************/
+/* STATE DIGESTS */
+/******************************************************************************************/
+
+// Instruction count of the last digest replay checked, which is where the
+// window for a mismatch starts.
+static uint64_t rr_last_digest = 0;
+
+// Dirty bits are scanned this many pages at a time before looking at
+// individual pages.
+#define RR_DIGEST_SCAN_CHUNK (64 * TARGET_PAGE_SIZE)
+
+static int rr_digest_collect_block(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque) {
+    GArray *pages = opaque;
+    ram_addr_t chunk, page;
+
+    for (chunk = 0; chunk < length; chunk += RR_DIGEST_SCAN_CHUNK) {
+        ram_addr_t chunk_end = MIN(chunk + RR_DIGEST_SCAN_CHUNK, length);
+        if (!cpu_physical_memory_get_dirty(offset + chunk, chunk_end - chunk,
+                                           DIRTY_MEMORY_MIGRATION)) {
+            continue;
+        }
+        for (page = chunk; page < chunk_end; page += TARGET_PAGE_SIZE) {
+            if (cpu_physical_memory_test_and_clear_dirty(offset + page,
+                        TARGET_PAGE_SIZE, DIRTY_MEMORY_MIGRATION)) {
+                RR_digest_page p = {
+                    .addr = offset + page,
+                    .crc = crc32(0, (uint8_t *)host_addr + page,
+                                 TARGET_PAGE_SIZE)
+                };
+                g_array_append_val(pages, p);
+            }
+        }
+    }
+    return 0;
+}
+
+static int rr_digest_clear_block(const char *block_name, void *host_addr,
+                                 ram_addr_t offset, ram_addr_t length,
+                                 void *opaque) {
+    cpu_physical_memory_test_and_clear_dirty(offset, length,
+                                             DIRTY_MEMORY_MIGRATION);
+    return 0;
+}
+
+// Piggyback on the migration dirty bitmap to find the pages each digest
+// has to cover. The snapshot has just been taken, so start with everything
+// clean.
+static void rr_digest_start(bool record) {
+    rr_last_digest = 0;
+    if (!record || !rr_digest_interval) return;
+    memory_global_dirty_log_start();
+    qemu_ram_foreach_block(rr_digest_clear_block, NULL);
+    rr_next_digest = rr_digest_interval;
+}
+
+static void rr_digest_stop(void) {
+    if (!rr_digest_interval) return;
+    memory_global_dirty_log_stop();
+}
+
+void rr_record_digest(void) {
+    GArray *pages = g_array_new(FALSE, FALSE, sizeof(RR_digest_page));
+
+    // Log what devices have put into mapped buffers so far, so that replay
+    // has applied the same bytes by the time it checks this digest.
+    rr_skipped_callsite_location = RR_CALLSITE_MAIN_LOOP_WAIT;
+    rr_tracked_mem_regions_record();
+
+    qemu_ram_foreach_block(rr_digest_collect_block, pages);
+    rr_write_item((RR_log_entry) {
+        .header = rr_header(RR_DIGEST, RR_CALLSITE_DIGEST),
+        .variant.digest = {
+            .regs_crc = rr_checksum_regs(),
+            .num_pages = pages->len,
+            .pages = (RR_digest_page *)pages->data
+        }
+    });
+    g_array_free(pages, TRUE);
+
+    rr_next_digest = rr_get_guest_instr_count() + rr_digest_interval;
+}
+
+void rr_replay_digest(void) {
+    RR_log_entry *item =
+        get_next_entry_checked(RR_DIGEST, RR_CALLSITE_DIGEST, true);
+    rr_assert(item);
+
+    RR_digest_args *digest = &item->variant.digest;
+    uint64_t instr_count = rr_get_guest_instr_count();
+    uint32_t regs_crc = rr_checksum_regs();
+    uint32_t i, num_bad = 0;
+
+    rcu_read_lock();
+    for (i = 0; i < digest->num_pages; i++) {
+        RR_digest_page *page = &digest->pages[i];
+        uint32_t crc = crc32(0, qemu_map_ram_ptr(NULL, page->addr),
+                             TARGET_PAGE_SIZE);
+        if (crc == page->crc) continue;
+        if (num_bad++ == 0) {
+            printf("STATE DIGEST MISMATCH between instr %" PRIu64
+                   " and %" PRIu64 "\n", rr_last_digest, instr_count);
+        }
+        printf("  ram page " RAM_ADDR_FMT ": crc %#08x, recorded %#08x\n",
+               (ram_addr_t)page->addr, crc, page->crc);
+    }
+    rcu_read_unlock();
+
+    if (regs_crc != digest->regs_crc) {
+        if (num_bad == 0) {
+            printf("STATE DIGEST MISMATCH between instr %" PRIu64
+                   " and %" PRIu64 "\n", rr_last_digest, instr_count);
+        }
+        printf("  registers: crc %#08x, recorded %#08x\n", regs_crc,
+               digest->regs_crc);
+        num_bad++;
+    }
+
+    rr_queue_pop_front();
+    if (num_bad) {
+        rr_do_end_replay(/*is_error=*/1);
+    }
+    rr_last_digest = instr_count;
+}
+
 uint8_t rr_debug_readb(target_ulong addr);
 uint8_t rr_debug_readb(target_ulong addr) {
     CPUState *cpu = first_cpu;
@@ -0,0 +1,654 @@
+/* Encoding and decoding of nondet log entries.
+ *
+ * Shared by the record/replay core, rr_print and the scissors plugin. See
+ * rr_log.h for a description of the two on-disk versions.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+
+#include "panda/rr/rr_log.h"
+
+// Longest LEB128 encoding of a 64-bit value.
+#define RR_LEB128_MAX 10
+
+void rr_codec_init(RR_log_codec *c, uint32_t version) {
+    memset(c, 0, sizeof(*c));
+    c->version = version;
+}
+
+/******************************************************************************************/
+/* PRIMITIVES */
+/******************************************************************************************/
+
+static inline uint8_t *rr_put_uleb128(uint8_t *p, uint64_t val) {
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        if (val) byte |= 0x80;
+        *p++ = byte;
+    } while (val);
+    return p;
+}
+
+static inline uint64_t rr_zigzag(int64_t val) {
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t rr_unzigzag(uint64_t val) {
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static inline bool rr_codec_fwrite(RR_log_codec *c, FILE *fp,
+                                   const void *ptr, size_t size) {
+    if (size == 0) return true;
+    if (fwrite(ptr, size, 1, fp) != 1) return false;
+    c->bytes += size;
+    return true;
+}
+
+static inline bool rr_codec_fread(RR_log_codec *c, FILE *fp,
+                                  void *ptr, size_t size) {
+    if (size == 0) return true;
+    if (fread(ptr, size, 1, fp) != 1) return false;
+    c->bytes += size;
+    return true;
+}
+
+static inline bool rr_get_uleb128(RR_log_codec *c, FILE *fp, uint64_t *val) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+    int byte;
+    do {
+        byte = getc(fp);
+        if (byte == EOF || shift >= 64) return false;
+        c->bytes++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *val = result;
+    return true;
+}
+
+/******************************************************************************************/
+/* HEADER */
+/******************************************************************************************/
+
+bool rr_codec_write_header(RR_log_codec *c, FILE *fp,
+                           uint64_t last_instr_count) {
+    uint64_t magic = RR_LOG_MAGIC;
+    assert(c->version == RR_LOG_VERSION_2);
+    return rr_codec_fwrite(c, fp, &magic, sizeof(magic))
+        && rr_codec_fwrite(c, fp, &c->version, sizeof(c->version))
+        && rr_codec_fwrite(c, fp, &last_instr_count, sizeof(last_instr_count));
+}
+
+// Rewrite the instruction count in the header once the log is complete.
+bool rr_codec_update_header(RR_log_codec *c, FILE *fp,
+                            uint64_t last_instr_count) {
+    long offset = 0;
+    if (c->version >= RR_LOG_VERSION_2) {
+        offset = sizeof(uint64_t) + sizeof(c->version);
+    }
+    if (fseek(fp, offset, SEEK_SET) != 0) return false;
+    return fwrite(&last_instr_count, sizeof(last_instr_count), 1, fp) == 1;
+}
+
+bool rr_codec_read_header(RR_log_codec *c, FILE *fp,
+                          uint64_t *last_instr_count) {
+    uint64_t first;
+    rr_codec_init(c, RR_LOG_VERSION_1);
+    if (!rr_codec_fread(c, fp, &first, sizeof(first))) return false;
+    if (first != RR_LOG_MAGIC) {
+        // Version 1 logs have no magic; this is the instruction count.
+        *last_instr_count = first;
+        return true;
+    }
+    if (!rr_codec_fread(c, fp, &c->version, sizeof(c->version))) return false;
+    if (c->version > RR_LOG_VERSION) {
+        fprintf(stderr, "Unsupported nondet log version %u\n", c->version);
+        return false;
+    }
+    return rr_codec_fread(c, fp, last_instr_count, sizeof(*last_instr_count));
+}
+
+/******************************************************************************************/
+/* ENCODE */
+/******************************************************************************************/
+
+// Only scalar inputs are run-length coded; they are what polling loops
+// produce and they carry no buffers.
+static inline bool rr_entry_repeatable(const RR_log_entry *entry) {
+    switch (entry->header.kind) {
+        case RR_INPUT_1:
+        case RR_INPUT_2:
+        case RR_INPUT_4:
+        case RR_INPUT_8:
+        case RR_INPUT_MMIO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool rr_entry_same_input(const RR_log_entry *a,
+                                       const RR_log_entry *b) {
+    if (a->header.kind != b->header.kind ||
+            a->header.callsite_loc != b->header.callsite_loc) {
+        return false;
+    }
+    switch (a->header.kind) {
+        case RR_INPUT_1: return a->variant.input_1 == b->variant.input_1;
+        case RR_INPUT_2: return a->variant.input_2 == b->variant.input_2;
+        case RR_INPUT_4: return a->variant.input_4 == b->variant.input_4;
+        case RR_INPUT_8: return a->variant.input_8 == b->variant.input_8;
+        case RR_INPUT_MMIO:
+            return a->variant.input_mmio.result == b->variant.input_mmio.result
+                && a->variant.input_mmio.value == b->variant.input_mmio.value;
+        default:
+            return false;
+    }
+}
+
+static inline uint8_t *rr_put_entry_header(uint8_t *p, uint8_t kind,
+                                           uint8_t callsite, uint64_t delta) {
+    *p++ = kind;
+    *p++ = callsite;
+    return rr_put_uleb128(p, delta);
+}
+
+// Write out any held-back repeats of c->last.
+bool rr_codec_flush(RR_log_codec *c, FILE *fp) {
+    uint8_t buf[2 + 2 * RR_LEB128_MAX];
+    uint8_t *p;
+
+    if (c->repeat_count == 0) return true;
+
+    p = rr_put_entry_header(buf, RR_REPEAT, c->last.header.callsite_loc,
+                            c->repeat_delta);
+    p = rr_put_uleb128(p, c->repeat_count);
+    c->prev_instr_count += c->repeat_delta * c->repeat_count;
+    c->repeat_count = 0;
+    return rr_codec_fwrite(c, fp, buf, p - buf);
+}
+
+static bool rr_codec_write_skipped_call(RR_log_codec *c, FILE *fp,
+                                        uint8_t *buf, uint8_t *p,
+                                        const RR_skipped_call_args *args) {
+    const void *data = NULL;
+    size_t data_len = 0;
+
+    *p++ = args->kind;
+    switch (args->kind) {
+        case RR_CALL_CPU_MEM_RW:
+            p = rr_put_uleb128(p, args->variant.cpu_mem_rw_args.addr);
+            p = rr_put_uleb128(p, args->variant.cpu_mem_rw_args.len);
+            data = args->variant.cpu_mem_rw_args.buf;
+            data_len = args->variant.cpu_mem_rw_args.len;
+            break;
+        case RR_CALL_CPU_MEM_UNMAP:
+            p = rr_put_uleb128(p, args->variant.cpu_mem_unmap.addr);
+            p = rr_put_uleb128(p, args->variant.cpu_mem_unmap.len);
+            data = args->variant.cpu_mem_unmap.buf;
+            data_len = args->variant.cpu_mem_unmap.len;
+            break;
+        case RR_CALL_MEM_REGION_CHANGE:
+            p = rr_put_uleb128(p, args->variant.mem_region_change_args.start_addr);
+            p = rr_put_uleb128(p, args->variant.mem_region_change_args.size);
+            p = rr_put_uleb128(p, args->variant.mem_region_change_args.mtype);
+            *p++ = args->variant.mem_region_change_args.added;
+            p = rr_put_uleb128(p, args->variant.mem_region_change_args.len);
+            data = args->variant.mem_region_change_args.name;
+            data_len = args->variant.mem_region_change_args.len;
+            break;
+        case RR_CALL_HD_TRANSFER:
+            p = rr_put_uleb128(p, args->variant.hd_transfer_args.type);
+            p = rr_put_uleb128(p, args->variant.hd_transfer_args.src_addr);
+            p = rr_put_uleb128(p, args->variant.hd_transfer_args.dest_addr);
+            p = rr_put_uleb128(p, args->variant.hd_transfer_args.num_bytes);
+            break;
+        case RR_CALL_NET_TRANSFER:
+            p = rr_put_uleb128(p, args->variant.net_transfer_args.type);
+            p = rr_put_uleb128(p, args->variant.net_transfer_args.src_addr);
+            p = rr_put_uleb128(p, args->variant.net_transfer_args.dest_addr);
+            p = rr_put_uleb128(p, args->variant.net_transfer_args.num_bytes);
+            break;
+        case RR_CALL_HANDLE_PACKET:
+            p = rr_put_uleb128(p, args->variant.handle_packet_args.size);
+            *p++ = args->variant.handle_packet_args.direction;
+            // mz XXX HACK the address of the original buffer is kept too
+            p = rr_put_uleb128(p, args->old_buf_addr ? args->old_buf_addr
+                    : (uintptr_t)args->variant.handle_packet_args.buf);
+            data = args->variant.handle_packet_args.buf;
+            data_len = args->variant.handle_packet_args.size;
+            break;
+        default:
+            return false;
+    }
+    return rr_codec_fwrite(c, fp, buf, p - buf)
+        && rr_codec_fwrite(c, fp, data, data_len);
+}
+
+static bool rr_codec_write_digest(RR_log_codec *c, FILE *fp,
+                                  uint8_t *buf, uint8_t *p,
+                                  const RR_digest_args *digest) {
+    uint8_t *pages = g_malloc(digest->num_pages * (RR_LEB128_MAX + 4));
+    uint8_t *q = pages;
+    uint64_t prev_addr = 0;
+    uint32_t i;
+    bool ok;
+
+    p = rr_put_uleb128(p, digest->regs_crc);
+    p = rr_put_uleb128(p, digest->num_pages);
+    for (i = 0; i < digest->num_pages; i++) {
+        q = rr_put_uleb128(q, digest->pages[i].addr - prev_addr);
+        prev_addr = digest->pages[i].addr;
+        memcpy(q, &digest->pages[i].crc, 4);
+        q += 4;
+    }
+    ok = rr_codec_fwrite(c, fp, buf, p - buf)
+        && rr_codec_fwrite(c, fp, pages, q - pages);
+    g_free(pages);
+    return ok;
+}
+
+bool rr_codec_write_entry(RR_log_codec *c, FILE *fp, const RR_log_entry *entry) {
+    uint8_t buf[4 + 8 * RR_LEB128_MAX];
+    uint64_t instr_count = entry->header.prog_point.guest_instr_count;
+    uint64_t delta;
+    uint8_t *p;
+
+    assert(c->version == RR_LOG_VERSION_2);
+
+    if (rr_entry_repeatable(entry) && c->last_valid &&
+            rr_entry_same_input(entry, &c->last)) {
+        uint64_t base = c->prev_instr_count + c->repeat_delta * c->repeat_count;
+        delta = instr_count - base;
+        if (c->repeat_count == 0) {
+            c->repeat_delta = delta;
+        } else if (delta != c->repeat_delta) {
+            if (!rr_codec_flush(c, fp)) return false;
+            c->repeat_delta = delta;
+        }
+        c->repeat_count++;
+        return true;
+    }
+
+    if (!rr_codec_flush(c, fp)) return false;
+
+    delta = instr_count - c->prev_instr_count;
+    c->prev_instr_count = instr_count;
+    c->last_valid = rr_entry_repeatable(entry);
+    if (c->last_valid) {
+        c->last = *entry;
+    }
+
+    p = rr_put_entry_header(buf, entry->header.kind,
+                            entry->header.callsite_loc, delta);
+    switch (entry->header.kind) {
+        case RR_INPUT_1:
+            p = rr_put_uleb128(p, entry->variant.input_1);
+            break;
+        case RR_INPUT_2:
+            p = rr_put_uleb128(p, entry->variant.input_2);
+            break;
+        case RR_INPUT_4:
+            p = rr_put_uleb128(p, entry->variant.input_4);
+            break;
+        case RR_INPUT_8:
+            p = rr_put_uleb128(p, entry->variant.input_8);
+            break;
+        case RR_INPUT_MMIO:
+            p = rr_put_uleb128(p, entry->variant.input_mmio.result);
+            p = rr_put_uleb128(p, entry->variant.input_mmio.value);
+            break;
+        case RR_INTERRUPT_REQUEST:
+            p = rr_put_uleb128(p, rr_zigzag(entry->variant.interrupt_request));
+            break;
+        case RR_EXIT_REQUEST:
+            p = rr_put_uleb128(p, entry->variant.exit_request);
+            break;
+        case RR_PENDING_INTERRUPTS:
+            p = rr_put_uleb128(p, entry->variant.pending_interrupts);
+            break;
+        case RR_EXCEPTION:
+            p = rr_put_uleb128(p, rr_zigzag(entry->variant.exception_index));
+            break;
+        case RR_SKIPPED_CALL:
+            return rr_codec_write_skipped_call(c, fp, buf, p,
+                                               &entry->variant.call_args);
+        case RR_DIGEST:
+            return rr_codec_write_digest(c, fp, buf, p, &entry->variant.digest);
+        case RR_END_OF_LOG:
+            // mz nothing to write
+            break;
+        default:
+            // mz unimplemented
+            return false;
+    }
+    return rr_codec_fwrite(c, fp, buf, p - buf);
+}
+
+/******************************************************************************************/
+/* DECODE */
+/******************************************************************************************/
+
+// Read a buffer of len bytes which follows a skipped call.
+static inline bool rr_codec_read_buf(RR_log_codec *c, FILE *fp,
+                                     uint8_t **buf, size_t len, size_t extra) {
+    if (c->skip_buffers) {
+        *buf = NULL;
+        if (fseek(fp, len, SEEK_CUR) != 0) return false;
+        c->bytes += len;
+        return true;
+    }
+    *buf = g_malloc0(len + extra);
+    return rr_codec_fread(c, fp, *buf, len);
+}
+
+static bool rr_codec_read_entry_v1(RR_log_codec *c, FILE *fp,
+                                   RR_log_entry *item) {
+#define RR_READ_ITEM(field) rr_codec_fread(c, fp, &(field), sizeof(field))
+    uint8_t kind, callsite;
+    if (!RR_READ_ITEM(item->header.prog_point.guest_instr_count) ||
+            !RR_READ_ITEM(kind) || !RR_READ_ITEM(callsite)) {
+        return false;
+    }
+    item->header.kind = kind;
+    item->header.callsite_loc = callsite;
+
+    switch (item->header.kind) {
+        case RR_INPUT_1:
+            return RR_READ_ITEM(item->variant.input_1);
+        case RR_INPUT_2:
+            return RR_READ_ITEM(item->variant.input_2);
+        case RR_INPUT_4:
+            return RR_READ_ITEM(item->variant.input_4);
+        case RR_INPUT_8:
+            return RR_READ_ITEM(item->variant.input_8);
+        case RR_INTERRUPT_REQUEST:
+            return RR_READ_ITEM(item->variant.interrupt_request);
+        case RR_PENDING_INTERRUPTS:
+            return RR_READ_ITEM(item->variant.pending_interrupts);
+        case RR_EXCEPTION:
+            return RR_READ_ITEM(item->variant.exception_index);
+        case RR_EXIT_REQUEST:
+            return RR_READ_ITEM(item->variant.exit_request);
+        case RR_SKIPPED_CALL: {
+            RR_skipped_call_args* args = &item->variant.call_args;
+            uint8_t call_kind;
+            if (!RR_READ_ITEM(call_kind)) return false;
+            args->kind = call_kind;
+            switch (args->kind) {
+                case RR_CALL_CPU_MEM_RW:
+                    return RR_READ_ITEM(args->variant.cpu_mem_rw_args)
+                        && rr_codec_read_buf(c, fp,
+                                &args->variant.cpu_mem_rw_args.buf,
+                                args->variant.cpu_mem_rw_args.len, 0);
+                case RR_CALL_CPU_MEM_UNMAP:
+                    return RR_READ_ITEM(args->variant.cpu_mem_unmap)
+                        && rr_codec_read_buf(c, fp,
+                                &args->variant.cpu_mem_unmap.buf,
+                                args->variant.cpu_mem_unmap.len, 0);
+                case RR_CALL_MEM_REGION_CHANGE:
+                    return RR_READ_ITEM(args->variant.mem_region_change_args)
+                        && rr_codec_read_buf(c, fp,
+                                (uint8_t **)&args->variant.mem_region_change_args.name,
+                                args->variant.mem_region_change_args.len, 1);
+                case RR_CALL_HD_TRANSFER:
+                    return RR_READ_ITEM(args->variant.hd_transfer_args);
+                case RR_CALL_NET_TRANSFER:
+                    return RR_READ_ITEM(args->variant.net_transfer_args);
+                case RR_CALL_HANDLE_PACKET:
+                    if (!RR_READ_ITEM(args->variant.handle_packet_args)) {
+                        return false;
+                    }
+                    // mz XXX HACK
+                    args->old_buf_addr =
+                        (uint64_t)args->variant.handle_packet_args.buf;
+                    return rr_codec_read_buf(c, fp,
+                            &args->variant.handle_packet_args.buf,
+                            args->variant.handle_packet_args.size, 0);
+                default:
+                    // mz unimplemented
+                    return false;
+            }
+        }
+        case RR_END_OF_LOG:
+            // mz nothing to read
+            return true;
+        default:
+            // mz unimplemented
+            return false;
+    }
+#undef RR_READ_ITEM
+}
+
+static bool rr_codec_read_skipped_call_v2(RR_log_codec *c, FILE *fp,
+                                          RR_skipped_call_args *args) {
+    uint64_t a, b, d, e;
+    uint8_t call_kind, flag;
+
+    if (!rr_codec_fread(c, fp, &call_kind, 1)) return false;
+    args->kind = call_kind;
+    switch (args->kind) {
+        case RR_CALL_CPU_MEM_RW:
+            if (!rr_get_uleb128(c, fp, &a) || !rr_get_uleb128(c, fp, &b)) {
+                return false;
+            }
+            args->variant.cpu_mem_rw_args.addr = a;
+            args->variant.cpu_mem_rw_args.len = b;
+            return rr_codec_read_buf(c, fp, &args->variant.cpu_mem_rw_args.buf,
+                                     b, 0);
+        case RR_CALL_CPU_MEM_UNMAP:
+            if (!rr_get_uleb128(c, fp, &a) || !rr_get_uleb128(c, fp, &b)) {
+                return false;
+            }
+            args->variant.cpu_mem_unmap.addr = a;
+            args->variant.cpu_mem_unmap.len = b;
+            return rr_codec_read_buf(c, fp, &args->variant.cpu_mem_unmap.buf,
+                                     b, 0);
+        case RR_CALL_MEM_REGION_CHANGE:
+            if (!rr_get_uleb128(c, fp, &a) || !rr_get_uleb128(c, fp, &b) ||
+                    !rr_get_uleb128(c, fp, &d) ||
+                    !rr_codec_fread(c, fp, &flag, 1) ||
+                    !rr_get_uleb128(c, fp, &e)) {
+                return false;
+            }
+            args->variant.mem_region_change_args.start_addr = a;
+            args->variant.mem_region_change_args.size = b;
+            args->variant.mem_region_change_args.mtype = d;
+            args->variant.mem_region_change_args.added = flag;
+            args->variant.mem_region_change_args.len = e;
+            return rr_codec_read_buf(c, fp,
+                    (uint8_t **)&args->variant.mem_region_change_args.name, e, 1);
+        case RR_CALL_HD_TRANSFER:
+            if (!rr_get_uleb128(c, fp, &a) || !rr_get_uleb128(c, fp, &b) ||
+                    !rr_get_uleb128(c, fp, &d) || !rr_get_uleb128(c, fp, &e)) {
+                return false;
+            }
+            args->variant.hd_transfer_args.type = a;
+            args->variant.hd_transfer_args.src_addr = b;
+            args->variant.hd_transfer_args.dest_addr = d;
+            args->variant.hd_transfer_args.num_bytes = e;
+            return true;
+        case RR_CALL_NET_TRANSFER:
+            if (!rr_get_uleb128(c, fp, &a) || !rr_get_uleb128(c, fp, &b) ||
+                    !rr_get_uleb128(c, fp, &d) || !rr_get_uleb128(c, fp, &e)) {
+                return false;
+            }
+            args->variant.net_transfer_args.type = a;
+            args->variant.net_transfer_args.src_addr = b;
+            args->variant.net_transfer_args.dest_addr = d;
+            args->variant.net_transfer_args.num_bytes = e;
+            return true;
+        case RR_CALL_HANDLE_PACKET:
+            if (!rr_get_uleb128(c, fp, &a) ||
+                    !rr_codec_fread(c, fp, &flag, 1) ||
+                    !rr_get_uleb128(c, fp, &b)) {
+                return false;
+            }
+            args->variant.handle_packet_args.size = a;
+            args->variant.handle_packet_args.direction = flag;
+            // mz XXX HACK
+            args->old_buf_addr = b;
+            return rr_codec_read_buf(c, fp,
+                    &args->variant.handle_packet_args.buf, a, 0);
+        default:
+            // mz unimplemented
+            return false;
+    }
+}
+
+static bool rr_codec_read_digest_v2(RR_log_codec *c, FILE *fp,
+                                    RR_digest_args *digest) {
+    uint64_t regs_crc, num_pages, delta, addr = 0;
+    uint32_t i;
+
+    if (!rr_get_uleb128(c, fp, &regs_crc) ||
+            !rr_get_uleb128(c, fp, &num_pages)) {
+        return false;
+    }
+    digest->regs_crc = regs_crc;
+    digest->num_pages = num_pages;
+    digest->pages = g_new0(RR_digest_page, num_pages);
+    for (i = 0; i < num_pages; i++) {
+        if (!rr_get_uleb128(c, fp, &delta) ||
+                !rr_codec_fread(c, fp, &digest->pages[i].crc, 4)) {
+            return false;
+        }
+        addr += delta;
+        digest->pages[i].addr = addr;
+    }
+    return true;
+}
+
+// Produce the next copy of a run-length coded input.
+static inline void rr_codec_next_repeat(RR_log_codec *c, RR_log_entry *item) {
+    RR_header header = item->header;
+    *item = c->last;
+    item->header.file_pos = header.file_pos;
+    item->header.prev_instr_count = header.prev_instr_count;
+    item->header.repeat_count = header.repeat_count;
+    item->header.repeat_delta = header.repeat_delta;
+    c->prev_instr_count += c->repeat_delta;
+    item->header.prog_point.guest_instr_count = c->prev_instr_count;
+    c->repeat_count--;
+}
+
+static bool rr_codec_read_entry_v2(RR_log_codec *c, FILE *fp,
+                                   RR_log_entry *item) {
+    uint8_t head[2];
+    uint64_t delta, val;
+
+    if (!rr_codec_fread(c, fp, head, 2) || !rr_get_uleb128(c, fp, &delta)) {
+        return false;
+    }
+    item->header.kind = head[0];
+    item->header.callsite_loc = head[1];
+
+    if (item->header.kind == RR_REPEAT) {
+        if (!c->last_valid || !rr_get_uleb128(c, fp, &val) || val == 0) {
+            return false;
+        }
+        c->repeat_delta = delta;
+        c->repeat_count = val;
+        rr_codec_next_repeat(c, item);
+        return true;
+    }
+
+    c->prev_instr_count += delta;
+    item->header.prog_point.guest_instr_count = c->prev_instr_count;
+
+    switch (item->header.kind) {
+        case RR_INPUT_1:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_1 = val;
+            break;
+        case RR_INPUT_2:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_2 = val;
+            break;
+        case RR_INPUT_4:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_4 = val;
+            break;
+        case RR_INPUT_8:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_8 = val;
+            break;
+        case RR_INPUT_MMIO:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_mmio.result = val;
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.input_mmio.value = val;
+            break;
+        case RR_INTERRUPT_REQUEST:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.interrupt_request = rr_unzigzag(val);
+            break;
+        case RR_EXIT_REQUEST:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.exit_request = val;
+            break;
+        case RR_PENDING_INTERRUPTS:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.pending_interrupts = val;
+            break;
+        case RR_EXCEPTION:
+            if (!rr_get_uleb128(c, fp, &val)) return false;
+            item->variant.exception_index = rr_unzigzag(val);
+            break;
+        case RR_SKIPPED_CALL:
+            if (!rr_codec_read_skipped_call_v2(c, fp, &item->variant.call_args)) {
+                return false;
+            }
+            break;
+        case RR_DIGEST:
+            if (!rr_codec_read_digest_v2(c, fp, &item->variant.digest)) {
+                return false;
+            }
+            break;
+        case RR_END_OF_LOG:
+            // mz nothing to read
+            break;
+        default:
+            // mz unimplemented
+            return false;
+    }
+
+    c->last_valid = rr_entry_repeatable(item);
+    if (c->last_valid) {
+        c->last = *item;
+    }
+    return true;
+}
+
+bool rr_codec_read_entry(RR_log_codec *c, FILE *fp, RR_log_entry *item) {
+    item->header.file_pos = c->bytes;
+    item->header.prev_instr_count = c->prev_instr_count;
+    item->header.repeat_count = c->repeat_count;
+    item->header.repeat_delta = c->repeat_delta;
+
+    if (c->repeat_count) {
+        rr_codec_next_repeat(c, item);
+        return true;
+    }
+    if (c->version == RR_LOG_VERSION_1) {
+        return rr_codec_read_entry_v1(c, fp, item);
+    }
+    return rr_codec_read_entry_v2(c, fp, item);
+}
+
+void rr_codec_rewind_to(RR_log_codec *c, const RR_log_entry *entry) {
+    c->bytes = entry->header.file_pos;
+    c->prev_instr_count = entry->header.prev_instr_count;
+    c->repeat_count = entry->header.repeat_count;
+    c->repeat_delta = entry->header.repeat_delta;
+    // A pending repeat is a copy of this very entry, and an entry read from
+    // the file sets c->last itself.
+    c->last_valid = rr_entry_repeatable(entry);
+    if (c->last_valid) {
+        c->last = *entry;
+    }
+}
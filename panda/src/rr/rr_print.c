@@ -26,7 +26,8 @@ RR_log *rr_nondet_log = NULL;
 
 static inline uint8_t log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
+        (rr_nondet_log->size == rr_nondet_log->codec.bytes) &&
+        !rr_codec_pending(&rr_nondet_log->codec)) {
         return 1;
     }
     else {
@@ -68,6 +69,9 @@ static void rr_spit_log_entry(RR_log_entry item) {
         case RR_INPUT_8:
             printf("\tRR_INPUT_8 %ld from %s\n", item.variant.input_8, get_callsite_string(item.header.callsite_loc));
             break;
+        case RR_INPUT_MMIO:
+            printf("\tRR_INPUT_MMIO %d %ld from %s\n", item.variant.input_mmio.result, item.variant.input_mmio.value, get_callsite_string(item.header.callsite_loc));
+            break;
         case RR_INTERRUPT_REQUEST:
             printf("\tRR_INTERRUPT_REQUEST_%d from %s\n", item.variant.interrupt_request, get_callsite_string(item.header.callsite_loc));
             break;
@@ -110,6 +114,9 @@ static void rr_spit_log_entry(RR_log_entry item) {
                         callbytes);
                 break;
             }
+        case RR_DIGEST:
+            printf("\tRR_DIGEST regs %#08x, %u pages\n", item.variant.digest.regs_crc, item.variant.digest.num_pages);
+            break;
         case RR_END_OF_LOG:
             printf("\tRR_END_OF_LOG\n");
             break;
@@ -142,9 +149,21 @@ static inline void free_entry_params(RR_log_entry *entry)
                     g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
                     entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
                     break;
+                case RR_CALL_MEM_REGION_CHANGE:
+                    g_free(entry->variant.call_args.variant.mem_region_change_args.name);
+                    entry->variant.call_args.variant.mem_region_change_args.name = NULL;
+                    break;
+                case RR_CALL_HANDLE_PACKET:
+                    g_free(entry->variant.call_args.variant.handle_packet_args.buf);
+                    entry->variant.call_args.variant.handle_packet_args.buf = NULL;
+                    break;
                 default: break;
             }
             break;
+        case RR_DIGEST:
+            g_free(entry->variant.digest.pages);
+            entry->variant.digest.pages = NULL;
+            break;
         case RR_INPUT_1:
         case RR_INPUT_2:
         case RR_INPUT_4:
@@ -164,109 +183,11 @@ static RR_log_entry *rr_read_item(void) {
     assert ( ! log_is_empty());
     assert (rr_nondet_log->fp != NULL);
 
-    //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point.guest_instr_count),
-                sizeof(item->header.prog_point.guest_instr_count), 1, rr_nondet_log->fp) != 1) {
+    if (!rr_codec_read_entry(&rr_nondet_log->codec, rr_nondet_log->fp, item)) {
         //mz an error occurred
-        if (feof(rr_nondet_log->fp)) {
-            // replay is done - we've reached the end of file
-            //mz we should never get here!
-            assert(0);
-        } 
-        else {
-            //mz some other kind of error
-            //mz XXX something more graceful, perhaps?
-            assert(0);
-        }
-    }
-    //mz this is more compact, as it doesn't include extra padding.
-    assert(fread(&(item->header.kind), 1, 1, rr_nondet_log->fp) == 1);
-    assert(fread(&(item->header.callsite_loc), 1, 1, rr_nondet_log->fp) == 1);
-
-    //mz read the rest of the item
-    switch (item->header.kind) {
-        case RR_INPUT_1:
-            assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_INPUT_2:
-            assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_INPUT_4:
-            assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_INPUT_8:
-            assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_INTERRUPT_REQUEST:
-            assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_EXIT_REQUEST:
-            assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_PENDING_INTERRUPTS:
-            assert(fread(&(item->variant.pending_interrupts), sizeof(item->variant.pending_interrupts), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_EXCEPTION:
-            assert(fread(&(item->variant.exception_index), sizeof(item->variant.exception_index), 1, rr_nondet_log->fp) == 1);
-            break;
-        case RR_SKIPPED_CALL:
-            {
-                RR_skipped_call_args *args = &item->variant.call_args;
-                //mz read kind first!
-                assert(fread(&(args->kind), 1, 1, rr_nondet_log->fp) == 1);
-                switch(args->kind) {
-                    case RR_CALL_CPU_MEM_RW:
-                        assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
-                        //mz buffer length in args->variant.cpu_mem_rw_args.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
-                        //mz read the buffer
-                        //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
-                        break;
-                    case RR_CALL_CPU_MEM_UNMAP:
-                        assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
-                        //mz buffer length in args->variant.cpu_mem_unmap.len
-                        //mz always allocate a new one. we free it when the item is added to the recycle list
-                        //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
-                        //mz read the buffer
-                        //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
-                        break;
-                    case RR_CALL_MEM_REGION_CHANGE:
-                        assert(fread(&(args->variant.mem_region_change_args),
-                            sizeof(args->variant.mem_region_change_args), 1,
-                            rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp, args->variant.mem_region_change_args.len, SEEK_CUR);
-                        break;
-                    case RR_CALL_HD_TRANSFER:
-                        assert(fread(&(args->variant.hd_transfer_args),
-                              sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
-                        break;
-                    case RR_CALL_HANDLE_PACKET:
-                        assert(fread(&(args->variant.handle_packet_args),
-                              sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
-                        break;
-                    case RR_CALL_NET_TRANSFER:
-                        assert(fread(&(args->variant.net_transfer_args),
-                              sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
-                        break;
-                    default:
-                        //mz unimplemented
-                        printf("rr_read_item: Call type %d unimplemented!\n", args->kind);
-                        assert(0);
-                }
-            }
-            break;
-        case RR_END_OF_LOG:
-            //mz nothing to read
-            break;
-        default:
-            //mz unimplemented
-            printf("rr_read_item: Log type %d unimplemented!\n", item->header.kind);
-            assert(0);
+        printf("rr_read_item: Could not read entry at offset %lu!\n",
+                item->header.file_pos);
+        assert(0);
     }
 
     return item;
@@ -291,7 +212,9 @@ void rr_create_replay_log (const char *filename) {
   fprintf (stdout, "opened %s for read.  len=%llu bytes.\n",
      rr_nondet_log->name, rr_nondet_log->size);
   //mz read the last program point from the log header.
-  assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  assert(rr_codec_read_header(&rr_nondet_log->codec, rr_nondet_log->fp,
+              &rr_nondet_log->last_prog_point.guest_instr_count));
+  fprintf (stdout, "nondet log version %u\n", rr_nondet_log->codec.version);
 }
 
 int main(int argc, char **argv) {
@@ -301,6 +224,7 @@ int main(int argc, char **argv) {
     while(!log_is_empty()) {
         log_entry = rr_read_item();
         rr_spit_log_entry(*log_entry);
+        free_entry_params(log_entry);
     }
     if (log_entry) g_free(log_entry);
     return 0;
@@ -0,0 +1,297 @@
+#!/usr/bin/env python2.7
+
+from __future__ import print_function
+
+USAGE = """
+
+Performance benchmarks for record/replay and the core plugins.
+
+NB: like ptest.py, this needs the PANDA_REGRESSION_DIR env variable,
+and it replays the recordings that the ptest.py tests create there,
+so run e.g. `ptest.py test rr-file` once first.  Set PANDA_BUILD if you
+didn't build in panda/build.
+
+pbench.py run [-r recording,...] [-c config,...] [-n runs] [-o out.json]
+    Replays each recording under each configuration and writes the
+    results as JSON, by default to
+    $PANDA_REGRESSION_DIR/bench/<git commit>.json
+    With -n, each pair is replayed that many times and the fastest run
+    is kept.
+
+pbench.py compare old.json new.json [-t percent]
+    Prints how each result changed between two runs and exits nonzero
+    if anything got worse by more than percent (default 5).
+
+pbench.py list
+    Lists the recordings and configurations.
+
+For each recording and configuration, the results are:
+
+  instr                      instructions replayed
+  wall_sec                   wall clock time of the replay
+  instr_per_sec              instr / wall_sec
+  max_rss_kb                 peak resident set size of qemu
+  nondet_bytes_per_minstr    nondet log size per million instructions
+  taint_ops_per_instr        taint ops run per instruction while taint
+                             was on (taint configurations only)
+
+"""
+
+import os
+import sys
+import re
+import json
+import time
+import socket
+import struct
+import argparse
+import subprocess as sp
+
+thisdir = os.path.dirname(os.path.realpath(__file__))
+pandadir = os.path.realpath(thisdir + "/../..")
+pandascriptsdir = os.path.realpath(pandadir + "/panda/scripts")
+panda_build_dir = os.getenv("PANDA_BUILD", os.path.join(pandadir, 'build'))
+
+sys.path.append(pandascriptsdir)
+
+# recording name -> (arch, replay under $PANDA_REGRESSION_DIR/replays,
+#                    file that the guest reads, for the taint configs)
+RECORDINGS = {
+    'rr-boot': ('i386', 'rr-boot/rr-boot-test', None),
+    'rr-file': ('i386', 'rr-file/file', 'ls'),
+}
+
+# configuration name -> extra qemu args.  {taint_file} is filled in from
+# the recording; configurations that use it are skipped for recordings
+# without one.
+CONFIGS = [
+    ('replay', []),
+    ('callstack_instr', ['-panda', 'callstack_instr']),
+    ('syscalls2', ['-panda', 'syscalls2:profile=linux_x86']),
+    ('stringsearch', ['-panda', 'stringsearch:str=root']),
+    ('taint2', ['-os', 'linux-32-lava32',
+                '-panda', 'file_taint:filename={taint_file},pos',
+                '-panda', 'tainted_branch']),
+]
+
+RR_LOG_MAGIC = 0x474f4c444e524450
+
+# (result field, True if bigger is better)
+METRICS = [
+    ('instr_per_sec', True),
+    ('max_rss_kb', False),
+    ('nondet_bytes_per_minstr', False),
+    ('taint_ops_per_instr', False),
+]
+
+
+def progress(msg):
+    print('[pbench.py] ' + msg)
+    sys.stdout.flush()
+
+
+def regression_dir():
+    if 'PANDA_REGRESSION_DIR' not in os.environ:
+        sys.exit("PANDA_REGRESSION_DIR is not set")
+    return os.environ['PANDA_REGRESSION_DIR']
+
+
+def nondet_log_info(replay):
+    """ returns (total instructions, size in bytes) of a nondet log """
+    fn = replay + "-rr-nondet.log"
+    with open(fn, 'rb') as f:
+        first = struct.unpack('<Q', f.read(8))[0]
+        if first == RR_LOG_MAGIC:
+            # version 2+: magic, u32 version, u64 instruction count
+            f.read(4)
+            first = struct.unpack('<Q', f.read(8))[0]
+    return (first, os.path.getsize(fn))
+
+
+def git_commit():
+    try:
+        return sp.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+                               cwd=pandadir).decode().strip()
+    except Exception:
+        return 'unknown'
+
+
+def replay_once(qemu, replay, args, outdir):
+    """ replays and returns (wall seconds, max rss kb, stdout) """
+    cmd = [qemu, '-replay', replay, '-display', 'none'] + args
+    log = open(os.path.join(outdir, 'qemu.out'), 'w+')
+    t1 = time.time()
+    p = sp.Popen(cmd, cwd=outdir, stdout=log, stderr=sp.STDOUT)
+    (_, status, rusage) = os.wait4(p.pid, 0)
+    wall = time.time() - t1
+    log.seek(0)
+    output = log.read()
+    log.close()
+    if status != 0 or "Replay completed successfully" not in output:
+        raise RuntimeError("replay failed: %s (see %s/qemu.out)"
+                           % (' '.join(cmd), outdir))
+    # ru_maxrss is in kilobytes on Linux
+    return (wall, rusage.ru_maxrss, output)
+
+
+def bench(recname, confname, confargs, runs):
+    (arch, replay_rel, taint_file) = RECORDINGS[recname]
+    if any('{taint_file}' in a for a in confargs):
+        if taint_file is None:
+            return None
+        confargs = [a.format(taint_file=taint_file) for a in confargs]
+
+    # only needed here, and it pulls in everything needed to record
+    from run_debian import SUPPORTED_ARCHES
+    rdir = regression_dir()
+    replay = os.path.join(rdir, 'replays', replay_rel)
+    arch_data = SUPPORTED_ARCHES[arch]
+    qemu = os.path.join(panda_build_dir, arch_data.dir, arch_data.binary)
+    outdir = os.path.join(rdir, 'bench', 'tmp', recname, confname)
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+
+    (instr, log_bytes) = nondet_log_info(replay)
+    res = {
+        'recording': recname,
+        'config': confname,
+        'instr': instr,
+        'nondet_bytes': log_bytes,
+        'nondet_bytes_per_minstr': log_bytes * 1e6 / instr if instr else None,
+        'taint_ops_per_instr': None,
+    }
+    best = None
+    for i in range(runs):
+        progress("%s / %s: run %d of %d" % (recname, confname, i + 1, runs))
+        r = replay_once(qemu, replay, confargs, outdir)
+        if best is None or r[0] < best[0]:
+            best = r
+    (wall, rss, output) = best
+    res['wall_sec'] = wall
+    res['instr_per_sec'] = instr / wall if wall else None
+    res['max_rss_kb'] = rss
+    m = re.search(r"taint2: \d+ taint ops over \d+ instructions, ([0-9.]+) per instruction",
+                  output)
+    if m:
+        res['taint_ops_per_instr'] = float(m.group(1))
+    return res
+
+
+def select(names, known, what):
+    if names is None:
+        return known
+    names = names.split(',')
+    for n in names:
+        if n not in known:
+            sys.exit("unknown %s %s" % (what, n))
+    return names
+
+
+def do_run(args):
+    recordings = select(args.recordings, sorted(RECORDINGS.keys()), 'recording')
+    confnames = select(args.configs, [c[0] for c in CONFIGS], 'config')
+    rdir = regression_dir()
+    present = []
+    for rec in recordings:
+        replay = os.path.join(rdir, 'replays', RECORDINGS[rec][1])
+        if os.path.exists(replay + "-rr-nondet.log"):
+            present.append(rec)
+        else:
+            progress("warning: recording %s missing, skipping it; run "
+                     "`ptest.py test %s` to make it" % (replay, rec))
+    recordings = present
+    if not recordings:
+        sys.exit("no recordings to benchmark")
+
+    results = []
+    for rec in recordings:
+        for (confname, confargs) in CONFIGS:
+            if confname not in confnames:
+                continue
+            res = bench(rec, confname, confargs, args.runs)
+            if res is None:
+                progress("%s / %s: skipped, nothing to taint" % (rec, confname))
+                continue
+            progress("%s / %s: %.0f instr/sec, %d KB max rss"
+                     % (rec, confname, res['instr_per_sec'], res['max_rss_kb']))
+            results.append(res)
+
+    commit = git_commit()
+    out = args.output
+    if out is None:
+        out = os.path.join(rdir, 'bench', commit + '.json')
+    doc = {
+        'commit': commit,
+        'host': socket.gethostname(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'runs': args.runs,
+        'results': results,
+    }
+    with open(out, 'w') as f:
+        json.dump(doc, f, indent=2, sort_keys=True)
+    progress("results in " + out)
+
+
+def do_compare(args):
+    docs = []
+    for fn in [args.old, args.new]:
+        with open(fn) as f:
+            docs.append(json.load(f))
+    old = dict(((r['recording'], r['config']), r) for r in docs[0]['results'])
+    print("%-10s %-16s %-24s %14s %14s %8s" % ('recording', 'config', 'metric',
+                                              docs[0]['commit'], docs[1]['commit'],
+                                              'change'))
+    worse = []
+    for r in docs[1]['results']:
+        key = (r['recording'], r['config'])
+        if key not in old:
+            continue
+        for (metric, bigger_better) in METRICS:
+            a, b = old[key].get(metric), r.get(metric)
+            if a is None or b is None:
+                continue
+            change = (b - a) * 100.0 / a if a else 0.0
+            flag = ''
+            if (-change if bigger_better else change) > args.threshold:
+                flag = ' <--'
+                worse.append((key, metric, change))
+            print("%-10s %-16s %-24s %14.6g %14.6g %+7.1f%%%s"
+                  % (key[0], key[1], metric, a, b, change, flag))
+    if worse:
+        print("\n%d results worse by more than %.1f%%" % (len(worse), args.threshold))
+        sys.exit(1)
+
+
+def do_list(args):
+    for rec in sorted(RECORDINGS.keys()):
+        (arch, replay, taint_file) = RECORDINGS[rec]
+        print("recording %-10s %s replays/%s" % (rec, arch, replay))
+    for (confname, confargs) in CONFIGS:
+        print("config    %-16s %s" % (confname, ' '.join(confargs)))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=USAGE,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='mode')
+    p = sub.add_parser('run')
+    p.add_argument('-r', dest='recordings', help='comma separated recordings')
+    p.add_argument('-c', dest='configs', help='comma separated configurations')
+    p.add_argument('-n', dest='runs', type=int, default=1, help='runs per pair')
+    p.add_argument('-o', dest='output', help='output json file')
+    p = sub.add_parser('compare')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('-t', dest='threshold', type=float, default=5.0,
+                   help='percent change that counts as a regression')
+    sub.add_parser('list')
+    args = parser.parse_args()
+
+    if args.mode == 'run':
+        do_run(args)
+    elif args.mode == 'compare':
+        do_compare(args)
+    elif args.mode == 'list':
+        do_list(args)
+    else:
+        parser.print_help()
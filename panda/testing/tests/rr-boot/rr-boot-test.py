@@ -17,6 +17,12 @@ def both(msg, disp_fn):
     tof.write(msg + "\n")
     disp_fn(msg)
 
+arch_data = SUPPORTED_ARCHES["i386"]
+qemu = os.path.join(panda_build_dir, arch_data.dir, arch_data.binary)
+if not os.path.isdir(replaydir):
+    os.makedirs(replaydir)
+replayfile = os.path.join(replaydir, "rr-boot-test")
+
 tof = open(tmpoutfile, "w")
 try:
     qcow = pandaregressiondir + "/qcows/wheezy_32bit.qcow2"
@@ -20,12 +20,21 @@ num_tests = 100
 num_pass = 0
 num_fail = 0
 
+# "PDRNDLOG", as in rr_log.h
+RR_LOG_MAGIC = 0x474f4c444e524450
+
+def nondet_log_num_instrs(fn):
+    with open(fn, 'rb') as f:
+        first = struct.unpack("<Q", f.read(8))[0]
+        if first == RR_LOG_MAGIC:
+            # version 2+: magic, u32 version, u64 instruction count
+            f.read(4)
+            first = struct.unpack("<Q", f.read(8))[0]
+    return first
+
 # get number of instructions in file 
 for binary in ["netstat", "find"]:
-    # ew -- ray this is grossssss
-    with open(replaydir+"/%s-rr-nondet.log" % binary, 'rb') as f:
-        num_instrs = struct.unpack("<Q", f.read()[:8])
-        num_instrs = num_instrs[0]
+    num_instrs = nondet_log_num_instrs(replaydir + "/%s-rr-nondet.log" % binary)
 
     random.seed()
     for i in range(num_tests):
@@ -4107,6 +4107,16 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>:<record-name>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-digest", HAS_ARG, QEMU_OPTION_record_digest,
+    "-record-digest <n>\n"
+    "                while recording, log a digest of guest state every <n>\n"
+    "                instructions for replay to check\n", QEMU_ARCH_ALL)
+
+DEF("record-lazy-snapshot", 0, QEMU_OPTION_record_lazy_snapshot,
+    "-record-lazy-snapshot\n"
+    "                store guest RAM in a separate image that replay maps\n"
+    "                in on demand\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay </path/to/snapshot-prefix>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
@@ -4128,6 +4138,11 @@ DEF("panda", HAS_ARG, QEMU_OPTION_panda_plugins,
     "               load <plugin1> with <opt1=val1> and <opt2=val2>; load <plugin2>\n"
     "               uses qemubuilddir/panda_plugins/panda_%s.so by default\n", QEMU_ARCH_ALL)
 
+DEF("panda-profile", 0, QEMU_OPTION_panda_profile,
+    "-panda-profile\n"
+    "               count calls and host ticks of each plugin callback, and\n"
+    "               print them at exit\n", QEMU_ARCH_ALL)
+
 DEF("os", HAS_ARG, QEMU_OPTION_panda_os_name,
     "-os os_name\n"
     "               inform panda about guest operating system\n", QEMU_ARCH_ALL)
@@ -36,6 +36,8 @@
 
 #include "trace-tcg.h"
 
+#include "panda/callback_support.h"
+
 static TCGv_i64 cpu_X[32];
 static TCGv_i64 cpu_pc;
 
@@ -11254,6 +11256,9 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
     if (max_insns > TCG_MAX_INSNS) {
         max_insns = TCG_MAX_INSNS;
     }
+    if (max_insns > panda_num_instr_before_next_deadline()) {
+        max_insns = panda_num_instr_before_next_deadline();
+    }
 
     gen_tb_start(tb);
 
@@ -11681,6 +11681,9 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
             max_insns = until_interrupt;
         }
     }
+    if (max_insns > panda_num_instr_before_next_deadline()) {
+        max_insns = panda_num_instr_before_next_deadline();
+    }
 
     gen_tb_start(tb);
 
@@ -11782,10 +11785,10 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_mode != RR_OFF || panda_update_pc) && !generate_llvm) {
-            gen_op_update_panda_pc(dc->pc);
-            gen_op_update_rr_icount();
+        // In LLVM mode we generate this more efficiently, unless the
+        // TB is outside the instrumentation gates and won't have LLVM code.
+        if ((rr_mode != RR_OFF || panda_update_pc) && !(generate_llvm && tb->panda_instrument)) {
+            gen_op_panda_insn_start(dc->pc);
         }
 #endif
 
@@ -8446,6 +8446,9 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
             max_insns = until_interrupt;
         }
     }
+    if (max_insns > panda_num_instr_before_next_deadline()) {
+        max_insns = panda_num_instr_before_next_deadline();
+    }
 
     /*
      * This function call emits a few instructions at the beginning of every
@@ -8475,10 +8478,10 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_mode != RR_OFF || panda_update_pc) && !generate_llvm) {
-            gen_op_update_panda_pc(pc_ptr);
-            gen_op_update_rr_icount();
+        // In LLVM mode we generate this more efficiently, unless the
+        // TB is outside the instrumentation gates and won't have LLVM code.
+        if ((rr_mode != RR_OFF || panda_update_pc) && !(generate_llvm && tb->panda_instrument)) {
+            gen_op_panda_insn_start(pc_ptr);
         }
 #endif
 
@@ -7019,6 +7019,9 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
             max_insns = until_interrupt;
         }
     }
+    if (max_insns > panda_num_instr_before_next_deadline()) {
+        max_insns = panda_num_instr_before_next_deadline();
+    }
 
     gen_tb_start(tb);
     tcg_clear_temp_count();
@@ -7045,10 +7048,10 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if (rr_mode != RR_OFF && !generate_llvm) {
-            gen_op_update_panda_pc(ctx.nip);
-            gen_op_update_rr_icount();
+        // In LLVM mode we generate this more efficiently, unless the
+        // TB is outside the instrumentation gates and won't have LLVM code.
+        if (rr_mode != RR_OFF && !(generate_llvm && tb->panda_instrument)) {
+            gen_op_panda_insn_start(ctx.nip);
         }
 #endif
 
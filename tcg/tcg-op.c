@@ -47,9 +47,20 @@ extern TCGv_i32 TCGV_HIGH_link_error(TCGv_i64);
 
 static void tcg_emit_op(TCGContext *ctx, TCGOpcode opc, int args)
 {
-    int oi = ctx->gen_next_op_idx;
-    int ni = oi + 1;
-    int pi = oi - 1;
+    int oi, ni, pi;
+
+    /* PANDA: branches, exits and memory ops (which may call the slow path
+       and the memory callbacks) see the current insn's pc and count.
+       Labels don't: falling into one isn't the only way to reach it.  */
+    if (unlikely(ctx->panda_sync_pending)
+        && (tcg_op_defs[opc].flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER))
+        && opc != INDEX_op_set_label) {
+        tcg_gen_panda_sync();
+    }
+
+    oi = ctx->gen_next_op_idx;
+    ni = oi + 1;
+    pi = oi - 1;
 
     tcg_debug_assert(oi < OPC_BUF_SIZE);
     ctx->gen_op_buf[0].prev = oi;
@@ -2575,6 +2586,22 @@ void tcg_gen_extr32_i64(TCGv_i64 lo, TCGv_i64 hi, TCGv_i64 arg)
 
 /* QEMU specific operations.  */
 
+void tcg_gen_panda_sync(void)
+{
+    TCGContext *s = &tcg_ctx;
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    /* clear first, the stores below go through tcg_emit_op too */
+    s->panda_sync_pending = false;
+    tcg_gen_addi_i64(t, s->panda_icount_base, s->panda_sync_insns);
+    tcg_gen_st_i64(t, s->tcg_env,
+                   -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
+    tcg_gen_movi_i64(t, s->panda_sync_pc);
+    tcg_gen_st_i64(t, s->tcg_env,
+                   -ENV_OFFSET + offsetof(CPUState, panda_guest_pc));
+    tcg_temp_free_i64(t);
+}
+
 void tcg_gen_goto_tb(unsigned idx)
 {
     /* We only support two chained exits.  */
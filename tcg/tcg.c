@@ -740,6 +740,13 @@ void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
     flags = info->flags;
     sizemask = info->sizemask;
 
+    /* PANDA: helpers see the current insn's pc and count, except pure
+       ones (e.g. condition code computation), which can't look */
+    if (unlikely(s->panda_sync_pending)
+        && !(flags & TCG_CALL_NO_SIDE_EFFECTS)) {
+        tcg_gen_panda_sync();
+    }
+
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
     /* We have 64-bit values in one register, but need to pass as two
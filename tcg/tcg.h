@@ -720,6 +720,14 @@ struct TCGContext {
     CPUState *cpu;                      /* *_trans */
     TCGv_env tcg_env;                   /* *_exec  */
 
+    /* PANDA: the guest pc and rr instruction count of the current insn
+       are only stored to CPUState before ops that can leave the TB or call
+       out of it; see gen_op_panda_insn_start() in exec/gen-icount.h.  */
+    bool panda_sync_pending;
+    int panda_sync_insns;               /* insns of this TB so far */
+    uint64_t panda_sync_pc;
+    TCGv_i64 panda_icount_base;         /* rr_guest_instr_count at TB start */
+
     /* The TCGBackendData structure is private to tcg-target.inc.c.  */
     struct TCGBackendData *be;
 
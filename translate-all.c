@@ -350,7 +350,7 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 
 #if defined(CONFIG_LLVM)
     target_ulong guest_pc = cpu->panda_guest_pc;
-    if (execute_llvm) {
+    if (execute_llvm && tb->llvm_function) {
         assert(guest_pc >= tb->pc);
         assert(guest_pc < tb->pc + tb->size);
         for (i = 0; i < num_insns; ++i) {
@@ -897,6 +897,7 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb->pc = pc;
     tb->cflags = 0;
     tb->invalid = false;
+    tb->panda_insns = NULL;
 #ifdef CONFIG_LLVM
     tcg_llvm_tb_alloc(tb);
 #endif
@@ -914,6 +915,7 @@ void tb_free(TranslationBlock *tb)
     if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
             tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        panda_insn_cache_free(tb);
 #if defined(CONFIG_LLVM)
         tcg_llvm_tb_free(tb);
 #endif
@@ -993,6 +995,12 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         tcg_llvm_tb_free(&tcg_ctx.tb_ctx.tbs[i2]);
     }
 #endif
+    {
+        int i3;
+        for (i3 = 0; i3 < tcg_ctx.tb_ctx.nb_tbs; ++i3) {
+            panda_insn_cache_free(&tcg_ctx.tb_ctx.tbs[i3]);
+        }
+    }
 
     CPU_FOREACH(cpu) {
         int i;
@@ -1357,6 +1365,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    /* the translators need to know this, see panda/src/gate.c */
+    tb->panda_asid_mask = panda_gate_asid_mask;
+    tb->panda_instrument = panda_gate_block(ENV_GET_CPU(env), pc);
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1398,7 +1409,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     gen_code_size = tcg_gen_code(&tcg_ctx, tb);
 
 #if defined(CONFIG_LLVM)
-    if (generate_llvm)
+    if (generate_llvm && tb->panda_instrument)
         tcg_llvm_gen_code(tcg_llvm_ctx, &tcg_ctx, tb);
 #endif
 
@@ -1410,6 +1421,11 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
 
+    /* insn bounds come from the insn_start data tcg_gen_code just used */
+    if (panda_insn_cache_on && tb->panda_instrument) {
+        panda_insn_cache_build(ENV_GET_CPU(env), tb);
+    }
+
 #ifdef CONFIG_PROFILER
     tcg_ctx.code_time += profile_getclock();
     tcg_ctx.code_in_len += tb->size;
@@ -1794,7 +1810,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
                 return tb;
             }
         }
-        return NULL;
+        /* TBs outside the instrumentation gates run their TCG code */
     }
 #endif
 
@@ -146,6 +146,7 @@ extern bool panda_load_plugin(const char *, const char *);
 extern void panda_unload_plugins(void);
 extern char *panda_plugin_path(const char *name);
 void panda_set_os_name(char *os_name);
+extern void panda_set_cb_profiling(bool on);
 
 extern void pandalog_cc_init_write(const char * fname); 
 int pandalog = 0;
@@ -4145,6 +4146,12 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_record_from:
                 record_name = optarg;
 	            break;
+            case QEMU_OPTION_record_digest:
+                rr_digest_interval = strtoull(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_record_lazy_snapshot:
+                rr_lazy_snapshot = true;
+                break;
             case QEMU_OPTION_panda_arg:
                 if(!panda_add_arg(optarg, strlen(optarg))) {
                     fprintf(stderr, "WARN: Couldn't add PANDA arg '%s': argument too long,\n", optarg);
@@ -4201,6 +4208,9 @@ int main(int argc, char **argv, char **envp)
                     free(new_optarg);
                     break;
                 }
+            case QEMU_OPTION_panda_profile:
+                panda_set_cb_profiling(true);
+                break;
             case QEMU_OPTION_panda_os_name:
             {
                 char *os_name = strdup(optarg);